@@ -0,0 +1,33 @@
+#ifndef BATCH_FORMAT_H
+#define BATCH_FORMAT_H
+
+/*
+ * Format of the batches of IOCTL_RAMDISK_BATCH.
+ * It only uses the basic Windows types, so that it can be included by the
+ * driver, by Windows programs and, through port.h, by Linux programs.
+ * The input buffer is a RAMDISK_BATCH header followed by "count"
+ * descriptors. The output buffer holds the statuses and the data: the
+ * status of descriptor i is the i-th LONG at its start, and the data of a
+ * descriptor is at "buffer_offset", beyond the statuses.
+ */
+#define RAMDISK_BATCH_READ              0
+#define RAMDISK_BATCH_WRITE             1
+
+#define RAMDISK_BATCH_MAX_ENTRIES       4096
+
+typedef struct {
+	ULONG     operation;
+	ULONG     length;                    /* Multiple of the sector size. */
+	ULONGLONG offset;                    /* On the disk, also a multiple of the sector size. */
+	ULONGLONG buffer_offset;             /* In the output buffer. */
+} RAMDISK_BATCH_ENTRY;
+
+typedef struct {
+	ULONG     count;
+	ULONG     reserved;
+} RAMDISK_BATCH;
+
+/* Bytes of the output buffer taken by the statuses. */
+#define RAMDISK_BATCH_STATUS_SIZE(count) ((ULONGLONG) (count) * sizeof(LONG))
+
+#endif /* BATCH_FORMAT_H */
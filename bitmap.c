@@ -0,0 +1,176 @@
+#include "bitmap.h"
+
+static LONGLONG word_mask(__in ULONG first, __in ULONG end);
+static LONGLONG count_bits(__in ULONGLONG bits);
+
+NTSTATUS atomic_bitmap_init(__out ATOMIC_BITMAP *bitmap, __in ULONGLONG nbits)
+{
+	SIZE_T size;
+
+	size = (SIZE_T) ((nbits + 63) >> 6) * sizeof(LONGLONG);
+
+	if ((bitmap->words = port_alloc(size)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory((void *) bitmap->words, size);
+
+	bitmap->nbits = nbits;
+	bitmap->count = 0;
+
+	return STATUS_SUCCESS;
+}
+
+void atomic_bitmap_free(__in ATOMIC_BITMAP *bitmap)
+{
+	if (bitmap->words) {
+		port_free((void *) bitmap->words);
+		bitmap->words = NULL;
+	}
+
+	bitmap->nbits = 0;
+	bitmap->count = 0;
+}
+
+void atomic_bitmap_set_range(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __in ULONGLONG count)
+{
+	ULONGLONG end;
+	ULONGLONG word;
+	ULONG last_bit;
+	LONGLONG mask;
+	LONGLONG old;
+
+	ASSERT(first + count <= bitmap->nbits);
+
+	end = first + count;
+
+	while (first < end) {
+		word = first >> 6;
+		last_bit = ((end - (word << 6)) > 64) ? 64 : (ULONG) (end - (word << 6));
+
+		mask = word_mask((ULONG) first & 63, last_bit);
+
+		/* Only write to the word if some bit changes. */
+		if ((bitmap->words[word] & mask) != mask) {
+			old = InterlockedOr64(&bitmap->words[word], mask);
+			InterlockedExchangeAdd64(&bitmap->count, count_bits((ULONGLONG) (mask & ~old)));
+		}
+
+		first = (word + 1) << 6;
+	}
+}
+
+void atomic_bitmap_clear_range(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __in ULONGLONG count)
+{
+	ULONGLONG end;
+	ULONGLONG word;
+	ULONG last_bit;
+	LONGLONG mask;
+	LONGLONG old;
+
+	ASSERT(first + count <= bitmap->nbits);
+
+	end = first + count;
+
+	while (first < end) {
+		word = first >> 6;
+		last_bit = ((end - (word << 6)) > 64) ? 64 : (ULONG) (end - (word << 6));
+
+		mask = word_mask((ULONG) first & 63, last_bit);
+
+		if (bitmap->words[word] & mask) {
+			old = InterlockedAnd64(&bitmap->words[word], ~mask);
+			InterlockedExchangeAdd64(&bitmap->count, -count_bits((ULONGLONG) (mask & old)));
+		}
+
+		first = (word + 1) << 6;
+	}
+}
+
+BOOLEAN atomic_bitmap_find_set(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __out ULONGLONG *index)
+{
+	ULONGLONG word;
+	ULONGLONG nwords;
+	ULONGLONG bits;
+	ULONG bit;
+
+	if (first >= bitmap->nbits) {
+		return FALSE;
+	}
+
+	nwords = (bitmap->nbits + 63) >> 6;
+
+	/* Ignore the bits before "first" in its word. */
+	word = first >> 6;
+	bits = (ULONGLONG) bitmap->words[word] & ~(((ULONGLONG) 1 << (first & 63)) - 1);
+
+	for (;;) {
+		if (bits) {
+			for (bit = 0; !((bits >> bit) & 1); bit++);
+
+			*index = (word << 6) + bit;
+
+			return (BOOLEAN) (*index < bitmap->nbits);
+		}
+
+		if (++word == nwords) {
+			return FALSE;
+		}
+
+		bits = (ULONGLONG) bitmap->words[word];
+	}
+}
+
+BOOLEAN atomic_bitmap_find_clear(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __out ULONGLONG *index)
+{
+	ULONGLONG word;
+	ULONGLONG nwords;
+	ULONGLONG bits;
+	ULONG bit;
+
+	if (first >= bitmap->nbits) {
+		return FALSE;
+	}
+
+	nwords = (bitmap->nbits + 63) >> 6;
+
+	/* Look for the set bits of the complement; the bits before "first" count as set. */
+	word = first >> 6;
+	bits = ~(ULONGLONG) bitmap->words[word] & ~(((ULONGLONG) 1 << (first & 63)) - 1);
+
+	for (;;) {
+		if (bits) {
+			for (bit = 0; !((bits >> bit) & 1); bit++);
+
+			*index = (word << 6) + bit;
+
+			return (BOOLEAN) (*index < bitmap->nbits);
+		}
+
+		if (++word == nwords) {
+			return FALSE;
+		}
+
+		bits = ~(ULONGLONG) bitmap->words[word];
+	}
+}
+
+LONGLONG word_mask(__in ULONG first, __in ULONG end)
+{
+	if (end - first == 64) {
+		return (LONGLONG) -1;
+	}
+
+	return (LONGLONG) ((((ULONGLONG) 1 << (end - first)) - 1) << first);
+}
+
+LONGLONG count_bits(__in ULONGLONG bits)
+{
+	LONGLONG count;
+
+	for (count = 0; bits; count++) {
+		bits &= bits - 1;
+	}
+
+	return count;
+}
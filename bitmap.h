@@ -0,0 +1,35 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "port.h"
+
+/*
+ * Bitmap which can be updated concurrently without locks.
+ * The bits are kept in 64-bit words (a cache line holds 512 bits) and are
+ * changed with interlocked operations; setting bits which are already set
+ * doesn't write to the word, so that the cache line is not bounced between
+ * processors writing to the same region over and over. The bits set are
+ * counted, only when they change.
+ */
+typedef struct {
+	volatile LONGLONG *words;
+	ULONGLONG         nbits;
+	volatile LONGLONG count;           /* Bits set. */
+} ATOMIC_BITMAP;
+
+NTSTATUS atomic_bitmap_init(__out ATOMIC_BITMAP *bitmap, __in ULONGLONG nbits);
+void atomic_bitmap_free(__in ATOMIC_BITMAP *bitmap);
+
+void atomic_bitmap_set_range(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __in ULONGLONG count);
+void atomic_bitmap_clear_range(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __in ULONGLONG count);
+
+/* First bit set at or after "first"; FALSE if there are none. */
+BOOLEAN atomic_bitmap_find_set(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __out ULONGLONG *index);
+
+/* First bit clear at or after "first"; FALSE if there are none. */
+BOOLEAN atomic_bitmap_find_clear(__in ATOMIC_BITMAP *bitmap, __in ULONGLONG first, __out ULONGLONG *index);
+
+#define atomic_bitmap_test(bitmap, bit) \
+	((BOOLEAN) (((ULONGLONG) (bitmap)->words[(bit) >> 6] >> ((bit) & 63)) & 1))
+
+#endif /* BITMAP_H */
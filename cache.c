@@ -0,0 +1,287 @@
+#include "cache.h"
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** Write-back cache in front of a backing file.                             **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+static NTSTATUS transfer_chunks(__in CACHE *cache, __in BOOLEAN write, __in ULONGLONG first, __in ULONGLONG end, __inout UCHAR *buffer);
+
+NTSTATUS cache_open(__out CACHE *cache, __in CHUNK_TABLE *table, __in ATOMIC_BITMAP *dirty_chunks, __in PORT_PATH path, __in ULONGLONG disk_size, __in ULONGLONG size, __in ULONGLONG dirty_limit)
+{
+	ULONGLONG file_size;
+	ULONGLONG index;
+	ULONG chunk_size;
+	NTSTATUS status;
+
+	RtlZeroMemory(cache, sizeof(CACHE));
+
+	chunk_size = 1UL << table->chunk_shift;
+
+	if ((disk_size == 0) || (((disk_size + chunk_size - 1) >> table->chunk_shift) != table->nchunks) || (dirty_chunks->nbits != table->nchunks)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	status = port_file_open(&cache->file, path, FALSE);
+	if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+		/* A new disk: the file is sparse, it only takes the space which has been written. */
+		status = port_file_open(&cache->file, path, TRUE);
+	}
+
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* The reads of the last chunks must not go beyond the end of the file. */
+	status = port_file_get_size(&cache->file, &file_size);
+	if ((NT_SUCCESS(status)) && (file_size < disk_size)) {
+		status = port_file_set_size(&cache->file, disk_size);
+	}
+
+	if (!NT_SUCCESS(status)) {
+		port_file_close(&cache->file);
+		return status;
+	}
+
+	/* Every chunk is in the file. */
+	for (index = 0; index < table->nchunks; index++) {
+		ASSERT(!chunk_table_get_chunk(table, index)->data);
+
+		chunk_table_get_chunk(table, index)->flags |= CHUNK_NOT_LOADED;
+	}
+
+	/* The clock needs to know which chunks are in use. */
+	chunk_table_track_references(table);
+
+	cache->dirty_chunks = dirty_chunks;
+	cache->disk_size = disk_size;
+	cache->size = size;
+	cache->dirty_limit = dirty_limit;
+	cache->chunk_shift = table->chunk_shift;
+	cache->buffer_size = (chunk_size > CACHE_TRANSFER_SIZE) ? chunk_size : CACHE_TRANSFER_SIZE;
+	cache->open = TRUE;
+
+	return STATUS_SUCCESS;
+}
+
+void cache_close(__in CACHE *cache)
+{
+	if (cache->open) {
+		port_file_close(&cache->file);
+
+		cache->open = FALSE;
+	}
+}
+
+NTSTATUS cache_load(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length, __out UCHAR *buffer)
+{
+	ULONGLONG index;
+	ULONGLONG last;
+	ULONGLONG first;
+	ULONGLONG end;
+	ULONGLONG i;
+	NTSTATUS status;
+
+	if (length == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	index = offset >> table->chunk_shift;
+	last = (offset + length - 1) >> table->chunk_shift;
+
+	if (last >= table->nchunks) {
+		last = table->nchunks - 1;
+	}
+
+	while (index <= last) {
+		/* Skip the chunks which are loaded. */
+		for (; (index <= last) && (!(chunk_table_get_chunk(table, index)->flags & CHUNK_NOT_LOADED)); index++);
+
+		if (index > last) {
+			break;
+		}
+
+		/* Read up to a buffer of chunks (the ones already loaded are not touched). */
+		first = index;
+		end = first + (cache->buffer_size >> table->chunk_shift);
+
+		if (end > last + 1) {
+			end = last + 1;
+		}
+
+		for (; (end > first + 1) && (!(chunk_table_get_chunk(table, end - 1)->flags & CHUNK_NOT_LOADED)); end--);
+
+		status = transfer_chunks(cache, FALSE, first, end, buffer);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		for (i = first; i < end; i++) {
+			if (chunk_table_get_chunk(table, i)->flags & CHUNK_NOT_LOADED) {
+				status = chunk_table_load_chunk(table, i, buffer + ((i - first) << table->chunk_shift));
+				if (!NT_SUCCESS(status)) {
+					return status;
+				}
+
+				InterlockedIncrement64(&cache->misses);
+			}
+		}
+
+		index = end;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void cache_claim(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length)
+{
+	ULONGLONG index;
+	ULONGLONG end;
+
+	index = (offset + ((ULONGLONG) 1 << table->chunk_shift) - 1) >> table->chunk_shift;
+
+	/* There is nothing to keep beyond the end of the disk. */
+	end = (offset + length >= cache->disk_size) ? table->nchunks : (offset + length) >> table->chunk_shift;
+
+	for (; index < end; index++) {
+		if (chunk_table_get_chunk(table, index)->flags & CHUNK_NOT_LOADED) {
+			InterlockedAnd(&chunk_table_get_chunk(table, index)->flags, ~CHUNK_NOT_LOADED);
+		}
+	}
+}
+
+BOOLEAN cache_next_dirty(__in CACHE *cache, __in ULONGLONG index, __out ULONGLONG *first, __out ULONGLONG *end)
+{
+	ULONG max_chunks;
+
+	if (!atomic_bitmap_find_set(cache->dirty_chunks, index, first)) {
+		return FALSE;
+	}
+
+	max_chunks = cache->buffer_size >> cache->chunk_shift;
+
+	for (*end = *first + 1;
+		 (*end < cache->dirty_chunks->nbits) && (*end - *first < max_chunks) && (atomic_bitmap_test(cache->dirty_chunks, *end));
+		 (*end)++);
+
+	return TRUE;
+}
+
+NTSTATUS cache_flush(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG end, __in UCHAR *buffer)
+{
+	ULONGLONG index;
+	ULONGLONG run;
+	UCHAR *data;
+	BOOLEAN present;
+	NTSTATUS status;
+
+	atomic_bitmap_clear_range(cache->dirty_chunks, first, end - first);
+
+	status = STATUS_SUCCESS;
+
+	for (index = first, run = first; (index <= end) && (NT_SUCCESS(status)); index++) {
+		/* The chunks not loaded are already in the file (a trim marks every chunk of its range). */
+		if ((index == end) || (chunk_table_get_chunk(table, index)->flags & CHUNK_NOT_LOADED)) {
+			if (index > run) {
+				status = transfer_chunks(cache, TRUE, run, index, buffer + ((run - first) << table->chunk_shift));
+				if (NT_SUCCESS(status)) {
+					InterlockedExchangeAdd64(&cache->flushed, (LONGLONG) (index - run));
+				}
+			}
+
+			run = index + 1;
+			continue;
+		}
+
+		/* The chunks without data are written as zeros, over whatever the file had. */
+		data = buffer + ((index - first) << table->chunk_shift);
+
+		status = chunk_table_copy_chunk(table, index, data, &present);
+		if ((NT_SUCCESS(status)) && (!present)) {
+			RtlZeroMemory(data, (SIZE_T) 1 << table->chunk_shift);
+		}
+	}
+
+	if (!NT_SUCCESS(status)) {
+		/* Try again next time. */
+		atomic_bitmap_set_range(cache->dirty_chunks, first, end - first);
+	}
+
+	return status;
+}
+
+BOOLEAN cache_next_victim(__in CACHE *cache, __in CHUNK_TABLE *table, __out ULONGLONG *index)
+{
+	ULONGLONG attempts;
+
+	/* The dirty chunks stay until they are flushed. */
+	for (attempts = 0; attempts < table->nchunks; attempts++) {
+		if (!chunk_table_next_victim(table, 0, index)) {
+			return FALSE;
+		}
+
+		if (!atomic_bitmap_test(cache->dirty_chunks, *index)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+BOOLEAN cache_evict(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG index)
+{
+	CHUNK *chunk;
+
+	chunk = chunk_table_get_chunk(table, index);
+
+	/* The chunk might have been written or evicted since it was chosen. */
+	if ((!chunk->data) || (chunk->refs) || (chunk->flags & CHUNK_NOT_LOADED) || (atomic_bitmap_test(cache->dirty_chunks, index))) {
+		return FALSE;
+	}
+
+	chunk_table_evict(table, index);
+
+	InterlockedIncrement64(&cache->evicted);
+
+	return TRUE;
+}
+
+NTSTATUS transfer_chunks(__in CACHE *cache, __in BOOLEAN write, __in ULONGLONG first, __in ULONGLONG end, __inout UCHAR *buffer)
+{
+	PORT_FILE_IO io;
+	ULONGLONG offset;
+	ULONG length;
+	NTSTATUS status;
+
+	offset = first << cache->chunk_shift;
+	length = (ULONG) ((end - first) << cache->chunk_shift);
+
+	/* The last chunk might go beyond the end of the disk (and of the file). */
+	if (offset + length > cache->disk_size) {
+		if (!write) {
+			RtlZeroMemory(buffer + (cache->disk_size - offset), (SIZE_T) (offset + length - cache->disk_size));
+		}
+
+		length = (ULONG) (cache->disk_size - offset);
+	}
+
+	status = port_file_io_init(&io);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (write) {
+		port_file_begin_write(&cache->file, &io, offset, buffer, length);
+	} else {
+		port_file_begin_read(&cache->file, &io, offset, buffer, length);
+	}
+
+	status = port_file_wait(&io);
+
+	port_file_io_destroy(&io);
+
+	return status;
+}
@@ -0,0 +1,86 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "port.h"
+#include "chunk_table.h"
+#include "bitmap.h"
+
+/*
+ * Write-back cache in front of a backing file.
+ * The file holds the whole disk at its disk offset, without a header, so
+ * that it can be any raw disk image. The chunk table only keeps the chunks
+ * in use: the others are marked CHUNK_NOT_LOADED and read from the file on
+ * demand. The writes only mark their chunks as dirty; the dirty chunks are
+ * written back later in runs of consecutive chunks, and the clean chunks
+ * which have not been referenced lately are evicted when the cache is
+ * over its size.
+ * The caller serializes the accesses to the chunks with the range lock, as
+ * for the lazy loading of the images (IMAGE_LOADER).
+ */
+
+#define CACHE_TRANSFER_SIZE             (4 * 1024 * 1024)
+
+typedef struct {
+	PORT_FILE         file;
+	BOOLEAN           open;
+	ATOMIC_BITMAP     *dirty_chunks; /* Chunks not written to the file yet. */
+	ULONGLONG         disk_size;
+	ULONGLONG         size;          /* Memory for the chunks. */
+	ULONGLONG         dirty_limit;   /* Bytes of dirty chunks. */
+	ULONG             chunk_shift;
+	ULONG             buffer_size;   /* Size of the buffers passed to cache_load() and cache_flush(). */
+
+	/* Statistics (chunks). */
+	volatile LONGLONG misses;
+	volatile LONGLONG flushed;
+	volatile LONGLONG evicted;
+} CACHE;
+
+/*
+ * Opens the backing file, creating it if it doesn't exist and extending it
+ * to the disk size if it is shorter, and marks every chunk of the (empty)
+ * table as CHUNK_NOT_LOADED. The writes must mark their chunks in
+ * "dirty_chunks" (disk_io_mark_dirty()).
+ */
+NTSTATUS cache_open(__out CACHE *cache, __in CHUNK_TABLE *table, __in ATOMIC_BITMAP *dirty_chunks, __in PORT_PATH path, __in ULONGLONG disk_size, __in ULONGLONG size, __in ULONGLONG dirty_limit);
+
+/* The dirty chunks have to be flushed first. */
+void cache_close(__in CACHE *cache);
+
+/* Reads the chunks of the range which are not loaded (read-through). */
+NTSTATUS cache_load(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length, __out UCHAR *buffer);
+
+/*
+ * The chunks completely covered by a write or a trim don't have to be read:
+ * they are marked as loaded (they read as zeros until written).
+ */
+void cache_claim(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length);
+
+/* Next run of dirty chunks [first, end) from "index" (at most buffer_size bytes); FALSE if there are none. */
+BOOLEAN cache_next_dirty(__in CACHE *cache, __in ULONGLONG index, __out ULONGLONG *first, __out ULONGLONG *end);
+
+/*
+ * Writes the chunks [first, end) to the file in a single transfer (the
+ * chunks not loaded split it, they are already in the file), with the
+ * writes kept out of the range (the reads can go on). The dirty marks
+ * are cleared before copying the chunks, so that the writes which come
+ * after the range is released set them again; they are set back if the
+ * transfer fails.
+ */
+NTSTATUS cache_flush(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG end, __in UCHAR *buffer);
+
+/* Next clean chunk which has not been referenced lately; FALSE if there are none. */
+BOOLEAN cache_next_victim(__in CACHE *cache, __in CHUNK_TABLE *table, __out ULONGLONG *index);
+
+/* Evicts the chunk if it is (still) clean; there must be no I/O on it. */
+BOOLEAN cache_evict(__in CACHE *cache, __in CHUNK_TABLE *table, __in ULONGLONG index);
+
+#define cache_over_size(cache, table)   (chunk_table_memory_used(table) > (cache)->size)
+
+/* The evictions go a bit below the size, so that they don't start again right away. */
+#define cache_low_watermark(cache)      ((cache)->size - ((cache)->size >> 4))
+
+#define cache_over_dirty_limit(cache) \
+	(((ULONGLONG) (cache)->dirty_chunks->count << (cache)->chunk_shift) > (cache)->dirty_limit)
+
+#endif /* CACHE_H */
@@ -0,0 +1,270 @@
+#include "chunk_pool.h"
+
+static BOOLEAN charge(__in volatile LONGLONG *used, __in LONGLONG limit, __in BOOLEAN force);
+static void free_memory(__in CHUNK_POOL *pool, __in ULONG node, __in void *data);
+static BOOLEAN alloc_block(__in CHUNK_POOL *pool, __in ULONG node, __out UCHAR **data);
+
+/* Free list of the node. */
+#define free_list(pool, node)           (&(pool)->free_lists[(node) + 1])
+
+void chunk_pool_init(__out CHUNK_POOL *pool, __in ULONG chunk_shift, __in ULONGLONG limit, __in ULONG max_free)
+{
+	ULONG i;
+
+	port_lock_init(&pool->lock);
+
+	for (i = 0; i <= PORT_MAX_NODES; i++) {
+		pool->free_lists[i].head = NULL;
+		pool->free_lists[i].nfree = 0;
+	}
+
+	pool->max_free = max_free;
+	pool->chunk_shift = chunk_shift;
+	pool->block_shift = 0;
+	pool->large_pages = FALSE;
+	pool->blocks = NULL;
+	pool->nblocks = 0;
+	pool->nlarge_blocks = 0;
+	pool->limit = (LONGLONG) (limit >> chunk_shift);
+	pool->used = 0;
+}
+
+void chunk_pool_free(__in CHUNK_POOL *pool)
+{
+	CHUNK_FREE_LIST *list;
+	CHUNK_BLOCK *block;
+	SIZE_T size;
+	void *next;
+	ULONG i;
+
+	ASSERT(pool->used == 0);
+
+	/* The free chunks are in the blocks, if any. */
+	for (i = 0; i <= PORT_MAX_NODES; i++) {
+		list = &pool->free_lists[i];
+
+		while (list->head) {
+			next = *((void **) list->head);
+
+			if (pool->block_shift == 0) {
+				free_memory(pool, (i == 0) ? PORT_NO_NODE : i - 1, list->head);
+			}
+
+			list->head = next;
+		}
+
+		list->nfree = 0;
+	}
+
+	size = (SIZE_T) 1 << pool->block_shift;
+
+	while ((block = pool->blocks) != NULL) {
+		pool->blocks = block->next;
+
+		if (block->large) {
+			port_free_large(block->data, size);
+		} else if (block->node == PORT_NO_NODE) {
+			port_free(block->data);
+		} else {
+			port_free_node(block->data, size);
+		}
+
+		port_free(block);
+	}
+
+	port_lock_destroy(&pool->lock);
+}
+
+void chunk_pool_use_large_pages(__in CHUNK_POOL *pool)
+{
+	ASSERT(pool->used == 0);
+
+	/* A block holds whole chunks. */
+	pool->block_shift = (pool->chunk_shift > PORT_LARGE_PAGE_SHIFT) ? pool->chunk_shift : PORT_LARGE_PAGE_SHIFT;
+	pool->large_pages = TRUE;
+}
+
+void chunk_quota_init(__out CHUNK_QUOTA *quota, __in CHUNK_POOL *pool, __in ULONGLONG limit)
+{
+	quota->pool = pool;
+	quota->limit = (LONGLONG) (limit >> pool->chunk_shift);
+	quota->used = 0;
+
+	RtlZeroMemory((void *) quota->node_used, sizeof(quota->node_used));
+}
+
+NTSTATUS chunk_pool_alloc(__in CHUNK_QUOTA *quota, __in ULONG node, __in BOOLEAN force, __out UCHAR **data)
+{
+	CHUNK_POOL *pool;
+	CHUNK_FREE_LIST *list;
+	PORT_LOCK_STATE state;
+	SIZE_T size;
+
+	pool = quota->pool;
+	list = free_list(pool, node);
+
+	if (!charge(&quota->used, quota->limit, force)) {
+		return STATUS_DISK_FULL;
+	}
+
+	if (!charge(&pool->used, pool->limit, force)) {
+		InterlockedDecrement64(&quota->used);
+		return STATUS_DISK_FULL;
+	}
+
+	*data = NULL;
+
+	/* Reuse a free chunk of the node (the count is only a hint outside the lock). */
+	if (list->nfree > 0) {
+		port_lock_acquire(&pool->lock, &state);
+
+		if ((*data = list->head) != NULL) {
+			list->head = *((void **) *data);
+			list->nfree--;
+		}
+
+		port_lock_release(&pool->lock, state);
+	}
+
+	if (!*data) {
+		size = (SIZE_T) 1 << pool->chunk_shift;
+
+		if (pool->block_shift > 0) {
+			alloc_block(pool, node, data);
+		} else {
+			*data = (node == PORT_NO_NODE) ? port_alloc(size) : port_alloc_node(size, node);
+		}
+
+		if (!*data) {
+			InterlockedDecrement64(&pool->used);
+			InterlockedDecrement64(&quota->used);
+
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	if (node != PORT_NO_NODE) {
+		InterlockedIncrement64(&quota->node_used[node]);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void chunk_pool_release(__in CHUNK_QUOTA *quota, __in ULONG node, __in UCHAR *data)
+{
+	CHUNK_POOL *pool;
+	CHUNK_FREE_LIST *list;
+	PORT_LOCK_STATE state;
+
+	pool = quota->pool;
+	list = free_list(pool, node);
+
+	InterlockedDecrement64(&quota->used);
+	InterlockedDecrement64(&pool->used);
+
+	if (node != PORT_NO_NODE) {
+		InterlockedDecrement64(&quota->node_used[node]);
+	}
+
+	/* The chunks of the blocks can't be freed on their own. */
+	if ((list->nfree < pool->max_free) || (pool->block_shift > 0)) {
+		port_lock_acquire(&pool->lock, &state);
+
+		if ((list->nfree < pool->max_free) || (pool->block_shift > 0)) {
+			*((void **) data) = list->head;
+			list->head = data;
+			list->nfree++;
+
+			data = NULL;
+		}
+
+		port_lock_release(&pool->lock, state);
+	}
+
+	if (data) {
+		free_memory(pool, node, data);
+	}
+}
+
+BOOLEAN charge(__in volatile LONGLONG *used, __in LONGLONG limit, __in BOOLEAN force)
+{
+	if ((InterlockedIncrement64(used) > limit) && (limit > 0) && (!force)) {
+		InterlockedDecrement64(used);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void free_memory(__in CHUNK_POOL *pool, __in ULONG node, __in void *data)
+{
+	if (node == PORT_NO_NODE) {
+		port_free(data);
+	} else {
+		port_free_node(data, (SIZE_T) 1 << pool->chunk_shift);
+	}
+}
+
+BOOLEAN alloc_block(__in CHUNK_POOL *pool, __in ULONG node, __out UCHAR **data)
+{
+	CHUNK_BLOCK *block;
+	CHUNK_FREE_LIST *list;
+	PORT_LOCK_STATE state;
+	SIZE_T block_size;
+	SIZE_T chunk_size;
+	UCHAR *chunk;
+
+	if ((block = (CHUNK_BLOCK *) port_alloc(sizeof(CHUNK_BLOCK))) == NULL) {
+		return FALSE;
+	}
+
+	block_size = (SIZE_T) 1 << pool->block_shift;
+	chunk_size = (SIZE_T) 1 << pool->chunk_shift;
+
+	block->data = NULL;
+	block->node = node;
+	block->large = FALSE;
+
+	if (pool->large_pages) {
+		if ((block->data = port_alloc_large(block_size, node)) != NULL) {
+			block->large = TRUE;
+		} else {
+			/* The large pages only get scarcer: don't try again. */
+			KdPrint(("No large pages left, the chunks come from small pages.\n"));
+			pool->large_pages = FALSE;
+		}
+	}
+
+	if (!block->data) {
+		block->data = (node == PORT_NO_NODE) ? port_alloc(block_size) : port_alloc_node(block_size, node);
+		if (!block->data) {
+			port_free(block);
+			return FALSE;
+		}
+	}
+
+	list = free_list(pool, node);
+
+	/* The first chunk is returned, the others are freed in order. */
+	port_lock_acquire(&pool->lock, &state);
+
+	block->next = pool->blocks;
+	pool->blocks = block;
+
+	pool->nblocks++;
+	if (block->large) {
+		pool->nlarge_blocks++;
+	}
+
+	for (chunk = (UCHAR *) block->data + block_size - chunk_size; chunk != (UCHAR *) block->data; chunk -= chunk_size) {
+		*((void **) chunk) = list->head;
+		list->head = chunk;
+		list->nfree++;
+	}
+
+	port_lock_release(&pool->lock, state);
+
+	*data = (UCHAR *) block->data;
+
+	return TRUE;
+}
@@ -0,0 +1,82 @@
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H
+
+#include "port.h"
+
+/*
+ * Memory of the chunks, shared by all the disks of the driver.
+ * The chunks are allocated when they are needed and charged both to the
+ * pool and to the quota of the disk; the limits are not reservations, so the
+ * memory of an idle disk can be used by the others. A few free chunks are
+ * kept to be reused without going through the system allocator.
+ * Only the uncompressed chunks are charged.
+ * A chunk can be placed on a NUMA node: it is allocated on that node and
+ * kept in the node's free list when released. Chunks of PORT_NO_NODE come
+ * from the regular allocator and have their own list.
+ * With large pages the chunks are carved from blocks of whole large pages,
+ * which are only freed with the pool: the free chunks are all kept. When no
+ * large pages are left the blocks come from the regular allocator.
+ */
+#define CHUNK_POOL_CACHE                64 /* Free chunks kept in each list of the pool. */
+
+typedef struct _CHUNK_BLOCK {
+	struct _CHUNK_BLOCK *next;
+	void                *data;
+	ULONG               node;
+	BOOLEAN             large;         /* Allocated with port_alloc_large(). */
+} CHUNK_BLOCK;
+
+typedef struct {
+	void              *head;           /* Free chunks, linked through their first bytes. */
+	ULONG             nfree;
+} CHUNK_FREE_LIST;
+
+typedef struct {
+	PORT_LOCK         lock;
+	CHUNK_FREE_LIST   free_lists[PORT_MAX_NODES + 1]; /* Node + 1 (0: PORT_NO_NODE). */
+	ULONG             max_free;
+	ULONG             chunk_shift;
+	ULONG             block_shift;     /* Chunks carved from blocks of 2^block_shift bytes (0: one by one). */
+	volatile LONG     large_pages;     /* Blocks are tried with large pages. */
+	CHUNK_BLOCK       *blocks;
+	volatile LONGLONG nblocks;
+	volatile LONGLONG nlarge_blocks;
+	LONGLONG          limit;           /* Chunks which can be allocated (0: no limit). */
+	volatile LONGLONG used;            /* Chunks allocated. */
+} CHUNK_POOL;
+
+typedef struct {
+	CHUNK_POOL        *pool;
+	LONGLONG          limit;           /* Chunks of the disk (0: only the limit of the pool). */
+	volatile LONGLONG used;
+	volatile LONGLONG node_used[PORT_MAX_NODES]; /* Chunks placed on each node. */
+} CHUNK_QUOTA;
+
+/* The limits are in bytes, rounded down to whole chunks. */
+void chunk_pool_init(__out CHUNK_POOL *pool, __in ULONG chunk_shift, __in ULONGLONG limit, __in ULONG max_free);
+void chunk_pool_free(__in CHUNK_POOL *pool);
+
+/* Carves the chunks from large pages; called before the first allocation. */
+void chunk_pool_use_large_pages(__in CHUNK_POOL *pool);
+
+void chunk_quota_init(__out CHUNK_QUOTA *quota, __in CHUNK_POOL *pool, __in ULONGLONG limit);
+
+/*
+ * Allocates a chunk (not zeroed) on "node" (or PORT_NO_NODE). Fails with
+ * STATUS_DISK_FULL if either limit would be exceeded, unless "force" is set:
+ * data which is already on the disk (being decompressed or loaded) must
+ * always find room. The chunk is released with the same node.
+ */
+NTSTATUS chunk_pool_alloc(__in CHUNK_QUOTA *quota, __in ULONG node, __in BOOLEAN force, __out UCHAR **data);
+void chunk_pool_release(__in CHUNK_QUOTA *quota, __in ULONG node, __in UCHAR *data);
+
+/* Bytes currently charged. */
+#define chunk_pool_used(pool)           ((ULONGLONG) (pool)->used << (pool)->chunk_shift)
+#define chunk_quota_used(quota)         ((ULONGLONG) (quota)->used << (quota)->pool->chunk_shift)
+#define chunk_quota_node_used(quota, node) ((ULONGLONG) (quota)->node_used[node] << (quota)->pool->chunk_shift)
+
+/* Bytes of the blocks, and of those in large pages. */
+#define chunk_pool_block_bytes(pool)    ((ULONGLONG) (pool)->nblocks << (pool)->block_shift)
+#define chunk_pool_large_bytes(pool)    ((ULONGLONG) (pool)->nlarge_blocks << (pool)->block_shift)
+
+#endif /* CHUNK_POOL_H */
@@ -0,0 +1,1077 @@
+#include "chunk_table.h"
+#include "zero.h"
+#include "lz.h"
+#include "copy.h"
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** The disk image is divided in fixed-size chunks. A chunk is allocated the **
+ ** first time it is written; reading a chunk which has never been written   **
+ ** returns zeros.                                                           **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+static NTSTATUS get_resident_data(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node, __out UCHAR **data);
+static NTSTATUS get_private_data(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node, __out UCHAR **data);
+static NTSTATUS get_chunk_for_write(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node, __out UCHAR **data);
+static void free_chunk(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node);
+static void release_shared_data(__in CHUNK_TABLE *table, __in volatile LONG *refs, __in UCHAR *data, __in BOOLEAN compressed, __in ULONG node);
+static void unshare_chunks(__in CHUNK_TABLE *table, __in ULONGLONG count);
+static NTSTATUS alloc_data(__in CHUNK_TABLE *table, __in ULONG node, __in BOOLEAN force, __out UCHAR **data);
+static void free_data(__in CHUNK_TABLE *table, __in ULONG node, __in UCHAR *data);
+static LONGLONG granule_mask(__in ULONG first, __in ULONG end);
+static ULONGLONG segment_length(__in ULONGLONG nchunks, __in ULONG segment_shift, __in ULONG segment);
+static CHUNK *alloc_segment(__in ULONGLONG count);
+
+NTSTATUS chunk_table_init(__out CHUNK_TABLE *table, __in ULONGLONG size, __in ULONG chunk_shift)
+{
+	ULONGLONG nchunks;
+	ULONG nsegments;
+	ULONG segment_shift;
+	ULONG i;
+
+	if ((chunk_shift < 9) || (chunk_shift >= SEGMENT_SHIFT)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	segment_shift = SEGMENT_SHIFT - chunk_shift;
+
+	nchunks = (size + ((ULONGLONG) 1 << chunk_shift) - 1) >> chunk_shift;
+	if ((nchunks == 0) || (((nchunks - 1) >> segment_shift) >= (ULONG) -1 / sizeof(CHUNK *))) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	nsegments = (ULONG) (((nchunks - 1) >> segment_shift) + 1);
+
+	/* Allocate the segment directory. */
+	if ((table->segments = port_alloc(nsegments * sizeof(CHUNK *))) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(table->segments, nsegments * sizeof(CHUNK *));
+
+	table->nsegments = nsegments;
+	table->nchunks = nchunks;
+	table->chunk_shift = chunk_shift;
+	table->segment_shift = segment_shift;
+	table->nallocated = 0;
+	table->nshared = 0;
+	table->npinned = 0;
+	table->quota = NULL;
+
+	numa_layout_init(&table->numa, NUMA_POLICY_NONE, 0, nchunks);
+
+	table->track_references = FALSE;
+
+	table->compress_work = NULL;
+	table->compress_buffer = NULL;
+	table->clock_hand = 0;
+	table->compressed_bytes = 0;
+
+	/* Allocate the segments (the last one might be shorter). */
+	for (i = 0; i < nsegments; i++) {
+		if ((table->segments[i] = alloc_segment(segment_length(nchunks, segment_shift, i))) == NULL) {
+			chunk_table_free(table);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void chunk_table_free(__in CHUNK_TABLE *table)
+{
+	ULONGLONG i;
+	CHUNK *chunk;
+
+	if (!table->segments) {
+		return;
+	}
+
+	for (i = 0; i < table->nchunks; i++) {
+		/* Segments are allocated in order; stop at the first missing one. */
+		if (!table->segments[i >> table->segment_shift]) {
+			break;
+		}
+
+		chunk = chunk_table_get_chunk(table, i);
+		if (chunk->data) {
+			/* The shared data is only freed with its last reference. */
+			free_chunk(table, chunk, chunk_table_node(table, i));
+		}
+	}
+
+	for (i = 0; i < table->nsegments; i++) {
+		if (table->segments[i]) {
+			port_free(table->segments[i]);
+		}
+	}
+
+	port_free(table->segments);
+	table->segments = NULL;
+
+	if (table->compress_work) {
+		port_free(table->compress_work);
+		table->compress_work = NULL;
+	}
+
+	if (table->compress_buffer) {
+		port_free(table->compress_buffer);
+		table->compress_buffer = NULL;
+	}
+
+	table->nallocated = 0;
+	table->nshared = 0;
+	table->compressed_bytes = 0;
+}
+
+NTSTATUS chunk_table_prepare_resize(__in CHUNK_TABLE *table, __in ULONGLONG size, __out CHUNK_TABLE_RESIZE *resize)
+{
+	ULONGLONG nchunks;
+	ULONG last;
+	ULONG i;
+
+	nchunks = (size + ((ULONGLONG) 1 << table->chunk_shift) - 1) >> table->chunk_shift;
+	if ((nchunks == 0) || (((nchunks - 1) >> table->segment_shift) >= (ULONG) -1 / sizeof(CHUNK *))) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	resize->nsegments = (ULONG) (((nchunks - 1) >> table->segment_shift) + 1);
+	resize->old_nsegments = table->nsegments;
+	resize->size = size;
+	resize->last = NULL;
+	resize->installed = FALSE;
+
+	if ((resize->segments = port_alloc(resize->nsegments * sizeof(CHUNK *))) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(resize->segments, resize->nsegments * sizeof(CHUNK *));
+
+	/* The segments which are kept don't move. */
+	RtlCopyMemory(resize->segments, table->segments, ((resize->nsegments < table->nsegments) ? resize->nsegments : table->nsegments) * sizeof(CHUNK *));
+
+	if (nchunks <= table->nchunks) {
+		return STATUS_SUCCESS;
+	}
+
+	/* A short last segment has to grow; its descriptors are copied by chunk_table_resize(). */
+	last = table->nsegments - 1;
+
+	if (segment_length(table->nchunks, table->segment_shift, last) < ((ULONGLONG) 1 << table->segment_shift)) {
+		if ((resize->last = alloc_segment(segment_length(nchunks, table->segment_shift, last))) == NULL) {
+			chunk_table_end_resize(resize);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	for (i = table->nsegments; i < resize->nsegments; i++) {
+		if ((resize->segments[i] = alloc_segment(segment_length(nchunks, table->segment_shift, i))) == NULL) {
+			chunk_table_end_resize(resize);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS chunk_table_resize(__in CHUNK_TABLE *table, __inout CHUNK_TABLE_RESIZE *resize)
+{
+	ULONGLONG nchunks;
+	ULONGLONG index;
+	ULONG last;
+	CHUNK **segments;
+	CHUNK *segment;
+
+	ASSERT(resize->old_nsegments == table->nsegments);
+
+	nchunks = (resize->size + ((ULONGLONG) 1 << table->chunk_shift) - 1) >> table->chunk_shift;
+
+	if (nchunks < table->nchunks) {
+		/* Only unused chunks can go away. */
+		for (index = nchunks; index < table->nchunks; index++) {
+			if (chunk_table_get_chunk(table, index)->data) {
+				return STATUS_DEVICE_BUSY;
+			}
+		}
+
+		/* The rest of the last chunk reads as zeros if the disk grows again. */
+		if (resize->size < (nchunks << table->chunk_shift)) {
+			chunk_table_trim(table, resize->size, (nchunks << table->chunk_shift) - resize->size);
+		}
+	}
+
+	/* Replace the short last segment by the longer copy. */
+	if (resize->last) {
+		last = table->nsegments - 1;
+
+		RtlCopyMemory(resize->last, table->segments[last], (SIZE_T) segment_length(table->nchunks, table->segment_shift, last) * sizeof(CHUNK));
+
+		segment = table->segments[last];
+		resize->segments[last] = resize->last;
+		resize->last = segment;
+	}
+
+	/* Install the new directory; the old one is freed by chunk_table_end_resize(). */
+	segments = table->segments;
+
+	table->segments = resize->segments;
+	table->nsegments = resize->nsegments;
+	table->nchunks = nchunks;
+
+	if (table->clock_hand >= nchunks) {
+		table->clock_hand = 0;
+	}
+
+	resize->segments = segments;
+	resize->installed = TRUE;
+
+	return STATUS_SUCCESS;
+}
+
+void chunk_table_end_resize(__in CHUNK_TABLE_RESIZE *resize)
+{
+	ULONG first;
+	ULONG end;
+	ULONG i;
+
+	if (!resize->segments) {
+		return;
+	}
+
+	/* Segments which are only in the directory not in use: removed by the resize, or never installed. */
+	if (resize->installed) {
+		first = resize->nsegments;
+		end = resize->old_nsegments;
+	} else {
+		first = resize->old_nsegments;
+		end = resize->nsegments;
+	}
+
+	for (i = first; i < end; i++) {
+		if (resize->segments[i]) {
+			port_free(resize->segments[i]);
+		}
+	}
+
+	if (resize->last) {
+		port_free(resize->last);
+		resize->last = NULL;
+	}
+
+	port_free(resize->segments);
+	resize->segments = NULL;
+}
+
+NTSTATUS chunk_table_read(__in CHUNK_TABLE *table, __in ULONGLONG offset, __out UCHAR *buffer, __in SIZE_T length)
+{
+	ULONGLONG index;
+	ULONG chunk_size;
+	ULONG chunk_offset;
+	SIZE_T count;
+	CHUNK *chunk;
+	UCHAR *data;
+	BOOLEAN streaming;
+	NTSTATUS status;
+
+	chunk_size = 1UL << table->chunk_shift;
+
+	index = offset >> table->chunk_shift;
+	chunk_offset = (ULONG) offset & (chunk_size - 1);
+
+	/* Large transfers don't go through the caches. */
+	streaming = copy_use_streaming(length);
+
+	while (length > 0) {
+		count = chunk_size - chunk_offset;
+		if (count > length) {
+			count = length;
+		}
+
+		/* Requests crossing a chunk (or segment) boundary are split here. */
+		chunk = chunk_table_get_chunk(table, index);
+
+		status = get_resident_data(table, chunk, chunk_table_node(table, index), &data);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		if (data) {
+			copy_memory(buffer, data + chunk_offset, count, streaming);
+		} else {
+			RtlZeroMemory(buffer, count);
+		}
+
+		buffer += count;
+		length -= count;
+
+		index++;
+		chunk_offset = 0;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS chunk_table_write(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in const UCHAR *buffer, __in SIZE_T length)
+{
+	ULONGLONG index;
+	ULONG chunk_size;
+	ULONG chunk_offset;
+	ULONG granule_shift;
+	SIZE_T count;
+	CHUNK *chunk;
+	UCHAR *data;
+	BOOLEAN streaming;
+	NTSTATUS status;
+
+	chunk_size = 1UL << table->chunk_shift;
+
+	index = offset >> table->chunk_shift;
+	chunk_offset = (ULONG) offset & (chunk_size - 1);
+
+	/* Large transfers don't go through the caches. */
+	streaming = copy_use_streaming(length);
+
+	while (length > 0) {
+		count = chunk_size - chunk_offset;
+		if (count > length) {
+			count = length;
+		}
+
+		/* Requests crossing a chunk (or segment) boundary are split here. */
+		chunk = chunk_table_get_chunk(table, index);
+
+		/*
+		 * Blocks of zeros don't need memory: skip them if the chunk has not
+		 * been allocated, and free the chunk if they overwrite it completely
+		 * (the caller has the whole chunk locked in that case). The writes of
+		 * whole chunks are thus scanned even if the chunk has data, but the
+		 * scan stops at the first non-zero bytes: for most data, right away.
+		 */
+		if (((!chunk->data) || ((count == chunk_size) && (!(chunk->flags & CHUNK_PINNED)))) && (is_zero_block(buffer, count))) {
+			if (chunk->data) {
+				free_chunk(table, chunk, chunk_table_node(table, index));
+			}
+
+			buffer += count;
+			length -= count;
+
+			index++;
+			chunk_offset = 0;
+
+			continue;
+		}
+
+		status = get_chunk_for_write(table, chunk, chunk_table_node(table, index), &data);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		copy_memory(data + chunk_offset, buffer, count, streaming);
+
+		/* The granules written are no longer trimmed. */
+		if (chunk->trimmed) {
+			granule_shift = table->chunk_shift - TRIM_GRANULES_SHIFT;
+
+			InterlockedAnd64(&chunk->trimmed, ~granule_mask(chunk_offset >> granule_shift, (ULONG) ((chunk_offset + count - 1) >> granule_shift) + 1));
+		}
+
+		buffer += count;
+		length -= count;
+
+		index++;
+		chunk_offset = 0;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS chunk_table_copy_chunk(__in CHUNK_TABLE *table, __in ULONGLONG index, __out UCHAR *buffer, __out BOOLEAN *present)
+{
+	CHUNK *chunk;
+	LONG flags;
+	BOOLEAN decompressed;
+
+	chunk = chunk_table_get_chunk(table, index);
+
+	for (;;) {
+		flags = chunk->flags;
+
+		/* Only a reader decompressing the chunk can change it under us. */
+		if (!(flags & CHUNK_COMPRESSED)) {
+			if ((*present = (BOOLEAN) (chunk->data != NULL)) != FALSE) {
+				RtlCopyMemory(buffer, chunk->data, (SIZE_T) 1 << table->chunk_shift);
+			}
+
+			return STATUS_SUCCESS;
+		}
+
+		if (flags & CHUNK_BUSY) {
+			YieldProcessor();
+			continue;
+		}
+
+		/* Keep the readers away while the compressed data is being used. */
+		if (InterlockedCompareExchange(&chunk->flags, flags | CHUNK_BUSY, flags) == flags) {
+			break;
+		}
+	}
+
+	decompressed = lz_decompress(chunk->data, chunk->compressed_size, buffer, 1UL << table->chunk_shift);
+
+	InterlockedAnd(&chunk->flags, ~CHUNK_BUSY);
+
+	if (!decompressed) {
+		ASSERT(FALSE);
+		return STATUS_DATA_ERROR;
+	}
+
+	*present = TRUE;
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN chunk_table_is_loaded(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length)
+{
+	ULONGLONG index;
+	ULONGLONG last;
+
+	if (length == 0) {
+		return TRUE;
+	}
+
+	last = (offset + length - 1) >> table->chunk_shift;
+
+	for (index = offset >> table->chunk_shift; index <= last; index++) {
+		if (chunk_table_get_chunk(table, index)->flags & CHUNK_NOT_LOADED) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+NTSTATUS chunk_table_load_chunk(__in CHUNK_TABLE *table, __in ULONGLONG index, __in const UCHAR *data)
+{
+	CHUNK *chunk;
+	UCHAR *copy;
+	NTSTATUS status;
+
+	chunk = chunk_table_get_chunk(table, index);
+
+	ASSERT(!chunk->data);
+
+	/* Blocks of zeros don't need memory (the data is already on the disk, it doesn't count against the quota). */
+	if (!is_zero_block(data, (SIZE_T) 1 << table->chunk_shift)) {
+		status = alloc_data(table, chunk_table_node(table, index), TRUE, &copy);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		RtlCopyMemory(copy, data, (SIZE_T) 1 << table->chunk_shift);
+
+		chunk->data = copy;
+
+		InterlockedIncrement(&table->nallocated);
+	}
+
+	/* Publish the chunk. */
+	InterlockedAnd(&chunk->flags, ~CHUNK_NOT_LOADED);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS chunk_table_clone(__out CHUNK_TABLE *clone, __in CHUNK_TABLE *table)
+{
+	ULONGLONG index;
+	CHUNK *chunk;
+	CHUNK *copy;
+	volatile LONG *refs;
+	NTSTATUS status;
+
+	/* The mappings would see the writes of one table only. */
+	if (table->npinned > 0) {
+		return STATUS_DEVICE_BUSY;
+	}
+
+	status = chunk_table_init(clone, table->nchunks << table->chunk_shift, table->chunk_shift);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* The shared data is released to the pool it came from. */
+	clone->quota = table->quota;
+
+	/* The chunks are freed from the nodes they were placed on. */
+	clone->numa = table->numa;
+
+	for (index = 0; index < table->nchunks; index++) {
+		chunk = chunk_table_get_chunk(table, index);
+		if (!chunk->data) {
+			continue;
+		}
+
+		ASSERT(!(chunk->flags & CHUNK_NOT_LOADED));
+
+		/* The first clone makes the chunk shared. */
+		if (!chunk->refs) {
+			if ((refs = port_alloc(sizeof(LONG))) == NULL) {
+				/* Drop the references of the clone, then make private again what only "table" shares. */
+				chunk_table_free(clone);
+				unshare_chunks(table, index);
+
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+
+			*refs = 1;
+			chunk->refs = refs;
+
+			if (chunk->flags & CHUNK_COMPRESSED) {
+				InterlockedExchangeAdd64(&table->compressed_bytes, -(LONGLONG) chunk->compressed_size);
+			} else {
+				InterlockedDecrement(&table->nallocated);
+			}
+
+			InterlockedIncrement(&table->nshared);
+		}
+
+		InterlockedIncrement(chunk->refs);
+
+		copy = chunk_table_get_chunk(clone, index);
+
+		copy->data = chunk->data;
+		copy->trimmed = chunk->trimmed;
+		copy->flags = chunk->flags & (CHUNK_COMPRESSED | CHUNK_INCOMPRESSIBLE);
+		copy->compressed_size = chunk->compressed_size;
+		copy->refs = chunk->refs;
+
+		clone->nshared++;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN chunk_table_is_shared(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length)
+{
+	ULONGLONG index;
+	ULONGLONG last;
+
+	if ((length == 0) || (table->nshared == 0)) {
+		return FALSE;
+	}
+
+	last = (offset + length - 1) >> table->chunk_shift;
+
+	for (index = offset >> table->chunk_shift; index <= last; index++) {
+		if (chunk_table_get_chunk(table, index)->refs) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+NTSTATUS get_resident_data(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node, __out UCHAR **data)
+{
+	UCHAR *compressed;
+	ULONG compressed_size;
+	volatile LONG *refs;
+	LONG flags;
+	NTSTATUS status;
+
+	for (;;) {
+		flags = chunk->flags;
+
+		if (!(flags & CHUNK_COMPRESSED)) {
+			/* Let the clock know that the chunk is in use. */
+			if ((table->track_references) && (!(flags & CHUNK_REFERENCED))) {
+				InterlockedOr(&chunk->flags, CHUNK_REFERENCED);
+			}
+
+			*data = chunk->data;
+			return STATUS_SUCCESS;
+		}
+
+		/* Somebody else is decompressing the chunk, wait. */
+		if (flags & CHUNK_BUSY) {
+			YieldProcessor();
+			continue;
+		}
+
+		if (InterlockedCompareExchange(&chunk->flags, flags | CHUNK_BUSY, flags) == flags) {
+			break;
+		}
+	}
+
+	/* Decompress the chunk (it is already on the disk, it doesn't count against the quota). */
+	if (!NT_SUCCESS(status = alloc_data(table, node, TRUE, data))) {
+		InterlockedAnd(&chunk->flags, ~CHUNK_BUSY);
+		return status;
+	}
+
+	compressed = chunk->data;
+	compressed_size = chunk->compressed_size;
+
+	if (!lz_decompress(compressed, compressed_size, *data, 1UL << table->chunk_shift)) {
+		/* Can only happen if the memory has been corrupted. */
+		ASSERT(FALSE);
+
+		free_data(table, node, *data);
+		InterlockedAnd(&chunk->flags, ~CHUNK_BUSY);
+		return STATUS_DATA_ERROR;
+	}
+
+	/* The decompressed chunk is private. */
+	refs = chunk->refs;
+
+	chunk->data = *data;
+	chunk->compressed_size = 0;
+	chunk->refs = NULL;
+
+	InterlockedIncrement(&table->nallocated);
+
+	if (refs) {
+		InterlockedDecrement(&table->nshared);
+	} else {
+		InterlockedExchangeAdd64(&table->compressed_bytes, -(LONGLONG) compressed_size);
+	}
+
+	/* Publish the uncompressed chunk. */
+	InterlockedAnd(&chunk->flags, ~(CHUNK_COMPRESSED | CHUNK_BUSY));
+	InterlockedOr(&chunk->flags, CHUNK_REFERENCED);
+
+	if (refs) {
+		release_shared_data(table, refs, compressed, TRUE, node);
+	} else {
+		port_free(compressed);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS get_private_data(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node, __out UCHAR **data)
+{
+	volatile LONG *refs;
+	UCHAR *copy;
+	NTSTATUS status;
+
+	status = get_resident_data(table, chunk, node, data);
+	if ((!NT_SUCCESS(status)) || (!*data) || (!chunk->refs)) {
+		return status;
+	}
+
+	/* Copy on write (the caller has the whole chunk, nobody else in this table uses the data). */
+	refs = chunk->refs;
+
+	if (*refs == 1) {
+		/* The other tables are gone, take the data over. */
+		port_free((void *) refs);
+	} else {
+		status = alloc_data(table, node, FALSE, &copy);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		RtlCopyMemory(copy, *data, (SIZE_T) 1 << table->chunk_shift);
+
+		release_shared_data(table, refs, *data, FALSE, node);
+
+		chunk->data = copy;
+		*data = copy;
+	}
+
+	chunk->refs = NULL;
+
+	InterlockedDecrement(&table->nshared);
+	InterlockedIncrement(&table->nallocated);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS get_chunk_for_write(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node, __out UCHAR **data)
+{
+	UCHAR *current;
+	NTSTATUS status;
+
+	status = get_private_data(table, chunk, node, data);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (*data) {
+		/* The new data might compress. */
+		if (chunk->flags & CHUNK_INCOMPRESSIBLE) {
+			InterlockedAnd(&chunk->flags, ~CHUNK_INCOMPRESSIBLE);
+		}
+
+		return STATUS_SUCCESS;
+	}
+
+	/* Allocate memory for the chunk. */
+	status = alloc_data(table, node, FALSE, data);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	RtlZeroMemory(*data, (SIZE_T) 1 << table->chunk_shift);
+
+	/* Install the new chunk, unless somebody else did it in the meantime. */
+	current = InterlockedCompareExchangePointer((void **) &chunk->data, *data, NULL);
+	if (current) {
+		free_data(table, node, *data);
+		*data = current;
+
+		return STATUS_SUCCESS;
+	}
+
+	InterlockedIncrement(&table->nallocated);
+
+	return STATUS_SUCCESS;
+}
+
+void chunk_table_trim(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length)
+{
+	ULONGLONG index;
+	ULONG chunk_size;
+	ULONG chunk_offset;
+	ULONG granule_shift;
+	ULONG granule_size;
+	ULONG count;
+	LONGLONG mask;
+	CHUNK *chunk;
+	UCHAR *data;
+	ULONG node;
+
+	chunk_size = 1UL << table->chunk_shift;
+
+	granule_shift = table->chunk_shift - TRIM_GRANULES_SHIFT;
+	granule_size = 1UL << granule_shift;
+
+	index = offset >> table->chunk_shift;
+	chunk_offset = (ULONG) offset & (chunk_size - 1);
+
+	while (length > 0) {
+		count = chunk_size - chunk_offset;
+		if (count > length) {
+			count = (ULONG) length;
+		}
+
+		chunk = chunk_table_get_chunk(table, index);
+		node = chunk_table_node(table, index);
+
+		if (chunk->flags & CHUNK_PINNED) {
+			/* The data is mapped: it stays. */
+			RtlZeroMemory(chunk->data + chunk_offset, count);
+		} else if (chunk->data) {
+			if (count == chunk_size) {
+				free_chunk(table, chunk, node);
+			} else if ((NT_SUCCESS(get_private_data(table, chunk, node, &data))) && (data)) {
+				RtlZeroMemory(data + chunk_offset, count);
+
+				/* Only the granules completely inside the range are marked. */
+				mask = granule_mask((chunk_offset + granule_size - 1) >> granule_shift, (chunk_offset + count) >> granule_shift);
+
+				if ((mask) && ((InterlockedOr64(&chunk->trimmed, mask) | mask) == ALL_GRANULES_TRIMMED)) {
+					free_chunk(table, chunk, node);
+				}
+			}
+		}
+
+		length -= count;
+
+		index++;
+		chunk_offset = 0;
+	}
+}
+
+void free_chunk(__in CHUNK_TABLE *table, __in CHUNK *chunk, __in ULONG node)
+{
+	UCHAR *data;
+
+	if ((data = InterlockedExchangePointer((void **) &chunk->data, NULL)) != NULL) {
+		if (chunk->refs) {
+			release_shared_data(table, chunk->refs, data, (BOOLEAN) ((chunk->flags & CHUNK_COMPRESSED) != 0), node);
+
+			chunk->refs = NULL;
+			chunk->compressed_size = 0;
+
+			InterlockedDecrement(&table->nshared);
+		} else if (chunk->flags & CHUNK_COMPRESSED) {
+			port_free(data);
+
+			InterlockedExchangeAdd64(&table->compressed_bytes, -(LONGLONG) chunk->compressed_size);
+			chunk->compressed_size = 0;
+		} else {
+			free_data(table, node, data);
+
+			InterlockedDecrement(&table->nallocated);
+		}
+	}
+
+	chunk->trimmed = 0;
+	chunk->flags = 0;
+}
+
+void release_shared_data(__in CHUNK_TABLE *table, __in volatile LONG *refs, __in UCHAR *data, __in BOOLEAN compressed, __in ULONG node)
+{
+	if (InterlockedDecrement(refs) == 0) {
+		if (compressed) {
+			port_free(data);
+		} else {
+			free_data(table, node, data);
+		}
+
+		port_free((void *) refs);
+	}
+}
+
+void unshare_chunks(__in CHUNK_TABLE *table, __in ULONGLONG count)
+{
+	ULONGLONG index;
+	CHUNK *chunk;
+
+	for (index = 0; index < count; index++) {
+		chunk = chunk_table_get_chunk(table, index);
+
+		/* Shared with no other table. */
+		if ((!chunk->refs) || (*chunk->refs != 1)) {
+			continue;
+		}
+
+		port_free((void *) chunk->refs);
+		chunk->refs = NULL;
+
+		if (chunk->flags & CHUNK_COMPRESSED) {
+			InterlockedExchangeAdd64(&table->compressed_bytes, chunk->compressed_size);
+		} else {
+			InterlockedIncrement(&table->nallocated);
+		}
+
+		InterlockedDecrement(&table->nshared);
+	}
+}
+
+NTSTATUS alloc_data(__in CHUNK_TABLE *table, __in ULONG node, __in BOOLEAN force, __out UCHAR **data)
+{
+	SIZE_T size;
+
+	if (table->quota) {
+		return chunk_pool_alloc(table->quota, node, force, data);
+	}
+
+	size = (SIZE_T) 1 << table->chunk_shift;
+
+	if ((*data = (node == PORT_NO_NODE) ? port_alloc(size) : port_alloc_node(size, node)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void free_data(__in CHUNK_TABLE *table, __in ULONG node, __in UCHAR *data)
+{
+	if (table->quota) {
+		chunk_pool_release(table->quota, node, data);
+	} else if (node == PORT_NO_NODE) {
+		port_free(data);
+	} else {
+		port_free_node(data, (SIZE_T) 1 << table->chunk_shift);
+	}
+}
+
+NTSTATUS chunk_table_enable_compression(__in CHUNK_TABLE *table)
+{
+	if ((table->compress_work = port_alloc(LZ_WORK_SIZE)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if ((table->compress_buffer = port_alloc((SIZE_T) 1 << table->chunk_shift)) == NULL) {
+		port_free(table->compress_work);
+		table->compress_work = NULL;
+
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	table->track_references = TRUE;
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN chunk_table_next_victim(__in CHUNK_TABLE *table, __in LONG skip, __out ULONGLONG *index)
+{
+	ULONGLONG i;
+	CHUNK *chunk;
+	LONG flags;
+
+	/* Two passes: the first one might only clear the marks. */
+	for (i = 0; i < 2 * table->nchunks; i++) {
+		chunk = chunk_table_get_chunk(table, table->clock_hand);
+
+		*index = table->clock_hand;
+
+		if (++table->clock_hand == table->nchunks) {
+			table->clock_hand = 0;
+		}
+
+		flags = chunk->flags;
+
+		/* Compressing or evicting a shared chunk would not free its data; a pinned one must stay. */
+		if ((!chunk->data) || (chunk->refs) || (flags & (skip | CHUNK_PINNED))) {
+			continue;
+		}
+
+		if (flags & CHUNK_REFERENCED) {
+			InterlockedAnd(&chunk->flags, ~CHUNK_REFERENCED);
+			continue;
+		}
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+BOOLEAN chunk_table_compress(__in CHUNK_TABLE *table, __in ULONGLONG index)
+{
+	UCHAR *compressed;
+	ULONG chunk_size;
+	ULONG size;
+	CHUNK *chunk;
+
+	ASSERT(table->compress_work);
+
+	chunk = chunk_table_get_chunk(table, index);
+
+	if ((!chunk->data) || (chunk->refs) || (chunk->flags & (CHUNK_COMPRESSED | CHUNK_INCOMPRESSIBLE | CHUNK_PINNED))) {
+		return FALSE;
+	}
+
+	chunk_size = 1UL << table->chunk_shift;
+
+	/* Only worth it if it saves at least 1/8 of the chunk. */
+	size = lz_compress(chunk->data, chunk_size, table->compress_buffer, chunk_size - (chunk_size >> 3), table->compress_work);
+	if (size == 0) {
+		InterlockedOr(&chunk->flags, CHUNK_INCOMPRESSIBLE);
+		return FALSE;
+	}
+
+	if ((compressed = port_alloc(size)) == NULL) {
+		return FALSE;
+	}
+
+	RtlCopyMemory(compressed, table->compress_buffer, size);
+
+	free_data(table, chunk_table_node(table, index), chunk->data);
+
+	chunk->data = compressed;
+	chunk->compressed_size = size;
+
+	InterlockedOr(&chunk->flags, CHUNK_COMPRESSED);
+
+	InterlockedDecrement(&table->nallocated);
+	InterlockedExchangeAdd64(&table->compressed_bytes, size);
+
+	return TRUE;
+}
+
+void chunk_table_evict(__in CHUNK_TABLE *table, __in ULONGLONG index)
+{
+	CHUNK *chunk;
+
+	chunk = chunk_table_get_chunk(table, index);
+
+	ASSERT(!chunk->refs);
+	ASSERT(!(chunk->flags & CHUNK_PINNED));
+
+	free_chunk(table, chunk, chunk_table_node(table, index));
+
+	/* Read from the file again when accessed. */
+	chunk->flags = CHUNK_NOT_LOADED;
+}
+
+NTSTATUS chunk_table_pin(__in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG count, __out UCHAR **data)
+{
+	ULONGLONG i;
+	CHUNK *chunk;
+	NTSTATUS status;
+
+	for (i = 0; i < count; i++) {
+		chunk = chunk_table_get_chunk(table, first + i);
+
+		ASSERT(!(chunk->flags & CHUNK_NOT_LOADED));
+
+		if ((chunk->flags & CHUNK_PINNED) == CHUNK_PINNED) {
+			chunk_table_unpin(table, first, i);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		/* Decompressed, unshared, or allocated as for a write. */
+		status = get_chunk_for_write(table, chunk, chunk_table_node(table, first + i), &data[i]);
+		if (!NT_SUCCESS(status)) {
+			chunk_table_unpin(table, first, i);
+			return status;
+		}
+
+		/* What is written through the mapping is not seen: no granule of the chunk is trimmed any longer. */
+		chunk->trimmed = 0;
+
+		if ((InterlockedExchangeAdd(&chunk->flags, CHUNK_PIN) & CHUNK_PINNED) == 0) {
+			InterlockedIncrement(&table->npinned);
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void chunk_table_unpin(__in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG count)
+{
+	ULONGLONG i;
+	CHUNK *chunk;
+
+	for (i = 0; i < count; i++) {
+		chunk = chunk_table_get_chunk(table, first + i);
+
+		ASSERT(chunk->flags & CHUNK_PINNED);
+
+		/* The data might have been changed through the mapping: it might compress now. */
+		if (((InterlockedExchangeAdd(&chunk->flags, -CHUNK_PIN) - CHUNK_PIN) & CHUNK_PINNED) == 0) {
+			InterlockedAnd(&chunk->flags, ~CHUNK_INCOMPRESSIBLE);
+			InterlockedDecrement(&table->npinned);
+		}
+	}
+}
+
+LONGLONG granule_mask(__in ULONG first, __in ULONG end)
+{
+	if (first >= end) {
+		return 0;
+	}
+
+	if (end - first == (1UL << TRIM_GRANULES_SHIFT)) {
+		return ALL_GRANULES_TRIMMED;
+	}
+
+	return (LONGLONG) ((((ULONGLONG) 1 << (end - first)) - 1) << first);
+}
+
+ULONGLONG segment_length(__in ULONGLONG nchunks, __in ULONG segment_shift, __in ULONG segment)
+{
+	ULONGLONG count;
+
+	count = nchunks - ((ULONGLONG) segment << segment_shift);
+
+	return (count > ((ULONGLONG) 1 << segment_shift)) ? (ULONGLONG) 1 << segment_shift : count;
+}
+
+CHUNK *alloc_segment(__in ULONGLONG count)
+{
+	CHUNK *segment;
+
+	if ((segment = port_alloc((SIZE_T) count * sizeof(CHUNK))) != NULL) {
+		RtlZeroMemory(segment, (SIZE_T) count * sizeof(CHUNK));
+	}
+
+	return segment;
+}
@@ -0,0 +1,196 @@
+#ifndef CHUNK_TABLE_H
+#define CHUNK_TABLE_H
+
+#include "port.h"
+#include "chunk_pool.h"
+#include "numa_layout.h"
+
+#define DEFAULT_CHUNK_SHIFT             16 /* 64 KB. */
+#define SEGMENT_SHIFT                   30 /* 1 GB. */
+
+/*
+ * Each chunk is divided in 64 trim granules. A bit is set in "trimmed"
+ * when its granule has been completely trimmed and cleared when the granule
+ * is written again; when all the bits are set the chunk is freed.
+ */
+#define TRIM_GRANULES_SHIFT             6
+#define ALL_GRANULES_TRIMMED            ((LONGLONG) -1)
+
+/* Chunk flags. */
+#define CHUNK_COMPRESSED                0x01 /* "data" points to the compressed chunk. */
+#define CHUNK_BUSY                      0x02 /* Being decompressed. */
+#define CHUNK_REFERENCED                0x04 /* Accessed since the clock hand last passed. */
+#define CHUNK_INCOMPRESSIBLE            0x08 /* Not worth compressing until written again. */
+#define CHUNK_NOT_LOADED                0x10 /* The data is still in the image (or backing) file. */
+#define CHUNK_SPILLED                   0x20 /* Not loaded: the data is in a slot of the spill file. */
+
+/* The high bits of the flags count the pins of the chunk (chunk_table_pin()). */
+#define CHUNK_PIN                       0x00010000
+#define CHUNK_PINNED                    0x7fff0000
+#define CHUNK_MAX_PINS                  (CHUNK_PINNED / CHUNK_PIN)
+
+typedef struct {
+	UCHAR             *data;           /* NULL if the chunk has never been written. */
+	volatile LONGLONG trimmed;         /* Bitmap of trimmed granules. */
+	volatile LONG     flags;
+	ULONG             compressed_size; /* Or the slot in the spill file (CHUNK_SPILLED). */
+	volatile LONG     *refs;           /* Tables sharing "data" (NULL: private). */
+} CHUNK;
+
+/*
+ * The chunk descriptors are grouped in segments of SEGMENT_SHIFT bytes of
+ * disk, each one allocated independently, so that large disks don't need a
+ * single contiguous allocation for the descriptors.
+ */
+typedef struct {
+	CHUNK         **segments;
+	ULONG         nsegments;
+	ULONGLONG     nchunks;
+	ULONG         chunk_shift;
+	ULONG         segment_shift; /* Log2 of the number of chunks per segment. */
+	volatile LONG nallocated;    /* Number of private uncompressed chunks with data. */
+	volatile LONG nshared;       /* Number of chunks sharing their data with other tables. */
+	volatile LONG npinned;       /* Number of pinned chunks. */
+	CHUNK_QUOTA   *quota;        /* Memory of the chunks (NULL: allocated directly). */
+	NUMA_LAYOUT   numa;          /* Node of each chunk. */
+	BOOLEAN       track_references; /* Accesses set CHUNK_REFERENCED. */
+
+	/* Compression of cold chunks (only if enabled). */
+	void              *compress_work;
+	UCHAR             *compress_buffer;
+	ULONGLONG         clock_hand;
+	volatile LONGLONG compressed_bytes;
+} CHUNK_TABLE;
+
+NTSTATUS chunk_table_init(__out CHUNK_TABLE *table, __in ULONGLONG size, __in ULONG chunk_shift);
+void chunk_table_free(__in CHUNK_TABLE *table);
+
+/*
+ * Takes the chunks from a pool, charging them to "quota"; writes which would
+ * exceed the quota fail with STATUS_DISK_FULL. Must be called before the
+ * table is used; the pool must have the table's chunk size.
+ */
+#define chunk_table_set_quota(table, q) ((table)->quota = (q))
+
+/*
+ * Places the chunks on the NUMA nodes (NUMA_POLICY_xxx, stripes of "stripe"
+ * bytes). Must be called before the table is used; the regions of
+ * NUMA_POLICY_PARTITION are those of the current size.
+ */
+#define chunk_table_set_numa(table, policy, stripe) \
+	numa_layout_init(&(table)->numa, (policy), (ULONGLONG) (stripe) >> (table)->chunk_shift, (table)->nchunks)
+
+/* Node of the chunk (PORT_NO_NODE if the chunks are not placed). */
+#define chunk_table_node(table, index)  numa_chunk_node(&(table)->numa, (index))
+
+/*
+ * Online resize. chunk_table_prepare_resize() allocates the new descriptors
+ * while the table is in use; chunk_table_resize() installs them, which
+ * requires that there is no I/O on the table (it is quick: the chunks are not
+ * copied, only the descriptors of the last segment if it grows), and
+ * chunk_table_end_resize() frees whatever is left over, whether the resize
+ * was installed or not. Only one resize can be in progress.
+ * Shrinking fails with STATUS_DEVICE_BUSY if a chunk beyond the new size
+ * has data; the rest of the last chunk is zeroed. The table must have no
+ * chunks not loaded.
+ */
+typedef struct {
+	CHUNK     **segments;      /* New segment directory (the old one once installed). */
+	CHUNK     *last;           /* New copy of the last segment (the old one once installed). */
+	ULONG     nsegments;
+	ULONG     old_nsegments;
+	ULONGLONG size;
+	BOOLEAN   installed;
+} CHUNK_TABLE_RESIZE;
+
+NTSTATUS chunk_table_prepare_resize(__in CHUNK_TABLE *table, __in ULONGLONG size, __out CHUNK_TABLE_RESIZE *resize);
+NTSTATUS chunk_table_resize(__in CHUNK_TABLE *table, __inout CHUNK_TABLE_RESIZE *resize);
+void chunk_table_end_resize(__in CHUNK_TABLE_RESIZE *resize);
+
+NTSTATUS chunk_table_read(__in CHUNK_TABLE *table, __in ULONGLONG offset, __out UCHAR *buffer, __in SIZE_T length);
+NTSTATUS chunk_table_write(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in const UCHAR *buffer, __in SIZE_T length);
+
+/*
+ * Copy a whole chunk to "buffer" without changing its state (a compressed
+ * chunk stays compressed). "present" is FALSE, and the buffer is not touched,
+ * if the chunk has no data. The chunk must not be written during the copy.
+ */
+NTSTATUS chunk_table_copy_chunk(__in CHUNK_TABLE *table, __in ULONGLONG index, __out UCHAR *buffer, __out BOOLEAN *present);
+
+/*
+ * Chunks marked CHUNK_NOT_LOADED have to be loaded before being accessed.
+ * chunk_table_load_chunk() takes a copy of the data and clears the mark;
+ * the chunk must not be accessed meanwhile.
+ */
+BOOLEAN chunk_table_is_loaded(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length);
+NTSTATUS chunk_table_load_chunk(__in CHUNK_TABLE *table, __in ULONGLONG index, __in const UCHAR *data);
+
+/*
+ * Discard the range: whole chunks are freed, partial ones are zeroed.
+ * The caller must make sure that there is no I/O on any of the chunks
+ * touched by the range, not only on the range itself.
+ */
+void chunk_table_trim(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length);
+
+/*
+ * Copy-on-write clones.
+ * chunk_table_clone() creates a table which shares the data of every chunk
+ * with "table" (only the descriptors are copied); the data is reference
+ * counted and copied the first time one of the tables writes the chunk.
+ * Neither table may have I/O during the clone, nor chunks not loaded; it
+ * fails with STATUS_DEVICE_BUSY if "table" has pinned chunks.
+ * Writing or trimming part of a shared chunk requires that there is no I/O
+ * on the rest of the chunk (see chunk_table_is_shared()).
+ * The shared chunks are not accounted in chunk_table_memory_used() and are
+ * not compressed. The clone takes its chunks from the quota of "table".
+ */
+NTSTATUS chunk_table_clone(__out CHUNK_TABLE *clone, __in CHUNK_TABLE *table);
+BOOLEAN chunk_table_is_shared(__in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length);
+
+/*
+ * Compression of cold chunks.
+ * Accesses mark the chunks as referenced (once enabled, by the compression
+ * or by chunk_table_track_references()); chunk_table_next_victim() moves
+ * a clock hand over the chunks, clearing the marks, and returns the first
+ * private chunk with data, without any of the "skip" flags, which has not
+ * been referenced since the previous pass.
+ * chunk_table_compress() must be called with no I/O on the chunk.
+ * Compressed chunks are decompressed transparently when accessed.
+ */
+NTSTATUS chunk_table_enable_compression(__in CHUNK_TABLE *table);
+BOOLEAN chunk_table_next_victim(__in CHUNK_TABLE *table, __in LONG skip, __out ULONGLONG *index);
+BOOLEAN chunk_table_compress(__in CHUNK_TABLE *table, __in ULONGLONG index);
+
+#define chunk_table_track_references(table) ((table)->track_references = TRUE)
+
+/*
+ * Drops the data of a private chunk whose data is also in the backing file
+ * and marks it as CHUNK_NOT_LOADED, with no I/O on the chunk.
+ */
+void chunk_table_evict(__in CHUNK_TABLE *table, __in ULONGLONG index);
+
+/*
+ * Pinning, for the mappings of the chunks in the address space of a process.
+ * chunk_table_pin() makes the chunks [first, first + count) resident,
+ * private and allocated (zeroed if they had no data) and returns their data
+ * in "data" (one pointer per chunk), which doesn't move until the chunks
+ * are unpinned: a pinned chunk is not compressed, evicted, spilled, shared
+ * by a clone nor freed by a trim or a write of zeros (it is zeroed instead).
+ * The pins are counted (up to CHUNK_MAX_PINS per chunk). There must be no
+ * I/O on the chunks while they are pinned, nor chunks not loaded; they can
+ * be unpinned with I/O.
+ */
+NTSTATUS chunk_table_pin(__in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG count, __out UCHAR **data);
+void chunk_table_unpin(__in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG count);
+
+/* Chunk descriptor for the chunk index. */
+#define chunk_table_get_chunk(table, index) \
+	(&(table)->segments[(index) >> (table)->segment_shift][(index) & (((ULONGLONG) 1 << (table)->segment_shift) - 1)])
+
+/* Bytes covered by the chunks (the disk size rounded up to whole chunks). */
+#define chunk_table_size(table)         ((table)->nchunks << (table)->chunk_shift)
+
+/* Bytes of memory currently used for private chunk data. */
+#define chunk_table_memory_used(table)  (((ULONGLONG) (table)->nallocated << (table)->chunk_shift) + (table)->compressed_bytes)
+
+#endif /* CHUNK_TABLE_H */
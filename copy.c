@@ -0,0 +1,81 @@
+#include "copy.h"
+
+/* Same instruction sets as zero.c: no SSE2 in the x86 driver. */
+#if defined(RAMDISK_USER_MODE) && defined(__AVX2__)
+	#define COPY_AVX2
+	#include <immintrin.h>
+#elif defined(_M_X64) || (defined(RAMDISK_USER_MODE) && defined(__SSE2__))
+	#define COPY_SSE2
+	#include <emmintrin.h>
+#endif
+
+#define PREFETCH_DISTANCE               512 /* Bytes read ahead of the copy. */
+
+void copy_memory(__out void *destination, __in const void *source, __in SIZE_T length, __in BOOLEAN streaming)
+{
+	if (streaming) {
+		copy_streaming(destination, source, length);
+	} else {
+		RtlCopyMemory(destination, source, length);
+	}
+}
+
+void copy_streaming(__out void *destination, __in const void *source, __in SIZE_T length)
+{
+#if defined(COPY_AVX2) || defined(COPY_SSE2)
+	UCHAR *d;
+	const UCHAR *s;
+	SIZE_T head;
+
+	d = (UCHAR *) destination;
+	s = (const UCHAR *) source;
+
+	/* The non-temporal stores need an aligned destination: copy the first bytes normally. */
+	head = (SIZE_T) ((0 - (ULONG_PTR) d) & 31);
+	if (head > length) {
+		head = length;
+	}
+
+	RtlCopyMemory(d, s, head);
+
+	d += head;
+	s += head;
+	length -= head;
+
+#if defined(COPY_AVX2)
+	while (length >= 128) {
+		_mm_prefetch((const char *) (s + PREFETCH_DISTANCE), _MM_HINT_NTA);
+		_mm_prefetch((const char *) (s + PREFETCH_DISTANCE + 64), _MM_HINT_NTA);
+
+		_mm256_stream_si256((__m256i *) d, _mm256_loadu_si256((const __m256i *) s));
+		_mm256_stream_si256((__m256i *) (d + 32), _mm256_loadu_si256((const __m256i *) (s + 32)));
+		_mm256_stream_si256((__m256i *) (d + 64), _mm256_loadu_si256((const __m256i *) (s + 64)));
+		_mm256_stream_si256((__m256i *) (d + 96), _mm256_loadu_si256((const __m256i *) (s + 96)));
+
+		d += 128;
+		s += 128;
+		length -= 128;
+	}
+#else
+	while (length >= 64) {
+		_mm_prefetch((const char *) (s + PREFETCH_DISTANCE), _MM_HINT_NTA);
+
+		_mm_stream_si128((__m128i *) d, _mm_loadu_si128((const __m128i *) s));
+		_mm_stream_si128((__m128i *) (d + 16), _mm_loadu_si128((const __m128i *) (s + 16)));
+		_mm_stream_si128((__m128i *) (d + 32), _mm_loadu_si128((const __m128i *) (s + 32)));
+		_mm_stream_si128((__m128i *) (d + 48), _mm_loadu_si128((const __m128i *) (s + 48)));
+
+		d += 64;
+		s += 64;
+		length -= 64;
+	}
+#endif
+
+	/* The non-temporal stores are weakly ordered: make them visible before the request completes. */
+	_mm_sfence();
+
+	RtlCopyMemory(d, s, length);
+#else
+	RtlCopyMemory(destination, source, length);
+#endif
+}
@@ -0,0 +1,22 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include "port.h"
+
+/*
+ * Transfers of at least COPY_STREAMING_THRESHOLD bytes are copied with
+ * non-temporal stores, which don't keep the destination in the caches: a
+ * large sequential transfer would otherwise evict the working set of the
+ * applications. The smaller ones use RtlCopyMemory.
+ */
+#define COPY_STREAMING_THRESHOLD        (1024 * 1024)
+
+#define copy_use_streaming(length)      ((length) >= COPY_STREAMING_THRESHOLD)
+
+/* "streaming" is decided once per transfer, which the caller might copy in several pieces. */
+void copy_memory(__out void *destination, __in const void *source, __in SIZE_T length, __in BOOLEAN streaming);
+
+/* Copies with non-temporal stores (RtlCopyMemory where they are not available). */
+void copy_streaming(__out void *destination, __in const void *source, __in SIZE_T length);
+
+#endif /* COPY_H */
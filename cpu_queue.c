@@ -0,0 +1,90 @@
+#include "cpu_queue.h"
+
+NTSTATUS cpu_queues_init(__out CPU_QUEUES *cpu_queues, __in ULONG ncpus, __in ULONG cpus_per_queue, __in ULONG trace_records)
+{
+	ULONG nqueues;
+	SIZE_T size;
+	ULONG i;
+	NTSTATUS status;
+
+	if ((ncpus == 0) || (cpus_per_queue == 0)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (cpus_per_queue > ncpus) {
+		cpus_per_queue = ncpus;
+	}
+
+	nqueues = (ncpus + cpus_per_queue - 1) / cpus_per_queue;
+
+	/* Allocate one more cache line, so that the queues can be aligned. */
+	size = nqueues * sizeof(CPU_QUEUE);
+
+	if ((cpu_queues->memory = port_alloc(size + CACHE_LINE_SIZE)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	cpu_queues->queues = (CPU_QUEUE *) (((ULONG_PTR) cpu_queues->memory + CACHE_LINE_SIZE - 1) & ~((ULONG_PTR) CACHE_LINE_SIZE - 1));
+
+	RtlZeroMemory(cpu_queues->queues, size);
+
+	cpu_queues->nqueues = nqueues;
+	cpu_queues->ncpus = ncpus;
+	cpu_queues->cpus_per_queue = cpus_per_queue;
+	cpu_queues->next_trace = 0;
+
+	for (i = 0; i < nqueues; i++) {
+		status = trace_ring_init(&cpu_queues->queues[i].data.trace, trace_records);
+		if (!NT_SUCCESS(status)) {
+			cpu_queues_free(cpu_queues);
+			return status;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void cpu_queues_free(__in CPU_QUEUES *cpu_queues)
+{
+	ULONG i;
+
+	if (cpu_queues->memory) {
+		/* The rings which were not allocated are empty. */
+		for (i = 0; i < cpu_queues->nqueues; i++) {
+			trace_ring_free(&cpu_queues->queues[i].data.trace);
+		}
+
+		port_free(cpu_queues->memory);
+
+		cpu_queues->memory = NULL;
+		cpu_queues->queues = NULL;
+	}
+}
+
+void cpu_queues_get_counters(__in CPU_QUEUES *cpu_queues, __in ULONG operation, __out IO_COUNTERS *counters)
+{
+	ULONG i;
+
+	ASSERT(operation < CPU_QUEUE_COUNTERS);
+
+	RtlZeroMemory(counters, sizeof(IO_COUNTERS));
+
+	for (i = 0; i < cpu_queues->nqueues; i++) {
+		io_counters_add(counters, &cpu_queues->queues[i].data.counters[operation]);
+	}
+}
+
+ULONG cpu_queues_read_trace(__in CPU_QUEUES *cpu_queues, __out RAMDISK_TRACE_RECORD *records, __in ULONG count, __inout ULONGLONG *lost)
+{
+	ULONG n;
+	ULONG i;
+
+	/* Start with a different queue every time, so that a small buffer doesn't always favour the first ones. */
+	for (i = 0, n = 0; (i < cpu_queues->nqueues) && (n < count); i++) {
+		n += trace_ring_read(&cpu_queues->queues[(cpu_queues->next_trace + i) % cpu_queues->nqueues].data.trace, records + n, count - n, lost);
+	}
+
+	cpu_queues->next_trace = (cpu_queues->next_trace + 1) % cpu_queues->nqueues;
+
+	return n;
+}
@@ -0,0 +1,54 @@
+#ifndef CPU_QUEUE_H
+#define CPU_QUEUE_H
+
+#include "port.h"
+#include "io_counters.h"
+#include "trace.h"
+
+#define CACHE_LINE_SIZE                 64
+#define CPU_QUEUE_COUNTERS              32 /* Kinds of operations counted separately. */
+
+/*
+ * Per-CPU request contexts.
+ * Each processor (or group of consecutive processors) has its own context,
+ * padded to a multiple of the cache line size, so that requests submitted
+ * on different CPUs never write to the same cache line.
+ */
+
+typedef struct {
+	IO_COUNTERS counters[CPU_QUEUE_COUNTERS];
+	TRACE_RING  trace;
+} CPU_QUEUE_DATA;
+
+typedef union {
+	CPU_QUEUE_DATA data;
+	UCHAR          padding[(sizeof(CPU_QUEUE_DATA) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1)];
+} CPU_QUEUE;
+
+typedef struct {
+	CPU_QUEUE *queues;         /* Aligned to the cache line size. */
+	void      *memory;         /* Memory allocated for the queues. */
+	ULONG     nqueues;
+	ULONG     ncpus;
+	ULONG     cpus_per_queue;
+	ULONG     next_trace;      /* Queue whose trace is read first (the reader is serialized). */
+} CPU_QUEUES;
+
+/* Each queue gets a trace ring of "trace_records" records (0: no tracing). */
+NTSTATUS cpu_queues_init(__out CPU_QUEUES *cpu_queues, __in ULONG ncpus, __in ULONG cpus_per_queue, __in ULONG trace_records);
+void cpu_queues_free(__in CPU_QUEUES *cpu_queues);
+
+/* Sum of the counters of an operation over all the queues (they might change meanwhile). */
+void cpu_queues_get_counters(__in CPU_QUEUES *cpu_queues, __in ULONG operation, __out IO_COUNTERS *counters);
+
+/* Reads the trace records of all the queues (see trace_ring_read()). */
+ULONG cpu_queues_read_trace(__in CPU_QUEUES *cpu_queues, __out RAMDISK_TRACE_RECORD *records, __in ULONG count, __inout ULONGLONG *lost);
+
+/* Queue of the processor. */
+#define cpu_queues_select(cpu_queues, cpu) \
+	(&(cpu_queues)->queues[((cpu) % (cpu_queues)->ncpus) / (cpu_queues)->cpus_per_queue].data)
+
+/* Queue of the current processor. */
+#define cpu_queues_current(cpu_queues)  cpu_queues_select((cpu_queues), port_current_cpu())
+
+#endif /* CPU_QUEUE_H */
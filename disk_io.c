@@ -0,0 +1,105 @@
+#include "disk_io.h"
+
+BOOLEAN disk_io_check(__in ULONGLONG disk_size, __in ULONG sector_size, __in LONGLONG offset, __in ULONGLONG length)
+{
+	return (BOOLEAN) ((offset >= 0) &&
+					  (length <= disk_size) &&
+					  ((ULONGLONG) offset <= disk_size - length) &&
+					  (((offset | length) & (sector_size - 1)) == 0));
+}
+
+NTSTATUS disk_io_transfer(__in CHUNK_TABLE *table, __in UCHAR operation, __in ULONGLONG offset, __inout UCHAR *buffer, __in SIZE_T length)
+{
+	switch (operation) {
+		case REQUEST_READ:
+			return chunk_table_read(table, offset, buffer, length);
+		case REQUEST_WRITE:
+			return chunk_table_write(table, offset, buffer, length);
+		default:
+			return STATUS_INVALID_PARAMETER;
+	}
+}
+
+void disk_io_mark_dirty(__in ATOMIC_BITMAP *dirty_chunks, __in ULONG chunk_shift, __in ULONGLONG start, __in ULONGLONG end)
+{
+	if ((dirty_chunks->words) && (start < end)) {
+		atomic_bitmap_set_range(dirty_chunks, start >> chunk_shift, ((end - 1) >> chunk_shift) - (start >> chunk_shift) + 1);
+	}
+}
+
+BOOLEAN disk_io_check_batch(__in ULONGLONG disk_size, __in ULONG sector_size, __in const RAMDISK_BATCH_ENTRY *entries, __in ULONG count, __in ULONGLONG buffer_length, __out ULONGLONG *start, __out ULONGLONG *end, __out BOOLEAN *write)
+{
+	ULONGLONG status_size;
+	ULONG i;
+
+	status_size = RAMDISK_BATCH_STATUS_SIZE(count);
+	if (status_size > buffer_length) {
+		return FALSE;
+	}
+
+	*start = (ULONGLONG) -1;
+	*end = 0;
+	*write = FALSE;
+
+	for (i = 0; i < count; i++) {
+		if (((entries[i].operation != RAMDISK_BATCH_READ) && (entries[i].operation != RAMDISK_BATCH_WRITE)) ||
+			(!disk_io_check(disk_size, sector_size, (LONGLONG) entries[i].offset, entries[i].length)) ||
+			(entries[i].length > buffer_length) ||
+			(entries[i].buffer_offset < status_size) ||
+			(entries[i].buffer_offset > buffer_length - entries[i].length)) {
+			return FALSE;
+		}
+
+		if (entries[i].length == 0) {
+			continue;
+		}
+
+		if (entries[i].offset < *start) {
+			*start = entries[i].offset;
+		}
+
+		if (entries[i].offset + entries[i].length > *end) {
+			*end = entries[i].offset + entries[i].length;
+		}
+
+		if (entries[i].operation == RAMDISK_BATCH_WRITE) {
+			*write = TRUE;
+		}
+	}
+
+	if (*start > *end) {
+		*start = 0;
+		*end = 0;
+	}
+
+	return TRUE;
+}
+
+SIZE_T disk_io_batch(__in CHUNK_TABLE *table, __in ATOMIC_BITMAP *dirty_chunks, __in const RAMDISK_BATCH_ENTRY *entries, __in ULONG count, __inout UCHAR *buffer)
+{
+	LONG *statuses;
+	SIZE_T transferred;
+	NTSTATUS status;
+	ULONG i;
+
+	statuses = (LONG *) buffer;
+	transferred = 0;
+
+	for (i = 0; i < count; i++) {
+		/* The operations of the descriptors are those of the requests. */
+		status = disk_io_transfer(table, (UCHAR) entries[i].operation, entries[i].offset, buffer + entries[i].buffer_offset, entries[i].length);
+
+		/* Failed writes too, as for the requests. */
+		if (entries[i].operation == RAMDISK_BATCH_WRITE) {
+			disk_io_mark_dirty(dirty_chunks, table->chunk_shift, entries[i].offset, entries[i].offset + entries[i].length);
+		}
+
+		if (NT_SUCCESS(status)) {
+			transferred += entries[i].length;
+		}
+
+		statuses[i] = status;
+	}
+
+	return transferred;
+}
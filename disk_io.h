@@ -0,0 +1,48 @@
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include "port.h"
+#include "chunk_table.h"
+#include "bitmap.h"
+#include "batch_format.h"
+
+/*
+ * Request path of the disk which doesn't depend on the framework, so that
+ * it can also be built into user-mode programs (tools/bench): validation
+ * of the requests, transfers between the buffers and the chunk table and
+ * the marking of the chunks changed since the last checkpoint.
+ * The caller serializes the requests with the range lock.
+ */
+
+/* Operations executed under the range lock. */
+#define REQUEST_READ                    0
+#define REQUEST_WRITE                   1
+#define REQUEST_TRIM                    2
+#define REQUEST_WAIT                    3 /* A PASSIVE_LEVEL thread waits for the range. */
+#define REQUEST_BATCH_READ              4 /* A batch which only reads (shares the range). */
+#define REQUEST_BATCH_WRITE             5 /* A batch with writes. */
+
+/* Returns TRUE if "length" bytes at "offset" are within the disk and both are multiples of the sector size. */
+BOOLEAN disk_io_check(__in ULONGLONG disk_size, __in ULONG sector_size, __in LONGLONG offset, __in ULONGLONG length);
+
+/* REQUEST_READ or REQUEST_WRITE. */
+NTSTATUS disk_io_transfer(__in CHUNK_TABLE *table, __in UCHAR operation, __in ULONGLONG offset, __inout UCHAR *buffer, __in SIZE_T length);
+
+/* Marks the chunks of [start, end) to be written by the next checkpoint (nothing if they are not tracked). */
+void disk_io_mark_dirty(__in ATOMIC_BITMAP *dirty_chunks, __in ULONG chunk_shift, __in ULONGLONG start, __in ULONGLONG end);
+
+/*
+ * Validates the descriptors of a batch against the disk and an output
+ * buffer of "buffer_length" bytes, and returns the range which covers them
+ * (empty if they transfer nothing) and whether any of them writes.
+ */
+BOOLEAN disk_io_check_batch(__in ULONGLONG disk_size, __in ULONG sector_size, __in const RAMDISK_BATCH_ENTRY *entries, __in ULONG count, __in ULONGLONG buffer_length, __out ULONGLONG *start, __out ULONGLONG *end, __out BOOLEAN *write);
+
+/*
+ * Executes the descriptors validated by disk_io_check_batch() in order,
+ * storing their statuses at the start of "buffer" and marking the chunks
+ * written. Returns the bytes transferred by the descriptors which succeeded.
+ */
+SIZE_T disk_io_batch(__in CHUNK_TABLE *table, __in ATOMIC_BITMAP *dirty_chunks, __in const RAMDISK_BATCH_ENTRY *entries, __in ULONG count, __inout UCHAR *buffer);
+
+#endif /* DISK_IO_H */
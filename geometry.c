@@ -0,0 +1,97 @@
+#include "geometry.h"
+
+BOOLEAN geometry_check_sectors(__in ULONG sector_size, __in ULONG physical_sector_size)
+{
+	return (BOOLEAN) (((sector_size == GEOMETRY_MIN_SECTOR_SIZE) || (sector_size == GEOMETRY_MAX_SECTOR_SIZE)) &&
+					  ((physical_sector_size == GEOMETRY_MIN_SECTOR_SIZE) || (physical_sector_size == GEOMETRY_MAX_SECTOR_SIZE)) &&
+					  (physical_sector_size >= sector_size));
+}
+
+void geometry_build(__in ULONGLONG disk_size, __in ULONG sector_size, __out DISK_GEOMETRY *geometry)
+{
+	ASSERT((disk_size & (sector_size - 1)) == 0);
+
+	geometry->BytesPerSector = sector_size;
+	geometry->SectorsPerTrack = GEOMETRY_SECTORS_PER_TRACK;
+	geometry->TracksPerCylinder = GEOMETRY_TRACKS_PER_CYLINDER;
+
+	geometry->Cylinders.QuadPart = disk_size / sector_size / GEOMETRY_SECTORS_PER_TRACK / GEOMETRY_TRACKS_PER_CYLINDER;
+
+	geometry->MediaType = FixedMedia;
+}
+
+NTSTATUS geometry_query_property(__in ULONG sector_size, __in ULONG physical_sector_size, __in STORAGE_PROPERTY_ID property_id, __in STORAGE_QUERY_TYPE query_type, __out void *buffer, __in ULONG buffer_length, __out ULONG *length)
+{
+	STORAGE_DESCRIPTOR_HEADER *header;
+	STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR *alignment_descriptor;
+	DEVICE_SEEK_PENALTY_DESCRIPTOR *seek_penalty_descriptor;
+	DEVICE_TRIM_DESCRIPTOR *trim_descriptor;
+	ULONG size;
+
+	*length = 0;
+
+	switch (property_id) {
+		case StorageAccessAlignmentProperty:
+			size = sizeof(STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR);
+			break;
+		case StorageDeviceSeekPenaltyProperty:
+			size = sizeof(DEVICE_SEEK_PENALTY_DESCRIPTOR);
+			break;
+		case StorageDeviceTrimProperty:
+			size = sizeof(DEVICE_TRIM_DESCRIPTOR);
+			break;
+		default:
+			return STATUS_NOT_SUPPORTED;
+	}
+
+	if (query_type == PropertyExistsQuery) {
+		return STATUS_SUCCESS;
+	} else if (query_type != PropertyStandardQuery) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* If the buffer is too small... */
+	if (buffer_length < sizeof(STORAGE_DESCRIPTOR_HEADER)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	header = (STORAGE_DESCRIPTOR_HEADER *) buffer;
+
+	/* If the buffer can only hold the header, return just the header. */
+	if (buffer_length < size) {
+		header->Version = size;
+		header->Size = size;
+
+		*length = sizeof(STORAGE_DESCRIPTOR_HEADER);
+		return STATUS_SUCCESS;
+	}
+
+	RtlZeroMemory(buffer, size);
+
+	header->Version = size;
+	header->Size = size;
+
+	switch (property_id) {
+		case StorageAccessAlignmentProperty:
+			alignment_descriptor = (STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR *) buffer;
+
+			/* The disk starts at a physical sector. */
+			alignment_descriptor->BytesPerCacheLine = GEOMETRY_CACHE_LINE;
+			alignment_descriptor->BytesOffsetForCacheAlignment = 0;
+			alignment_descriptor->BytesPerLogicalSector = sector_size;
+			alignment_descriptor->BytesPerPhysicalSector = physical_sector_size;
+			alignment_descriptor->BytesOffsetForSectorAlignment = 0;
+			break;
+		case StorageDeviceSeekPenaltyProperty:
+			seek_penalty_descriptor = (DEVICE_SEEK_PENALTY_DESCRIPTOR *) buffer;
+			seek_penalty_descriptor->IncursSeekPenalty = FALSE;
+			break;
+		default:
+			trim_descriptor = (DEVICE_TRIM_DESCRIPTOR *) buffer;
+			trim_descriptor->TrimEnabled = TRUE;
+	}
+
+	*length = size;
+
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include "port.h"
+
+/*
+ * What the disk tells about its sectors: the DISK_GEOMETRY and the answers
+ * to IOCTL_STORAGE_QUERY_PROPERTY. It doesn't depend on the framework, so
+ * that it can be built into user-mode programs (tools/geometrycheck), which
+ * get the few Windows structures involved from here.
+ * The logical sector (the unit of the requests) is 512 bytes or 4 KB; the
+ * physical sector, reported for the alignment of the I/O, is at least as
+ * large: 512/512 (512n), 512/4096 (512e) or 4096/4096 (4Kn).
+ */
+#define GEOMETRY_MIN_SECTOR_SIZE        512
+#define GEOMETRY_MAX_SECTOR_SIZE        4096
+
+#define GEOMETRY_SECTORS_PER_TRACK      32
+#define GEOMETRY_TRACKS_PER_CYLINDER    2
+
+#define GEOMETRY_CACHE_LINE             64 /* Bytes; the disk is memory. */
+
+#ifdef RAMDISK_USER_MODE
+
+typedef union {
+	struct {
+		ULONG LowPart;
+		LONG  HighPart;
+	} u;
+
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef enum {
+	FixedMedia = 12
+} MEDIA_TYPE;
+
+typedef struct {
+	LARGE_INTEGER Cylinders;
+	MEDIA_TYPE    MediaType;
+	ULONG         TracksPerCylinder;
+	ULONG         SectorsPerTrack;
+	ULONG         BytesPerSector;
+} DISK_GEOMETRY;
+
+typedef enum {
+	StorageDeviceProperty = 0,
+	StorageAccessAlignmentProperty = 6,
+	StorageDeviceSeekPenaltyProperty = 7,
+	StorageDeviceTrimProperty = 8
+} STORAGE_PROPERTY_ID;
+
+typedef enum {
+	PropertyStandardQuery = 0,
+	PropertyExistsQuery,
+	PropertyMaskQuery
+} STORAGE_QUERY_TYPE;
+
+typedef struct {
+	ULONG Version;
+	ULONG Size;
+} STORAGE_DESCRIPTOR_HEADER;
+
+typedef struct {
+	ULONG Version;
+	ULONG Size;
+	ULONG BytesPerCacheLine;
+	ULONG BytesOffsetForCacheAlignment;
+	ULONG BytesPerLogicalSector;
+	ULONG BytesPerPhysicalSector;
+	ULONG BytesOffsetForSectorAlignment;
+} STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR;
+
+typedef struct {
+	ULONG   Version;
+	ULONG   Size;
+	BOOLEAN IncursSeekPenalty;
+} DEVICE_SEEK_PENALTY_DESCRIPTOR;
+
+typedef struct {
+	ULONG   Version;
+	ULONG   Size;
+	BOOLEAN TrimEnabled;
+} DEVICE_TRIM_DESCRIPTOR;
+
+#else /* !RAMDISK_USER_MODE */
+
+#pragma warning(disable:4201)  // nameless struct/union warning
+
+#include <ntdddisk.h>
+#include <ntddstor.h>
+
+#pragma warning(default:4201)
+
+#endif /* RAMDISK_USER_MODE */
+
+/* Returns TRUE if the pair of sector sizes is one of those supported. */
+BOOLEAN geometry_check_sectors(__in ULONG sector_size, __in ULONG physical_sector_size);
+
+/*
+ * Fake geometry of a disk of "disk_size" bytes (a multiple of the sector
+ * size): the whole cylinders it holds.
+ */
+void geometry_build(__in ULONGLONG disk_size, __in ULONG sector_size, __out DISK_GEOMETRY *geometry);
+
+/*
+ * Answers a query of a storage property with the descriptor in "buffer"
+ * ("length" bytes written). A buffer which only holds the header receives
+ * the header, with the size of the whole descriptor. Fails with
+ * STATUS_NOT_SUPPORTED for the properties which are not reported.
+ */
+NTSTATUS geometry_query_property(__in ULONG sector_size, __in ULONG physical_sector_size, __in STORAGE_PROPERTY_ID property_id, __in STORAGE_QUERY_TYPE query_type, __out void *buffer, __in ULONG buffer_length, __out ULONG *length);
+
+#endif /* GEOMETRY_H */
@@ -0,0 +1,591 @@
+#include "image.h"
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** Save and restore the disk image to/from a file.                          **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+#define ALIGN_UP(x, alignment)          (((x) + (alignment) - 1) & ~((ULONGLONG) (alignment) - 1))
+
+#define BITMAP_SIZE(nbits)              ((((nbits) + 63) >> 6) * sizeof(ULONGLONG))
+#define TEST_BIT(bitmap, bit)           (((bitmap)[(bit) >> 6] >> ((bit) & 63)) & 1)
+#define SET_BIT(bitmap, bit)            ((bitmap)[(bit) >> 6] |= (ULONGLONG) 1 << ((bit) & 63))
+#define CLEAR_BIT(bitmap, bit)          ((bitmap)[(bit) >> 6] &= ~((ULONGLONG) 1 << ((bit) & 63)))
+
+/* Two buffers: one is being transferred while the other one is prepared. */
+typedef struct {
+	PORT_FILE    *file;
+	UCHAR        *buffers[2];
+	PORT_FILE_IO io[2];
+	BOOLEAN      pending[2];
+	ULONGLONG    offsets[2]; /* Disk offset of the data in the buffer. */
+	ULONG        lengths[2];
+	ULONG        current;
+	ULONG        size;
+	NTSTATUS     status;     /* First error. */
+} IMAGE_STREAM;
+
+static NTSTATUS stream_init(__out IMAGE_STREAM *stream, __in PORT_FILE *file, __in ULONG size);
+static void stream_free(__in IMAGE_STREAM *stream);
+static void stream_wait(__in IMAGE_STREAM *stream, __in ULONG i);
+static void stream_write(__in IMAGE_STREAM *stream, __in ULONGLONG data_offset);
+static void stream_restore(__in IMAGE_STREAM *stream, __in ULONG i, __in CHUNK_TABLE *table, __in ULONGLONG limit);
+static NTSTATUS transfer(__in PORT_FILE *file, __in BOOLEAN write, __in ULONGLONG offset, __in void *buffer, __in ULONG length);
+
+NTSTATUS image_save(__in CHUNK_TABLE *table, __in ULONGLONG disk_size, __in PORT_PATH path)
+{
+	IMAGE_STREAM stream;
+	IMAGE_HEADER *header;
+	PORT_FILE file;
+	ULONGLONG *bitmap;
+	ULONGLONG bitmap_size;
+	ULONGLONG data_offset;
+	ULONGLONG index;
+	ULONG chunk_size;
+	BOOLEAN present;
+	NTSTATUS status;
+
+	chunk_size = 1UL << table->chunk_shift;
+
+	bitmap_size = BITMAP_SIZE(table->nchunks);
+	if (bitmap_size > (ULONG) -1) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	data_offset = ALIGN_UP(IMAGE_ALIGNMENT + bitmap_size, IMAGE_ALIGNMENT);
+
+	if ((bitmap = port_alloc((SIZE_T) bitmap_size)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(bitmap, (SIZE_T) bitmap_size);
+
+	status = port_file_open(&file, path, TRUE);
+	if (!NT_SUCCESS(status)) {
+		port_free(bitmap);
+		return status;
+	}
+
+	status = stream_init(&stream, &file, (chunk_size > IMAGE_TRANSFER_SIZE) ? chunk_size : IMAGE_TRANSFER_SIZE);
+	if (!NT_SUCCESS(status)) {
+		port_file_close(&file);
+		port_free(bitmap);
+		return status;
+	}
+
+	/* Write the runs of consecutive chunks with data. */
+	for (index = 0; (index < table->nchunks) && (NT_SUCCESS(stream.status)); index++) {
+		if (stream.lengths[stream.current] + chunk_size > stream.size) {
+			stream_write(&stream, data_offset);
+		}
+
+		status = chunk_table_copy_chunk(table, index, stream.buffers[stream.current] + stream.lengths[stream.current], &present);
+		if (!NT_SUCCESS(status)) {
+			stream.status = status;
+			break;
+		}
+
+		if (!present) {
+			/* Leave a hole. */
+			if (stream.lengths[stream.current] > 0) {
+				stream_write(&stream, data_offset);
+			}
+
+			continue;
+		}
+
+		if (stream.lengths[stream.current] == 0) {
+			stream.offsets[stream.current] = index << table->chunk_shift;
+		}
+
+		stream.lengths[stream.current] += chunk_size;
+
+		SET_BIT(bitmap, index);
+	}
+
+	if ((NT_SUCCESS(stream.status)) && (stream.lengths[stream.current] > 0)) {
+		stream_write(&stream, data_offset);
+	}
+
+	stream_wait(&stream, 0);
+	stream_wait(&stream, 1);
+
+	status = stream.status;
+
+	/* The header goes last, so that an interrupted save leaves an invalid image. */
+	if (NT_SUCCESS(status)) {
+		status = transfer(&file, TRUE, IMAGE_ALIGNMENT, bitmap, (ULONG) bitmap_size);
+	}
+
+	if (NT_SUCCESS(status)) {
+		status = port_file_set_size(&file, data_offset + (table->nchunks << table->chunk_shift));
+	}
+
+	if (NT_SUCCESS(status)) {
+		RtlZeroMemory(stream.buffers[0], IMAGE_ALIGNMENT);
+
+		header = (IMAGE_HEADER *) stream.buffers[0];
+
+		RtlCopyMemory(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+		header->version = IMAGE_VERSION;
+		header->chunk_shift = table->chunk_shift;
+		header->disk_size = disk_size;
+		header->bitmap_offset = IMAGE_ALIGNMENT;
+		header->data_offset = data_offset;
+
+		status = transfer(&file, TRUE, 0, header, IMAGE_ALIGNMENT);
+	}
+
+	stream_free(&stream);
+	port_file_close(&file);
+	port_free(bitmap);
+
+	return status;
+}
+
+NTSTATUS image_open(__out IMAGE_FILE *image, __in PORT_PATH path)
+{
+	IMAGE_HEADER *header;
+	ULONGLONG bitmap_size;
+	NTSTATUS status;
+
+	RtlZeroMemory(image, sizeof(IMAGE_FILE));
+
+	status = port_file_open(&image->file, path, FALSE);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	header = &image->header;
+
+	status = transfer(&image->file, FALSE, 0, header, sizeof(IMAGE_HEADER));
+	if (!NT_SUCCESS(status)) {
+		port_file_close(&image->file);
+		return status;
+	}
+
+	/* Validate the header. */
+	if ((!RtlEqualMemory(header->magic, IMAGE_MAGIC, sizeof(header->magic))) ||
+		(header->version != IMAGE_VERSION) ||
+		(header->chunk_shift < 9) ||
+		(header->chunk_shift >= SEGMENT_SHIFT) ||
+		(header->disk_size == 0) ||
+		(header->bitmap_offset < sizeof(IMAGE_HEADER))) {
+		port_file_close(&image->file);
+		return STATUS_DATA_ERROR;
+	}
+
+	image->nchunks = (header->disk_size + ((ULONGLONG) 1 << header->chunk_shift) - 1) >> header->chunk_shift;
+
+	bitmap_size = BITMAP_SIZE(image->nchunks);
+	if ((bitmap_size > (ULONG) -1) || (header->data_offset < header->bitmap_offset + bitmap_size)) {
+		port_file_close(&image->file);
+		return STATUS_DATA_ERROR;
+	}
+
+	image->bitmap_size = (ULONG) bitmap_size;
+
+	if ((image->bitmap = port_alloc(image->bitmap_size)) == NULL) {
+		port_file_close(&image->file);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = transfer(&image->file, FALSE, header->bitmap_offset, image->bitmap, image->bitmap_size);
+	if (!NT_SUCCESS(status)) {
+		port_free(image->bitmap);
+		port_file_close(&image->file);
+		return status;
+	}
+
+	image->open = TRUE;
+
+	return STATUS_SUCCESS;
+}
+
+void image_close(__in IMAGE_FILE *image)
+{
+	if (image->open) {
+		port_free(image->bitmap);
+		port_file_close(&image->file);
+
+		image->open = FALSE;
+	}
+}
+
+NTSTATUS image_restore(__in CHUNK_TABLE *table, __in ULONGLONG disk_size, __in IMAGE_FILE *image)
+{
+	IMAGE_STREAM stream;
+	ULONGLONG limit;
+	ULONGLONG nchunks;
+	ULONGLONG index;
+	ULONGLONG first;
+	ULONG chunk_shift;
+	ULONG chunk_size;
+	ULONG max_chunks;
+	NTSTATUS status;
+
+	chunk_shift = image->header.chunk_shift;
+	chunk_size = 1UL << chunk_shift;
+
+	status = stream_init(&stream, &image->file, (chunk_size > IMAGE_TRANSFER_SIZE) ? chunk_size : IMAGE_TRANSFER_SIZE);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* Only the part common to both disks is restored. */
+	limit = (disk_size < image->header.disk_size) ? disk_size : image->header.disk_size;
+	nchunks = (limit + chunk_size - 1) >> chunk_shift;
+
+	max_chunks = stream.size >> chunk_shift;
+
+	/* Read the runs of consecutive chunks, copying one to the table while the next one is being read. */
+	for (index = 0; NT_SUCCESS(stream.status); ) {
+		for (; (index < nchunks) && (!TEST_BIT(image->bitmap, index)); index++);
+
+		if (index == nchunks) {
+			break;
+		}
+
+		for (first = index; (index < nchunks) && (TEST_BIT(image->bitmap, index)) && (index - first < max_chunks); index++);
+
+		stream.offsets[stream.current] = first << chunk_shift;
+		stream.lengths[stream.current] = (ULONG) ((index - first) << chunk_shift);
+
+		port_file_begin_read(&image->file,
+							 &stream.io[stream.current],
+							 image->header.data_offset + stream.offsets[stream.current],
+							 stream.buffers[stream.current],
+							 stream.lengths[stream.current]);
+
+		stream.pending[stream.current] = TRUE;
+
+		stream.current ^= 1;
+
+		stream_restore(&stream, stream.current, table, limit);
+	}
+
+	stream_restore(&stream, stream.current ^ 1, table, limit);
+
+	status = stream.status;
+
+	stream_free(&stream);
+
+	return status;
+}
+
+NTSTATUS image_write_chunks(__in IMAGE_FILE *image, __in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG count, __in UCHAR *buffer, __in ULONG buffer_size)
+{
+	ULONGLONG index;
+	ULONGLONG start;
+	ULONG run;
+	ULONG max_chunks;
+	BOOLEAN present;
+	NTSTATUS status;
+
+	if ((image->header.chunk_shift != table->chunk_shift) || (first + count > image->nchunks)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	max_chunks = buffer_size >> table->chunk_shift;
+
+	start = first;
+	run = 0;
+
+	/* Write the runs of consecutive chunks with data. */
+	for (index = first; index < first + count; index++) {
+		status = chunk_table_copy_chunk(table, index, buffer + ((SIZE_T) run << table->chunk_shift), &present);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		if (present) {
+			if (run++ == 0) {
+				start = index;
+			}
+
+			SET_BIT(image->bitmap, index);
+		} else {
+			CLEAR_BIT(image->bitmap, index);
+		}
+
+		if ((run > 0) && ((!present) || (run == max_chunks) || (index + 1 == first + count))) {
+			status = transfer(&image->file, TRUE, image->header.data_offset + (start << table->chunk_shift), buffer, run << table->chunk_shift);
+			if (!NT_SUCCESS(status)) {
+				return status;
+			}
+
+			run = 0;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS image_write_bitmap(__in IMAGE_FILE *image)
+{
+	return transfer(&image->file, TRUE, image->header.bitmap_offset, image->bitmap, image->bitmap_size);
+}
+
+NTSTATUS image_loader_init(__out IMAGE_LOADER *loader, __in IMAGE_FILE *image, __in CHUNK_TABLE *table, __in ULONGLONG disk_size)
+{
+	ULONGLONG limit;
+	ULONGLONG index;
+	ULONG chunk_shift;
+
+	RtlZeroMemory(loader, sizeof(IMAGE_LOADER));
+
+	chunk_shift = image->header.chunk_shift;
+
+	/* The chunks are loaded one by one. */
+	if (chunk_shift != table->chunk_shift) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	limit = (disk_size < image->header.disk_size) ? disk_size : image->header.disk_size;
+
+	loader->image = image;
+	loader->nchunks = (limit + ((ULONGLONG) 1 << chunk_shift) - 1) >> chunk_shift;
+	loader->buffer_size = ((1UL << chunk_shift) > IMAGE_TRANSFER_SIZE) ? (1UL << chunk_shift) : IMAGE_TRANSFER_SIZE;
+
+	for (index = 0; index < loader->nchunks; index++) {
+		if (TEST_BIT(image->bitmap, index)) {
+			chunk_table_get_chunk(table, index)->flags |= CHUNK_NOT_LOADED;
+			loader->remaining++;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS image_loader_load(__in IMAGE_LOADER *loader, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length, __out UCHAR *buffer)
+{
+	ULONGLONG index;
+	ULONGLONG last;
+	ULONGLONG first;
+	ULONGLONG end;
+	ULONGLONG i;
+	NTSTATUS status;
+
+	if (length == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	index = offset >> table->chunk_shift;
+	last = (offset + length - 1) >> table->chunk_shift;
+
+	if (last >= loader->nchunks) {
+		last = loader->nchunks - 1;
+	}
+
+	while (index <= last) {
+		/* Skip the chunks which are loaded. */
+		for (; (index <= last) && (!(chunk_table_get_chunk(table, index)->flags & CHUNK_NOT_LOADED)); index++);
+
+		if (index > last) {
+			break;
+		}
+
+		/* Read up to a buffer of chunks (the ones already loaded are not touched). */
+		first = index;
+		end = first + (loader->buffer_size >> table->chunk_shift);
+
+		if (end > last + 1) {
+			end = last + 1;
+		}
+
+		for (; (end > first + 1) && (!(chunk_table_get_chunk(table, end - 1)->flags & CHUNK_NOT_LOADED)); end--);
+
+		status = transfer(&loader->image->file, FALSE, loader->image->header.data_offset + (first << table->chunk_shift), buffer, (ULONG) ((end - first) << table->chunk_shift));
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		for (i = first; i < end; i++) {
+			if (chunk_table_get_chunk(table, i)->flags & CHUNK_NOT_LOADED) {
+				status = chunk_table_load_chunk(table, i, buffer + ((i - first) << table->chunk_shift));
+				if (!NT_SUCCESS(status)) {
+					return status;
+				}
+
+				InterlockedExchangeAdd64(&loader->remaining, -1);
+			}
+		}
+
+		index = end;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN image_loader_next(__in IMAGE_LOADER *loader, __in CHUNK_TABLE *table, __out ULONGLONG *offset, __out ULONGLONG *length)
+{
+	ULONGLONG first;
+	ULONGLONG end;
+	ULONGLONG i;
+
+	if (loader->nchunks == 0) {
+		return FALSE;
+	}
+
+	/* Look for the next chunk to be loaded, wrapping around. */
+	for (i = 0; i < loader->nchunks; i++) {
+		first = loader->cursor;
+
+		if (++loader->cursor == loader->nchunks) {
+			loader->cursor = 0;
+		}
+
+		if (chunk_table_get_chunk(table, first)->flags & CHUNK_NOT_LOADED) {
+			break;
+		}
+	}
+
+	if (i == loader->nchunks) {
+		return FALSE;
+	}
+
+	/* Extend the range with the following chunks to be loaded. */
+	for (end = first + 1;
+		 (end < loader->nchunks) &&
+		 (end - first < (loader->buffer_size >> table->chunk_shift)) &&
+		 (chunk_table_get_chunk(table, end)->flags & CHUNK_NOT_LOADED);
+		 end++);
+
+	loader->cursor = (end == loader->nchunks) ? 0 : end;
+
+	*offset = first << table->chunk_shift;
+	*length = (end - first) << table->chunk_shift;
+
+	return TRUE;
+}
+
+NTSTATUS stream_init(__out IMAGE_STREAM *stream, __in PORT_FILE *file, __in ULONG size)
+{
+	ULONG i;
+	NTSTATUS status;
+
+	RtlZeroMemory(stream, sizeof(IMAGE_STREAM));
+
+	stream->file = file;
+	stream->size = size;
+	stream->status = STATUS_SUCCESS;
+
+	for (i = 0; i < 2; i++) {
+		if ((stream->buffers[i] = port_alloc(size)) == NULL) {
+			stream_free(stream);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		status = port_file_io_init(&stream->io[i]);
+		if (!NT_SUCCESS(status)) {
+			port_free(stream->buffers[i]);
+			stream->buffers[i] = NULL;
+
+			stream_free(stream);
+			return status;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void stream_free(__in IMAGE_STREAM *stream)
+{
+	ULONG i;
+
+	for (i = 0; i < 2; i++) {
+		if (stream->buffers[i]) {
+			/* Don't free a buffer which is still being transferred. */
+			stream_wait(stream, i);
+
+			port_file_io_destroy(&stream->io[i]);
+			port_free(stream->buffers[i]);
+		}
+	}
+}
+
+void stream_wait(__in IMAGE_STREAM *stream, __in ULONG i)
+{
+	NTSTATUS status;
+
+	if (stream->pending[i]) {
+		stream->pending[i] = FALSE;
+
+		status = port_file_wait(&stream->io[i]);
+		if ((!NT_SUCCESS(status)) && (NT_SUCCESS(stream->status))) {
+			stream->status = status;
+		}
+	}
+}
+
+void stream_write(__in IMAGE_STREAM *stream, __in ULONGLONG data_offset)
+{
+	ULONG i;
+
+	i = stream->current;
+
+	port_file_begin_write(stream->file, &stream->io[i], data_offset + stream->offsets[i], stream->buffers[i], stream->lengths[i]);
+	stream->pending[i] = TRUE;
+
+	/* Switch to the other buffer, once its previous transfer has finished. */
+	i ^= 1;
+
+	stream_wait(stream, i);
+
+	stream->lengths[i] = 0;
+	stream->current = i;
+}
+
+void stream_restore(__in IMAGE_STREAM *stream, __in ULONG i, __in CHUNK_TABLE *table, __in ULONGLONG limit)
+{
+	ULONG length;
+	NTSTATUS status;
+
+	if (!stream->pending[i]) {
+		return;
+	}
+
+	stream_wait(stream, i);
+
+	if (!NT_SUCCESS(stream->status)) {
+		return;
+	}
+
+	/* The last chunk of the image might go beyond the disk. */
+	length = stream->lengths[i];
+	if (stream->offsets[i] + length > limit) {
+		length = (ULONG) (limit - stream->offsets[i]);
+	}
+
+	/* Blocks of zeros are not allocated. */
+	status = chunk_table_write(table, stream->offsets[i], stream->buffers[i], length);
+	if (!NT_SUCCESS(status)) {
+		stream->status = status;
+	}
+}
+
+NTSTATUS transfer(__in PORT_FILE *file, __in BOOLEAN write, __in ULONGLONG offset, __in void *buffer, __in ULONG length)
+{
+	PORT_FILE_IO io;
+	NTSTATUS status;
+
+	status = port_file_io_init(&io);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (write) {
+		port_file_begin_write(file, &io, offset, buffer, length);
+	} else {
+		port_file_begin_read(file, &io, offset, buffer, length);
+	}
+
+	status = port_file_wait(&io);
+
+	port_file_io_destroy(&io);
+
+	return status;
+}
@@ -0,0 +1,100 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "port.h"
+#include "chunk_table.h"
+
+/*
+ * Disk image file.
+ * The file starts with a header and a bitmap of the chunks stored in the
+ * file (one bit per chunk, in 64-bit words), followed by the chunks at their
+ * disk offset relative to data_offset. Chunks without data are not written
+ * and the file is created sparse, so they don't take disk space.
+ * All the fields are little-endian.
+ */
+
+#define IMAGE_MAGIC                     "RDIMAGE" /* 8 bytes with the terminator. */
+#define IMAGE_VERSION                   1
+
+#define IMAGE_ALIGNMENT                 4096
+#define IMAGE_TRANSFER_SIZE             (1024 * 1024)
+
+typedef struct {
+	UCHAR     magic[8];
+	ULONG     version;
+	ULONG     chunk_shift;
+	ULONGLONG disk_size;
+	ULONGLONG bitmap_offset;
+	ULONGLONG data_offset;
+} IMAGE_HEADER;
+
+/*
+ * Image file kept open with its header and bitmap, so that it can be
+ * loaded lazily and updated in place by the checkpoints.
+ */
+typedef struct {
+	PORT_FILE    file;
+	BOOLEAN      open;
+	IMAGE_HEADER header;
+	ULONGLONG    *bitmap;      /* Chunks stored in the file. */
+	ULONG        bitmap_size;
+	ULONGLONG    nchunks;      /* Chunks of the image. */
+} IMAGE_FILE;
+
+/* Opens an existing image and reads its header and bitmap. */
+NTSTATUS image_open(__out IMAGE_FILE *image, __in PORT_PATH path);
+void image_close(__in IMAGE_FILE *image);
+
+/*
+ * Both directions stream the chunks with two buffers of (at least)
+ * IMAGE_TRANSFER_SIZE bytes, so that a transfer is in flight while the
+ * next one is being prepared.
+ * The caller must make sure that the disk is not written while saving and
+ * that the image file is not open.
+ */
+NTSTATUS image_save(__in CHUNK_TABLE *table, __in ULONGLONG disk_size, __in PORT_PATH path);
+
+/*
+ * The chunk size of the image doesn't have to be the same as the table's;
+ * if the disk sizes differ, only the common part is restored.
+ */
+NTSTATUS image_restore(__in CHUNK_TABLE *table, __in ULONGLONG disk_size, __in IMAGE_FILE *image);
+
+/*
+ * Incremental update: writes the chunks [first, first + count) in place
+ * (buffer_size bytes of buffer are used to batch consecutive chunks) and
+ * updates the bitmap in memory; image_write_bitmap() writes it to the file
+ * once all the chunks are written. The image must have the table's chunk
+ * size and disk size. The chunks which no longer have data are only
+ * removed from the bitmap, they take disk space until the next full save.
+ * An update interrupted by a crash leaves a mix of old and new chunks.
+ */
+NTSTATUS image_write_chunks(__in IMAGE_FILE *image, __in CHUNK_TABLE *table, __in ULONGLONG first, __in ULONGLONG count, __in UCHAR *buffer, __in ULONG buffer_size);
+NTSTATUS image_write_bitmap(__in IMAGE_FILE *image);
+
+/*
+ * Lazy loading: image_loader_init() marks the chunks stored in the (open)
+ * image as CHUNK_NOT_LOADED; they are loaded later with image_loader_load(),
+ * either on demand or by walking the disk with image_loader_next(). The
+ * image must have the table's chunk size and stay open until all the chunks
+ * are loaded. Loading a chunk requires that nobody accesses it meanwhile.
+ */
+typedef struct {
+	IMAGE_FILE        *image;
+	ULONGLONG         nchunks;     /* Chunks which can be loaded. */
+	ULONGLONG         cursor;      /* Next chunk looked at by image_loader_next(). */
+	ULONG             buffer_size; /* Size of the buffers passed to image_loader_load(). */
+	volatile LONGLONG remaining;   /* Chunks not loaded yet. */
+} IMAGE_LOADER;
+
+NTSTATUS image_loader_init(__out IMAGE_LOADER *loader, __in IMAGE_FILE *image, __in CHUNK_TABLE *table, __in ULONGLONG disk_size);
+
+/* Loads the chunks of the range which are not loaded yet. */
+NTSTATUS image_loader_load(__in IMAGE_LOADER *loader, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length, __out UCHAR *buffer);
+
+/* Next range of chunks (of at most buffer_size bytes) to be loaded; FALSE if there are none. */
+BOOLEAN image_loader_next(__in IMAGE_LOADER *loader, __in CHUNK_TABLE *table, __out ULONGLONG *offset, __out ULONGLONG *length);
+
+#define image_loader_pending(loader)    ((loader)->remaining > 0)
+
+#endif /* IMAGE_H */
@@ -0,0 +1,51 @@
+#include "io_counters.h"
+
+#define NS_PER_SECOND                   1000000000ULL
+
+void io_counters_complete(__in IO_COUNTERS *counters, __in ULONGLONG bytes, __in BOOLEAN error, __in ULONGLONG latency)
+{
+	/* The counters are those of the current processor, the cache line stays there. */
+	InterlockedDecrement64(&counters->in_flight);
+	InterlockedIncrement64(&counters->requests);
+
+	if (error) {
+		InterlockedIncrement64(&counters->errors);
+	} else if (bytes > 0) {
+		InterlockedExchangeAdd64(&counters->bytes, (LONGLONG) bytes);
+	}
+
+	InterlockedIncrement64(&counters->latency[io_latency_bucket(latency)]);
+}
+
+void io_counters_add(__inout IO_COUNTERS *sum, __in IO_COUNTERS *counters)
+{
+	ULONG i;
+
+	sum->requests += counters->requests;
+	sum->bytes += counters->bytes;
+	sum->errors += counters->errors;
+	sum->in_flight += counters->in_flight;
+
+	for (i = 0; i < IO_LATENCY_BUCKETS; i++) {
+		sum->latency[i] += counters->latency[i];
+	}
+}
+
+ULONG io_latency_bucket(__in ULONGLONG latency)
+{
+	ULONG bucket;
+
+	latency >>= IO_LATENCY_SHIFT - 1;
+
+	for (bucket = 0; (latency > 1) && (bucket < IO_LATENCY_BUCKETS - 1); bucket++) {
+		latency >>= 1;
+	}
+
+	return bucket;
+}
+
+ULONGLONG io_ticks_to_ns(__in ULONGLONG ticks, __in ULONGLONG frequency)
+{
+	/* Split the conversion, so that it doesn't overflow for long intervals. */
+	return ((ticks / frequency) * NS_PER_SECOND) + (((ticks % frequency) * NS_PER_SECOND) / frequency);
+}
@@ -0,0 +1,40 @@
+#ifndef IO_COUNTERS_H
+#define IO_COUNTERS_H
+
+#include "port.h"
+
+/*
+ * Counters of one kind of operation.
+ * The latencies are counted in a histogram of IO_LATENCY_BUCKETS buckets
+ * of powers of two nanoseconds: bucket 0 has the latencies below
+ * 2^IO_LATENCY_SHIFT ns, bucket i the latencies in
+ * [2^(IO_LATENCY_SHIFT + i - 1), 2^(IO_LATENCY_SHIFT + i)) ns and the last
+ * bucket everything above.
+ * "in_flight" is incremented where the request starts and decremented where
+ * it completes, which might be different processors: only the sum over all
+ * of them is meaningful.
+ */
+#define IO_LATENCY_BUCKETS              24
+#define IO_LATENCY_SHIFT                9 /* 512 ns. */
+
+typedef struct {
+	volatile LONGLONG requests;
+	volatile LONGLONG bytes;
+	volatile LONGLONG errors;
+	volatile LONGLONG in_flight;
+	volatile LONGLONG latency[IO_LATENCY_BUCKETS];
+} IO_COUNTERS;
+
+#define io_counters_start(counters)     InterlockedIncrement64(&(counters)->in_flight)
+
+void io_counters_complete(__in IO_COUNTERS *counters, __in ULONGLONG bytes, __in BOOLEAN error, __in ULONGLONG latency);
+
+/* Adds "counters" to "sum" (which is not updated concurrently). */
+void io_counters_add(__inout IO_COUNTERS *sum, __in IO_COUNTERS *counters);
+
+ULONG io_latency_bucket(__in ULONGLONG latency);
+
+/* Converts a difference of timestamps to nanoseconds. */
+ULONGLONG io_ticks_to_ns(__in ULONGLONG ticks, __in ULONGLONG frequency);
+
+#endif /* IO_COUNTERS_H */
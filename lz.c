@@ -0,0 +1,250 @@
+#include "lz.h"
+
+/*
+ * A compressed block is a sequence of:
+ *   - token: number of literals (high nibble) and match length - LZ_MIN_MATCH
+ *     (low nibble). A nibble of 15 is followed by extra length bytes: 255
+ *     means "add 255 and read another byte".
+ *   - The literals.
+ *   - The offset of the match (2 bytes, little endian) and the extra match
+ *     length bytes. The last sequence has no match.
+ */
+
+#define LZ_MIN_MATCH                    4
+#define LZ_MAX_OFFSET                   0xffff
+#define LZ_LAST_LITERALS                8 /* Bytes at the end not searched for matches. */
+
+#define HASH(v)                         (((ULONG) ((v) * 2654435761U)) >> (32 - LZ_HASH_BITS))
+
+static ULONG read32(__in const UCHAR *p);
+static UCHAR *put_length(__out UCHAR *op, __in const UCHAR *oend, __in ULONG length);
+static UCHAR *put_sequence(__out UCHAR *op, __in const UCHAR *oend, __in const UCHAR *literals, __in ULONG nliterals, __in ULONG offset, __in ULONG match_length);
+
+ULONG lz_compress(__in const UCHAR *src, __in ULONG length, __out UCHAR *dst, __in ULONG capacity, __in void *work)
+{
+	const UCHAR *ip;
+	const UCHAR *anchor;
+	const UCHAR *ref;
+	const UCHAR *end;
+	const UCHAR *limit;
+	const UCHAR *oend;
+	ULONG *table;
+	ULONG match_length;
+	ULONG sequence;
+	ULONG h;
+	UCHAR *op;
+
+	table = (ULONG *) work;
+	RtlZeroMemory(table, LZ_WORK_SIZE);
+
+	ip = src;
+	anchor = src;
+	end = src + length;
+	limit = (length > LZ_LAST_LITERALS) ? end - LZ_LAST_LITERALS : src;
+
+	op = dst;
+	oend = dst + capacity;
+
+	while (ip < limit) {
+		sequence = read32(ip);
+		h = HASH(sequence);
+
+		ref = src + table[h];
+		table[h] = (ULONG) (ip - src);
+
+		if ((ref >= ip) || (ip - ref > LZ_MAX_OFFSET) || (read32(ref) != sequence)) {
+			ip++;
+			continue;
+		}
+
+		/* Extend the match. */
+		match_length = LZ_MIN_MATCH;
+		while ((ip + match_length < end) && (ref[match_length] == ip[match_length])) {
+			match_length++;
+		}
+
+		if ((op = put_sequence(op, oend, anchor, (ULONG) (ip - anchor), (ULONG) (ip - ref), match_length)) == NULL) {
+			return 0;
+		}
+
+		ip += match_length;
+		anchor = ip;
+	}
+
+	/* Last literals. */
+	if (anchor < end) {
+		if ((op = put_sequence(op, oend, anchor, (ULONG) (end - anchor), 0, 0)) == NULL) {
+			return 0;
+		}
+	}
+
+	return (ULONG) (op - dst);
+}
+
+BOOLEAN lz_decompress(__in const UCHAR *src, __in ULONG compressed_length, __out UCHAR *dst, __in ULONG length)
+{
+	const UCHAR *ip;
+	const UCHAR *iend;
+	const UCHAR *ref;
+	UCHAR *op;
+	UCHAR *oend;
+	ULONG nliterals;
+	ULONG match_length;
+	ULONG offset;
+	UCHAR token;
+	UCHAR c;
+
+	ip = src;
+	iend = src + compressed_length;
+
+	op = dst;
+	oend = dst + length;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* Literals. */
+		if ((nliterals = token >> 4) == 15) {
+			do {
+				if (ip == iend) {
+					return FALSE;
+				}
+
+				c = *ip++;
+				nliterals += c;
+			} while (c == 255);
+		}
+
+		if ((nliterals > (ULONG) (iend - ip)) || (nliterals > (ULONG) (oend - op))) {
+			return FALSE;
+		}
+
+		RtlCopyMemory(op, ip, nliterals);
+
+		ip += nliterals;
+		op += nliterals;
+
+		/* The last sequence has no match. */
+		if (ip == iend) {
+			break;
+		}
+
+		/* Match. */
+		if (iend - ip < 2) {
+			return FALSE;
+		}
+
+		offset = ip[0] | ((ULONG) ip[1] << 8);
+		ip += 2;
+
+		if ((offset == 0) || (offset > (ULONG) (op - dst))) {
+			return FALSE;
+		}
+
+		if ((match_length = token & 15) == 15) {
+			do {
+				if (ip == iend) {
+					return FALSE;
+				}
+
+				c = *ip++;
+				match_length += c;
+			} while (c == 255);
+		}
+
+		match_length += LZ_MIN_MATCH;
+
+		if (match_length > (ULONG) (oend - op)) {
+			return FALSE;
+		}
+
+		ref = op - offset;
+
+		if (offset >= match_length) {
+			RtlCopyMemory(op, ref, match_length);
+			op += match_length;
+		} else {
+			/* Overlapping match (repeated pattern). */
+			while (match_length-- > 0) {
+				*op++ = *ref++;
+			}
+		}
+	}
+
+	return (BOOLEAN) (op == oend);
+}
+
+ULONG read32(__in const UCHAR *p)
+{
+	ULONG v;
+
+	/* Unaligned load (compiles to a single move). */
+	RtlCopyMemory(&v, p, sizeof(ULONG));
+
+	return v;
+}
+
+UCHAR *put_length(__out UCHAR *op, __in const UCHAR *oend, __in ULONG length)
+{
+	while (length >= 255) {
+		if (op == oend) {
+			return NULL;
+		}
+
+		*op++ = 255;
+		length -= 255;
+	}
+
+	if (op == oend) {
+		return NULL;
+	}
+
+	*op++ = (UCHAR) length;
+
+	return op;
+}
+
+UCHAR *put_sequence(__out UCHAR *op, __in const UCHAR *oend, __in const UCHAR *literals, __in ULONG nliterals, __in ULONG offset, __in ULONG match_length)
+{
+	UCHAR *token;
+
+	if (op == oend) {
+		return NULL;
+	}
+
+	token = op++;
+	*token = (UCHAR) (((nliterals < 15) ? nliterals : 15) << 4);
+
+	if ((nliterals >= 15) && ((op = put_length(op, oend, nliterals - 15)) == NULL)) {
+		return NULL;
+	}
+
+	if (nliterals > (ULONG) (oend - op)) {
+		return NULL;
+	}
+
+	RtlCopyMemory(op, literals, nliterals);
+	op += nliterals;
+
+	/* Last sequence? */
+	if (match_length == 0) {
+		return op;
+	}
+
+	if (oend - op < 2) {
+		return NULL;
+	}
+
+	*op++ = (UCHAR) offset;
+	*op++ = (UCHAR) (offset >> 8);
+
+	match_length -= LZ_MIN_MATCH;
+
+	*token |= (UCHAR) ((match_length < 15) ? match_length : 15);
+
+	if ((match_length >= 15) && ((op = put_length(op, oend, match_length - 15)) == NULL)) {
+		return NULL;
+	}
+
+	return op;
+}
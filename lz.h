@@ -0,0 +1,24 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include "port.h"
+
+/*
+ * Fast LZ77 codec (LZ4-like sequences of literals and matches with 16-bit
+ * offsets), used to compress cold chunks.
+ */
+
+#define LZ_WORK_SIZE                    ((1 << LZ_HASH_BITS) * sizeof(ULONG))
+#define LZ_HASH_BITS                    12
+
+/*
+ * Compress "length" bytes of "src" into "dst". "work" must point to
+ * LZ_WORK_SIZE bytes of scratch memory.
+ * Returns the compressed size or 0 if it doesn't fit in "capacity" bytes.
+ */
+ULONG lz_compress(__in const UCHAR *src, __in ULONG length, __out UCHAR *dst, __in ULONG capacity, __in void *work);
+
+/* Returns TRUE if "src" decompresses into exactly "length" bytes. */
+BOOLEAN lz_decompress(__in const UCHAR *src, __in ULONG compressed_length, __out UCHAR *dst, __in ULONG length);
+
+#endif /* LZ_H */
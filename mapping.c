@@ -0,0 +1,185 @@
+#include "mapping.h"
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** Views of the disk in the address space of processes.                     **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+static void destroy_mapping(__in CHUNK_TABLE *table, __in MAPPING *mapping, __in ATOMIC_BITMAP *dirty_chunks);
+
+void mapping_set_init(__out MAPPING_SET *set)
+{
+	port_lock_init(&set->lock);
+
+	set->head = NULL;
+	set->count = 0;
+}
+
+void mapping_set_free(__in MAPPING_SET *set)
+{
+	/* The owners remove their views before the disk goes away. */
+	ASSERT(!set->head);
+
+	port_lock_destroy(&set->lock);
+}
+
+NTSTATUS mapping_create(__in MAPPING_SET *set, __in CHUNK_TABLE *table, __in void *owner, __in ULONGLONG offset, __in ULONGLONG length, __in BOOLEAN writable, __out void **address)
+{
+	MAPPING *mapping;
+	UCHAR **data;
+	SIZE_T chunk_size;
+	PORT_LOCK_STATE state;
+	NTSTATUS status;
+
+	if ((length == 0) || (length > MAPPING_MAX_LENGTH) || (offset + length > chunk_table_size(table))) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	chunk_size = (SIZE_T) 1 << table->chunk_shift;
+
+	if (chunk_size & (PORT_PAGE_SIZE - 1)) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if ((mapping = (MAPPING *) port_alloc(sizeof(MAPPING))) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	mapping->owner = owner;
+	mapping->first = offset >> table->chunk_shift;
+	mapping->count = ((offset + length - 1) >> table->chunk_shift) - mapping->first + 1;
+	mapping->writable = writable;
+
+	if ((data = (UCHAR **) port_alloc((SIZE_T) mapping->count * sizeof(UCHAR *))) == NULL) {
+		port_free(mapping);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = chunk_table_pin(table, mapping->first, mapping->count, data);
+	if (!NT_SUCCESS(status)) {
+		port_free(data);
+		port_free(mapping);
+		return status;
+	}
+
+	status = port_map_pages(&mapping->view, data, (ULONG) mapping->count, chunk_size, writable);
+
+	port_free(data);
+
+	if (!NT_SUCCESS(status)) {
+		chunk_table_unpin(table, mapping->first, mapping->count);
+		port_free(mapping);
+		return status;
+	}
+
+	mapping->address = (UCHAR *) mapping->view.address + (offset & (chunk_size - 1));
+
+	port_lock_acquire(&set->lock, &state);
+
+	mapping->next = set->head;
+	set->head = mapping;
+
+	set->count++;
+
+	port_lock_release(&set->lock, state);
+
+	*address = mapping->address;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS mapping_remove(__in MAPPING_SET *set, __in CHUNK_TABLE *table, __in void *owner, __in void *address, __in ATOMIC_BITMAP *dirty_chunks)
+{
+	MAPPING **link;
+	MAPPING *mapping;
+	PORT_LOCK_STATE state;
+
+	port_lock_acquire(&set->lock, &state);
+
+	for (link = &set->head; ((mapping = *link) != NULL) && ((mapping->owner != owner) || (mapping->address != address)); link = &mapping->next);
+
+	if (mapping) {
+		*link = mapping->next;
+		set->count--;
+	}
+
+	port_lock_release(&set->lock, state);
+
+	if (!mapping) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	destroy_mapping(table, mapping, dirty_chunks);
+
+	return STATUS_SUCCESS;
+}
+
+void mapping_remove_owner(__in MAPPING_SET *set, __in CHUNK_TABLE *table, __in void *owner, __in ATOMIC_BITMAP *dirty_chunks)
+{
+	MAPPING **link;
+	MAPPING *mapping;
+	MAPPING *removed;
+	PORT_LOCK_STATE state;
+
+	removed = NULL;
+
+	/* The views are unmapped outside the lock. */
+	port_lock_acquire(&set->lock, &state);
+
+	for (link = &set->head; (mapping = *link) != NULL;) {
+		if (mapping->owner == owner) {
+			*link = mapping->next;
+			set->count--;
+
+			mapping->next = removed;
+			removed = mapping;
+		} else {
+			link = &mapping->next;
+		}
+	}
+
+	port_lock_release(&set->lock, state);
+
+	while ((mapping = removed) != NULL) {
+		removed = mapping->next;
+
+		destroy_mapping(table, mapping, dirty_chunks);
+	}
+}
+
+void mapping_mark_dirty(__in MAPPING_SET *set, __in ATOMIC_BITMAP *dirty_chunks)
+{
+	MAPPING *mapping;
+	PORT_LOCK_STATE state;
+
+	if (!dirty_chunks->words) {
+		return;
+	}
+
+	port_lock_acquire(&set->lock, &state);
+
+	for (mapping = set->head; mapping; mapping = mapping->next) {
+		if (mapping->writable) {
+			atomic_bitmap_set_range(dirty_chunks, mapping->first, mapping->count);
+		}
+	}
+
+	port_lock_release(&set->lock, state);
+}
+
+void destroy_mapping(__in CHUNK_TABLE *table, __in MAPPING *mapping, __in ATOMIC_BITMAP *dirty_chunks)
+{
+	port_unmap_pages(&mapping->view);
+
+	/* Whatever was written through the view is in the chunks. */
+	if ((mapping->writable) && (dirty_chunks->words)) {
+		atomic_bitmap_set_range(dirty_chunks, mapping->first, mapping->count);
+	}
+
+	chunk_table_unpin(table, mapping->first, mapping->count);
+
+	port_free(mapping);
+}
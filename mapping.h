@@ -0,0 +1,63 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include "port.h"
+#include "chunk_table.h"
+#include "bitmap.h"
+
+/*
+ * Views of the disk in the address space of processes (IOCTL_RAMDISK_MAP).
+ * A view maps the chunks which cover the range, one after the other, with
+ * the chunks pinned (chunk_table_pin()) until it is removed: the process
+ * accesses the same memory as the requests, without copies, so that what
+ * it writes is read by the requests and the other way round. The address
+ * returned points to the first byte of the range in the view.
+ * Each view belongs to an owner (the handle it was created with), and the
+ * views of an owner are removed together when the owner goes away.
+ * The chunks written through a writable view can't be tracked: they are
+ * marked dirty when the view is removed and by mapping_mark_dirty().
+ * The views are created with no I/O on their chunks; the set is protected
+ * by its own lock.
+ */
+#define MAPPING_MAX_LENGTH              (1024 * 1024 * 1024) /* Bytes of a view. */
+
+typedef struct _MAPPING {
+	struct _MAPPING *next;
+	void            *owner;
+	void            *address;        /* Returned to the owner. */
+	ULONGLONG       first;           /* Chunks of the view. */
+	ULONGLONG       count;
+	BOOLEAN         writable;
+	PORT_MAPPING    view;
+} MAPPING;
+
+typedef struct {
+	PORT_LOCK       lock;
+	MAPPING         *head;
+	volatile LONG   count;
+} MAPPING_SET;
+
+void mapping_set_init(__out MAPPING_SET *set);
+void mapping_set_free(__in MAPPING_SET *set);
+
+/*
+ * Maps "length" bytes at "offset" (within the table, at most
+ * MAPPING_MAX_LENGTH) in the current process. The chunks must be loaded.
+ * Fails with STATUS_NOT_SUPPORTED if the chunks are smaller than a page.
+ */
+NTSTATUS mapping_create(__in MAPPING_SET *set, __in CHUNK_TABLE *table, __in void *owner, __in ULONGLONG offset, __in ULONGLONG length, __in BOOLEAN writable, __out void **address);
+
+/*
+ * Removes the view of "owner" at "address" (STATUS_INVALID_PARAMETER if
+ * there is none), or all the views of "owner". The chunks of the writable
+ * views are marked in "dirty_chunks" (if they are tracked).
+ */
+NTSTATUS mapping_remove(__in MAPPING_SET *set, __in CHUNK_TABLE *table, __in void *owner, __in void *address, __in ATOMIC_BITMAP *dirty_chunks);
+void mapping_remove_owner(__in MAPPING_SET *set, __in CHUNK_TABLE *table, __in void *owner, __in ATOMIC_BITMAP *dirty_chunks);
+
+/* Marks the chunks of the writable views, which might have changed since the last checkpoint. */
+void mapping_mark_dirty(__in MAPPING_SET *set, __in ATOMIC_BITMAP *dirty_chunks);
+
+#define mapping_count(set)              ((set)->count)
+
+#endif /* MAPPING_H */
@@ -0,0 +1,52 @@
+#include "numa_layout.h"
+
+void numa_layout_init(__out NUMA_LAYOUT *layout, __in ULONG policy, __in ULONGLONG stripe_chunks, __in ULONGLONG nchunks)
+{
+	layout->nnodes = port_node_count();
+	layout->policy = (layout->nnodes > 1) ? policy : NUMA_POLICY_NONE;
+
+	for (layout->stripe_shift = 0; (stripe_chunks >> layout->stripe_shift) > 1; layout->stripe_shift++);
+	layout->region_chunks = (nchunks + layout->nnodes - 1) / layout->nnodes;
+
+	if (layout->region_chunks == 0) {
+		layout->region_chunks = 1;
+	}
+}
+
+ULONG numa_chunk_node(__in const NUMA_LAYOUT *layout, __in ULONGLONG index)
+{
+	ULONGLONG node;
+
+	switch (layout->policy) {
+		case NUMA_POLICY_INTERLEAVE:
+			return (ULONG) ((index >> layout->stripe_shift) % layout->nnodes);
+		case NUMA_POLICY_PARTITION:
+			node = index / layout->region_chunks;
+			return (node < layout->nnodes) ? (ULONG) node : layout->nnodes - 1;
+		default:
+			return PORT_NO_NODE;
+	}
+}
+
+ULONGLONG numa_node_run(__in const NUMA_LAYOUT *layout, __in ULONGLONG index)
+{
+	ULONGLONG end;
+
+	switch (layout->policy) {
+		case NUMA_POLICY_INTERLEAVE:
+			end = ((index >> layout->stripe_shift) + 1) << layout->stripe_shift;
+			break;
+		case NUMA_POLICY_PARTITION:
+			/* The last region has no end. */
+			if (index / layout->region_chunks >= layout->nnodes - 1) {
+				return (ULONGLONG) -1 - index;
+			}
+
+			end = ((index / layout->region_chunks) + 1) * layout->region_chunks;
+			break;
+		default:
+			return (ULONGLONG) -1 - index;
+	}
+
+	return end - index;
+}
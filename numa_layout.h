@@ -0,0 +1,36 @@
+#ifndef NUMA_LAYOUT_H
+#define NUMA_LAYOUT_H
+
+#include "port.h"
+
+/*
+ * Placement of the chunks of a disk on the NUMA nodes.
+ * NUMA_POLICY_INTERLEAVE deals stripes of 2^stripe_shift chunks to the nodes
+ * in turn; NUMA_POLICY_PARTITION gives each node a region of consecutive
+ * chunks (the last node takes whatever the disk grows beyond the regions).
+ * With NUMA_POLICY_NONE, or a single node, the chunks are not placed.
+ */
+#define NUMA_POLICY_NONE                0
+#define NUMA_POLICY_INTERLEAVE          1
+#define NUMA_POLICY_PARTITION           2
+
+typedef struct {
+	ULONG     policy;
+	ULONG     nnodes;
+	ULONG     stripe_shift;            /* Interleave: log2 of the chunks per stripe. */
+	ULONGLONG region_chunks;           /* Partition: chunks of each node's region. */
+} NUMA_LAYOUT;
+
+/* The nodes are those of port_node_count(); the stripe is rounded down to a power of two chunks. */
+void numa_layout_init(__out NUMA_LAYOUT *layout, __in ULONG policy, __in ULONGLONG stripe_chunks, __in ULONGLONG nchunks);
+
+/* Node of the chunk, PORT_NO_NODE if the chunks are not placed. */
+ULONG numa_chunk_node(__in const NUMA_LAYOUT *layout, __in ULONGLONG index);
+
+/*
+ * Chunks from "index" which are on the same node, at least one (the whole
+ * disk if the chunks are not placed).
+ */
+ULONGLONG numa_node_run(__in const NUMA_LAYOUT *layout, __in ULONGLONG index);
+
+#endif /* NUMA_LAYOUT_H */
@@ -0,0 +1,326 @@
+#ifndef PORT_H
+#define PORT_H
+
+/*
+ * Primitives used by the storage modules (chunk table, ...), so that they
+ * can be built both into the driver and into a user-mode program.
+ * The modules are written against the kernel names; when RAMDISK_USER_MODE
+ * is defined those names are mapped to the C library.
+ */
+
+#define RAMDISK_TAG                     'DmaR'
+
+#ifndef RAMDISK_USER_MODE
+
+#pragma warning(disable:4201)  // nameless struct/union warning
+
+#include <ntddk.h>
+
+#pragma warning(default:4201)
+
+#define port_alloc(size)                ExAllocatePoolWithTag(NonPagedPool, (size), RAMDISK_TAG)
+#define port_free(p)                    ExFreePoolWithTag((p), RAMDISK_TAG)
+
+typedef KSPIN_LOCK PORT_LOCK;
+typedef KIRQL PORT_LOCK_STATE;
+
+#define port_lock_init(l)               KeInitializeSpinLock(l)
+#define port_lock_destroy(l)            ((void) 0)
+#define port_lock_acquire(l, state)     KeAcquireSpinLock((l), (state))
+#define port_lock_release(l, state)     KeReleaseSpinLock((l), (state))
+
+#define port_current_cpu()              KeGetCurrentProcessorNumberEx(NULL)
+#define port_cpu_count()                KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS)
+
+#define port_memory_barrier()           KeMemoryBarrier()
+
+/* Orders the stores before it with those after it (x86 and x64 never reorder stores). */
+#if defined(_M_IX86) || defined(_M_X64)
+	#define port_store_barrier()        KeMemoryBarrierWithoutFence()
+#else
+	#define port_store_barrier()        KeMemoryBarrier()
+#endif
+
+/* Monotonic timestamp, in ticks of port_timestamp_frequency() per second. */
+#define port_timestamp()                ((ULONGLONG) KeQueryPerformanceCounter(NULL).QuadPart)
+
+__inline ULONGLONG port_timestamp_frequency(void)
+{
+	LARGE_INTEGER frequency;
+
+	KeQueryPerformanceCounter(&frequency);
+
+	return (ULONGLONG) frequency.QuadPart;
+}
+
+typedef PKTHREAD PORT_THREAD;
+typedef KSEMAPHORE PORT_SEMAPHORE;
+
+#define port_semaphore_init(s)          KeInitializeSemaphore((s), 0, MAXLONG)
+#define port_semaphore_destroy(s)       ((void) 0)
+#define port_semaphore_release(s, n)    ((void) KeReleaseSemaphore((s), IO_NO_INCREMENT, (n), FALSE))
+#define port_semaphore_wait(s)          ((void) KeWaitForSingleObject((s), Executive, KernelMode, FALSE, NULL))
+
+typedef PCUNICODE_STRING PORT_PATH;
+
+typedef struct {
+	HANDLE handle;
+} PORT_FILE;
+
+typedef struct {
+	IO_STATUS_BLOCK io_status;
+	HANDLE          event;
+	ULONG           length;
+	NTSTATUS        status;
+} PORT_FILE_IO;
+
+#define PORT_PAGE_SIZE                  ((SIZE_T) PAGE_SIZE)
+
+typedef struct {
+	void      *address;
+	SIZE_T    size;
+	PMDL      mdl;
+	PEPROCESS process;                 /* Where the view is. */
+} PORT_MAPPING;
+
+#else /* RAMDISK_USER_MODE */
+
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
+
+typedef unsigned char  UCHAR;
+typedef uint16_t       USHORT;
+typedef unsigned char  BOOLEAN;
+typedef int32_t        LONG;
+typedef uint32_t       ULONG;
+typedef int64_t        LONGLONG;
+typedef uint64_t       ULONGLONG;
+typedef uintptr_t      ULONG_PTR;
+typedef size_t         SIZE_T;
+typedef int32_t        NTSTATUS;
+
+#define TRUE                            1
+#define FALSE                           0
+
+#define __in
+#define __out
+#define __inout
+
+#define UNALIGNED
+
+#define STATUS_SUCCESS                  ((NTSTATUS) 0x00000000L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS) 0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS) 0xC000009AL)
+#define STATUS_DATA_ERROR               ((NTSTATUS) 0xC000003EL)
+#define STATUS_END_OF_FILE              ((NTSTATUS) 0xC0000011L)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS) 0xC0000034L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS) 0xC0000001L)
+#define STATUS_DISK_FULL                ((NTSTATUS) 0xC000007FL)
+#define STATUS_DEVICE_BUSY              ((NTSTATUS) 0x80000011L)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS) 0xC00000BBL)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS) 0xC0000023L)
+
+#define NT_SUCCESS(status)              (((NTSTATUS) (status)) >= 0)
+
+#define ASSERT(e)                       assert(e)
+#define KdPrint(x)                      ((void) 0)
+
+#define RtlZeroMemory(p, n)             memset((p), 0, (n))
+#define RtlCopyMemory(d, s, n)          memcpy((d), (s), (n))
+#define RtlEqualMemory(a, b, n)         (memcmp((a), (b), (n)) == 0)
+
+#define InterlockedIncrement(p)         __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)         __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedOr(p, v)             __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(p, v)            __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)    __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p)       __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(p)       __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(p, v)  __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr64(p, v)           __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAnd64(p, v)          __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+static inline LONG InterlockedCompareExchange(volatile LONG *p, LONG exchange, LONG comparand)
+{
+	__atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+static inline void *InterlockedCompareExchangePointer(void *volatile *p, void *exchange, void *comparand)
+{
+	__atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+#define port_alloc(size)                malloc(size)
+#define port_free(p)                    free(p)
+
+typedef pthread_spinlock_t PORT_LOCK;
+typedef int PORT_LOCK_STATE;
+
+#define port_lock_init(l)               pthread_spin_init((l), PTHREAD_PROCESS_PRIVATE)
+#define port_lock_destroy(l)            pthread_spin_destroy(l)
+#define port_lock_acquire(l, state)     (*(state) = 0, pthread_spin_lock(l))
+#define port_lock_release(l, state)     ((void) (state), pthread_spin_unlock(l))
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define YieldProcessor()            __builtin_ia32_pause()
+#else
+	#define YieldProcessor()            sched_yield()
+#endif
+
+#define port_current_cpu()              ((ULONG) sched_getcpu())
+#define port_cpu_count()                ((ULONG) sysconf(_SC_NPROCESSORS_CONF))
+
+#define port_memory_barrier()           __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define port_store_barrier()            __atomic_thread_fence(__ATOMIC_RELEASE)
+
+static inline ULONGLONG port_timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((ULONGLONG) ts.tv_sec * 1000000000ULL) + (ULONGLONG) ts.tv_nsec;
+}
+
+#define port_timestamp_frequency()      1000000000ULL
+
+typedef pthread_t PORT_THREAD;
+typedef sem_t PORT_SEMAPHORE;
+
+#define port_semaphore_init(s)          sem_init((s), 0, 0)
+#define port_semaphore_destroy(s)       sem_destroy(s)
+
+static inline void port_semaphore_release(PORT_SEMAPHORE *s, LONG n)
+{
+	while (n-- > 0) {
+		sem_post(s);
+	}
+}
+
+static inline void port_semaphore_wait(PORT_SEMAPHORE *s)
+{
+	while (sem_wait(s) != 0);
+}
+
+typedef const char *PORT_PATH;
+
+typedef struct {
+	int fd;
+} PORT_FILE;
+
+typedef struct {
+	NTSTATUS status;
+} PORT_FILE_IO;
+
+#define PORT_PAGE_SIZE                  ((SIZE_T) sysconf(_SC_PAGESIZE))
+
+typedef struct {
+	void      *address;
+	SIZE_T    size;
+} PORT_MAPPING;
+
+#endif /* RAMDISK_USER_MODE */
+
+/*
+ * NUMA topology. The nodes are numbered from 0 and only the first
+ * PORT_MAX_NODES are used. port_alloc_node() prefers the memory of "node",
+ * falling back to the other nodes; its memory is page aligned and must be
+ * freed with port_free_node(). Both can be called at DISPATCH_LEVEL (in the
+ * driver an allocation takes one page more, which keeps its MDL).
+ * port_thread_set_node() runs the calling thread on the processors of "node"
+ * (PASSIVE_LEVEL only).
+ */
+#define PORT_MAX_NODES                  16
+#define PORT_NO_NODE                    ((ULONG) -1)
+
+ULONG port_node_count(void);
+ULONG port_current_node(void);
+void *port_alloc_node(__in SIZE_T size, __in ULONG node);
+void port_free_node(__in void *p, __in SIZE_T size);
+void port_thread_set_node(__in ULONG node);
+
+#ifdef RAMDISK_USER_MODE
+/*
+ * Without libnuma (RAMDISK_LIBNUMA) the topology is simulated: the
+ * processors are divided in "nnodes" nodes of consecutive numbers and the
+ * memory comes from malloc(). One node by default.
+ */
+void port_simulate_nodes(__in ULONG nnodes);
+#endif
+
+/*
+ * Large pages. port_alloc_large() allocates "size" bytes (a multiple of
+ * PORT_LARGE_PAGE_SIZE) aligned and mapped with large pages, preferably on
+ * "node" (or PORT_NO_NODE); it returns NULL when no large pages are
+ * available and can be called at DISPATCH_LEVEL. The memory is freed with
+ * port_free_large(), at PASSIVE_LEVEL only.
+ */
+#define PORT_LARGE_PAGE_SHIFT           21
+#define PORT_LARGE_PAGE_SIZE            ((SIZE_T) 1 << PORT_LARGE_PAGE_SHIFT)
+
+void *port_alloc_large(__in SIZE_T size, __in ULONG node);
+void port_free_large(__in void *p, __in SIZE_T size);
+
+/*
+ * Views of memory in the address space of the current process (PASSIVE_LEVEL
+ * only, in the context of that process). port_map_pages() maps "count"
+ * blocks of "size" bytes (a multiple of PORT_PAGE_SIZE, page aligned) one
+ * after the other in a single view, read-only unless "writable" and never
+ * executable. The blocks must be non-paged memory (the pool,
+ * port_alloc_node() or port_alloc_large()) and stay allocated until the view
+ * is removed by port_unmap_pages(), which can be called from any process.
+ */
+NTSTATUS port_map_pages(__out PORT_MAPPING *mapping, __in UCHAR **blocks, __in ULONG count, __in SIZE_T size, __in BOOLEAN writable);
+void port_unmap_pages(__in PORT_MAPPING *mapping);
+
+#ifdef RAMDISK_USER_MODE
+/*
+ * Linux only maps the same pages again if they are mapped shared: after
+ * port_share_memory() the memory of port_alloc_node() is, so that it can be
+ * passed to port_map_pages(). Must be called before the first allocation.
+ */
+void port_share_memory(void);
+BOOLEAN port_memory_is_shared(void);
+#endif
+
+/* Threads (PASSIVE_LEVEL only). The routine returns to terminate the thread. */
+typedef void PORT_THREAD_ROUTINE(__in void *context);
+
+NTSTATUS port_thread_create(__out PORT_THREAD *thread, __in PORT_THREAD_ROUTINE *routine, __in void *context);
+void port_thread_join(__in PORT_THREAD *thread);
+
+/*
+ * File I/O (PASSIVE_LEVEL only).
+ * A transfer is started with port_file_begin_read()/port_file_begin_write()
+ * and finished with port_file_wait(), so that several transfers can be in
+ * flight; each one needs its own PORT_FILE_IO. Short transfers fail.
+ */
+NTSTATUS port_file_open(__out PORT_FILE *file, __in PORT_PATH path, __in BOOLEAN create);
+void port_file_close(__in PORT_FILE *file);
+
+/* Sets the file size; the new space doesn't take disk space if the file is sparse. */
+NTSTATUS port_file_set_size(__in PORT_FILE *file, __in ULONGLONG size);
+NTSTATUS port_file_get_size(__in PORT_FILE *file, __out ULONGLONG *size);
+
+NTSTATUS port_file_io_init(__out PORT_FILE_IO *io);
+void port_file_io_destroy(__in PORT_FILE_IO *io);
+
+void port_file_begin_read(__in PORT_FILE *file, __in PORT_FILE_IO *io, __in ULONGLONG offset, __out void *buffer, __in ULONG length);
+void port_file_begin_write(__in PORT_FILE *file, __in PORT_FILE_IO *io, __in ULONGLONG offset, __in const void *buffer, __in ULONG length);
+NTSTATUS port_file_wait(__in PORT_FILE_IO *io);
+
+#endif /* PORT_H */
@@ -0,0 +1,276 @@
+#ifndef RAMDISK_USER_MODE
+	#include <ntifs.h>
+#endif
+
+#include "port.h"
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** File I/O used to save and restore the disk image.                        **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+#ifndef RAMDISK_USER_MODE
+
+#ifdef ALLOC_PRAGMA
+	#pragma alloc_text(PAGE, port_file_open)
+	#pragma alloc_text(PAGE, port_file_close)
+	#pragma alloc_text(PAGE, port_file_set_size)
+	#pragma alloc_text(PAGE, port_file_get_size)
+	#pragma alloc_text(PAGE, port_file_io_init)
+	#pragma alloc_text(PAGE, port_file_io_destroy)
+	#pragma alloc_text(PAGE, port_file_begin_read)
+	#pragma alloc_text(PAGE, port_file_begin_write)
+	#pragma alloc_text(PAGE, port_file_wait)
+#endif
+
+NTSTATUS port_file_open(__out PORT_FILE *file, __in PORT_PATH path, __in BOOLEAN create)
+{
+	OBJECT_ATTRIBUTES attributes;
+	PORT_FILE_IO io;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	InitializeObjectAttributes(&attributes, (PUNICODE_STRING) path, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	/* The file is opened for asynchronous I/O, the transfers are waited for with events. */
+	status = ZwCreateFile(&file->handle,
+						  GENERIC_READ | GENERIC_WRITE,
+						  &attributes,
+						  &io.io_status,
+						  NULL,
+						  FILE_ATTRIBUTE_NORMAL,
+						  0,
+						  create ? FILE_OVERWRITE_IF : FILE_OPEN,
+						  FILE_NON_DIRECTORY_FILE,
+						  NULL,
+						  0);
+
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (!create) {
+		return STATUS_SUCCESS;
+	}
+
+	/* Make the file sparse (not supported by every file system). */
+	status = port_file_io_init(&io);
+	if (!NT_SUCCESS(status)) {
+		ZwClose(file->handle);
+		return status;
+	}
+
+	status = ZwFsControlFile(file->handle, io.event, NULL, NULL, &io.io_status, FSCTL_SET_SPARSE, NULL, 0, NULL, 0);
+	if (status == STATUS_PENDING) {
+		ZwWaitForSingleObject(io.event, FALSE, NULL);
+		status = io.io_status.Status;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("The image file cannot be made sparse (0x%08x).\n", status));
+	}
+
+	port_file_io_destroy(&io);
+
+	return STATUS_SUCCESS;
+}
+
+void port_file_close(__in PORT_FILE *file)
+{
+	PAGED_CODE();
+
+	ZwClose(file->handle);
+}
+
+NTSTATUS port_file_set_size(__in PORT_FILE *file, __in ULONGLONG size)
+{
+	FILE_END_OF_FILE_INFORMATION information;
+	IO_STATUS_BLOCK io_status;
+
+	PAGED_CODE();
+
+	information.EndOfFile.QuadPart = (LONGLONG) size;
+
+	return ZwSetInformationFile(file->handle, &io_status, &information, sizeof(information), FileEndOfFileInformation);
+}
+
+NTSTATUS port_file_get_size(__in PORT_FILE *file, __out ULONGLONG *size)
+{
+	FILE_STANDARD_INFORMATION information;
+	IO_STATUS_BLOCK io_status;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	status = ZwQueryInformationFile(file->handle, &io_status, &information, sizeof(information), FileStandardInformation);
+	if (NT_SUCCESS(status)) {
+		*size = (ULONGLONG) information.EndOfFile.QuadPart;
+	}
+
+	return status;
+}
+
+NTSTATUS port_file_io_init(__out PORT_FILE_IO *io)
+{
+	OBJECT_ATTRIBUTES attributes;
+
+	PAGED_CODE();
+
+	InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	io->status = STATUS_SUCCESS;
+
+	return ZwCreateEvent(&io->event, EVENT_ALL_ACCESS, &attributes, NotificationEvent, FALSE);
+}
+
+void port_file_io_destroy(__in PORT_FILE_IO *io)
+{
+	PAGED_CODE();
+
+	ZwClose(io->event);
+}
+
+void port_file_begin_read(__in PORT_FILE *file, __in PORT_FILE_IO *io, __in ULONGLONG offset, __out void *buffer, __in ULONG length)
+{
+	LARGE_INTEGER byte_offset;
+
+	PAGED_CODE();
+
+	byte_offset.QuadPart = (LONGLONG) offset;
+
+	io->length = length;
+	io->status = ZwReadFile(file->handle, io->event, NULL, NULL, &io->io_status, buffer, length, &byte_offset, NULL);
+}
+
+void port_file_begin_write(__in PORT_FILE *file, __in PORT_FILE_IO *io, __in ULONGLONG offset, __in const void *buffer, __in ULONG length)
+{
+	LARGE_INTEGER byte_offset;
+
+	PAGED_CODE();
+
+	byte_offset.QuadPart = (LONGLONG) offset;
+
+	io->length = length;
+	io->status = ZwWriteFile(file->handle, io->event, NULL, NULL, &io->io_status, (PVOID) buffer, length, &byte_offset, NULL);
+}
+
+NTSTATUS port_file_wait(__in PORT_FILE_IO *io)
+{
+	PAGED_CODE();
+
+	if (io->status == STATUS_PENDING) {
+		ZwWaitForSingleObject(io->event, FALSE, NULL);
+		io->status = io->io_status.Status;
+	}
+
+	if ((NT_SUCCESS(io->status)) && (io->io_status.Information != io->length)) {
+		io->status = STATUS_END_OF_FILE;
+	}
+
+	return io->status;
+}
+
+#else /* RAMDISK_USER_MODE */
+
+#include <errno.h>
+#include <fcntl.h>
+
+NTSTATUS port_file_open(__out PORT_FILE *file, __in PORT_PATH path, __in BOOLEAN create)
+{
+	if ((file->fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644)) < 0) {
+		return (errno == ENOENT) ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_UNSUCCESSFUL;
+	}
+
+	/* Regular files are sparse on the usual Linux file systems. */
+	return STATUS_SUCCESS;
+}
+
+void port_file_close(__in PORT_FILE *file)
+{
+	close(file->fd);
+}
+
+NTSTATUS port_file_set_size(__in PORT_FILE *file, __in ULONGLONG size)
+{
+	return (ftruncate(file->fd, (off_t) size) == 0) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+NTSTATUS port_file_get_size(__in PORT_FILE *file, __out ULONGLONG *size)
+{
+	off_t end;
+
+	if ((end = lseek(file->fd, 0, SEEK_END)) < 0) {
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	*size = (ULONGLONG) end;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS port_file_io_init(__out PORT_FILE_IO *io)
+{
+	io->status = STATUS_SUCCESS;
+	return STATUS_SUCCESS;
+}
+
+void port_file_io_destroy(__in PORT_FILE_IO *io)
+{
+	(void) io;
+}
+
+/* The transfers are done synchronously. */
+void port_file_begin_read(__in PORT_FILE *file, __in PORT_FILE_IO *io, __in ULONGLONG offset, __out void *buffer, __in ULONG length)
+{
+	ssize_t ret;
+
+	io->status = STATUS_SUCCESS;
+
+	while (length > 0) {
+		if ((ret = pread(file->fd, buffer, length, (off_t) offset)) <= 0) {
+			if ((ret < 0) && (errno == EINTR)) {
+				continue;
+			}
+
+			io->status = (ret == 0) ? STATUS_END_OF_FILE : STATUS_UNSUCCESSFUL;
+			return;
+		}
+
+		buffer = (UCHAR *) buffer + ret;
+		length -= (ULONG) ret;
+		offset += (ULONGLONG) ret;
+	}
+}
+
+void port_file_begin_write(__in PORT_FILE *file, __in PORT_FILE_IO *io, __in ULONGLONG offset, __in const void *buffer, __in ULONG length)
+{
+	ssize_t ret;
+
+	io->status = STATUS_SUCCESS;
+
+	while (length > 0) {
+		if ((ret = pwrite(file->fd, buffer, length, (off_t) offset)) <= 0) {
+			if ((ret < 0) && (errno == EINTR)) {
+				continue;
+			}
+
+			io->status = STATUS_UNSUCCESSFUL;
+			return;
+		}
+
+		buffer = (const UCHAR *) buffer + ret;
+		length -= (ULONG) ret;
+		offset += (ULONGLONG) ret;
+	}
+}
+
+NTSTATUS port_file_wait(__in PORT_FILE_IO *io)
+{
+	return io->status;
+}
+
+#endif /* RAMDISK_USER_MODE */
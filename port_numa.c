@@ -0,0 +1,271 @@
+#include "port.h"
+
+#if defined(RAMDISK_USER_MODE) && defined(RAMDISK_LIBNUMA)
+	#include <numa.h>
+#endif
+
+#ifdef RAMDISK_USER_MODE
+	#include <sys/mman.h>
+#endif
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** NUMA topology and node-local memory.                                     **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+#ifndef RAMDISK_USER_MODE
+
+#ifdef ALLOC_PRAGMA
+	#pragma alloc_text(PAGE, port_thread_set_node)
+#endif
+
+ULONG port_node_count(void)
+{
+	ULONG nnodes;
+
+	nnodes = (ULONG) KeQueryHighestNodeNumber() + 1;
+
+	return (nnodes < PORT_MAX_NODES) ? nnodes : PORT_MAX_NODES;
+}
+
+ULONG port_current_node(void)
+{
+	return (ULONG) KeGetCurrentNodeNumber();
+}
+
+void *port_alloc_node(__in SIZE_T size, __in ULONG node)
+{
+	PHYSICAL_ADDRESS lowest;
+	PHYSICAL_ADDRESS highest;
+	PHYSICAL_ADDRESS skip;
+	MDL *mdl;
+	UCHAR *p;
+
+	/*
+	 * The pool has no preferred node; the pages of an MDL have, and unlike
+	 * contiguous memory they don't run out when the physical memory is
+	 * fragmented, and can be allocated, mapped and freed at DISPATCH_LEVEL.
+	 * The node is only a preference. The first page keeps the MDL for
+	 * port_free_node().
+	 */
+	lowest.QuadPart = 0;
+	highest.QuadPart = -1;
+	skip.QuadPart = 0;
+
+	mdl = MmAllocateNodePagesForMdlEx(lowest, highest, skip, size + PAGE_SIZE, MmCached, node, MM_ALLOCATE_FULLY_REQUIRED | MM_DONT_ZERO_ALLOCATION);
+	if (!mdl) {
+		return NULL;
+	}
+
+	p = (UCHAR *) MmMapLockedPagesSpecifyCache(mdl, KernelMode, MmCached, NULL, FALSE, NormalPagePriority | MdlMappingNoExecute);
+	if (!p) {
+		MmFreePagesFromMdl(mdl);
+		ExFreePool(mdl);
+
+		return NULL;
+	}
+
+	*((MDL **) p) = mdl;
+
+	return p + PAGE_SIZE;
+}
+
+void port_free_node(__in void *p, __in SIZE_T size)
+{
+	UCHAR *base;
+	MDL *mdl;
+
+	UNREFERENCED_PARAMETER(size);
+
+	base = (UCHAR *) p - PAGE_SIZE;
+	mdl = *((MDL **) base);
+
+	MmUnmapLockedPages(base, mdl);
+	MmFreePagesFromMdl(mdl);
+	ExFreePool(mdl);
+}
+
+void port_thread_set_node(__in ULONG node)
+{
+	GROUP_AFFINITY affinity;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(&affinity, sizeof(affinity));
+
+	KeQueryNodeActiveAffinity((USHORT) node, &affinity, NULL);
+
+	/* A node without active processors keeps the thread where it is. */
+	if (affinity.Mask != 0) {
+		KeSetSystemGroupAffinityThread(&affinity, NULL);
+	}
+}
+
+#else /* RAMDISK_USER_MODE */
+
+static void *alloc_shared(__in SIZE_T size);
+
+#ifdef RAMDISK_LIBNUMA
+
+ULONG port_node_count(void)
+{
+	ULONG nnodes;
+
+	if (numa_available() < 0) {
+		return 1;
+	}
+
+	nnodes = (ULONG) numa_max_node() + 1;
+
+	return (nnodes < PORT_MAX_NODES) ? nnodes : PORT_MAX_NODES;
+}
+
+ULONG port_current_node(void)
+{
+	int node;
+
+	if ((numa_available() < 0) || ((node = numa_node_of_cpu(sched_getcpu())) < 0)) {
+		return 0;
+	}
+
+	return (ULONG) node;
+}
+
+void *port_alloc_node(__in SIZE_T size, __in ULONG node)
+{
+	void *p;
+
+	if (port_memory_is_shared()) {
+		if (((p = alloc_shared(size)) != NULL) && (numa_available() >= 0)) {
+			numa_tonode_memory(p, size, (int) node);
+		}
+
+		return p;
+	}
+
+	if (numa_available() < 0) {
+		return malloc(size);
+	}
+
+	return numa_alloc_onnode(size, (int) node);
+}
+
+void port_free_node(__in void *p, __in SIZE_T size)
+{
+	if (port_memory_is_shared()) {
+		munmap(p, size);
+	} else if (numa_available() < 0) {
+		free(p);
+	} else {
+		numa_free(p, size);
+	}
+}
+
+void port_thread_set_node(__in ULONG node)
+{
+	if (numa_available() >= 0) {
+		numa_run_on_node((int) node);
+	}
+}
+
+void port_simulate_nodes(__in ULONG nnodes)
+{
+	/* The real topology is used. */
+	(void) nnodes;
+}
+
+#else /* Simulated topology. */
+
+static ULONG simulated_nodes = 1;
+
+static ULONG node_of_cpu(__in ULONG cpu);
+
+ULONG port_node_count(void)
+{
+	return simulated_nodes;
+}
+
+ULONG port_current_node(void)
+{
+	return node_of_cpu(port_current_cpu());
+}
+
+void *port_alloc_node(__in SIZE_T size, __in ULONG node)
+{
+	(void) node;
+
+	if (port_memory_is_shared()) {
+		return alloc_shared(size);
+	}
+
+	return malloc(size);
+}
+
+void port_free_node(__in void *p, __in SIZE_T size)
+{
+	if (port_memory_is_shared()) {
+		munmap(p, size);
+	} else {
+		free(p);
+	}
+}
+
+void port_thread_set_node(__in ULONG node)
+{
+	cpu_set_t cpus;
+	ULONG ncpus;
+	ULONG cpu;
+
+	CPU_ZERO(&cpus);
+
+	ncpus = port_cpu_count();
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		if (node_of_cpu(cpu) == node) {
+			CPU_SET(cpu, &cpus);
+		}
+	}
+
+	/* Best effort: the node might have no processors. */
+	if (CPU_COUNT(&cpus) > 0) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+}
+
+void port_simulate_nodes(__in ULONG nnodes)
+{
+	if (nnodes < 1) {
+		nnodes = 1;
+	} else if (nnodes > PORT_MAX_NODES) {
+		nnodes = PORT_MAX_NODES;
+	}
+
+	simulated_nodes = nnodes;
+}
+
+ULONG node_of_cpu(__in ULONG cpu)
+{
+	ULONG ncpus;
+
+	ncpus = port_cpu_count();
+
+	/* Consecutive processors share a node; with fewer processors than nodes some nodes have none. */
+	return (ULONG) (((ULONGLONG) cpu * simulated_nodes) / ((ncpus > 0) ? ncpus : 1));
+}
+
+#endif /* RAMDISK_LIBNUMA */
+
+void *alloc_shared(__in SIZE_T size)
+{
+	void *p;
+
+	/* Anonymous, but shared: port_map_pages() can map it again. */
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	return (p != MAP_FAILED) ? p : NULL;
+}
+
+#endif /* RAMDISK_USER_MODE */
@@ -0,0 +1,293 @@
+#ifndef RAMDISK_USER_MODE
+	#include <ntifs.h>
+#endif
+
+#include "port.h"
+
+#ifdef RAMDISK_USER_MODE
+	#include <sys/mman.h>
+	#include <errno.h>
+
+	#ifdef RAMDISK_LIBNUMA
+		#include <numa.h>
+	#endif
+#endif
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** Large pages.                                                             **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+#ifndef RAMDISK_USER_MODE
+
+void *port_alloc_large(__in SIZE_T size, __in ULONG node)
+{
+	PHYSICAL_ADDRESS lowest;
+	PHYSICAL_ADDRESS highest;
+	PHYSICAL_ADDRESS boundary;
+
+	/*
+	 * Contiguous memory which doesn't cross a multiple of its (power of two)
+	 * size is physically aligned, and mapped with large pages by the memory
+	 * manager. It fails when the physical memory is too fragmented.
+	 */
+	ASSERT((size & (size - 1)) == 0);
+	ASSERT(size >= PORT_LARGE_PAGE_SIZE);
+
+	lowest.QuadPart = 0;
+	highest.QuadPart = -1;
+	boundary.QuadPart = (LONGLONG) size;
+
+	return MmAllocateContiguousMemorySpecifyCacheNode(size, lowest, highest, boundary, MmCached, (node == PORT_NO_NODE) ? MM_ANY_NODE_OK : (NODE_REQUIREMENT) node);
+}
+
+void port_free_large(__in void *p, __in SIZE_T size)
+{
+	UNREFERENCED_PARAMETER(size);
+
+	MmFreeContiguousMemory(p);
+}
+
+#else /* RAMDISK_USER_MODE */
+
+static void *map_huge_pages(__in SIZE_T size);
+static void *map_transparent_huge_pages(__in SIZE_T size);
+
+void *port_alloc_large(__in SIZE_T size, __in ULONG node)
+{
+	void *p;
+
+	/* Pages reserved in hugetlbfs (vm.nr_hugepages) or else transparent huge pages. */
+	if ((p = map_huge_pages(size)) == NULL) {
+		if ((p = map_transparent_huge_pages(size)) == NULL) {
+			return NULL;
+		}
+	}
+
+#ifdef RAMDISK_LIBNUMA
+	/* The pages are not touched yet: they will be faulted in on the node. */
+	if ((node != PORT_NO_NODE) && (numa_available() >= 0)) {
+		numa_tonode_memory(p, size, (int) node);
+	}
+#else
+	(void) node;
+#endif
+
+	return p;
+}
+
+void port_free_large(__in void *p, __in SIZE_T size)
+{
+	munmap(p, size);
+}
+
+void *map_huge_pages(__in SIZE_T size)
+{
+	void *p;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		return p;
+	}
+#else
+	(void) size;
+	(void) p;
+#endif
+
+	return NULL;
+}
+
+void *map_transparent_huge_pages(__in SIZE_T size)
+{
+#ifdef MADV_HUGEPAGE
+	UCHAR *p;
+	UCHAR *aligned;
+	SIZE_T head;
+
+	/* Map a large page more to align the mapping, and unmap the ends. */
+	p = (UCHAR *) mmap(NULL, size + PORT_LARGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == (UCHAR *) MAP_FAILED) {
+		return NULL;
+	}
+
+	aligned = (UCHAR *) (((ULONG_PTR) p + PORT_LARGE_PAGE_SIZE - 1) & ~((ULONG_PTR) PORT_LARGE_PAGE_SIZE - 1));
+	head = (SIZE_T) (aligned - p);
+
+	if (head > 0) {
+		munmap(p, head);
+	}
+
+	munmap(aligned + size, PORT_LARGE_PAGE_SIZE - head);
+
+	/* Fails if the transparent huge pages are disabled. */
+	if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+		munmap(aligned, size);
+		return NULL;
+	}
+
+	return aligned;
+#else
+	(void) size;
+
+	return NULL;
+#endif
+}
+
+#endif /* RAMDISK_USER_MODE */
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** Views of memory in the address space of a process.                       **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+#ifndef RAMDISK_USER_MODE
+
+#ifdef ALLOC_PRAGMA
+	#pragma alloc_text(PAGE, port_map_pages)
+	#pragma alloc_text(PAGE, port_unmap_pages)
+#endif
+
+NTSTATUS port_map_pages(__out PORT_MAPPING *mapping, __in UCHAR **blocks, __in ULONG count, __in SIZE_T size, __in BOOLEAN writable)
+{
+	PFN_NUMBER *pfns;
+	SIZE_T offset;
+	ULONG priority;
+	ULONG i;
+
+	PAGED_CODE();
+
+	ASSERT((size & (PAGE_SIZE - 1)) == 0);
+
+	mapping->address = NULL;
+	mapping->size = (SIZE_T) count * size;
+
+	/* An MDL describes less than 4 GB. */
+	if ((mapping->size == 0) || (mapping->size > MAXULONG - PAGE_SIZE)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ((mapping->mdl = IoAllocateMdl(NULL, (ULONG) mapping->size, FALSE, FALSE, NULL)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	/* The memory is non-paged: the pages are resident and don't move, the MDL only lists them. */
+	pfns = MmGetMdlPfnArray(mapping->mdl);
+
+	for (i = 0; i < count; i++) {
+		for (offset = 0; offset < size; offset += PAGE_SIZE) {
+			*pfns++ = (PFN_NUMBER) (MmGetPhysicalAddress(blocks[i] + offset).QuadPart >> PAGE_SHIFT);
+		}
+	}
+
+	mapping->mdl->MdlFlags |= MDL_PAGES_LOCKED;
+
+	priority = NormalPagePriority | MdlMappingNoExecute;
+	if (!writable) {
+		priority |= MdlMappingNoWrite;
+	}
+
+	/* The mapping in user mode raises an exception when it fails. */
+	__try {
+		mapping->address = MmMapLockedPagesSpecifyCache(mapping->mdl, UserMode, MmCached, NULL, FALSE, priority);
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		mapping->address = NULL;
+	}
+
+	if (!mapping->address) {
+		IoFreeMdl(mapping->mdl);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	mapping->process = PsGetCurrentProcess();
+	ObReferenceObject(mapping->process);
+
+	return STATUS_SUCCESS;
+}
+
+void port_unmap_pages(__in PORT_MAPPING *mapping)
+{
+	KAPC_STATE state;
+	BOOLEAN attach;
+
+	PAGED_CODE();
+
+	/* The last handle might be closed by another process (it was duplicated). */
+	attach = (BOOLEAN) (PsGetCurrentProcess() != mapping->process);
+
+	if (attach) {
+		KeStackAttachProcess(mapping->process, &state);
+	}
+
+	MmUnmapLockedPages(mapping->address, mapping->mdl);
+
+	if (attach) {
+		KeUnstackDetachProcess(&state);
+	}
+
+	ObDereferenceObject(mapping->process);
+	IoFreeMdl(mapping->mdl);
+}
+
+#else /* RAMDISK_USER_MODE */
+
+static BOOLEAN shared_memory = FALSE;
+
+NTSTATUS port_map_pages(__out PORT_MAPPING *mapping, __in UCHAR **blocks, __in ULONG count, __in SIZE_T size, __in BOOLEAN writable)
+{
+	UCHAR *view;
+	ULONG i;
+
+	mapping->address = NULL;
+	mapping->size = (SIZE_T) count * size;
+
+	if (mapping->size == 0) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* Reserve the view, then map each block again in its place. */
+	view = (UCHAR *) mmap(NULL, mapping->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (view == (UCHAR *) MAP_FAILED) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* With an old size of 0, mremap() maps the same pages (shared mappings only). */
+		if (mremap(blocks[i], 0, size, MREMAP_MAYMOVE | MREMAP_FIXED, view + (SIZE_T) i * size) == MAP_FAILED) {
+			munmap(view, mapping->size);
+			return (errno == EINVAL) ? STATUS_NOT_SUPPORTED : STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	if (mprotect(view, mapping->size, writable ? PROT_READ | PROT_WRITE : PROT_READ) != 0) {
+		munmap(view, mapping->size);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	mapping->address = view;
+
+	return STATUS_SUCCESS;
+}
+
+void port_unmap_pages(__in PORT_MAPPING *mapping)
+{
+	munmap(mapping->address, mapping->size);
+}
+
+void port_share_memory(void)
+{
+	shared_memory = TRUE;
+}
+
+BOOLEAN port_memory_is_shared(void)
+{
+	return shared_memory;
+}
+
+#endif /* RAMDISK_USER_MODE */
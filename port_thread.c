@@ -0,0 +1,94 @@
+#include "port.h"
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** Worker threads.                                                          **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+#ifndef RAMDISK_USER_MODE
+
+#ifdef ALLOC_PRAGMA
+	#pragma alloc_text(PAGE, port_thread_create)
+	#pragma alloc_text(PAGE, port_thread_join)
+#endif
+
+NTSTATUS port_thread_create(__out PORT_THREAD *thread, __in PORT_THREAD_ROUTINE *routine, __in void *context)
+{
+	OBJECT_ATTRIBUTES attributes;
+	HANDLE handle;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	status = PsCreateSystemThread(&handle, THREAD_ALL_ACCESS, &attributes, NULL, NULL, (PKSTART_ROUTINE) routine, context);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* Keep a reference to the thread object, to wait for it. */
+	status = ObReferenceObjectByHandle(handle, THREAD_ALL_ACCESS, NULL, KernelMode, (PVOID *) thread, NULL);
+
+	ZwClose(handle);
+
+	return status;
+}
+
+void port_thread_join(__in PORT_THREAD *thread)
+{
+	PAGED_CODE();
+
+	KeWaitForSingleObject(*thread, Executive, KernelMode, FALSE, NULL);
+	ObDereferenceObject(*thread);
+}
+
+#else /* RAMDISK_USER_MODE */
+
+typedef struct {
+	PORT_THREAD_ROUTINE *routine;
+	void                *context;
+} THREAD_START;
+
+static void *thread_start(void *arg);
+
+NTSTATUS port_thread_create(__out PORT_THREAD *thread, __in PORT_THREAD_ROUTINE *routine, __in void *context)
+{
+	THREAD_START *start;
+
+	if ((start = (THREAD_START *) malloc(sizeof(THREAD_START))) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	start->routine = routine;
+	start->context = context;
+
+	if (pthread_create(thread, NULL, thread_start, start) != 0) {
+		free(start);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void port_thread_join(__in PORT_THREAD *thread)
+{
+	pthread_join(*thread, NULL);
+}
+
+void *thread_start(void *arg)
+{
+	THREAD_START start;
+
+	start = *((THREAD_START *) arg);
+	free(arg);
+
+	start.routine(start.context);
+
+	return NULL;
+}
+
+#endif /* RAMDISK_USER_MODE */
@@ -1,5 +1,6 @@
 #include "ramdisk.h"
 #include <mountdev.h>
+#include <ntstrsafe.h>
 
 /******************************************************************************
  ******************************************************************************
@@ -10,201 +11,2386 @@
  ******************************************************************************/
 #ifdef ALLOC_PRAGMA
 	#pragma alloc_text(INIT, DriverEntry)
+	#pragma alloc_text(PAGE, EvtDriverCleanup)
 	#pragma alloc_text(PAGE, EvtDriverDeviceAdd)
 	#pragma alloc_text(PAGE, EvtCleanupCallback)
+	#pragma alloc_text(PAGE, EvtCompressionWorkItem)
+	#pragma alloc_text(PAGE, create_compression_objects)
+	#pragma alloc_text(PAGE, create_queues)
+	#pragma alloc_text(PAGE, create_clone)
+	#pragma alloc_text(PAGE, delete_clone)
+	#pragma alloc_text(PAGE, delete_clones)
+	#pragma alloc_text(PAGE, assign_disk_number)
+	#pragma alloc_text(PAGE, release_disk_number)
+	#pragma alloc_text(PAGE, resize_disk)
+	#pragma alloc_text(PAGE, read_trace)
+	#pragma alloc_text(PAGE, EvtIoPassiveDeviceControl)
+	#pragma alloc_text(PAGE, EvtDeviceShutdown)
+	#pragma alloc_text(PAGE, wait_for_range)
+	#pragma alloc_text(PAGE, restore_image)
+	#pragma alloc_text(PAGE, create_load_objects)
+	#pragma alloc_text(PAGE, EvtIoLoad)
+	#pragma alloc_text(PAGE, load_chunks)
+	#pragma alloc_text(PAGE, load_range)
+	#pragma alloc_text(PAGE, prefetch)
+	#pragma alloc_text(PAGE, load_image)
+	#pragma alloc_text(PAGE, save_image)
+	#pragma alloc_text(PAGE, checkpoint_image)
+	#pragma alloc_text(PAGE, write_image)
+	#pragma alloc_text(PAGE, write_dirty_chunks)
+	#pragma alloc_text(PAGE, open_cache)
+	#pragma alloc_text(PAGE, create_flusher)
+	#pragma alloc_text(PAGE, flusher)
+	#pragma alloc_text(PAGE, flush_cache)
+	#pragma alloc_text(PAGE, evict_chunks)
+	#pragma alloc_text(PAGE, throttle_writes)
+	#pragma alloc_text(PAGE, open_spill)
+	#pragma alloc_text(PAGE, spill_cold_chunks)
 	#pragma alloc_text(PAGE, query_disk_parameters)
+	#pragma alloc_text(PAGE, query_parameters)
+	#pragma alloc_text(PAGE, query_driver_parameters)
+	#pragma alloc_text(PAGE, query_ulonglong)
 	#pragma alloc_text(PAGE, set_disk_geometry)
 	#pragma alloc_text(PAGE, query_device_name)
 	#pragma alloc_text(PAGE, query_unique_id)
 	#pragma alloc_text(PAGE, get_length_info)
 	#pragma alloc_text(PAGE, get_hotplug_info)
+	#pragma alloc_text(PAGE, EvtDeviceCleanup)
+	#pragma alloc_text(PAGE, assign_mapping_callbacks)
+	#pragma alloc_text(PAGE, map_range)
+	#pragma alloc_text(PAGE, unmap_range)
 #endif
 
+/*
+ * Operations with their own counters (IOCTL_RAMDISK_QUERY_STATISTICS), in
+ * the order of the counters: reads, writes, the control codes which are not
+ * handled and then each control code which is handled.
+ */
+const ULONG counted_operations[] = {
+	RAMDISK_OPERATION_READ,
+	RAMDISK_OPERATION_WRITE,
+	RAMDISK_OPERATION_OTHER_IOCTL,
+	IOCTL_DISK_GET_PARTITION_INFO,
+	IOCTL_DISK_SET_PARTITION_INFO,
+	IOCTL_DISK_GET_DRIVE_GEOMETRY,
+	IOCTL_DISK_GET_MEDIA_TYPES,
+	IOCTL_STORAGE_GET_MEDIA_TYPES,
+	IOCTL_DISK_UPDATE_PROPERTIES,
+	IOCTL_DISK_CHECK_VERIFY,
+	IOCTL_STORAGE_CHECK_VERIFY,
+	IOCTL_DISK_IS_WRITABLE,
+	IOCTL_MOUNTDEV_QUERY_DEVICE_NAME,
+	IOCTL_MOUNTDEV_QUERY_UNIQUE_ID,
+	IOCTL_DISK_MEDIA_REMOVAL,
+	IOCTL_STORAGE_MEDIA_REMOVAL,
+	IOCTL_DISK_GET_LENGTH_INFO,
+	IOCTL_STORAGE_GET_HOTPLUG_INFO,
+	IOCTL_STORAGE_QUERY_PROPERTY,
+	IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES,
+	IOCTL_RAMDISK_SAVE_IMAGE,
+	IOCTL_RAMDISK_CHECKPOINT,
+	IOCTL_RAMDISK_SNAPSHOT,
+	IOCTL_RAMDISK_CLONE,
+	IOCTL_RAMDISK_DELETE_CLONE,
+	IOCTL_RAMDISK_RESIZE,
+	IOCTL_RAMDISK_QUERY_STATISTICS,
+	IOCTL_RAMDISK_READ_TRACE,
+	IOCTL_RAMDISK_QUERY_NUMA,
+	IOCTL_RAMDISK_BATCH
+};
+
+#define COUNTERS_READ                   0
+#define COUNTERS_WRITE                  1
+#define COUNTERS_OTHER_IOCTL            2
+
+C_ASSERT(RTL_NUMBER_OF(counted_operations) <= CPU_QUEUE_COUNTERS);
+C_ASSERT(CPU_QUEUE_COUNTERS <= RAMDISK_MAX_OPERATIONS);
+C_ASSERT(IO_LATENCY_BUCKETS == RAMDISK_LATENCY_BUCKETS);
+
+/* The operations are traced with their own codes. */
+C_ASSERT((REQUEST_READ == RAMDISK_TRACE_READ) && (REQUEST_WRITE == RAMDISK_TRACE_WRITE) && (REQUEST_TRIM == RAMDISK_TRACE_TRIM));
+
+/* The descriptors of a batch are executed with the operations of the requests (disk_io_batch()). */
+C_ASSERT((REQUEST_READ == RAMDISK_BATCH_READ) && (REQUEST_WRITE == RAMDISK_BATCH_WRITE));
+
+/* The views are validated by mapping_create(). */
+C_ASSERT(MAPPING_MAX_LENGTH == RAMDISK_MAP_MAX_LENGTH);
+
+/* The placement policies and the nodes reported are those of numa_layout.h. */
+C_ASSERT((NUMA_POLICY_NONE == RAMDISK_NUMA_NONE) && (NUMA_POLICY_INTERLEAVE == RAMDISK_NUMA_INTERLEAVE) && (NUMA_POLICY_PARTITION == RAMDISK_NUMA_PARTITION));
+C_ASSERT(PORT_MAX_NODES <= RAMDISK_MAX_NUMA_NODES);
+
 NTSTATUS DriverEntry(__in DRIVER_OBJECT *driver, __in UNICODE_STRING *regpath)
 {
 	WDF_DRIVER_CONFIG config;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	DRIVER_EXTENSION *driver_extension;
+	DRIVER_INFO driver_info;
+	WDFDRIVER wdf_driver;
+	UNICODE_STRING low_memory_name;
+	NTSTATUS status;
 
 	KdPrint(("Windows Ramdisk Driver.\n"));
 	KdPrint(("Built %s %s.\n", __DATE__, __TIME__));
 
 	WDF_DRIVER_CONFIG_INIT(&config, EvtDriverDeviceAdd);
 
-	return WdfDriverCreate(driver, regpath, WDF_NO_OBJECT_ATTRIBUTES, &config, WDF_NO_HANDLE);
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, DRIVER_EXTENSION);
+	attributes.EvtCleanupCallback = EvtDriverCleanup;
+
+	status = WdfDriverCreate(driver, regpath, &attributes, &config, &wdf_driver);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	driver_extension = DriverGetExtension(wdf_driver);
+
+	query_driver_parameters(WdfDriverGetRegistryPath(wdf_driver), &driver_info);
+
+	/* Memory shared by the disks (PoolSize limits the memory of all of them). */
+	chunk_pool_init(&driver_extension->pool, DEFAULT_CHUNK_SHIFT, driver_info.pool_size, CHUNK_POOL_CACHE);
+
+	/* Fewer TLB misses on random requests; the pool falls back to small pages. */
+	if (driver_info.large_pages) {
+		chunk_pool_use_large_pages(&driver_extension->pool);
+	}
+
+	/* Threads copying the large transfers (the processor submitting a transfer copies a part too). */
+	if (driver_info.split_workers == 0) {
+		driver_info.split_workers = port_cpu_count() - 1;
+	}
+
+	if (driver_info.split_workers > SPLIT_MAX_PARTS - 1) {
+		driver_info.split_workers = SPLIT_MAX_PARTS - 1;
+	}
+
+	status = split_pool_init(&driver_extension->split_pool, driver_info.split_workers, (SIZE_T) driver_info.split_threshold);
+	if (!NT_SUCCESS(status)) {
+		/* The transfers are copied by a single processor. */
+		KdPrint(("Couldn't create the split workers (status 0x%08x).\n", status));
+	}
+
+	/* The disks with a spill file follow the memory pressure of the system. */
+	RtlInitUnicodeString(&low_memory_name, LOW_MEMORY_EVENT);
+
+	if ((driver_extension->low_memory = IoCreateNotificationEvent(&low_memory_name, &driver_extension->low_memory_handle)) == NULL) {
+		KdPrint(("Couldn't open the low memory event, nothing will be spilled.\n"));
+	}
+
+	/* Clones of the disks. */
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = wdf_driver;
+
+	status = WdfCollectionCreate(&attributes, &driver_extension->clones);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	return WdfWaitLockCreate(&attributes, &driver_extension->lock);
+}
+
+void EvtDriverCleanup(__in WDFOBJECT driver)
+{
+	PAGED_CODE();
+
+	/* All the disks are gone, only the free chunks and the idle workers are left. */
+	split_pool_free(&DriverGetExtension(driver)->split_pool);
+
+	KdPrint(("Blocks: %I64u bytes, %I64u in large pages.\n", chunk_pool_block_bytes(&DriverGetExtension(driver)->pool), chunk_pool_large_bytes(&DriverGetExtension(driver)->pool)));
+
+	chunk_pool_free(&DriverGetExtension(driver)->pool);
+
+	if (DriverGetExtension(driver)->low_memory) {
+		ZwClose(DriverGetExtension(driver)->low_memory_handle);
+	}
 }
 
 NTSTATUS EvtDriverDeviceAdd(__in WDFDRIVER driver, __in PWDFDEVICE_INIT device_init)
 {
 	DISK_INFO disk_info;
-	UCHAR *disk_image;
+	CHUNK_TABLE chunk_table;
 	WDFDEVICE device;
 	WDFQUEUE queue;
 	WDF_OBJECT_ATTRIBUTES device_attributes;
-	WDF_OBJECT_ATTRIBUTES queue_attributes;
+	WDF_OBJECT_ATTRIBUTES request_attributes;
+	DEVICE_EXTENSION *device_extension;
+	UNICODE_STRING nt_name;
+	WCHAR nt_name_buffer[MAX_DEVICE_NAME];
+	ULONG number;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	/* Every device of the driver is a disk, numbered in the order in which they are added. */
+	status = assign_disk_number(&number);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* Get the disk parameters from the registry. */
+	query_disk_parameters(WdfDriverGetRegistryPath(driver), number, &disk_info);
+
+	/* Create the chunk table for the disk image (chunks are allocated on first write). */
+	status = chunk_table_init(&chunk_table, disk_info.disk_size, DEFAULT_CHUNK_SHIFT);
+	if (!NT_SUCCESS(status)) {
+		RtlFreeUnicodeString(&disk_info.image_file);
+		RtlFreeUnicodeString(&disk_info.spill_file);
+		release_disk_number(number);
+		return status;
+	}
+
+	/* Assign a device name (the first disk keeps the name it always had). */
+	RtlInitEmptyUnicodeString(&nt_name, nt_name_buffer, sizeof(nt_name_buffer));
+
+	if (number == 0) {
+		status = RtlUnicodeStringCopyString(&nt_name, NT_DEVICE_NAME);
+	} else {
+		status = RtlUnicodeStringPrintf(&nt_name, DISK_DEVICE_NAME, number);
+	}
+
+	if (NT_SUCCESS(status)) {
+		status = WdfDeviceInitAssignName(device_init, &nt_name);
+	}
+
+	if (!NT_SUCCESS(status)) {
+		chunk_table_free(&chunk_table);
+		RtlFreeUnicodeString(&disk_info.image_file);
+		RtlFreeUnicodeString(&disk_info.spill_file);
+		release_disk_number(number);
+		return status;
+	}
+
+	/* Save the disk image on shutdown. */
+	if (disk_info.image_file.Length > 0) {
+		status = WdfDeviceInitAssignWdmIrpPreprocessCallback(device_init, EvtDeviceShutdown, IRP_MJ_SHUTDOWN, NULL, 0);
+		if (!NT_SUCCESS(status)) {
+			chunk_table_free(&chunk_table);
+			RtlFreeUnicodeString(&disk_info.image_file);
+			RtlFreeUnicodeString(&disk_info.spill_file);
+			release_disk_number(number);
+			return status;
+		}
+	}
+
+	/* The views of the processes are created and removed in their context. */
+	status = assign_mapping_callbacks(device_init);
+	if (!NT_SUCCESS(status)) {
+		chunk_table_free(&chunk_table);
+		RtlFreeUnicodeString(&disk_info.image_file);
+		RtlFreeUnicodeString(&disk_info.spill_file);
+		release_disk_number(number);
+		return status;
+	}
+
+	WdfDeviceInitSetDeviceType(device_init, FILE_DEVICE_DISK);
+	WdfDeviceInitSetIoType(device_init, WdfDeviceIoDirect);
+	WdfDeviceInitSetExclusive(device_init, FALSE);
+
+	/* Every request carries its entry for the range lock. */
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&request_attributes, REQUEST_CONTEXT);
+	WdfDeviceInitSetRequestAttributes(device_init, &request_attributes);
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&device_attributes, DEVICE_EXTENSION);
+	device_attributes.EvtCleanupCallback = EvtCleanupCallback;
+
+	/* Create device object. */
+	status = WdfDeviceCreate(&device_init, &device_attributes, &device);
+	if (!NT_SUCCESS(status)) {
+		chunk_table_free(&chunk_table);
+		RtlFreeUnicodeString(&disk_info.image_file);
+		RtlFreeUnicodeString(&disk_info.spill_file);
+		release_disk_number(number);
+		return status;
+	}
+
+	/* From now on, the file names and the disk number are freed by EvtCleanupCallback. */
+	device_extension = DeviceGetExtension(device);
+
+	device_extension->disk_number = number;
+
+	mapping_set_init(&device_extension->mappings);
+
+	device_extension->disk_info.image_file = disk_info.image_file;
+	device_extension->disk_info.spill_file = disk_info.spill_file;
+
+	RtlInitEmptyUnicodeString(&device_extension->device_name, device_extension->device_name_buffer, sizeof(device_extension->device_name_buffer));
+	RtlCopyUnicodeString(&device_extension->device_name, &nt_name);
+
+	KeInitializeMutex(&device_extension->image_mutex, 0);
+
+	/* Create a device interface. */
+	status = WdfDeviceCreateDeviceInterface(device, &MOUNTDEV_MOUNTED_DEVICE_GUID, NULL);
+	if (!NT_SUCCESS(status)) {
+		chunk_table_free(&chunk_table);
+		return status;
+	}
+
+	/* Set up the device extension before the queue starts receiving requests. */
+	status = cpu_queues_init(&device_extension->cpu_queues, port_cpu_count(), disk_info.cpus_per_queue, disk_info.trace_records);
+	if (!NT_SUCCESS(status)) {
+		chunk_table_free(&chunk_table);
+		return status;
+	}
+
+	device_extension->timestamp_frequency = port_timestamp_frequency();
+
+	/* The chunks are taken from the pool of the driver. */
+	chunk_quota_init(&device_extension->quota, &DriverGetExtension(driver)->pool, disk_info.quota);
+
+	device_extension->chunk_table = chunk_table;
+	chunk_table_set_quota(&device_extension->chunk_table, &device_extension->quota);
+	chunk_table_set_numa(&device_extension->chunk_table, disk_info.numa_policy, disk_info.numa_stripe);
+
+	device_extension->disk_info.disk_size = disk_info.disk_size;
+	device_extension->disk_info.cpus_per_queue = disk_info.cpus_per_queue;
+	device_extension->disk_info.memory_budget = disk_info.memory_budget;
+	device_extension->disk_info.lazy_load = disk_info.lazy_load;
+	device_extension->disk_info.quota = disk_info.quota;
+	device_extension->disk_info.trace_records = disk_info.trace_records;
+	device_extension->disk_info.numa_policy = disk_info.numa_policy;
+	device_extension->disk_info.numa_stripe = disk_info.numa_stripe;
+	device_extension->disk_info.cache_size = disk_info.cache_size;
+	device_extension->disk_info.flush_interval = disk_info.flush_interval;
+	device_extension->disk_info.dirty_limit = disk_info.dirty_limit;
+	device_extension->disk_info.min_resident = disk_info.min_resident;
+	device_extension->disk_info.sector_size = disk_info.sector_size;
+	device_extension->disk_info.physical_sector_size = disk_info.physical_sector_size;
+
+	range_lock_init(&device_extension->range_lock);
+
+	set_disk_geometry(device_extension);
+
+	/* Load the disk image saved previously. */
+	if (disk_info.image_file.Length > 0) {
+		/* The writes mark their chunks, so that the checkpoints only write what has changed. */
+		status = atomic_bitmap_init(&device_extension->dirty_chunks, chunk_table.nchunks);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		/* With a cache, the image file is a raw backing file which is only partly in memory. */
+		if (disk_info.cache_size > 0) {
+			status = open_cache(device_extension);
+		} else {
+			status = restore_image(device_extension);
+		}
+
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		/* The chunks still in the image file are loaded on demand (and in the background without a cache). */
+		if ((device_extension->cache.open) || (image_loader_pending(&device_extension->image_loader))) {
+			status = create_load_objects(device);
+			if (!NT_SUCCESS(status)) {
+				return status;
+			}
+		}
+
+		if (device_extension->cache.open) {
+			status = create_flusher(device_extension);
+			if (!NT_SUCCESS(status)) {
+				return status;
+			}
+		}
+	}
+
+	/* Spill cold chunks to a file when the system is low on memory; they are faulted back through the load queue. */
+	if (disk_info.spill_file.Length > 0) {
+		status = open_spill(device_extension);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		status = create_load_objects(device);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+	}
+
+	/* Compress cold chunks when the memory budget is exceeded. */
+	if (disk_info.memory_budget > 0) {
+		status = chunk_table_enable_compression(&device_extension->chunk_table);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+	}
+
+	/* The same timer checks the budget and the memory pressure. */
+	if ((disk_info.memory_budget > 0) || (device_extension->spill.open)) {
+		status = create_compression_objects(device);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+	}
+
+	status = create_queues(device, &queue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = SetForwardProgressOnQueue(queue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (disk_info.image_file.Length > 0) {
+		status = IoRegisterShutdownNotification(WdfDeviceWdmGetDeviceObject(device));
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+	}
+
+	if (device_extension->compression_timer) {
+		WdfTimerStart(device_extension->compression_timer, WDF_REL_TIMEOUT_IN_MS(COMPRESSION_PERIOD));
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS create_queues(__in WDFDEVICE device, __out WDFQUEUE *queue)
+{
+	DEVICE_EXTENSION *device_extension;
 	WDF_IO_QUEUE_CONFIG io_queue_config;
+	WDF_OBJECT_ATTRIBUTES queue_attributes;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	device_extension = DeviceGetExtension(device);
+
+	/* Configure the default queue (overlapping requests are serialized by the range lock). */
+	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&io_queue_config, WdfIoQueueDispatchParallel);
+
+	io_queue_config.EvtIoRead = EvtIoRead;
+	io_queue_config.EvtIoWrite = EvtIoWrite;
+	io_queue_config.EvtIoDeviceControl = EvtIoDeviceControl;
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queue_attributes, QUEUE_EXTENSION);
+
+	/* Create I/O queue (from now on, the disk image is freed by EvtCleanupCallback). */
+	status = WdfIoQueueCreate(device, &io_queue_config, &queue_attributes, queue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	QueueGetExtension(*queue)->device_extension = device_extension;
+
+	/* Queue for the requests which have to be handled at PASSIVE_LEVEL. */
+	WDF_IO_QUEUE_CONFIG_INIT(&io_queue_config, WdfIoQueueDispatchSequential);
+
+	io_queue_config.EvtIoDeviceControl = EvtIoPassiveDeviceControl;
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queue_attributes, QUEUE_EXTENSION);
+	queue_attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+	status = WdfIoQueueCreate(device, &io_queue_config, &queue_attributes, &device_extension->passive_queue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	QueueGetExtension(device_extension->passive_queue)->device_extension = device_extension;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS create_compression_objects(__in WDFDEVICE device)
+{
 	DEVICE_EXTENSION *device_extension;
-	QUEUE_EXTENSION *queue_extension;
+	WDF_TIMER_CONFIG timer_config;
+	WDF_WORKITEM_CONFIG work_item_config;
+	WDF_OBJECT_ATTRIBUTES attributes;
 	NTSTATUS status;
 
-	DECLARE_CONST_UNICODE_STRING(nt_name, NT_DEVICE_NAME);
+	PAGED_CODE();
+
+	device_extension = DeviceGetExtension(device);
+
+	WDF_WORKITEM_CONFIG_INIT(&work_item_config, EvtCompressionWorkItem);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = device;
+
+	status = WdfWorkItemCreate(&work_item_config, &attributes, &device_extension->compression_work_item);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	WDF_TIMER_CONFIG_INIT_PERIODIC(&timer_config, EvtCompressionTimer, COMPRESSION_PERIOD);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = device;
+
+	return WdfTimerCreate(&timer_config, &attributes, &device_extension->compression_timer);
+}
+
+void EvtCleanupCallback(__in WDFOBJECT device)
+{
+	DEVICE_EXTENSION *device_extension;
+
+	PAGED_CODE();
+
+	device_extension = DeviceGetExtension(device);
+
+	/* The clones are control devices, they would keep the driver loaded (and they use the quota of the disk). */
+	if (!device_extension->clone_number) {
+		delete_clones(device_extension->disk_number);
+	}
+
+	/* Stop the prefetching. */
+	if (device_extension->prefetch_thread) {
+		InterlockedExchange(&device_extension->stop_prefetch, 1);
+
+		KeWaitForSingleObject(device_extension->prefetch_thread, Executive, KernelMode, FALSE, NULL);
+		ObDereferenceObject(device_extension->prefetch_thread);
+	}
+
+	/* Stop the flusher (the checkpoint below flushes what is left). */
+	if (device_extension->flusher_thread) {
+		InterlockedExchange(&device_extension->stop_flusher, 1);
+		KeSetEvent(&device_extension->flush_event, IO_NO_INCREMENT, FALSE);
+
+		KeWaitForSingleObject(device_extension->flusher_thread, Executive, KernelMode, FALSE, NULL);
+		ObDereferenceObject(device_extension->flusher_thread);
+	}
+
+	/* Make sure that the compression is not running. */
+	if (device_extension->compression_timer) {
+		WdfTimerStop(device_extension->compression_timer, TRUE);
+	}
+
+	if (device_extension->compression_work_item) {
+		WdfWorkItemFlush(device_extension->compression_work_item);
+	}
+
+	if (device_extension->disk_info.image_file.Length > 0) {
+		IoUnregisterShutdownNotification(WdfDeviceWdmGetDeviceObject(device));
+
+		if (device_extension->save_image) {
+			checkpoint_image(device_extension);
+		}
+	}
+
+	RtlFreeUnicodeString(&device_extension->disk_info.image_file);
+	RtlFreeUnicodeString(&device_extension->disk_info.spill_file);
+
+	image_close(&device_extension->image);
+
+	if (device_extension->cache.open) {
+		KdPrint(("Cache: %I64d misses, %I64d chunks flushed, %I64d evicted.\n", device_extension->cache.misses, device_extension->cache.flushed, device_extension->cache.evicted));
+
+		cache_close(&device_extension->cache);
+	}
+
+	if (device_extension->spill.open) {
+		KdPrint(("Spill: %I64d chunks spilled in %I64d transfers, %I64d faulted back.\n", device_extension->spill.spilled, device_extension->spill.transfers, device_extension->spill.faulted));
+
+		spill_close(&device_extension->spill);
+	}
+
+	if (device_extension->spill_work) {
+		port_free(device_extension->spill_work->buffer);
+		port_free(device_extension->spill_work);
+	}
+
+	atomic_bitmap_free(&device_extension->dirty_chunks);
+
+	mapping_set_free(&device_extension->mappings);
+
+	if (device_extension->load_buffer) {
+		port_free(device_extension->load_buffer);
+	}
+
+	if (device_extension->cpu_queues.queues) {
+		IO_COUNTERS counters;
+
+		cpu_queues_get_counters(&device_extension->cpu_queues, COUNTERS_READ, &counters);
+		KdPrint(("Reads: %I64d (%I64d bytes, %I64d errors).\n", counters.requests, counters.bytes, counters.errors));
+
+		cpu_queues_get_counters(&device_extension->cpu_queues, COUNTERS_WRITE, &counters);
+		KdPrint(("Writes: %I64d (%I64d bytes, %I64d errors).\n", counters.requests, counters.bytes, counters.errors));
+
+		cpu_queues_free(&device_extension->cpu_queues);
+	}
+
+	chunk_table_free(&device_extension->chunk_table);
+
+	range_lock_destroy(&device_extension->range_lock);
+
+	if (!device_extension->clone_number) {
+		release_disk_number(device_extension->disk_number);
+	}
+}
+
+void EvtIoRead(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_t length)
+{
+	WDF_REQUEST_PARAMETERS parameters;
+	DEVICE_EXTENSION *device_extension;
+	LARGE_INTEGER offset;
+
+	__analysis_assume(length > 0);
+
+	/* Retrieve the parameters associated with the request. */
+	WDF_REQUEST_PARAMETERS_INIT(&parameters);
+	WdfRequestGetParameters(request, &parameters);
+
+	offset.QuadPart = parameters.Parameters.Read.DeviceOffset;
+
+	device_extension = QueueGetExtension(queue)->device_extension;
+
+	start_request(device_extension, request, COUNTERS_READ);
+
+	if (!check_parameters(device_extension, offset, length)) {
+		complete_request(device_extension, request, STATUS_INVALID_PARAMETER, (ULONG_PTR) length);
+		return;
+	}
+
+	dispatch_request(device_extension, request, offset.QuadPart, offset.QuadPart + length, REQUEST_READ);
+}
+
+void EvtIoWrite(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_t length)
+{
+	WDF_REQUEST_PARAMETERS parameters;
+	DEVICE_EXTENSION *device_extension;
+	LARGE_INTEGER offset;
+
+	__analysis_assume(length > 0);
+
+	/* Retrieve the parameters associated with the request. */
+	WDF_REQUEST_PARAMETERS_INIT(&parameters);
+	WdfRequestGetParameters(request, &parameters);
+
+	offset.QuadPart = parameters.Parameters.Write.DeviceOffset;
+
+	device_extension = QueueGetExtension(queue)->device_extension;
+
+	start_request(device_extension, request, COUNTERS_WRITE);
+
+	if (!check_parameters(device_extension, offset, length)) {
+		complete_request(device_extension, request, STATUS_INVALID_PARAMETER, (ULONG_PTR) length);
+		return;
+	}
+
+	if (device_extension->read_only) {
+		complete_request(device_extension, request, STATUS_MEDIA_WRITE_PROTECTED, 0);
+		return;
+	}
+
+	dispatch_request(device_extension, request, offset.QuadPart, offset.QuadPart + length, REQUEST_WRITE);
+}
+
+void start_request(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in ULONG counters)
+{
+	REQUEST_CONTEXT *context;
+
+	context = RequestGetContext(request);
+	context->counters = counters;
+	context->start_time = port_timestamp();
+	context->dispatch_time = 0;
+
+	/* The counters of the current processor: no cache line is shared with the other processors. */
+	io_counters_start(&cpu_queues_current(&device_extension->cpu_queues)->counters[counters]);
+}
+
+void complete_request(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in NTSTATUS status, __in ULONG_PTR information)
+{
+	REQUEST_CONTEXT *context;
+	CPU_QUEUE_DATA *cpu_queue;
+	RAMDISK_TRACE_RECORD record;
+	ULONGLONG now;
+
+	/* Account the request before completing it (the context goes away with it). */
+	context = RequestGetContext(request);
+	cpu_queue = cpu_queues_current(&device_extension->cpu_queues);
+
+	now = port_timestamp();
+
+	io_counters_complete(&cpu_queue->counters[context->counters],
+						 (ULONGLONG) information,
+						 (BOOLEAN) !NT_SUCCESS(status),
+						 io_ticks_to_ns(now - context->start_time, device_extension->timestamp_frequency));
+
+	/* Only the requests which went through the range lock are traced. */
+	if ((context->dispatch_time) && (trace_ring_enabled(&cpu_queue->trace))) {
+		record.offset = context->offset;
+		record.length = context->length;
+		record.arrival = context->start_time;
+		record.dispatch = context->dispatch_time;
+		record.completion = now;
+		record.status = (ULONG) status;
+		record.cpu = (USHORT) port_current_cpu();
+		record.operation = context->operation;
+
+		trace_ring_write(&cpu_queue->trace, &record);
+	}
+
+	WdfRequestCompleteWithInformation(request, status, information);
+}
+
+ULONG counters_index(__in ULONG code)
+{
+	ULONG i;
+
+	for (i = COUNTERS_OTHER_IOCTL + 1; i < RTL_NUMBER_OF(counted_operations); i++) {
+		if (counted_operations[i] == code) {
+			return i;
+		}
+	}
+
+	return COUNTERS_OTHER_IOCTL;
+}
+
+void dispatch_request(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in ULONGLONG start, __in ULONGLONG end, __in UCHAR operation)
+{
+	REQUEST_CONTEXT *context;
+
+	context = RequestGetContext(request);
+	context->request = request;
+	context->operation = operation;
+	context->offset = start;
+	context->length = end - start;
+	context->throttled = FALSE;
+
+	/* Reads (and batches of reads) share the range, the other operations lock it exclusively. */
+	if (!range_lock_acquire(&device_extension->range_lock, &context->range, start, end, (BOOLEAN) ((operation != REQUEST_READ) && (operation != REQUEST_BATCH_READ)))) {
+		/* The request will be executed when the conflicting requests complete. */
+		return;
+	}
+
+	execute_requests(device_extension, &context->range);
+}
+
+void execute_requests(__in DEVICE_EXTENSION *device_extension, __in RANGE_LOCK_ENTRY *head)
+{
+	RANGE_LOCK_ENTRY *tail;
+	RANGE_LOCK_ENTRY *entry;
+	RANGE_LOCK_ENTRY *granted;
+
+	/*
+	 * Execute the requests and then the requests which were waiting for them.
+	 * They are queued here instead of executed recursively, so that long
+	 * chains of overlapping requests don't exhaust the stack.
+	 */
+	for (tail = head; tail->next_granted; tail = tail->next_granted);
+
+	do {
+		entry = head;
+		if ((head = entry->next_granted) == NULL) {
+			tail = NULL;
+		}
+
+		granted = execute_request(device_extension, CONTAINING_RECORD(entry, REQUEST_CONTEXT, range));
+		if (granted) {
+			if (tail) {
+				tail->next_granted = granted;
+			} else {
+				head = granted;
+			}
+
+			for (tail = granted; tail->next_granted; tail = tail->next_granted);
+		}
+	} while (head);
+}
+
+RANGE_LOCK_ENTRY *execute_request(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context)
+{
+	RANGE_LOCK_ENTRY *granted;
+	SPLIT_REQUEST *split;
+	WDFREQUEST request;
+	WDFMEMORY hMemory;
+	ULONGLONG offset;
+	ULONGLONG chunk_mask;
+	size_t length;
+	NTSTATUS status;
+
+	if (context->operation == REQUEST_WAIT) {
+		/* The waiting thread releases the range when it is done. */
+		KeSetEvent(context->granted, IO_NO_INCREMENT, FALSE);
+		return NULL;
+	}
+
+	request = context->request;
+
+	offset = context->offset;
+	length = (size_t) context->length;
+
+	/* The batches are not traced (the records have a single range). */
+	if ((device_extension->disk_info.trace_records) && (context->operation != REQUEST_BATCH_READ) && (context->operation != REQUEST_BATCH_WRITE)) {
+		context->dispatch_time = port_timestamp();
+	}
+
+	/* The disk might have shrunk while the request was waiting (trims cover whole chunks). */
+	if (offset + length > ((context->operation == REQUEST_TRIM) ? chunk_table_size(&device_extension->chunk_table) : device_extension->disk_info.disk_size)) {
+		granted = range_lock_release(&device_extension->range_lock, &context->range);
+
+		complete_request(device_extension, request, STATUS_INVALID_PARAMETER, 0);
+
+		return granted;
+	}
+
+	/* Beyond the dirty limit, the writes wait (at PASSIVE_LEVEL) for the flusher. */
+	if ((device_extension->cache.open) &&
+		((context->operation == REQUEST_WRITE) || (context->operation == REQUEST_BATCH_WRITE)) &&
+		(!context->throttled) &&
+		(cache_over_dirty_limit(&device_extension->cache))) {
+		return forward_to_load_queue(device_extension, context);
+	}
+
+	claim_chunks(device_extension, context);
+
+	/*
+	 * Chunks still in the image file (or spilled) have to be loaded (at
+	 * PASSIVE_LEVEL) first. The trims of a cache, or of spilled chunks,
+	 * only drop the chunks which are loaded or which they cover completely
+	 * (see trim()).
+	 */
+	if (((image_loader_pending(&device_extension->image_loader)) ||
+		 (((device_extension->cache.open) || (spill_pending(&device_extension->spill))) && (context->operation != REQUEST_TRIM))) &&
+		(!chunks_loaded(device_extension, context))) {
+		return forward_to_load_queue(device_extension, context);
+	}
+
+	/*
+	 * Copy on write: a chunk shared with a clone can only be copied when
+	 * nobody else uses it. Lock the whole chunks and come back (once).
+	 */
+	chunk_mask = ((ULONGLONG) 1 << device_extension->chunk_table.chunk_shift) - 1;
+
+	if (((context->operation == REQUEST_WRITE) || (context->operation == REQUEST_BATCH_WRITE)) &&
+		(((context->range.start | context->range.end) & chunk_mask) != 0) &&
+		(chunk_table_is_shared(&device_extension->chunk_table, offset, length))) {
+		granted = range_lock_release(&device_extension->range_lock, &context->range);
+
+		if (range_lock_acquire(&device_extension->range_lock, &context->range, offset & ~chunk_mask, (offset + length + chunk_mask) & ~chunk_mask, TRUE)) {
+			context->range.next_granted = granted;
+			return &context->range;
+		}
+
+		return granted;
+	}
+
+	switch (context->operation) {
+		case REQUEST_READ:
+		case REQUEST_WRITE:
+			/* Retrieve a handle to the memory object that represents the request's output (read) or input (write) buffer. */
+			if (context->operation == REQUEST_READ) {
+				status = WdfRequestRetrieveOutputMemory(request, &hMemory);
+			} else {
+				status = WdfRequestRetrieveInputMemory(request, &hMemory);
+			}
+
+			if (!NT_SUCCESS(status)) {
+				break;
+			}
+
+			/* Copy the large transfers in parallel; the last part to be copied finishes the request. */
+			if ((split_pool_should_split(&DriverGetExtension(WdfGetDriver())->split_pool, length)) &&
+				((split = (SPLIT_REQUEST *) port_alloc(sizeof(SPLIT_REQUEST))) != NULL)) {
+				split->completion = complete_split;
+				split->context = context;
+
+				if (!split_execute(&DriverGetExtension(WdfGetDriver())->split_pool, split, &device_extension->chunk_table, context->operation, offset, WdfMemoryGetBuffer(hMemory, NULL), length)) {
+					return NULL;
+				}
+
+				status = split->status;
+				port_free(split);
+			} else {
+				/* Copy between the memory object's buffer and the disk image. */
+				status = disk_io_transfer(&device_extension->chunk_table, context->operation, offset, WdfMemoryGetBuffer(hMemory, NULL), length);
+			}
+
+			break;
+		case REQUEST_TRIM:
+			status = trim(device_extension, request);
+			length = 0;
+			break;
+		case REQUEST_BATCH_READ:
+		case REQUEST_BATCH_WRITE:
+			/* Validated by dispatch_batch(); each descriptor has its own status. */
+			length = disk_io_batch(&device_extension->chunk_table,
+								   &device_extension->dirty_chunks,
+								   (RAMDISK_BATCH_ENTRY *) (context->batch + 1),
+								   context->batch->count,
+								   context->batch_buffer);
+
+			status = STATUS_SUCCESS;
+			break;
+		default:
+			status = STATUS_INVALID_DEVICE_REQUEST;
+			length = 0;
+	}
+
+	return finish_request(device_extension, context, status, length);
+}
+
+RANGE_LOCK_ENTRY *finish_request(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context, __in NTSTATUS status, __in SIZE_T length)
+{
+	RANGE_LOCK_ENTRY *granted;
+	WDFREQUEST request;
+
+	request = context->request;
+
+	/*
+	 * Remember the chunks to be written by the next checkpoint (trimmed
+	 * chunks and failed writes too; the batches mark their descriptors).
+	 */
+	if ((context->operation == REQUEST_WRITE) || (context->operation == REQUEST_TRIM)) {
+		disk_io_mark_dirty(&device_extension->dirty_chunks, device_extension->chunk_table.chunk_shift, context->range.start, context->range.end);
+	}
+
+	/* Don't wait for the interval when the cache is over its limits. */
+	if ((device_extension->cache.open) &&
+		((cache_over_size(&device_extension->cache, &device_extension->chunk_table)) ||
+		 ((context->operation != REQUEST_READ) && (cache_over_dirty_limit(&device_extension->cache))))) {
+		KeSetEvent(&device_extension->flush_event, IO_NO_INCREMENT, FALSE);
+	}
+
+	/* Release the range before completing the request (the context goes away with it). */
+	granted = range_lock_release(&device_extension->range_lock, &context->range);
+
+	complete_request(device_extension, request, status, (ULONG_PTR) length);
+
+	return granted;
+}
+
+void complete_split(__in SPLIT_REQUEST *split)
+{
+	DEVICE_EXTENSION *device_extension;
+	REQUEST_CONTEXT *context;
+	RANGE_LOCK_ENTRY *granted;
+	NTSTATUS status;
+
+	/* Called by the worker which copied the last part of a request of execute_request(). */
+	context = (REQUEST_CONTEXT *) split->context;
+	status = split->status;
+
+	port_free(split);
+
+	device_extension = DeviceGetExtension(WdfIoQueueGetDevice(WdfRequestGetIoQueue(context->request)));
+
+	granted = finish_request(device_extension, context, status, (SIZE_T) context->length);
+	if (granted) {
+		execute_requests(device_extension, granted);
+	}
+}
+
+void wait_for_range(__in DEVICE_EXTENSION *device_extension, __out REQUEST_CONTEXT *context, __in ULONGLONG start, __in ULONGLONG end, __in BOOLEAN exclusive)
+{
+	KEVENT granted;
+
+	PAGED_CODE();
+
+	KeInitializeEvent(&granted, NotificationEvent, FALSE);
+
+	context->request = NULL;
+	context->operation = REQUEST_WAIT;
+	context->granted = &granted;
+
+	if (!range_lock_acquire(&device_extension->range_lock, &context->range, start, end, exclusive)) {
+		KeWaitForSingleObject(&granted, Executive, KernelMode, FALSE, NULL);
+	}
+}
+
+void release_range(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context)
+{
+	RANGE_LOCK_ENTRY *granted;
+
+	/* Execute the requests which were waiting for the range. */
+	if ((granted = range_lock_release(&device_extension->range_lock, &context->range)) != NULL) {
+		execute_requests(device_extension, granted);
+	}
+}
+
+RANGE_LOCK_ENTRY *forward_to_load_queue(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context)
+{
+	RANGE_LOCK_ENTRY *granted;
+	NTSTATUS status;
+
+	/* EvtIoLoad executes the request afterwards; it keeps its range meanwhile. */
+	status = WdfRequestForwardToIoQueue(context->request, device_extension->load_queue);
+	if (NT_SUCCESS(status)) {
+		return NULL;
+	}
+
+	granted = range_lock_release(&device_extension->range_lock, &context->range);
+
+	complete_request(device_extension, context->request, status, 0);
+
+	return granted;
+}
+
+void claim_chunks(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context)
+{
+	RAMDISK_BATCH_ENTRY *entries;
+	ULONG i;
+
+	if ((!device_extension->cache.open) && (!spill_pending(&device_extension->spill))) {
+		return;
+	}
+
+	if (context->operation == REQUEST_WRITE) {
+		claim_range(device_extension, context->offset, context->length);
+	} else if (context->operation == REQUEST_BATCH_WRITE) {
+		entries = (RAMDISK_BATCH_ENTRY *) (context->batch + 1);
+
+		for (i = 0; i < context->batch->count; i++) {
+			if (entries[i].operation == RAMDISK_BATCH_WRITE) {
+				claim_range(device_extension, entries[i].offset, entries[i].length);
+			}
+		}
+	}
+}
+
+void claim_range(__in DEVICE_EXTENSION *device_extension, __in ULONGLONG offset, __in ULONGLONG length)
+{
+	/* The chunks which are completely overwritten don't have to be read (cache) or read back (spill). */
+	if (device_extension->cache.open) {
+		cache_claim(&device_extension->cache, &device_extension->chunk_table, offset, length);
+	}
+
+	if (spill_pending(&device_extension->spill)) {
+		spill_claim(&device_extension->spill, &device_extension->chunk_table, offset, length);
+	}
+}
+
+BOOLEAN chunks_loaded(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context)
+{
+	RAMDISK_BATCH_ENTRY *entries;
+	ULONG i;
+
+	if ((context->operation != REQUEST_BATCH_READ) && (context->operation != REQUEST_BATCH_WRITE)) {
+		return chunk_table_is_loaded(&device_extension->chunk_table, context->offset, context->length);
+	}
+
+	/* Only the chunks of the descriptors, not those in between. */
+	entries = (RAMDISK_BATCH_ENTRY *) (context->batch + 1);
+
+	for (i = 0; i < context->batch->count; i++) {
+		if ((entries[i].length > 0) && (!chunk_table_is_loaded(&device_extension->chunk_table, entries[i].offset, entries[i].length))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+NTSTATUS load_chunks(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context)
+{
+	RAMDISK_BATCH_ENTRY *entries;
+	ULONG i;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	if ((context->operation != REQUEST_BATCH_READ) && (context->operation != REQUEST_BATCH_WRITE)) {
+		return load_range(device_extension, context->range.start, context->range.end - context->range.start);
+	}
+
+	entries = (RAMDISK_BATCH_ENTRY *) (context->batch + 1);
+
+	for (i = 0; i < context->batch->count; i++) {
+		if (entries[i].length > 0) {
+			status = load_range(device_extension, entries[i].offset, entries[i].length);
+			if (!NT_SUCCESS(status)) {
+				return status;
+			}
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS load_range(__in DEVICE_EXTENSION *device_extension, __in ULONGLONG offset, __in ULONGLONG length)
+{
+	PAGED_CODE();
+
+	if (device_extension->cache.open) {
+		return cache_load(&device_extension->cache, &device_extension->chunk_table, offset, length, device_extension->load_buffer);
+	} else if (device_extension->spill.open) {
+		return spill_load(&device_extension->spill, &device_extension->chunk_table, offset, length, device_extension->load_buffer);
+	} else {
+		return image_loader_load(&device_extension->image_loader, &device_extension->chunk_table, offset, length, device_extension->load_buffer);
+	}
+}
+
+NTSTATUS restore_image(__in DEVICE_EXTENSION *device_extension)
+{
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	/* The image file stays open for the checkpoints. */
+	status = image_open(&device_extension->image, &device_extension->disk_info.image_file);
+	if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+		/* The image will be created when saved. */
+		device_extension->save_image = TRUE;
+		return STATUS_SUCCESS;
+	}
+
+	if (NT_SUCCESS(status)) {
+		/* Lazy loading: only the header and the bitmap have been read. */
+		if (device_extension->disk_info.lazy_load) {
+			status = image_loader_init(&device_extension->image_loader, &device_extension->image, &device_extension->chunk_table, device_extension->disk_info.disk_size);
+			if (NT_SUCCESS(status)) {
+				KdPrint(("Loading %I64d chunks from %wZ on demand.\n", device_extension->image_loader.remaining, &device_extension->disk_info.image_file));
+
+				device_extension->load_start = KeQueryInterruptTime();
+				device_extension->save_image = TRUE;
+				return STATUS_SUCCESS;
+			}
+
+			/* Otherwise, load it now (it might have another chunk size). */
+		}
+
+		status = image_restore(&device_extension->chunk_table, device_extension->disk_info.disk_size, &device_extension->image);
+		if (NT_SUCCESS(status)) {
+			KdPrint(("Disk image restored from %wZ.\n", &device_extension->disk_info.image_file));
+
+			device_extension->save_image = TRUE;
+			return STATUS_SUCCESS;
+		}
+
+		image_close(&device_extension->image);
+	}
+
+	/* Don't overwrite an image which couldn't be read, it might still be good. */
+	KdPrint(("The disk image cannot be restored from %wZ (0x%08x).\n", &device_extension->disk_info.image_file, status));
+
+	/* Start with an empty disk. */
+	chunk_table_free(&device_extension->chunk_table);
+
+	status = chunk_table_init(&device_extension->chunk_table, device_extension->disk_info.disk_size, DEFAULT_CHUNK_SHIFT);
+	if (NT_SUCCESS(status)) {
+		chunk_table_set_quota(&device_extension->chunk_table, &device_extension->quota);
+		chunk_table_set_numa(&device_extension->chunk_table, device_extension->disk_info.numa_policy, device_extension->disk_info.numa_stripe);
+	}
+
+	return status;
+}
+
+NTSTATUS create_load_objects(__in WDFDEVICE device)
+{
+	DEVICE_EXTENSION *device_extension;
+	WDF_IO_QUEUE_CONFIG io_queue_config;
+	WDF_OBJECT_ATTRIBUTES queue_attributes;
+	OBJECT_ATTRIBUTES thread_attributes;
+	HANDLE thread;
+	ULONG buffer_size;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	device_extension = DeviceGetExtension(device);
+
+	if (device_extension->cache.open) {
+		buffer_size = device_extension->cache.buffer_size;
+	} else if (device_extension->spill.open) {
+		buffer_size = device_extension->spill.buffer_size;
+	} else {
+		buffer_size = device_extension->image_loader.buffer_size;
+	}
+
+	if ((device_extension->load_buffer = port_alloc(buffer_size)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	/* The requests touching chunks which are not loaded yet are forwarded to this queue. */
+	WDF_IO_QUEUE_CONFIG_INIT(&io_queue_config, WdfIoQueueDispatchSequential);
+
+	io_queue_config.EvtIoDefault = EvtIoLoad;
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queue_attributes, QUEUE_EXTENSION);
+	queue_attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+	status = WdfIoQueueCreate(device, &io_queue_config, &queue_attributes, &device_extension->load_queue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	QueueGetExtension(device_extension->load_queue)->device_extension = device_extension;
+
+	/* Load the rest of the image in the background (a cache only reads what is used). */
+	if (!image_loader_pending(&device_extension->image_loader)) {
+		return STATUS_SUCCESS;
+	}
+
+	InitializeObjectAttributes(&thread_attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, &thread_attributes, NULL, NULL, prefetch, device_extension);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, NULL, KernelMode, (PVOID *) &device_extension->prefetch_thread, NULL);
+
+	ZwClose(thread);
+
+	return status;
+}
+
+void EvtIoLoad(__in WDFQUEUE queue, __in WDFREQUEST request)
+{
+	DEVICE_EXTENSION *device_extension;
+	REQUEST_CONTEXT *context;
+	RANGE_LOCK_ENTRY *granted;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	device_extension = QueueGetExtension(queue)->device_extension;
+	context = RequestGetContext(request);
+
+	/* The request still has its range, nobody else is using those chunks. */
+	if ((device_extension->cache.open) &&
+		((context->operation == REQUEST_WRITE) || (context->operation == REQUEST_BATCH_WRITE)) &&
+		(!context->throttled)) {
+		throttle_writes(device_extension);
+
+		context->throttled = TRUE;
+
+		claim_chunks(device_extension, context);
+	}
+
+	status = load_chunks(device_extension, context);
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("The chunks cannot be loaded (0x%08x).\n", status));
+
+		granted = range_lock_release(&device_extension->range_lock, &context->range);
+
+		complete_request(device_extension, request, status, 0);
+
+		if (granted) {
+			execute_requests(device_extension, granted);
+		}
+
+		return;
+	}
+
+	/* Execute it as if it had just been granted (it has left the chain it was granted with). */
+	context->range.next_granted = NULL;
+
+	execute_requests(device_extension, &context->range);
+}
+
+void prefetch(__in PVOID context)
+{
+	DEVICE_EXTENSION *device_extension;
+	RANGE_LOCK_ENTRY entry;
+	RANGE_LOCK_ENTRY *granted;
+	LARGE_INTEGER backoff;
+	ULONGLONG offset;
+	ULONGLONG length;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	device_extension = (DEVICE_EXTENSION *) context;
+
+	/* Stay out of the way of the requests. */
+	KeSetPriorityThread(KeGetCurrentThread(), PREFETCH_PRIORITY);
+
+	backoff.QuadPart = -10000LL * PREFETCH_BACKOFF;
+
+	if ((buffer = port_alloc(device_extension->image_loader.buffer_size)) == NULL) {
+		PsTerminateSystemThread(STATUS_INSUFFICIENT_RESOURCES);
+	}
+
+	while ((!device_extension->stop_prefetch) && (image_loader_pending(&device_extension->image_loader))) {
+		if (!image_loader_next(&device_extension->image_loader, &device_extension->chunk_table, &offset, &length)) {
+			break;
+		}
+
+		/* The chunks with I/O are being loaded by the load queue, come back later. */
+		if (!range_lock_try_acquire(&device_extension->range_lock, &entry, offset, offset + length, TRUE)) {
+			KeDelayExecutionThread(KernelMode, FALSE, &backoff);
+			continue;
+		}
+
+		status = image_loader_load(&device_extension->image_loader, &device_extension->chunk_table, offset, length, buffer);
+
+		/* Execute the requests which arrived in the meantime. */
+		if ((granted = range_lock_release(&device_extension->range_lock, &entry)) != NULL) {
+			execute_requests(device_extension, granted);
+		}
+
+		if (!NT_SUCCESS(status)) {
+			KdPrint(("Prefetching failed (0x%08x).\n", status));
+			break;
+		}
+	}
+
+	if (!image_loader_pending(&device_extension->image_loader)) {
+		KdPrint(("Disk image loaded in %I64u ms.\n", (KeQueryInterruptTime() - device_extension->load_start) / 10000));
+	}
+
+	port_free(buffer);
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS load_image(__in DEVICE_EXTENSION *device_extension)
+{
+	ULONGLONG offset;
+	ULONGLONG length;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	/* The caller has the whole disk, the load queue is idle. */
+	while (image_loader_next(&device_extension->image_loader, &device_extension->chunk_table, &offset, &length)) {
+		status = image_loader_load(&device_extension->image_loader, &device_extension->chunk_table, offset, length, device_extension->load_buffer);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS save_image(__in DEVICE_EXTENSION *device_extension)
+{
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	if (!device_extension->save_image) {
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	KeWaitForSingleObject(&device_extension->image_mutex, Executive, KernelMode, FALSE, NULL);
+
+	/* The backing file of a cache only lacks the dirty chunks. */
+	if (device_extension->cache.open) {
+		status = flush_cache(device_extension, TRUE);
+	} else {
+		status = write_image(device_extension);
+	}
+
+	KeReleaseMutex(&device_extension->image_mutex, FALSE);
+
+	return status;
+}
+
+NTSTATUS checkpoint_image(__in DEVICE_EXTENSION *device_extension)
+{
+	IMAGE_FILE *image;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	if (!device_extension->save_image) {
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	KeWaitForSingleObject(&device_extension->image_mutex, Executive, KernelMode, FALSE, NULL);
+
+	image = &device_extension->image;
+
+	/* The chunks can only be written in place if the image has the same layout as the disk. */
+	if (device_extension->cache.open) {
+		status = flush_cache(device_extension, TRUE);
+	} else if ((image->open) &&
+		(image->header.chunk_shift == device_extension->chunk_table.chunk_shift) &&
+		(image->header.disk_size == device_extension->disk_info.disk_size)) {
+		status = write_dirty_chunks(device_extension);
+	} else {
+		status = write_image(device_extension);
+	}
+
+	KeReleaseMutex(&device_extension->image_mutex, FALSE);
+
+	return status;
+}
+
+NTSTATUS write_image(__in DEVICE_EXTENSION *device_extension)
+{
+	REQUEST_CONTEXT context;
+	BOOLEAN loading;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	/*
+	 * Keep the writes out while the disk is being saved. If the image is
+	 * still being loaded, the rest of it has to be loaded before the file
+	 * is overwritten, so nothing else can run.
+	 */
+	loading = image_loader_pending(&device_extension->image_loader);
+
+	wait_for_range(device_extension, &context, 0, device_extension->disk_info.disk_size, loading);
+
+	status = loading ? load_image(device_extension) : STATUS_SUCCESS;
+
+	if (NT_SUCCESS(status)) {
+		image_close(&device_extension->image);
+
+		status = image_save(&device_extension->chunk_table, device_extension->disk_info.disk_size, &device_extension->disk_info.image_file);
+	}
+
+	if (NT_SUCCESS(status)) {
+		/* Everything has been written, the next checkpoints start from here. */
+		atomic_bitmap_clear_range(&device_extension->dirty_chunks, 0, device_extension->dirty_chunks.nbits);
+
+		status = image_open(&device_extension->image, &device_extension->disk_info.image_file);
+	}
+
+	release_range(device_extension, &context);
+
+	KdPrint(("Disk image saved to %wZ (0x%08x).\n", &device_extension->disk_info.image_file, status));
+
+	return status;
+}
+
+NTSTATUS write_dirty_chunks(__in DEVICE_EXTENSION *device_extension)
+{
+	REQUEST_CONTEXT context;
+	CHUNK_TABLE *chunk_table;
+	ATOMIC_BITMAP *dirty_chunks;
+	ULONGLONG index;
+	ULONGLONG first;
+	ULONGLONG end;
+	ULONG buffer_size;
+	ULONG max_chunks;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	chunk_table = &device_extension->chunk_table;
+	dirty_chunks = &device_extension->dirty_chunks;
+
+	/* What the processes wrote through their views is not tracked. */
+	mapping_mark_dirty(&device_extension->mappings, dirty_chunks);
+
+	buffer_size = ((1UL << chunk_table->chunk_shift) > IMAGE_TRANSFER_SIZE) ? (1UL << chunk_table->chunk_shift) : IMAGE_TRANSFER_SIZE;
+	max_chunks = buffer_size >> chunk_table->chunk_shift;
+
+	if ((buffer = port_alloc(buffer_size)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = STATUS_SUCCESS;
+
+	for (index = 0; atomic_bitmap_find_set(dirty_chunks, index, &first); index = end) {
+		/* Up to a buffer of consecutive dirty chunks. */
+		for (end = first + 1; (end < dirty_chunks->nbits) && (end - first < max_chunks) && (atomic_bitmap_test(dirty_chunks, end)); end++);
+
+		/*
+		 * The reads go on, the writes wait. The bits are cleared before
+		 * copying the chunks: the writes which come after the range is
+		 * released set them again.
+		 */
+		wait_for_range(device_extension,
+					   &context,
+					   first << chunk_table->chunk_shift,
+					   ((end << chunk_table->chunk_shift) < device_extension->disk_info.disk_size) ? (end << chunk_table->chunk_shift) : device_extension->disk_info.disk_size,
+					   FALSE);
+
+		atomic_bitmap_clear_range(dirty_chunks, first, end - first);
+
+		status = image_write_chunks(&device_extension->image, chunk_table, first, end - first, buffer, buffer_size);
+		if (!NT_SUCCESS(status)) {
+			/* Try again next time. */
+			atomic_bitmap_set_range(dirty_chunks, first, end - first);
+		}
+
+		release_range(device_extension, &context);
+
+		if (!NT_SUCCESS(status)) {
+			break;
+		}
+	}
+
+	/* The bitmap goes last, it tells which chunks of the file are valid. */
+	if (NT_SUCCESS(status)) {
+		status = image_write_bitmap(&device_extension->image);
+	}
+
+	port_free(buffer);
+
+	KdPrint(("Checkpoint of %wZ (0x%08x).\n", &device_extension->disk_info.image_file, status));
+
+	return status;
+}
+
+NTSTATUS open_cache(__in DEVICE_EXTENSION *device_extension)
+{
+	DISK_INFO *disk_info;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	disk_info = &device_extension->disk_info;
+
+	status = cache_open(&device_extension->cache,
+						&device_extension->chunk_table,
+						&device_extension->dirty_chunks,
+						&disk_info->image_file,
+						disk_info->disk_size,
+						disk_info->cache_size,
+						disk_info->dirty_limit);
+
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("The backing file %wZ cannot be opened (0x%08x).\n", &disk_info->image_file, status));
+		return status;
+	}
+
+	KdPrint(("Caching %wZ in 0x%I64x bytes.\n", &disk_info->image_file, disk_info->cache_size));
+
+	/* The checkpoints and the shutdown flush the cache. */
+	device_extension->save_image = TRUE;
+
+	KeInitializeEvent(&device_extension->flush_event, SynchronizationEvent, FALSE);
+	KeInitializeEvent(&device_extension->flushed_event, NotificationEvent, FALSE);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS create_flusher(__in DEVICE_EXTENSION *device_extension)
+{
+	OBJECT_ATTRIBUTES thread_attributes;
+	HANDLE thread;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	InitializeObjectAttributes(&thread_attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, &thread_attributes, NULL, NULL, flusher, device_extension);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, NULL, KernelMode, (PVOID *) &device_extension->flusher_thread, NULL);
+
+	ZwClose(thread);
+
+	return status;
+}
+
+void flusher(__in PVOID context)
+{
+	DEVICE_EXTENSION *device_extension;
+	LARGE_INTEGER interval;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	device_extension = (DEVICE_EXTENSION *) context;
+
+	interval.QuadPart = -10000LL * device_extension->disk_info.flush_interval;
+
+	while (!device_extension->stop_flusher) {
+		/* Every interval, or as soon as the cache goes over its limits. */
+		KeWaitForSingleObject(&device_extension->flush_event, Executive, KernelMode, FALSE, &interval);
+
+		if (device_extension->stop_flusher) {
+			break;
+		}
+
+		if (device_extension->dirty_chunks.count > 0) {
+			KeWaitForSingleObject(&device_extension->image_mutex, Executive, KernelMode, FALSE, NULL);
+
+			status = flush_cache(device_extension, FALSE);
+
+			KeReleaseMutex(&device_extension->image_mutex, FALSE);
+
+			if (!NT_SUCCESS(status)) {
+				KdPrint(("The cache cannot be flushed to %wZ (0x%08x).\n", &device_extension->disk_info.image_file, status));
+			}
+		}
+
+		/* The chunks which have just been flushed can be evicted. */
+		if (cache_over_size(&device_extension->cache, &device_extension->chunk_table)) {
+			evict_chunks(device_extension);
+		}
+
+		/* Let the throttled writes go on. */
+		KeSetEvent(&device_extension->flushed_event, IO_NO_INCREMENT, FALSE);
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS flush_cache(__in DEVICE_EXTENSION *device_extension, __in BOOLEAN wait)
+{
+	REQUEST_CONTEXT context;
+	CHUNK_TABLE *chunk_table;
+	ULONGLONG index;
+	ULONGLONG first;
+	ULONGLONG end;
+	ULONGLONG start;
+	ULONGLONG stop;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	chunk_table = &device_extension->chunk_table;
+
+	if ((buffer = port_alloc(device_extension->cache.buffer_size)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = STATUS_SUCCESS;
+
+	for (index = 0; cache_next_dirty(&device_extension->cache, index, &first, &end); index = end) {
+		start = first << chunk_table->chunk_shift;
+		stop = ((end << chunk_table->chunk_shift) < device_extension->disk_info.disk_size) ? (end << chunk_table->chunk_shift) : device_extension->disk_info.disk_size;
+
+		/*
+		 * The reads go on, the writes wait. The flusher skips the runs being
+		 * written (they are flushed next time), the writes might be waiting
+		 * for it.
+		 */
+		if (wait) {
+			wait_for_range(device_extension, &context, start, stop, FALSE);
+		} else if (!range_lock_try_acquire(&device_extension->range_lock, &context.range, start, stop, FALSE)) {
+			continue;
+		}
+
+		status = cache_flush(&device_extension->cache, chunk_table, first, end, buffer);
+
+		release_range(device_extension, &context);
+
+		if (!NT_SUCCESS(status)) {
+			break;
+		}
+	}
+
+	port_free(buffer);
+
+	return status;
+}
+
+void evict_chunks(__in DEVICE_EXTENSION *device_extension)
+{
+	CHUNK_TABLE *chunk_table;
+	RANGE_LOCK_ENTRY entry;
+	RANGE_LOCK_ENTRY *granted;
+	ULONGLONG index;
+	ULONGLONG start;
+	ULONGLONG attempts;
+
+	PAGED_CODE();
+
+	chunk_table = &device_extension->chunk_table;
+
+	for (attempts = 0; (attempts < chunk_table->nchunks) && (chunk_table_memory_used(chunk_table) > cache_low_watermark(&device_extension->cache)); attempts++) {
+		if (!cache_next_victim(&device_extension->cache, chunk_table, &index)) {
+			break;
+		}
+
+		/* Skip the chunk if there is I/O on it. */
+		start = index << chunk_table->chunk_shift;
+		if (!range_lock_try_acquire(&device_extension->range_lock, &entry, start, start + ((ULONGLONG) 1 << chunk_table->chunk_shift), TRUE)) {
+			continue;
+		}
+
+		cache_evict(&device_extension->cache, chunk_table, index);
+
+		/* Execute the requests which arrived in the meantime. */
+		if ((granted = range_lock_release(&device_extension->range_lock, &entry)) != NULL) {
+			execute_requests(device_extension, granted);
+		}
+	}
+}
+
+void throttle_writes(__in DEVICE_EXTENSION *device_extension)
+{
+	LARGE_INTEGER timeout;
+	ULONG waits;
+
+	PAGED_CODE();
+
+	timeout.QuadPart = -10000LL * THROTTLE_WAIT;
+
+	/* Bounded, so that the writes go on even if the backing file cannot be written. */
+	for (waits = 0; (waits < THROTTLE_MAX_WAITS) && (cache_over_dirty_limit(&device_extension->cache)); waits++) {
+		KeClearEvent(&device_extension->flushed_event);
+		KeSetEvent(&device_extension->flush_event, IO_NO_INCREMENT, FALSE);
+
+		KeWaitForSingleObject(&device_extension->flushed_event, Executive, KernelMode, FALSE, &timeout);
+	}
+}
+
+NTSTATUS open_spill(__in DEVICE_EXTENSION *device_extension)
+{
+	DISK_INFO *disk_info;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	disk_info = &device_extension->disk_info;
+
+	status = spill_open(&device_extension->spill, &device_extension->chunk_table, &disk_info->spill_file, disk_info->min_resident);
+	if (!NT_SUCCESS(status)) {
+		KdPrint(("The spill file %wZ cannot be created (0x%08x).\n", &disk_info->spill_file, status));
+		return status;
+	}
+
+	/* Allocating the buffer when memory is short might fail. */
+	if ((device_extension->spill_work = port_alloc(sizeof(SPILL_WORK))) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if ((device_extension->spill_work->buffer = port_alloc(device_extension->spill.buffer_size)) == NULL) {
+		port_free(device_extension->spill_work);
+		device_extension->spill_work = NULL;
+
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	KdPrint(("Spilling cold chunks to %wZ under memory pressure.\n", &disk_info->spill_file));
+
+	return STATUS_SUCCESS;
+}
+
+void spill_cold_chunks(__in DEVICE_EXTENSION *device_extension)
+{
+	DRIVER_EXTENSION *driver_extension;
+	CHUNK_TABLE *chunk_table;
+	SPILL_WORK *work;
+	RANGE_LOCK_ENTRY *granted;
+	ULONGLONG target;
+	ULONGLONG index;
+	ULONGLONG start;
+	ULONGLONG attempts;
+	ULONG count;
+	ULONG i;
+	BOOLEAN pressure;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	driver_extension = DriverGetExtension(WdfGetDriver());
+	chunk_table = &device_extension->chunk_table;
+	work = device_extension->spill_work;
+
+	pressure = (BOOLEAN) ((driver_extension->low_memory) && (KeReadStateEvent(driver_extension->low_memory)));
+
+	target = spill_target(&device_extension->spill, chunk_table_memory_used(chunk_table), pressure);
+
+	for (attempts = 0; (attempts < chunk_table->nchunks) && (chunk_table_memory_used(chunk_table) > target); ) {
+		/* A batch of cold chunks without I/O, locked until they are in the file. */
+		for (count = 0;
+			 (count < SPILL_MAX_BATCH) && (attempts < chunk_table->nchunks) &&
+			 (chunk_table_memory_used(chunk_table) > target + ((ULONGLONG) count << chunk_table->chunk_shift));
+			 attempts++) {
+			if (!spill_next_victim(&device_extension->spill, chunk_table, &index)) {
+				attempts = chunk_table->nchunks;
+				break;
+			}
+
+			start = index << chunk_table->chunk_shift;
+			if (range_lock_try_acquire(&device_extension->range_lock, &work->entries[count], start, start + ((ULONGLONG) 1 << chunk_table->chunk_shift), TRUE)) {
+				work->indexes[count++] = index;
+			}
+		}
+
+		if (count == 0) {
+			break;
+		}
+
+		status = spill_chunks(&device_extension->spill, chunk_table, work->indexes, count, work->buffer);
+
+		/* Execute the requests which arrived in the meantime (they fault the chunks back). */
+		for (i = 0; i < count; i++) {
+			if ((granted = range_lock_release(&device_extension->range_lock, &work->entries[i])) != NULL) {
+				execute_requests(device_extension, granted);
+			}
+		}
+
+		if (!NT_SUCCESS(status)) {
+			KdPrint(("The chunks cannot be spilled to %wZ (0x%08x).\n", &device_extension->disk_info.spill_file, status));
+			break;
+		}
+	}
+}
+
+NTSTATUS create_clone(__in DEVICE_EXTENSION *device_extension, __in BOOLEAN read_only, __out ULONG *number)
+{
+	DRIVER_EXTENSION *driver_extension;
+	DEVICE_EXTENSION *clone_extension;
+	REQUEST_CONTEXT context;
+	PWDFDEVICE_INIT device_init;
+	WDFDEVICE device;
+	WDFQUEUE queue;
+	WDF_OBJECT_ATTRIBUTES device_attributes;
+	WDF_OBJECT_ATTRIBUTES request_attributes;
+	UNICODE_STRING link_name;
+	WCHAR link_name_buffer[MAX_DEVICE_NAME];
+	WCHAR device_name_buffer[MAX_DEVICE_NAME];
+	UNICODE_STRING device_name;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	/* The chunks of a cache, or of a disk which spills, come and go. */
+	if ((device_extension->cache.open) || (device_extension->spill.open)) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	driver_extension = DriverGetExtension(WdfGetDriver());
+
+	*number = (ULONG) InterlockedIncrement(&driver_extension->last_clone);
+
+	RtlInitEmptyUnicodeString(&device_name, device_name_buffer, sizeof(device_name_buffer));
+	RtlInitEmptyUnicodeString(&link_name, link_name_buffer, sizeof(link_name_buffer));
+
+	status = RtlUnicodeStringPrintf(&device_name, CLONE_DEVICE_NAME, *number);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = RtlUnicodeStringPrintf(&link_name, CLONE_LINK_NAME, *number);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* The clones are not PnP devices: they come and go with the IOCTLs. */
+	if ((device_init = WdfControlDeviceInitAllocate(WdfGetDriver(), &SDDL_DEVOBJ_SYS_ALL_ADM_ALL)) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = WdfDeviceInitAssignName(device_init, &device_name);
+	if (!NT_SUCCESS(status)) {
+		WdfDeviceInitFree(device_init);
+		return status;
+	}
+
+	status = assign_mapping_callbacks(device_init);
+	if (!NT_SUCCESS(status)) {
+		WdfDeviceInitFree(device_init);
+		return status;
+	}
+
+	WdfDeviceInitSetDeviceType(device_init, FILE_DEVICE_DISK);
+	WdfDeviceInitSetIoType(device_init, WdfDeviceIoDirect);
+	WdfDeviceInitSetExclusive(device_init, FALSE);
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&request_attributes, REQUEST_CONTEXT);
+	WdfDeviceInitSetRequestAttributes(device_init, &request_attributes);
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&device_attributes, DEVICE_EXTENSION);
+	device_attributes.EvtCleanupCallback = EvtCleanupCallback;
+
+	status = WdfDeviceCreate(&device_init, &device_attributes, &device);
+	if (!NT_SUCCESS(status)) {
+		WdfDeviceInitFree(device_init);
+		return status;
+	}
+
+	/* From now on, everything is freed by EvtCleanupCallback when the device is deleted. */
+	clone_extension = DeviceGetExtension(device);
+
+	RtlInitEmptyUnicodeString(&clone_extension->device_name, clone_extension->device_name_buffer, sizeof(clone_extension->device_name_buffer));
+	RtlCopyUnicodeString(&clone_extension->device_name, &device_name);
+
+	clone_extension->disk_number = device_extension->disk_number;
+	clone_extension->clone_number = *number;
+	clone_extension->read_only = read_only;
+
+	mapping_set_init(&clone_extension->mappings);
+
+	clone_extension->disk_info.disk_size = device_extension->disk_info.disk_size;
+	clone_extension->disk_info.cpus_per_queue = device_extension->disk_info.cpus_per_queue;
+	clone_extension->disk_info.memory_budget = device_extension->disk_info.memory_budget;
+	clone_extension->disk_info.quota = device_extension->disk_info.quota;
+	clone_extension->disk_info.trace_records = device_extension->disk_info.trace_records;
+	clone_extension->disk_info.numa_policy = device_extension->disk_info.numa_policy;
+	clone_extension->disk_info.numa_stripe = device_extension->disk_info.numa_stripe;
+	clone_extension->disk_info.partition_type = device_extension->disk_info.partition_type;
+	clone_extension->disk_info.sector_size = device_extension->disk_info.sector_size;
+	clone_extension->disk_info.physical_sector_size = device_extension->disk_info.physical_sector_size;
+
+	range_lock_init(&clone_extension->range_lock);
+
+	status = WdfDeviceCreateSymbolicLink(device, &link_name);
+	if (!NT_SUCCESS(status)) {
+		WdfObjectDelete(device);
+		return status;
+	}
+
+	status = cpu_queues_init(&clone_extension->cpu_queues, port_cpu_count(), clone_extension->disk_info.cpus_per_queue, clone_extension->disk_info.trace_records);
+	if (!NT_SUCCESS(status)) {
+		WdfObjectDelete(device);
+		return status;
+	}
+
+	clone_extension->timestamp_frequency = port_timestamp_frequency();
+
+	/*
+	 * Only the chunk descriptors are copied, with the disk locked. The
+	 * chunks still in the image file have to be loaded first.
+	 */
+	wait_for_range(device_extension, &context, 0, device_extension->disk_info.disk_size, TRUE);
+
+	status = image_loader_pending(&device_extension->image_loader) ? load_image(device_extension) : STATUS_SUCCESS;
+
+	if (NT_SUCCESS(status)) {
+		status = chunk_table_clone(&clone_extension->chunk_table, &device_extension->chunk_table);
+	}
+
+	release_range(device_extension, &context);
+
+	if (!NT_SUCCESS(status)) {
+		WdfObjectDelete(device);
+		return status;
+	}
+
+	set_disk_geometry(clone_extension);
+
+	if (clone_extension->disk_info.memory_budget > 0) {
+		status = chunk_table_enable_compression(&clone_extension->chunk_table);
+		if (NT_SUCCESS(status)) {
+			status = create_compression_objects(device);
+		}
+
+		if (!NT_SUCCESS(status)) {
+			WdfObjectDelete(device);
+			return status;
+		}
+	}
+
+	status = create_queues(device, &queue);
+	if (!NT_SUCCESS(status)) {
+		WdfObjectDelete(device);
+		return status;
+	}
+
+	WdfWaitLockAcquire(driver_extension->lock, NULL);
+	status = WdfCollectionAdd(driver_extension->clones, device);
+	WdfWaitLockRelease(driver_extension->lock);
+
+	if (!NT_SUCCESS(status)) {
+		WdfObjectDelete(device);
+		return status;
+	}
+
+	WdfControlFinishInitializing(device);
+
+	if (clone_extension->compression_timer) {
+		WdfTimerStart(clone_extension->compression_timer, WDF_REL_TIMEOUT_IN_MS(COMPRESSION_PERIOD));
+	}
+
+	KdPrint(("%wZ created (%s, %ld shared chunks).\n", &device_name, read_only ? "snapshot" : "clone", clone_extension->chunk_table.nshared));
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS delete_clone(__in ULONG number)
+{
+	DRIVER_EXTENSION *driver_extension;
+	WDFDEVICE device;
+	ULONG count;
+	ULONG i;
+
+	PAGED_CODE();
+
+	driver_extension = DriverGetExtension(WdfGetDriver());
+
+	WdfWaitLockAcquire(driver_extension->lock, NULL);
+
+	count = WdfCollectionGetCount(driver_extension->clones);
+
+	for (i = 0; i < count; i++) {
+		device = (WDFDEVICE) WdfCollectionGetItem(driver_extension->clones, i);
+
+		if (DeviceGetExtension(device)->clone_number == number) {
+			break;
+		}
+	}
+
+	/* The chunks of the views must stay until the processes let them go. */
+	if ((i < count) && (mapping_count(&DeviceGetExtension(device)->mappings) > 0)) {
+		WdfWaitLockRelease(driver_extension->lock);
+		return STATUS_DEVICE_BUSY;
+	}
+
+	if (i < count) {
+		WdfCollectionRemoveItem(driver_extension->clones, i);
+	}
+
+	WdfWaitLockRelease(driver_extension->lock);
+
+	if (i == count) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* The chunks shared with other disks are freed with their last reference. */
+	WdfObjectDelete(device);
+
+	return STATUS_SUCCESS;
+}
+
+void delete_clones(__in ULONG disk_number)
+{
+	DRIVER_EXTENSION *driver_extension;
+	WDFDEVICE device;
+	ULONG count;
+	ULONG i;
+
+	PAGED_CODE();
+
+	driver_extension = DriverGetExtension(WdfGetDriver());
+
+	/* Clones of clones have the number of the disk too. */
+	for (;;) {
+		WdfWaitLockAcquire(driver_extension->lock, NULL);
+
+		count = WdfCollectionGetCount(driver_extension->clones);
+
+		for (i = 0, device = NULL; i < count; i++) {
+			device = (WDFDEVICE) WdfCollectionGetItem(driver_extension->clones, i);
+
+			if (DeviceGetExtension(device)->disk_number == disk_number) {
+				WdfCollectionRemoveItem(driver_extension->clones, i);
+				break;
+			}
+
+			device = NULL;
+		}
+
+		WdfWaitLockRelease(driver_extension->lock);
+
+		if (!device) {
+			break;
+		}
+
+		WdfObjectDelete(device);
+	}
+}
+
+NTSTATUS assign_disk_number(__out ULONG *number)
+{
+	DRIVER_EXTENSION *driver_extension;
+
+	PAGED_CODE();
+
+	driver_extension = DriverGetExtension(WdfGetDriver());
+
+	WdfWaitLockAcquire(driver_extension->lock, NULL);
+
+	/* Lowest number free, so that the disks get the same parameters when they are added again. */
+	for (*number = 0; (*number < MAX_DISKS) && (driver_extension->disks & (1UL << *number)); (*number)++);
+
+	if (*number < MAX_DISKS) {
+		driver_extension->disks |= 1UL << *number;
+	}
+
+	WdfWaitLockRelease(driver_extension->lock);
+
+	if (*number == MAX_DISKS) {
+		KdPrint(("Too many disks (%lu).\n", MAX_DISKS));
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void release_disk_number(__in ULONG number)
+{
+	DRIVER_EXTENSION *driver_extension;
 
 	PAGED_CODE();
 
-	/* Get the disk parameters from the registry. */
-	query_disk_parameters(WdfDriverGetRegistryPath(driver), &disk_info);
+	driver_extension = DriverGetExtension(WdfGetDriver());
 
-	/* Allocate memory for the disk image. */
-	if ((disk_image = ExAllocatePoolWithTag(NonPagedPool, disk_info.disk_size, RAMDISK_TAG)) == NULL) {
-		return STATUS_INSUFFICIENT_RESOURCES;
+	WdfWaitLockAcquire(driver_extension->lock, NULL);
+	driver_extension->disks &= ~(1UL << number);
+	WdfWaitLockRelease(driver_extension->lock);
+}
+
+NTSTATUS resize_disk(__in DEVICE_EXTENSION *device_extension, __in ULONGLONG disk_size)
+{
+	CHUNK_TABLE_RESIZE resize;
+	ATOMIC_BITMAP dirty_chunks;
+	ATOMIC_BITMAP old_dirty_chunks;
+	REQUEST_CONTEXT context;
+	ULONGLONG nchunks;
+	ULONGLONG end;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	if ((disk_size == 0) || (disk_size & (device_extension->disk_geometry.BytesPerSector - 1))) {
+		return STATUS_INVALID_PARAMETER;
 	}
 
-	/* Assign a device name. */
-	status = WdfDeviceInitAssignName(device_init, &nt_name);
-	if (!NT_SUCCESS(status)) {
-		ExFreePoolWithTag(disk_image, RAMDISK_TAG);
-		return status;
+	if (device_extension->read_only) {
+		return STATUS_MEDIA_WRITE_PROTECTED;
 	}
 
-	WdfDeviceInitSetDeviceType(device_init, FILE_DEVICE_DISK);
-	WdfDeviceInitSetIoType(device_init, WdfDeviceIoDirect);
-	WdfDeviceInitSetExclusive(device_init, FALSE);
+	/* The backing file of a cache has the size of the disk, the spill file a slot per chunk. */
+	if ((device_extension->cache.open) || (device_extension->spill.open)) {
+		return STATUS_NOT_SUPPORTED;
+	}
 
-	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&device_attributes, DEVICE_EXTENSION);
-	device_attributes.EvtCleanupCallback = EvtCleanupCallback;
+	/* The chunks still in the image file would have to be loaded with the I/O stopped. */
+	if (image_loader_pending(&device_extension->image_loader)) {
+		return STATUS_DEVICE_BUSY;
+	}
 
-	/* Create device object. */
-	status = WdfDeviceCreate(&device_init, &device_attributes, &device);
-	if (!NT_SUCCESS(status)) {
-		ExFreePoolWithTag(disk_image, RAMDISK_TAG);
-		return status;
+	/* The prefetch thread might still be looking at the chunk descriptors. */
+	if (device_extension->prefetch_thread) {
+		KeWaitForSingleObject(device_extension->prefetch_thread, Executive, KernelMode, FALSE, NULL);
 	}
 
-	/* Create a device interface. */
-	status = WdfDeviceCreateDeviceInterface(device, &MOUNTDEV_MOUNTED_DEVICE_GUID, NULL);
+	/* No checkpoints meanwhile. */
+	KeWaitForSingleObject(&device_extension->image_mutex, Executive, KernelMode, FALSE, NULL);
+
+	/* Allocate everything while the I/O goes on. */
+	status = chunk_table_prepare_resize(&device_extension->chunk_table, disk_size, &resize);
 	if (!NT_SUCCESS(status)) {
-		ExFreePoolWithTag(disk_image, RAMDISK_TAG);
+		KeReleaseMutex(&device_extension->image_mutex, FALSE);
 		return status;
 	}
 
-	/* Configure the default queue. */
-	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&io_queue_config, WdfIoQueueDispatchSequential);
+	nchunks = (disk_size + ((ULONGLONG) 1 << device_extension->chunk_table.chunk_shift) - 1) >> device_extension->chunk_table.chunk_shift;
 
-	io_queue_config.EvtIoRead = EvtIoRead;
-	io_queue_config.EvtIoWrite = EvtIoWrite;
-	io_queue_config.EvtIoDeviceControl = EvtIoDeviceControl;
+	RtlZeroMemory(&dirty_chunks, sizeof(dirty_chunks));
 
-	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queue_attributes, QUEUE_EXTENSION);
+	if (device_extension->dirty_chunks.words) {
+		status = atomic_bitmap_init(&dirty_chunks, nchunks);
+		if (!NT_SUCCESS(status)) {
+			chunk_table_end_resize(&resize);
+			KeReleaseMutex(&device_extension->image_mutex, FALSE);
+			return status;
+		}
 
-	/* Create I/O queue. */
-	status = WdfIoQueueCreate(device, &io_queue_config, &queue_attributes, &queue);
-	if (!NT_SUCCESS(status)) {
-		ExFreePoolWithTag(disk_image, RAMDISK_TAG);
-		return status;
+		/* The image no longer has the size of the disk: the next checkpoint writes everything. */
+		atomic_bitmap_set_range(&dirty_chunks, 0, nchunks);
 	}
 
-	status = SetForwardProgressOnQueue(queue);
-	if (!NT_SUCCESS(status)) {
-		ExFreePoolWithTag(disk_image, RAMDISK_TAG);
-		return status;
+	/* The compression walks the chunk descriptors without the range lock. */
+	if (device_extension->compression_timer) {
+		WdfTimerStop(device_extension->compression_timer, TRUE);
+		WdfWorkItemFlush(device_extension->compression_work_item);
 	}
 
-	device_extension = DeviceGetExtension(device);
-	queue_extension = QueueGetExtension(queue);
+	/* Stop the I/O; the requests validated with either size wait. */
+	end = chunk_table_size(&device_extension->chunk_table);
+	if (end < (nchunks << device_extension->chunk_table.chunk_shift)) {
+		end = nchunks << device_extension->chunk_table.chunk_shift;
+	}
 
-	queue_extension->device_extension = device_extension;
+	wait_for_range(device_extension, &context, 0, end, TRUE);
 
-	/* Set up the device extension. */
-	device_extension->disk_image = disk_image;
+	status = chunk_table_resize(&device_extension->chunk_table, &resize);
+	if (NT_SUCCESS(status)) {
+		if (dirty_chunks.words) {
+			old_dirty_chunks = device_extension->dirty_chunks;
+			device_extension->dirty_chunks = dirty_chunks;
+			dirty_chunks = old_dirty_chunks;
+		}
 
-	device_extension->disk_info.disk_size = disk_info.disk_size;
+		device_extension->disk_info.disk_size = disk_size;
 
-	set_disk_geometry(device_extension);
+		set_disk_geometry(device_extension);
+	}
 
-	return STATUS_SUCCESS;
+	release_range(device_extension, &context);
+
+	if (device_extension->compression_timer) {
+		WdfTimerStart(device_extension->compression_timer, WDF_REL_TIMEOUT_IN_MS(COMPRESSION_PERIOD));
+	}
+
+	chunk_table_end_resize(&resize);
+	atomic_bitmap_free(&dirty_chunks);
+
+	KeReleaseMutex(&device_extension->image_mutex, FALSE);
+
+	KdPrint(("Resize of %wZ to 0x%I64x bytes (0x%08x).\n", &device_extension->device_name, disk_size, status));
+
+	return status;
 }
 
-void EvtCleanupCallback(__in WDFOBJECT device)
+NTSTATUS read_trace(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __out ULONG_PTR *information)
 {
-	DEVICE_EXTENSION *device_extension;
+	RAMDISK_TRACE *trace;
+	size_t length;
+	size_t count;
+	NTSTATUS status;
 
 	PAGED_CODE();
 
-	device_extension = DeviceGetExtension(device);
+	*information = 0;
+
+	if (!device_extension->disk_info.trace_records) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(request, sizeof(RAMDISK_TRACE), &trace, &length);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
 
-	if (device_extension->disk_image) {
-		ExFreePoolWithTag(device_extension->disk_image, RAMDISK_TAG);
+	/* As many records as fit after the header. */
+	count = (length - sizeof(RAMDISK_TRACE)) / sizeof(RAMDISK_TRACE_RECORD);
+	if (count > MAXULONG) {
+		count = MAXULONG;
 	}
+
+	trace->version = RAMDISK_TRACE_VERSION;
+	trace->frequency = device_extension->timestamp_frequency;
+	trace->lost = 0;
+	trace->nrecords = cpu_queues_read_trace(&device_extension->cpu_queues, (RAMDISK_TRACE_RECORD *) (trace + 1), (ULONG) count, &trace->lost);
+
+	*information = sizeof(RAMDISK_TRACE) + ((ULONG_PTR) trace->nrecords * sizeof(RAMDISK_TRACE_RECORD));
+
+	return STATUS_SUCCESS;
 }
 
-void EvtIoRead(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_t length)
+void EvtIoPassiveDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_t output_buffer_length, __in size_t input_buffer_length, __in ULONG code)
 {
-	WDF_REQUEST_PARAMETERS parameters;
 	DEVICE_EXTENSION *device_extension;
-	LARGE_INTEGER offset;
-	WDFMEMORY hMemory;
+	RAMDISK_CLONE *clone;
+	RAMDISK_RESIZE *resize;
+	ULONG_PTR information;
 	NTSTATUS status;
 
-	__analysis_assume(length > 0);
-
-	/* Retrieve the parameters associated with the request. */
-	WDF_REQUEST_PARAMETERS_INIT(&parameters);
-	WdfRequestGetParameters(request, &parameters);
+	UNREFERENCED_PARAMETER(output_buffer_length);
+	UNREFERENCED_PARAMETER(input_buffer_length);
 
-	offset.QuadPart = parameters.Parameters.Read.DeviceOffset;
+	PAGED_CODE();
 
 	device_extension = QueueGetExtension(queue)->device_extension;
 
-	if (!check_parameters(device_extension, offset, length)) {
-		WdfRequestCompleteWithInformation(request, STATUS_INVALID_PARAMETER, (ULONG_PTR) length);
-		return;
-	}
+	information = 0;
 
-	/* Retrieve a handle to the memory object that represents the request's output buffer. */
-	status = WdfRequestRetrieveOutputMemory(request, &hMemory);
-	if (!NT_SUCCESS(status)){
-		WdfRequestCompleteWithInformation(request, status, (ULONG_PTR) length);
-		return;
+	switch (code) {
+		case IOCTL_RAMDISK_SAVE_IMAGE:
+			status = save_image(device_extension);
+			break;
+		case IOCTL_RAMDISK_CHECKPOINT:
+			status = checkpoint_image(device_extension);
+			break;
+		case IOCTL_RAMDISK_SNAPSHOT:
+		case IOCTL_RAMDISK_CLONE:
+			status = WdfRequestRetrieveOutputBuffer(request, sizeof(RAMDISK_CLONE), &clone, NULL);
+			if (!NT_SUCCESS(status)) {
+				break;
+			}
+
+			status = create_clone(device_extension, (BOOLEAN) (code == IOCTL_RAMDISK_SNAPSHOT), &clone->number);
+			if (NT_SUCCESS(status)) {
+				information = sizeof(RAMDISK_CLONE);
+			}
+
+			break;
+		case IOCTL_RAMDISK_DELETE_CLONE:
+			status = WdfRequestRetrieveInputBuffer(request, sizeof(RAMDISK_CLONE), &clone, NULL);
+			if (!NT_SUCCESS(status)) {
+				break;
+			}
+
+			/* A clone cannot delete itself from its own queue. */
+			if (clone->number == device_extension->clone_number) {
+				status = STATUS_INVALID_DEVICE_REQUEST;
+				break;
+			}
+
+			status = delete_clone(clone->number);
+			break;
+		case IOCTL_RAMDISK_RESIZE:
+			status = WdfRequestRetrieveInputBuffer(request, sizeof(RAMDISK_RESIZE), &resize, NULL);
+			if (!NT_SUCCESS(status)) {
+				break;
+			}
+
+			status = resize_disk(device_extension, resize->disk_size);
+			break;
+		case IOCTL_RAMDISK_READ_TRACE:
+			status = read_trace(device_extension, request, &information);
+			break;
+		default:
+			status = STATUS_INVALID_DEVICE_REQUEST;
 	}
 
-	/* Copy from the disk image to the memory object's buffer. */
-	status = WdfMemoryCopyFromBuffer(hMemory, 0, device_extension->disk_image + offset.LowPart, length);
+	complete_request(device_extension, request, status, information);
+}
+
+NTSTATUS EvtDeviceShutdown(__in WDFDEVICE device, __inout PIRP irp)
+{
+	PAGED_CODE();
+
+	/*
+	 * The file systems are flushed after the shutdown notifications, so the
+	 * volumes on the ramdisk should have been flushed or dismounted before.
+	 */
+	checkpoint_image(DeviceGetExtension(device));
 
-	WdfRequestCompleteWithInformation(request, status, (ULONG_PTR) length);
+	irp->IoStatus.Status = STATUS_SUCCESS;
+	irp->IoStatus.Information = 0;
+
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+
+	return STATUS_SUCCESS;
 }
 
-void EvtIoWrite(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_t length)
+void EvtCompressionTimer(__in WDFTIMER timer)
 {
-	WDF_REQUEST_PARAMETERS parameters;
 	DEVICE_EXTENSION *device_extension;
-	LARGE_INTEGER offset;
-	WDFMEMORY hMemory;
-	NTSTATUS status;
 
-	__analysis_assume(length > 0);
+	device_extension = DeviceGetExtension(WdfTimerGetParentObject(timer));
 
-	/* Retrieve the parameters associated with the request. */
-	WDF_REQUEST_PARAMETERS_INIT(&parameters);
-	WdfRequestGetParameters(request, &parameters);
+	/* The spill policy looks at the memory pressure every period. */
+	if (((device_extension->disk_info.memory_budget > 0) && (chunk_table_memory_used(&device_extension->chunk_table) > device_extension->disk_info.memory_budget)) ||
+		(device_extension->spill.open)) {
+		/* Nothing happens if the work item is already queued. */
+		WdfWorkItemEnqueue(device_extension->compression_work_item);
+	}
+}
 
-	offset.QuadPart = parameters.Parameters.Write.DeviceOffset;
+void EvtCompressionWorkItem(__in WDFWORKITEM work_item)
+{
+	DEVICE_EXTENSION *device_extension;
+	CHUNK_TABLE *chunk_table;
+	RANGE_LOCK_ENTRY entry;
+	RANGE_LOCK_ENTRY *granted;
+	ULONGLONG low_watermark;
+	ULONGLONG index;
+	ULONGLONG start;
+	ULONGLONG attempts;
 
-	device_extension = QueueGetExtension(queue)->device_extension;
+	PAGED_CODE();
 
-	if (!check_parameters(device_extension, offset, length)) {
-		WdfRequestCompleteWithInformation(request, STATUS_INVALID_PARAMETER, (ULONG_PTR) length);
-		return;
+	device_extension = DeviceGetExtension(WdfWorkItemGetParentObject(work_item));
+	chunk_table = &device_extension->chunk_table;
+
+	/* The same clock hand is used to spill, they can't run at the same time. */
+	if (device_extension->spill.open) {
+		spill_cold_chunks(device_extension);
 	}
 
-	/* Retrieve a handle to the memory object that represents the request's input buffer. */
-	status = WdfRequestRetrieveInputMemory(request, &hMemory);
-	if (!NT_SUCCESS(status)){
-		WdfRequestCompleteWithInformation(request, status, (ULONG_PTR) length);
+	if (device_extension->disk_info.memory_budget == 0) {
 		return;
 	}
 
-	/* Copy from the memory object's buffer to the disk image. */
-	status = WdfMemoryCopyToBuffer(hMemory, 0, device_extension->disk_image + offset.LowPart, length);
+	/* Compress a bit below the budget, so that it doesn't start again right away. */
+	low_watermark = device_extension->disk_info.memory_budget - (device_extension->disk_info.memory_budget >> 4);
+
+	for (attempts = 0; (attempts < chunk_table->nchunks) && (chunk_table_memory_used(chunk_table) > low_watermark); attempts++) {
+		if (!chunk_table_next_victim(chunk_table, CHUNK_COMPRESSED | CHUNK_INCOMPRESSIBLE, &index)) {
+			break;
+		}
+
+		/* Skip the chunk if there is I/O on it. */
+		start = index << chunk_table->chunk_shift;
+		if (!range_lock_try_acquire(&device_extension->range_lock, &entry, start, start + ((ULONGLONG) 1 << chunk_table->chunk_shift), TRUE)) {
+			continue;
+		}
+
+		chunk_table_compress(chunk_table, index);
 
-	WdfRequestCompleteWithInformation(request, status, (ULONG_PTR) length);
+		/* Execute the requests which arrived in the meantime. */
+		if ((granted = range_lock_release(&device_extension->range_lock, &entry)) != NULL) {
+			execute_requests(device_extension, granted);
+		}
+	}
 }
 
 void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_t output_buffer_length, __in size_t input_buffer_length, __in ULONG code)
@@ -224,17 +2410,19 @@ void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_
 
 	device_extension = QueueGetExtension(queue)->device_extension;
 
+	start_request(device_extension, request, counters_index(code));
+
 	switch (code) {
 		case IOCTL_DISK_GET_PARTITION_INFO:
 			/* If the buffer is too small... */
 			if (output_buffer_length < sizeof(PARTITION_INFORMATION)) {
-				WdfRequestCompleteWithInformation(request, STATUS_BUFFER_TOO_SMALL, sizeof(PARTITION_INFORMATION));
+				complete_request(device_extension, request, STATUS_BUFFER_TOO_SMALL, sizeof(PARTITION_INFORMATION));
 				return;
 			}
 
 			status = WdfRequestRetrieveOutputBuffer(request, sizeof(PARTITION_INFORMATION), &partition_information, NULL);
 			if (!NT_SUCCESS(status)) {
-				WdfRequestCompleteWithInformation(request, status, 0);
+				complete_request(device_extension, request, status, 0);
 				return;
 			}
 
@@ -252,13 +2440,13 @@ void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_
 		case IOCTL_DISK_SET_PARTITION_INFO:
 			/* If the buffer is too small... */
 			if (input_buffer_length < sizeof(SET_PARTITION_INFORMATION)) {
-				WdfRequestCompleteWithInformation(request, STATUS_BUFFER_TOO_SMALL, sizeof(SET_PARTITION_INFORMATION));
+				complete_request(device_extension, request, STATUS_BUFFER_TOO_SMALL, sizeof(SET_PARTITION_INFORMATION));
 				return;
 			}
 
 			status = WdfRequestRetrieveInputBuffer(request, sizeof(SET_PARTITION_INFORMATION), &set_partition_information, NULL);
 			if (!NT_SUCCESS(status)) {
-				WdfRequestCompleteWithInformation(request, status, 0);
+				complete_request(device_extension, request, status, 0);
 				return;
 			}
 
@@ -271,13 +2459,13 @@ void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_
 		case IOCTL_DISK_GET_DRIVE_GEOMETRY:
 			/* If the buffer is too small... */
 			if (output_buffer_length < sizeof(DISK_GEOMETRY)) {
-				WdfRequestCompleteWithInformation(request, STATUS_BUFFER_TOO_SMALL, sizeof(DISK_GEOMETRY));
+				complete_request(device_extension, request, STATUS_BUFFER_TOO_SMALL, sizeof(DISK_GEOMETRY));
 				return;
 			}
 
 			status = WdfRequestRetrieveOutputBuffer(request, sizeof(DISK_GEOMETRY), &disk_geometry, NULL);
 			if (!NT_SUCCESS(status)) {
-				WdfRequestCompleteWithInformation(request, status, 0);
+				complete_request(device_extension, request, status, 0);
 				return;
 			}
 
@@ -289,13 +2477,13 @@ void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_
 		case IOCTL_STORAGE_GET_MEDIA_TYPES:
 			/* If the buffer is too small... */
 			if (output_buffer_length < sizeof(DISK_GEOMETRY)) {
-				WdfRequestCompleteWithInformation(request, STATUS_BUFFER_TOO_SMALL, sizeof(DISK_GEOMETRY));
+				complete_request(device_extension, request, STATUS_BUFFER_TOO_SMALL, sizeof(DISK_GEOMETRY));
 				return;
 			}
 
 			status = WdfRequestRetrieveOutputBuffer(request, sizeof(DISK_GEOMETRY), &disk_geometry, NULL);
 			if (!NT_SUCCESS(status)) {
-				WdfRequestCompleteWithInformation(request, status, 0);
+				complete_request(device_extension, request, status, 0);
 				return;
 			}
 
@@ -303,25 +2491,32 @@ void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_
 
 			information = sizeof(DISK_GEOMETRY);
 			break;
+		case IOCTL_DISK_UPDATE_PROPERTIES: /* Nothing is cached, the answers always have the current size. */
+			status = STATUS_SUCCESS;
+			information = 0;
+			break;
 		case IOCTL_DISK_CHECK_VERIFY: /* The media has not changed. */
 		case IOCTL_STORAGE_CHECK_VERIFY: /* The media has not changed. */
-		case IOCTL_DISK_IS_WRITABLE:
 			status = STATUS_SUCCESS;
 			information = 0;
 			break;
+		case IOCTL_DISK_IS_WRITABLE:
+			status = device_extension->read_only ? STATUS_MEDIA_WRITE_PROTECTED : STATUS_SUCCESS;
+			information = 0;
+			break;
 		case IOCTL_MOUNTDEV_QUERY_DEVICE_NAME:
-			status = query_device_name(request, parameters, &length);
+			status = query_device_name(device_extension, request, parameters, &length);
 			information = length;
 			break;
 		case IOCTL_MOUNTDEV_QUERY_UNIQUE_ID:
-			status = query_unique_id(request, parameters, &length);
+			status = query_unique_id(device_extension, request, parameters, &length);
 			information = length;
 			break;
 		case IOCTL_DISK_MEDIA_REMOVAL:
 		case IOCTL_STORAGE_MEDIA_REMOVAL:
 			/* If the buffer is too small... */
 			if (input_buffer_length < sizeof(BOOLEAN)) {
-				WdfRequestCompleteWithInformation(request, STATUS_INVALID_DEVICE_REQUEST, sizeof(BOOLEAN));
+				complete_request(device_extension, request, STATUS_INVALID_DEVICE_REQUEST, sizeof(BOOLEAN));
 				return;
 			}
 
@@ -336,6 +2531,40 @@ void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_
 			status = get_hotplug_info(request, parameters, &length);
 			information = length;
 			break;
+		case IOCTL_STORAGE_QUERY_PROPERTY:
+			status = query_property(device_extension, request, parameters, &length);
+			information = length;
+			break;
+		case IOCTL_RAMDISK_QUERY_STATISTICS:
+			status = query_statistics(device_extension, request, parameters, &length);
+			information = length;
+			break;
+		case IOCTL_RAMDISK_QUERY_NUMA:
+			status = query_numa(device_extension, request, parameters, &length);
+			information = length;
+			break;
+		case IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES:
+			/* The request is either completed or dispatched. */
+			manage_data_set_attributes(device_extension, request, parameters);
+			return;
+		case IOCTL_RAMDISK_BATCH:
+			/* The request is either completed or dispatched. */
+			dispatch_batch(device_extension, request, parameters);
+			return;
+		case IOCTL_RAMDISK_SAVE_IMAGE:
+		case IOCTL_RAMDISK_CHECKPOINT:
+		case IOCTL_RAMDISK_SNAPSHOT:
+		case IOCTL_RAMDISK_CLONE:
+		case IOCTL_RAMDISK_DELETE_CLONE:
+		case IOCTL_RAMDISK_RESIZE:
+		case IOCTL_RAMDISK_READ_TRACE: /* The passive queue also serializes the readers of the trace. */
+			/* Handled at PASSIVE_LEVEL. */
+			status = WdfRequestForwardToIoQueue(request, device_extension->passive_queue);
+			if (!NT_SUCCESS(status)) {
+				complete_request(device_extension, request, status, 0);
+			}
+
+			return;
 		default:
 			KdPrint(("IOCTL code: 0x%x\n", code));
 
@@ -343,66 +2572,432 @@ void EvtIoDeviceControl(__in WDFQUEUE queue, __in WDFREQUEST request, __in size_
 			information = 0;
 	}
 
-	WdfRequestCompleteWithInformation(request, status, information);
+	complete_request(device_extension, request, status, information);
 }
 
-void query_disk_parameters(__in PWSTR regpath, __in DISK_INFO *disk_info)
+void query_disk_parameters(__in PWSTR regpath, __in ULONG number, __in DISK_INFO *disk_info)
 {
-	RTL_QUERY_REGISTRY_TABLE query_table[3];
-	DISK_INFO default_disk_info;
+	WCHAR key[MAX_PARAMETERS_KEY];
 
 	PAGED_CODE();
 
 	ASSERT(regpath);
 
-	/* Set the default value. */
-	default_disk_info.disk_size = DEFAULT_DISK_SIZE;
+	/* Set the default values. */
+	disk_info->disk_size = DEFAULT_DISK_SIZE;
+	disk_info->cpus_per_queue = DEFAULT_CPUS_PER_QUEUE;
+	disk_info->memory_budget = DEFAULT_MEMORY_BUDGET;
+	disk_info->lazy_load = DEFAULT_LAZY_LOAD;
+	disk_info->quota = DEFAULT_QUOTA;
+	disk_info->trace_records = DEFAULT_TRACE_RECORDS;
+	disk_info->numa_policy = DEFAULT_NUMA_POLICY;
+	disk_info->numa_stripe = DEFAULT_NUMA_STRIPE;
+	disk_info->cache_size = DEFAULT_CACHE_SIZE;
+	disk_info->flush_interval = DEFAULT_FLUSH_INTERVAL;
+	disk_info->dirty_limit = DEFAULT_DIRTY_LIMIT;
+	disk_info->min_resident = DEFAULT_MIN_RESIDENT;
+	disk_info->sector_size = DEFAULT_SECTOR_SIZE;
+	disk_info->physical_sector_size = DEFAULT_PHYSICAL_SECTOR_SIZE;
+
+	RtlInitEmptyUnicodeString(&disk_info->image_file, NULL, 0);
+	RtlInitEmptyUnicodeString(&disk_info->spill_file, NULL, 0);
+
+	/*
+	 * The values of Parameters apply to every disk and can be overridden in
+	 * Parameters\<number>. The disks cannot share an image or spill file, so
+	 * only the first one takes them from Parameters.
+	 */
+	query_parameters(regpath, L"Parameters", (BOOLEAN) (number == 0), disk_info);
+
+	if (NT_SUCCESS(RtlStringCchPrintfW(key, MAX_PARAMETERS_KEY, L"Parameters\\%lu", number))) {
+		query_parameters(regpath, key, TRUE, disk_info);
+	}
+
+	if (disk_info->cpus_per_queue == 0) {
+		disk_info->cpus_per_queue = DEFAULT_CPUS_PER_QUEUE;
+	}
+
+	if (disk_info->numa_policy > RAMDISK_NUMA_PARTITION) {
+		disk_info->numa_policy = DEFAULT_NUMA_POLICY;
+	}
+
+	/* A physical sector smaller than the logical one is the logical one. */
+	if (disk_info->physical_sector_size < disk_info->sector_size) {
+		disk_info->physical_sector_size = disk_info->sector_size;
+	}
+
+	if (!geometry_check_sectors(disk_info->sector_size, disk_info->physical_sector_size)) {
+		KdPrint(("Unsupported sector sizes %lu/%lu.\n", disk_info->sector_size, disk_info->physical_sector_size));
+
+		disk_info->sector_size = DEFAULT_SECTOR_SIZE;
+		disk_info->physical_sector_size = DEFAULT_PHYSICAL_SECTOR_SIZE;
+	}
+
+	/* The disk holds whole sectors. */
+	disk_info->disk_size &= ~((ULONGLONG) disk_info->sector_size - 1);
+
+	/* A cache evicts the cold chunks instead of compressing them. */
+	if ((disk_info->cache_size > 0) && (disk_info->image_file.Length > 0)) {
+		if ((disk_info->dirty_limit == 0) || (disk_info->dirty_limit > disk_info->cache_size)) {
+			disk_info->dirty_limit = disk_info->cache_size >> 2;
+		}
+
+		if (disk_info->flush_interval == 0) {
+			disk_info->flush_interval = DEFAULT_FLUSH_INTERVAL;
+		}
+
+		disk_info->memory_budget = 0;
+	} else {
+		disk_info->cache_size = 0;
+	}
+
+	/* The chunks of a disk with an image file are already in a file (and a checkpoint would miss the spilled ones). */
+	if ((disk_info->spill_file.Length > 0) && (disk_info->image_file.Length > 0)) {
+		KdPrint(("SpillFile ignored, the disk has an ImageFile.\n"));
+
+		RtlFreeUnicodeString(&disk_info->spill_file);
+		RtlInitEmptyUnicodeString(&disk_info->spill_file, NULL, 0);
+	}
+
+	KdPrint(("Disk %lu.\n", number));
+	KdPrint(("DiskSize = 0x%I64x.\n", disk_info->disk_size));
+	KdPrint(("CpusPerQueue = %lu.\n", disk_info->cpus_per_queue));
+	KdPrint(("MemoryBudget = 0x%I64x.\n", disk_info->memory_budget));
+	KdPrint(("ImageFile = %wZ.\n", &disk_info->image_file));
+	KdPrint(("LazyLoad = %lu.\n", disk_info->lazy_load));
+	KdPrint(("Quota = 0x%I64x.\n", disk_info->quota));
+	KdPrint(("TraceRecords = %lu.\n", disk_info->trace_records));
+	KdPrint(("NumaPolicy = %lu.\n", disk_info->numa_policy));
+	KdPrint(("NumaStripe = 0x%I64x.\n", disk_info->numa_stripe));
+	KdPrint(("CacheSize = 0x%I64x.\n", disk_info->cache_size));
+	KdPrint(("FlushInterval = %lu.\n", disk_info->flush_interval));
+	KdPrint(("DirtyLimit = 0x%I64x.\n", disk_info->dirty_limit));
+	KdPrint(("SpillFile = %wZ.\n", &disk_info->spill_file));
+	KdPrint(("MinResident = 0x%I64x.\n", disk_info->min_resident));
+	KdPrint(("SectorSize = %lu.\n", disk_info->sector_size));
+	KdPrint(("PhysicalSectorSize = %lu.\n", disk_info->physical_sector_size));
+}
+
+NTSTATUS query_parameters(__in PWSTR regpath, __in PWSTR key, __in BOOLEAN files, __inout DISK_INFO *disk_info)
+{
+	RTL_QUERY_REGISTRY_TABLE query_table[18];
+	DISK_INFO values;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	/* The values missing from the key keep their current value. */
+	values = *disk_info;
 
 	/* Setup the query table. */
 	RtlZeroMemory(query_table, sizeof(query_table));
 
-	query_table[0].Flags         = RTL_QUERY_REGISTRY_SUBKEY;
-	query_table[0].Name          = L"Parameters";
+	query_table[0].Flags         = RTL_QUERY_REGISTRY_SUBKEY;
+	query_table[0].Name          = key;
+
+	/* Disk parameters (DiskSize might be either a REG_DWORD or a REG_QWORD). */
+	query_table[1].QueryRoutine  = query_ulonglong;
+	query_table[1].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[1].Name          = L"DiskSize";
+	query_table[1].EntryContext  = &values.disk_size;
+	query_table[1].DefaultType   = REG_NONE;
+
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[2].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[2].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[2].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[2].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[2].Name          = L"CpusPerQueue";
+	query_table[2].EntryContext  = &values.cpus_per_queue;
+	query_table[2].DefaultData   = &disk_info->cpus_per_queue;
+	query_table[2].DefaultLength = sizeof(ULONG);
+
+	query_table[3].QueryRoutine  = query_ulonglong;
+	query_table[3].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[3].Name          = L"MemoryBudget";
+	query_table[3].EntryContext  = &values.memory_budget;
+	query_table[3].DefaultType   = REG_NONE;
+
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[4].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[4].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[4].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[4].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[4].Name          = L"LazyLoad";
+	query_table[4].EntryContext  = &values.lazy_load;
+	query_table[4].DefaultData   = &disk_info->lazy_load;
+	query_table[4].DefaultLength = sizeof(ULONG);
+
+	query_table[5].QueryRoutine  = query_ulonglong;
+	query_table[5].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[5].Name          = L"Quota";
+	query_table[5].EntryContext  = &values.quota;
+	query_table[5].DefaultType   = REG_NONE;
+
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[6].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[6].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[6].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[6].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[6].Name          = L"TraceRecords";
+	query_table[6].EntryContext  = &values.trace_records;
+	query_table[6].DefaultData   = &disk_info->trace_records;
+	query_table[6].DefaultLength = sizeof(ULONG);
+
+	/* Placement of the chunks on the NUMA nodes. */
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[7].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[7].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[7].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[7].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[7].Name          = L"NumaPolicy";
+	query_table[7].EntryContext  = &values.numa_policy;
+	query_table[7].DefaultData   = &disk_info->numa_policy;
+	query_table[7].DefaultLength = sizeof(ULONG);
+
+	query_table[8].QueryRoutine  = query_ulonglong;
+	query_table[8].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[8].Name          = L"NumaStripe";
+	query_table[8].EntryContext  = &values.numa_stripe;
+	query_table[8].DefaultType   = REG_NONE;
+
+	/* Write-back cache in front of the image file. */
+	query_table[9].QueryRoutine  = query_ulonglong;
+	query_table[9].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[9].Name          = L"CacheSize";
+	query_table[9].EntryContext  = &values.cache_size;
+	query_table[9].DefaultType   = REG_NONE;
+
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[10].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[10].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[10].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[10].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[10].Name          = L"FlushInterval";
+	query_table[10].EntryContext  = &values.flush_interval;
+	query_table[10].DefaultData   = &disk_info->flush_interval;
+	query_table[10].DefaultLength = sizeof(ULONG);
+
+	query_table[11].QueryRoutine  = query_ulonglong;
+	query_table[11].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[11].Name          = L"DirtyLimit";
+	query_table[11].EntryContext  = &values.dirty_limit;
+	query_table[11].DefaultType   = REG_NONE;
+
+	/* Spill of the cold chunks under memory pressure. */
+	query_table[12].QueryRoutine  = query_ulonglong;
+	query_table[12].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[12].Name          = L"MinResident";
+	query_table[12].EntryContext  = &values.min_resident;
+	query_table[12].DefaultType   = REG_NONE;
+
+	/* Logical and physical sector sizes. */
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[13].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[13].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[13].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[13].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[13].Name          = L"SectorSize";
+	query_table[13].EntryContext  = &values.sector_size;
+	query_table[13].DefaultData   = &disk_info->sector_size;
+	query_table[13].DefaultLength = sizeof(ULONG);
+
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[14].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[14].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[14].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[14].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[14].Name          = L"PhysicalSectorSize";
+	query_table[14].EntryContext  = &values.physical_sector_size;
+	query_table[14].DefaultData   = &disk_info->physical_sector_size;
+	query_table[14].DefaultLength = sizeof(ULONG);
+
+	/* Image and spill files (allocated by RtlQueryRegistryValues; the table ends here if they are not wanted). */
+	RtlInitEmptyUnicodeString(&values.image_file, NULL, 0);
+	RtlInitEmptyUnicodeString(&values.spill_file, NULL, 0);
+
+	if (files) {
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+		query_table[15].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+		query_table[15].DefaultType   = (REG_SZ << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+		query_table[15].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+		query_table[15].DefaultType   = REG_NONE;
+#endif
+
+		query_table[15].Name          = L"ImageFile";
+		query_table[15].EntryContext  = &values.image_file;
+
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+		query_table[16].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+		query_table[16].DefaultType   = (REG_SZ << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+		query_table[16].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+		query_table[16].DefaultType   = REG_NONE;
+#endif
+
+		query_table[16].Name          = L"SpillFile";
+		query_table[16].EntryContext  = &values.spill_file;
+	}
+
+	status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL, regpath, query_table, NULL, NULL);
+	if (!NT_SUCCESS(status)) {
+		/* Keep the current values. */
+		RtlFreeUnicodeString(&values.image_file);
+		RtlFreeUnicodeString(&values.spill_file);
+		return status;
+	}
+
+	/* An empty ImageFile (or SpillFile) replaces the current one too (no file for this disk). */
+	if (values.image_file.Buffer) {
+		RtlFreeUnicodeString(&disk_info->image_file);
+	} else {
+		values.image_file = disk_info->image_file;
+	}
+
+	if (values.spill_file.Buffer) {
+		RtlFreeUnicodeString(&disk_info->spill_file);
+	} else {
+		values.spill_file = disk_info->spill_file;
+	}
+
+	*disk_info = values;
+
+	return STATUS_SUCCESS;
+}
+
+void query_driver_parameters(__in PWSTR regpath, __out DRIVER_INFO *driver_info)
+{
+	RTL_QUERY_REGISTRY_TABLE query_table[6];
+	ULONG default_split_workers;
+	ULONG default_large_pages;
+
+	PAGED_CODE();
+
+	driver_info->pool_size = DEFAULT_POOL_SIZE;
+	driver_info->split_threshold = DEFAULT_SPLIT_THRESHOLD;
+	driver_info->split_workers = DEFAULT_SPLIT_WORKERS;
+	driver_info->large_pages = DEFAULT_LARGE_PAGES;
+
+	default_split_workers = DEFAULT_SPLIT_WORKERS;
+	default_large_pages = DEFAULT_LARGE_PAGES;
+
+	RtlZeroMemory(query_table, sizeof(query_table));
+
+	query_table[0].Flags         = RTL_QUERY_REGISTRY_SUBKEY;
+	query_table[0].Name          = L"Parameters";
+
+	/* Memory of all the disks together. */
+	query_table[1].QueryRoutine  = query_ulonglong;
+	query_table[1].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[1].Name          = L"PoolSize";
+	query_table[1].EntryContext  = &driver_info->pool_size;
+	query_table[1].DefaultType   = REG_NONE;
+
+	/* Transfers copied in parallel by the split workers. */
+	query_table[2].QueryRoutine  = query_ulonglong;
+	query_table[2].Flags         = RTL_QUERY_REGISTRY_NOEXPAND;
+	query_table[2].Name          = L"SplitThreshold";
+	query_table[2].EntryContext  = &driver_info->split_threshold;
+	query_table[2].DefaultType   = REG_NONE;
+
+#ifdef RTL_QUERY_REGISTRY_TYPECHECK
+	query_table[3].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[3].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+#else
+	query_table[3].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[3].DefaultType   = REG_DWORD;
+#endif
+
+	query_table[3].Name          = L"SplitWorkers";
+	query_table[3].EntryContext  = &driver_info->split_workers;
+	query_table[3].DefaultData   = &default_split_workers;
+	query_table[3].DefaultLength = sizeof(ULONG);
 
-	/* Disk parameters. */
+	/* Chunks carved from large pages. */
 #ifdef RTL_QUERY_REGISTRY_TYPECHECK
-	query_table[1].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
-	query_table[1].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+	query_table[4].Flags         = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	query_table[4].DefaultType   = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
 #else
-	query_table[1].Flags         = RTL_QUERY_REGISTRY_DIRECT;
-	query_table[1].DefaultType   = REG_DWORD;
+	query_table[4].Flags         = RTL_QUERY_REGISTRY_DIRECT;
+	query_table[4].DefaultType   = REG_DWORD;
 #endif
 
-	query_table[1].Name          = L"DiskSize";
-	query_table[1].EntryContext  = &disk_info->disk_size;
-	query_table[1].DefaultData   = &default_disk_info.disk_size;
-	query_table[1].DefaultLength = sizeof(ULONG);
+	query_table[4].Name          = L"LargePages";
+	query_table[4].EntryContext  = &driver_info->large_pages;
+	query_table[4].DefaultData   = &default_large_pages;
+	query_table[4].DefaultLength = sizeof(ULONG);
 
 	if (!NT_SUCCESS(RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL, regpath, query_table, NULL, NULL))) {
-		/* Use default value. */
-		disk_info->disk_size = default_disk_info.disk_size;
+		driver_info->pool_size = DEFAULT_POOL_SIZE;
+		driver_info->split_threshold = DEFAULT_SPLIT_THRESHOLD;
+		driver_info->split_workers = DEFAULT_SPLIT_WORKERS;
+		driver_info->large_pages = DEFAULT_LARGE_PAGES;
 	}
 
-	KdPrint(("DiskSize = 0x%lx.\n", disk_info->disk_size));
+	KdPrint(("PoolSize = 0x%I64x.\n", driver_info->pool_size));
+	KdPrint(("SplitThreshold = 0x%I64x.\n", driver_info->split_threshold));
+	KdPrint(("SplitWorkers = %lu.\n", driver_info->split_workers));
+	KdPrint(("LargePages = %lu.\n", driver_info->large_pages));
 }
 
-void set_disk_geometry(__in DEVICE_EXTENSION *device_extension)
+NTSTATUS query_ulonglong(__in PWSTR value_name, __in ULONG value_type, __in PVOID value_data, __in ULONG value_length, __in PVOID context, __in PVOID entry_context)
 {
+	UNREFERENCED_PARAMETER(context);
+
 	PAGED_CODE();
 
-	ASSERT(device_extension->disk_image);
+	switch (value_type) {
+		case REG_DWORD:
+			if (value_length == sizeof(ULONG)) {
+				*((ULONGLONG *) entry_context) = *((ULONG *) value_data);
+				return STATUS_SUCCESS;
+			}
+
+			break;
+		case REG_QWORD:
+			if (value_length == sizeof(ULONGLONG)) {
+				*((ULONGLONG *) entry_context) = *((ULONGLONG UNALIGNED *) value_data);
+				return STATUS_SUCCESS;
+			}
+
+			break;
+	}
+
+	/* Ignore values of the wrong type, the default value is kept. */
+	KdPrint(("Ignoring registry value %ws (type %lu, length %lu).\n", value_name, value_type, value_length));
+
+	return STATUS_SUCCESS;
+}
 
-	device_extension->disk_geometry.BytesPerSector = 512;
-	device_extension->disk_geometry.SectorsPerTrack = 32;
-	device_extension->disk_geometry.TracksPerCylinder = 2;
+void set_disk_geometry(__in DEVICE_EXTENSION *device_extension)
+{
+	PAGED_CODE();
 
-	/* Calculate number of cylinders. */
-	device_extension->disk_geometry.Cylinders.QuadPart = device_extension->disk_info.disk_size
-														/ device_extension->disk_geometry.BytesPerSector
-														/ device_extension->disk_geometry.SectorsPerTrack
-														/ device_extension->disk_geometry.TracksPerCylinder;
+	ASSERT(device_extension->chunk_table.segments);
 
-	device_extension->disk_geometry.MediaType = FixedMedia;
+	geometry_build(device_extension->disk_info.disk_size, device_extension->disk_info.sector_size, &device_extension->disk_geometry);
 
 	KdPrint(("Cylinders: %lld.\n", device_extension->disk_geometry.Cylinders.QuadPart));
 	KdPrint(("TracksPerCylinder: %lu.\n", device_extension->disk_geometry.TracksPerCylinder));
@@ -412,8 +3007,7 @@ void set_disk_geometry(__in DEVICE_EXTENSION *device_extension)
 
 BOOLEAN check_parameters(__in DEVICE_EXTENSION *device_extension, __in LARGE_INTEGER offset, __in size_t length)
 {
-	if ((offset.QuadPart < 0) || ((ULONGLONG) offset.QuadPart + length > device_extension->disk_info.disk_size) || \
-	(length & (device_extension->disk_geometry.BytesPerSector - 1))) {
+	if (!disk_io_check(device_extension->disk_info.disk_size, device_extension->disk_geometry.BytesPerSector, offset.QuadPart, length)) {
 		KdPrint(("Error invalid parameter.\nByteOffset: %I64x.\nLength: %u.\n", offset.QuadPart, length));
 		return FALSE;
 	}
@@ -421,15 +3015,16 @@ BOOLEAN check_parameters(__in DEVICE_EXTENSION *device_extension, __in LARGE_INT
 	return TRUE;
 }
 
-NTSTATUS query_device_name(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
+NTSTATUS query_device_name(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
 {
 	MOUNTDEV_NAME *name;
+	PCUNICODE_STRING nt_name;
 	NTSTATUS status;
 
-	DECLARE_CONST_UNICODE_STRING(nt_name, NT_DEVICE_NAME);
-
 	PAGED_CODE();
 
+	nt_name = &device_extension->device_name;
+
 	/* If the buffer is too small... */
 	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(MOUNTDEV_NAME)) {
 		*length = sizeof(MOUNTDEV_NAME);
@@ -443,29 +3038,30 @@ NTSTATUS query_device_name(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS
 	}
 
 	RtlZeroMemory(name, sizeof(MOUNTDEV_NAME));
-	name->NameLength = nt_name.Length;
+	name->NameLength = nt_name->Length;
 
-	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(USHORT) + nt_name.Length) {
+	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(USHORT) + nt_name->Length) {
 		*length = sizeof(MOUNTDEV_NAME);
 		return STATUS_BUFFER_OVERFLOW;
 	}
 
-	RtlCopyMemory(name->Name, nt_name.Buffer, nt_name.Length);
+	RtlCopyMemory(name->Name, nt_name->Buffer, nt_name->Length);
 
-	*length = sizeof(USHORT) + nt_name.Length;
+	*length = sizeof(USHORT) + nt_name->Length;
 
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS query_unique_id(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
+NTSTATUS query_unique_id(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
 {
 	MOUNTDEV_UNIQUE_ID *unique_id;
+	PCUNICODE_STRING nt_name;
 	NTSTATUS status;
 
-	DECLARE_CONST_UNICODE_STRING(nt_name, NT_DEVICE_NAME);
-
 	PAGED_CODE();
 
+	nt_name = &device_extension->device_name;
+
 	/* If the buffer is too small... */
 	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(MOUNTDEV_UNIQUE_ID)) {
 		*length = sizeof(MOUNTDEV_UNIQUE_ID);
@@ -479,16 +3075,16 @@ NTSTATUS query_unique_id(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS pa
 	}
 
 	RtlZeroMemory(unique_id, sizeof(MOUNTDEV_UNIQUE_ID));
-	unique_id->UniqueIdLength = nt_name.Length;
+	unique_id->UniqueIdLength = nt_name->Length;
 
-	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(USHORT) + nt_name.Length) {
+	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(USHORT) + nt_name->Length) {
 		*length = sizeof(MOUNTDEV_UNIQUE_ID);
 		return STATUS_BUFFER_OVERFLOW;
 	}
 
-	RtlCopyMemory(unique_id->UniqueId, nt_name.Buffer, nt_name.Length);
+	RtlCopyMemory(unique_id->UniqueId, nt_name->Buffer, nt_name->Length);
 
-	*length = sizeof(USHORT) + nt_name.Length;
+	*length = sizeof(USHORT) + nt_name->Length;
 
 	return STATUS_SUCCESS;
 }
@@ -519,6 +3115,90 @@ NTSTATUS get_length_info(__in DEVICE_EXTENSION *device_extension, __in WDFREQUES
 	return STATUS_SUCCESS;
 }
 
+NTSTATUS query_statistics(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
+{
+	RAMDISK_STATISTICS *statistics;
+	IO_COUNTERS counters;
+	ULONG i;
+	ULONG j;
+	NTSTATUS status;
+
+	/* If the buffer is too small... */
+	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(RAMDISK_STATISTICS)) {
+		*length = sizeof(RAMDISK_STATISTICS);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(request, sizeof(RAMDISK_STATISTICS), &statistics, NULL);
+	if (!NT_SUCCESS(status)) {
+		*length = 0;
+		return status;
+	}
+
+	RtlZeroMemory(statistics, sizeof(RAMDISK_STATISTICS));
+
+	/* The counters are not frozen: the sums might be slightly inconsistent with each other. */
+	for (i = 0; i < RTL_NUMBER_OF(counted_operations); i++) {
+		cpu_queues_get_counters(&device_extension->cpu_queues, i, &counters);
+
+		statistics->operations[i].code = counted_operations[i];
+		statistics->operations[i].requests = counters.requests;
+		statistics->operations[i].bytes = counters.bytes;
+		statistics->operations[i].errors = counters.errors;
+		statistics->operations[i].in_flight = counters.in_flight;
+
+		for (j = 0; j < IO_LATENCY_BUCKETS; j++) {
+			statistics->operations[i].latency[j] = counters.latency[j];
+		}
+	}
+
+	statistics->noperations = RTL_NUMBER_OF(counted_operations);
+
+	*length = sizeof(RAMDISK_STATISTICS);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS query_numa(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
+{
+	RAMDISK_NUMA_INFO *info;
+	NUMA_LAYOUT *layout;
+	ULONG i;
+	NTSTATUS status;
+
+	/* If the buffer is too small... */
+	if (parameters.Parameters.DeviceIoControl.OutputBufferLength < sizeof(RAMDISK_NUMA_INFO)) {
+		*length = sizeof(RAMDISK_NUMA_INFO);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(request, sizeof(RAMDISK_NUMA_INFO), &info, NULL);
+	if (!NT_SUCCESS(status)) {
+		*length = 0;
+		return status;
+	}
+
+	RtlZeroMemory(info, sizeof(RAMDISK_NUMA_INFO));
+
+	layout = &device_extension->chunk_table.numa;
+
+	info->policy = layout->policy;
+	info->nodes = layout->nnodes;
+	info->stripe_size = (ULONGLONG) 1 << (layout->stripe_shift + device_extension->chunk_table.chunk_shift);
+	info->region_size = layout->region_chunks << device_extension->chunk_table.chunk_shift;
+
+	/* The clones report the memory of their disk (they share its quota). */
+	if ((layout->policy != NUMA_POLICY_NONE) && (device_extension->chunk_table.quota)) {
+		for (i = 0; i < layout->nnodes; i++) {
+			info->node_bytes[i] = chunk_quota_node_used(device_extension->chunk_table.quota, i);
+		}
+	}
+
+	*length = sizeof(RAMDISK_NUMA_INFO);
+
+	return STATUS_SUCCESS;
+}
+
 NTSTATUS get_hotplug_info(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
 {
 	STORAGE_HOTPLUG_INFO *storage_hotplug_info;
@@ -549,3 +3229,461 @@ NTSTATUS get_hotplug_info(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS p
 
 	return STATUS_SUCCESS;
 }
+
+void manage_data_set_attributes(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters)
+{
+	DEVICE_MANAGE_DATA_SET_ATTRIBUTES *attributes;
+	DEVICE_DATA_SET_RANGE *ranges;
+	ULONGLONG chunk_mask;
+	ULONGLONG start;
+	ULONGLONG end;
+	size_t length;
+	ULONG nranges;
+	ULONG i;
+	NTSTATUS status;
+
+	/* If the buffer is too small... */
+	if (parameters.Parameters.DeviceIoControl.InputBufferLength < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES)) {
+		complete_request(device_extension, request, STATUS_INVALID_PARAMETER, 0);
+		return;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(request, sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), &attributes, &length);
+	if (!NT_SUCCESS(status)) {
+		complete_request(device_extension, request, status, 0);
+		return;
+	}
+
+	/* Only trim is supported. */
+	if ((attributes->Action & ~DeviceDsmActionFlag_NonDestructive) != DeviceDsmAction_Trim) {
+		complete_request(device_extension, request, STATUS_INVALID_DEVICE_REQUEST, 0);
+		return;
+	}
+
+	if (device_extension->read_only) {
+		complete_request(device_extension, request, STATUS_MEDIA_WRITE_PROTECTED, 0);
+		return;
+	}
+
+	if (attributes->Flags & DEVICE_DSM_FLAG_ENTIRE_DATA_SET_RANGE) {
+		start = 0;
+		end = device_extension->disk_info.disk_size;
+	} else {
+		if ((attributes->DataSetRangesOffset < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES)) || \
+		(attributes->DataSetRangesOffset & (sizeof(ULONGLONG) - 1)) || \
+		(attributes->DataSetRangesOffset > length) || \
+		(attributes->DataSetRangesLength > length - attributes->DataSetRangesOffset) || \
+		(attributes->DataSetRangesLength % sizeof(DEVICE_DATA_SET_RANGE))) {
+			complete_request(device_extension, request, STATUS_INVALID_PARAMETER, 0);
+			return;
+		}
+
+		ranges = (DEVICE_DATA_SET_RANGE *) ((UCHAR *) attributes + attributes->DataSetRangesOffset);
+		nranges = attributes->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
+
+		if (nranges == 0) {
+			complete_request(device_extension, request, STATUS_SUCCESS, 0);
+			return;
+		}
+
+		/* Validate the ranges and compute the range which covers all of them. */
+		start = (ULONGLONG) -1;
+		end = 0;
+
+		for (i = 0; i < nranges; i++) {
+			if ((ranges[i].StartingOffset < 0) || \
+			(ranges[i].LengthInBytes > device_extension->disk_info.disk_size) || \
+			((ULONGLONG) ranges[i].StartingOffset > device_extension->disk_info.disk_size - ranges[i].LengthInBytes)) {
+				complete_request(device_extension, request, STATUS_INVALID_PARAMETER, 0);
+				return;
+			}
+
+			if ((ULONGLONG) ranges[i].StartingOffset < start) {
+				start = ranges[i].StartingOffset;
+			}
+
+			if ((ULONGLONG) ranges[i].StartingOffset + ranges[i].LengthInBytes > end) {
+				end = ranges[i].StartingOffset + ranges[i].LengthInBytes;
+			}
+		}
+	}
+
+	if (start >= end) {
+		complete_request(device_extension, request, STATUS_SUCCESS, 0);
+		return;
+	}
+
+	/* Trimming might free whole chunks: lock the complete chunks. */
+	chunk_mask = ((ULONGLONG) 1 << device_extension->chunk_table.chunk_shift) - 1;
+
+	dispatch_request(device_extension, request, start & ~chunk_mask, (end + chunk_mask) & ~chunk_mask, REQUEST_TRIM);
+}
+
+NTSTATUS trim(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request)
+{
+	DEVICE_MANAGE_DATA_SET_ATTRIBUTES *attributes;
+	DEVICE_DATA_SET_RANGE *ranges;
+	ULONGLONG length;
+	ULONG nranges;
+	ULONG i;
+	NTSTATUS status;
+
+	/* The input buffer has already been validated by manage_data_set_attributes(). */
+	status = WdfRequestRetrieveInputBuffer(request, sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), &attributes, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/*
+	 * The chunks of a cache (or spilled) which are completely trimmed don't
+	 * have to be read; the others are only trimmed if they are loaded
+	 * (trimming is a hint, their data can stay).
+	 */
+	if (attributes->Flags & DEVICE_DSM_FLAG_ENTIRE_DATA_SET_RANGE) {
+		if (device_extension->cache.open) {
+			cache_claim(&device_extension->cache, &device_extension->chunk_table, 0, device_extension->disk_info.disk_size);
+		}
+
+		if (spill_pending(&device_extension->spill)) {
+			spill_claim(&device_extension->spill, &device_extension->chunk_table, 0, chunk_table_size(&device_extension->chunk_table));
+		}
+
+		/* With the rest of the last chunk, beyond the disk: otherwise the chunk is never freed (and the disk cannot shrink). */
+		chunk_table_trim(&device_extension->chunk_table, 0, chunk_table_size(&device_extension->chunk_table));
+	} else {
+		ranges = (DEVICE_DATA_SET_RANGE *) ((UCHAR *) attributes + attributes->DataSetRangesOffset);
+		nranges = attributes->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
+
+		for (i = 0; i < nranges; i++) {
+			if (device_extension->cache.open) {
+				cache_claim(&device_extension->cache, &device_extension->chunk_table, ranges[i].StartingOffset, ranges[i].LengthInBytes);
+			}
+
+			if (spill_pending(&device_extension->spill)) {
+				spill_claim(&device_extension->spill, &device_extension->chunk_table, ranges[i].StartingOffset, ranges[i].LengthInBytes);
+			}
+
+			length = ranges[i].LengthInBytes;
+
+			/* Likewise (the range lock covers the whole chunks). */
+			if ((ULONGLONG) ranges[i].StartingOffset + length == device_extension->disk_info.disk_size) {
+				length = chunk_table_size(&device_extension->chunk_table) - ranges[i].StartingOffset;
+			}
+
+			chunk_table_trim(&device_extension->chunk_table, ranges[i].StartingOffset, length);
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void dispatch_batch(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters)
+{
+	REQUEST_CONTEXT *context;
+	RAMDISK_BATCH *batch;
+	RAMDISK_BATCH_ENTRY *entries;
+	UCHAR *buffer;
+	ULONGLONG start;
+	ULONGLONG end;
+	size_t input_length;
+	size_t buffer_length;
+	ULONG i;
+	BOOLEAN write;
+	NTSTATUS status;
+
+	/* If the buffer is too small... */
+	if (parameters.Parameters.DeviceIoControl.InputBufferLength < sizeof(RAMDISK_BATCH)) {
+		complete_request(device_extension, request, STATUS_INVALID_PARAMETER, 0);
+		return;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(request, sizeof(RAMDISK_BATCH), &batch, &input_length);
+	if (!NT_SUCCESS(status)) {
+		complete_request(device_extension, request, status, 0);
+		return;
+	}
+
+	if ((batch->count == 0) ||
+		(batch->count > RAMDISK_BATCH_MAX_ENTRIES) ||
+		((input_length - sizeof(RAMDISK_BATCH)) / sizeof(RAMDISK_BATCH_ENTRY) < batch->count)) {
+		complete_request(device_extension, request, STATUS_INVALID_PARAMETER, 0);
+		return;
+	}
+
+	/* The output buffer is locked (METHOD_OUT_DIRECT): the data is copied in place. */
+	status = WdfRequestRetrieveOutputBuffer(request, (size_t) RAMDISK_BATCH_STATUS_SIZE(batch->count), &buffer, &buffer_length);
+	if (!NT_SUCCESS(status)) {
+		complete_request(device_extension, request, status, 0);
+		return;
+	}
+
+	/* The descriptors are in the input buffer, which is a copy: they cannot change after this. */
+	entries = (RAMDISK_BATCH_ENTRY *) (batch + 1);
+
+	if (!disk_io_check_batch(device_extension->disk_info.disk_size,
+							 device_extension->disk_geometry.BytesPerSector,
+							 entries,
+							 batch->count,
+							 buffer_length,
+							 &start,
+							 &end,
+							 &write)) {
+		KdPrint(("Invalid batch of %lu descriptors.\n", batch->count));
+
+		complete_request(device_extension, request, STATUS_INVALID_PARAMETER, 0);
+		return;
+	}
+
+	if ((write) && (device_extension->read_only)) {
+		complete_request(device_extension, request, STATUS_MEDIA_WRITE_PROTECTED, 0);
+		return;
+	}
+
+	/* Nothing to transfer. */
+	if (start >= end) {
+		for (i = 0; i < batch->count; i++) {
+			((LONG *) buffer)[i] = STATUS_SUCCESS;
+		}
+
+		complete_request(device_extension, request, STATUS_SUCCESS, 0);
+		return;
+	}
+
+	context = RequestGetContext(request);
+	context->batch = batch;
+	context->batch_buffer = buffer;
+
+	dispatch_request(device_extension, request, start, end, write ? REQUEST_BATCH_WRITE : REQUEST_BATCH_READ);
+}
+
+NTSTATUS assign_mapping_callbacks(__in PWDFDEVICE_INIT device_init)
+{
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	status = WdfDeviceInitAssignWdmIrpPreprocessCallback(device_init, EvtDeviceControlPreprocess, IRP_MJ_DEVICE_CONTROL, NULL, 0);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	return WdfDeviceInitAssignWdmIrpPreprocessCallback(device_init, EvtDeviceCleanup, IRP_MJ_CLEANUP, NULL, 0);
+}
+
+NTSTATUS EvtDeviceControlPreprocess(__in WDFDEVICE device, __inout PIRP irp)
+{
+	DEVICE_EXTENSION *device_extension;
+	PIO_STACK_LOCATION stack;
+	RAMDISK_MAP_ADDRESS *address;
+	ULONG_PTR information;
+	ULONG code;
+	NTSTATUS status;
+
+	stack = IoGetCurrentIrpStackLocation(irp);
+	code = stack->Parameters.DeviceIoControl.IoControlCode;
+
+	/*
+	 * The views are created in the address space of the caller: they can't
+	 * wait for the queues, which might run the request in another context.
+	 * Everything else goes to the queues.
+	 */
+	if ((code != IOCTL_RAMDISK_MAP) && (code != IOCTL_RAMDISK_MAP_WRITABLE) && (code != IOCTL_RAMDISK_UNMAP)) {
+		IoSkipCurrentIrpStackLocation(irp);
+		return WdfDeviceWdmDispatchPreprocessedIrp(device, irp);
+	}
+
+	device_extension = DeviceGetExtension(device);
+	information = 0;
+
+	if (code == IOCTL_RAMDISK_UNMAP) {
+		if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(RAMDISK_MAP_ADDRESS)) {
+			status = STATUS_INVALID_PARAMETER;
+		} else {
+			address = (RAMDISK_MAP_ADDRESS *) irp->AssociatedIrp.SystemBuffer;
+
+			/* NULL would remove all the views of the handle. */
+			status = (address->address != 0) ? unmap_range(device_extension, stack->FileObject, (void *) (ULONG_PTR) address->address) : STATUS_INVALID_PARAMETER;
+		}
+	} else {
+		status = map_range(device_extension, irp, (BOOLEAN) (code == IOCTL_RAMDISK_MAP_WRITABLE), &information);
+	}
+
+	irp->IoStatus.Status = status;
+	irp->IoStatus.Information = information;
+
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+
+	return status;
+}
+
+NTSTATUS EvtDeviceCleanup(__in WDFDEVICE device, __inout PIRP irp)
+{
+	DEVICE_EXTENSION *device_extension;
+
+	PAGED_CODE();
+
+	device_extension = DeviceGetExtension(device);
+
+	/* The last handle of the file object is closed, also when the process exits: its views go away. */
+	if (mapping_count(&device_extension->mappings) > 0) {
+		unmap_range(device_extension, IoGetCurrentIrpStackLocation(irp)->FileObject, NULL);
+	}
+
+	IoSkipCurrentIrpStackLocation(irp);
+	return WdfDeviceWdmDispatchPreprocessedIrp(device, irp);
+}
+
+NTSTATUS map_range(__in DEVICE_EXTENSION *device_extension, __in PIRP irp, __in BOOLEAN writable, __out ULONG_PTR *information)
+{
+	PIO_STACK_LOCATION stack;
+	RAMDISK_MAP_RANGE range;
+	RAMDISK_MAP_ADDRESS *output;
+	REQUEST_CONTEXT context;
+	ULONGLONG chunk_mask;
+	void *address;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	stack = IoGetCurrentIrpStackLocation(irp);
+
+	/* The view goes to the user part of the address space of the caller. */
+	if (irp->RequestorMode != UserMode) {
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	if ((stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(RAMDISK_MAP_RANGE)) ||
+		(stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(RAMDISK_MAP_ADDRESS))) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	/* The process bypasses the file systems, as with the direct access to the volumes. */
+	if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), UserMode)) {
+		return STATUS_PRIVILEGE_NOT_HELD;
+	}
+
+	range = *((RAMDISK_MAP_RANGE *) irp->AssociatedIrp.SystemBuffer);
+
+	if ((range.offset > MAXLONGLONG) ||
+		(!disk_io_check(device_extension->disk_info.disk_size, device_extension->disk_geometry.BytesPerSector, (LONGLONG) range.offset, range.length))) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* Even a read-only view pins its chunks, which copies the shared ones and allocates the holes of a snapshot. */
+	if (device_extension->read_only) {
+		return (writable) ? STATUS_MEDIA_WRITE_PROTECTED : STATUS_NOT_SUPPORTED;
+	}
+
+	/* The chunks of a cache, or of a disk which spills, come and go. */
+	if ((device_extension->cache.open) || (device_extension->spill.open)) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	/* The chunks still in the image file would have to be loaded first. */
+	if (image_loader_pending(&device_extension->image_loader)) {
+		return STATUS_DEVICE_BUSY;
+	}
+
+	/* The chunks are made private and allocated as for a write: no I/O on them meanwhile. */
+	chunk_mask = ((ULONGLONG) 1 << device_extension->chunk_table.chunk_shift) - 1;
+
+	wait_for_range(device_extension, &context, range.offset & ~chunk_mask, (range.offset + range.length + chunk_mask) & ~chunk_mask, TRUE);
+
+	status = mapping_create(&device_extension->mappings,
+							&device_extension->chunk_table,
+							stack->FileObject,
+							range.offset,
+							range.length,
+							writable,
+							&address);
+
+	release_range(device_extension, &context);
+
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* The input and the output share the system buffer. */
+	output = (RAMDISK_MAP_ADDRESS *) irp->AssociatedIrp.SystemBuffer;
+	output->address = (ULONGLONG) (ULONG_PTR) address;
+
+	*information = sizeof(RAMDISK_MAP_ADDRESS);
+
+	KdPrint(("View of 0x%I64x bytes at 0x%I64x of %wZ (%s) at %p.\n", range.length, range.offset, &device_extension->device_name, writable ? "writable" : "read-only", address));
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS unmap_range(__in DEVICE_EXTENSION *device_extension, __in PFILE_OBJECT owner, __in void *address)
+{
+	REQUEST_CONTEXT context;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	/* The chunk descriptors must not be moved by a resize while they are unpinned. */
+	wait_for_range(device_extension, &context, 0, chunk_table_size(&device_extension->chunk_table), FALSE);
+
+	if (address) {
+		status = mapping_remove(&device_extension->mappings, &device_extension->chunk_table, owner, address, &device_extension->dirty_chunks);
+	} else {
+		mapping_remove_owner(&device_extension->mappings, &device_extension->chunk_table, owner, &device_extension->dirty_chunks);
+		status = STATUS_SUCCESS;
+	}
+
+	release_range(device_extension, &context);
+
+	return status;
+}
+
+NTSTATUS query_property(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length)
+{
+	STORAGE_PROPERTY_QUERY *query;
+	STORAGE_PROPERTY_ID property_id;
+	STORAGE_QUERY_TYPE query_type;
+	void *buffer;
+	size_t buffer_length;
+	ULONG descriptor_length;
+	NTSTATUS status;
+
+	/* If the buffer is too small... */
+	if (parameters.Parameters.DeviceIoControl.InputBufferLength < sizeof(STORAGE_PROPERTY_QUERY)) {
+		*length = 0;
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(request, sizeof(STORAGE_PROPERTY_QUERY), &query, NULL);
+	if (!NT_SUCCESS(status)) {
+		*length = 0;
+		return status;
+	}
+
+	/* The input and the output buffers are the same buffer. */
+	property_id = query->PropertyId;
+	query_type = query->QueryType;
+
+	*length = 0;
+
+	/* Without room for a header the query fails before the buffer is used. */
+	buffer = NULL;
+	buffer_length = 0;
+
+	if (parameters.Parameters.DeviceIoControl.OutputBufferLength >= sizeof(STORAGE_DESCRIPTOR_HEADER)) {
+		status = WdfRequestRetrieveOutputBuffer(request, sizeof(STORAGE_DESCRIPTOR_HEADER), &buffer, &buffer_length);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+	}
+
+	status = geometry_query_property(device_extension->disk_info.sector_size,
+									 device_extension->disk_info.physical_sector_size,
+									 property_id,
+									 query_type,
+									 buffer,
+									 (buffer_length < MAXULONG) ? (ULONG) buffer_length : MAXULONG,
+									 &descriptor_length);
+
+	*length = descriptor_length;
+
+	return status;
+}
@@ -1,9 +1,10 @@
 #ifndef RAMDISK_H
 #define RAMDISK_H
 
+#include "port.h"
+
 #pragma warning(disable:4201)  // nameless struct/union warning
 
-#include <ntddk.h>
 #include <initguid.h>
 #include <ntdddisk.h>
 
@@ -11,23 +12,139 @@
 
 #include <wdf.h>
 
-#include "forward_progress.h"
+#include "ramdisk_ioctl.h"
 
-#define NT_DEVICE_NAME                  L"\\Device\\Ramdisk"
+#include "forward_progress.h"
+#include "chunk_table.h"
+#include "disk_io.h"
+#include "split.h"
+#include "range_lock.h"
+#include "cpu_queue.h"
+#include "image.h"
+#include "cache.h"
+#include "spill.h"
+#include "mapping.h"
+#include "geometry.h"
+#include "bitmap.h"
 
-#define RAMDISK_TAG                     'DmaR'
+#define NT_DEVICE_NAME                  L"\\Device\\Ramdisk"      /* Disk 0. */
+#define DISK_DEVICE_NAME                L"\\Device\\Ramdisk%lu"   /* The other disks. */
+#define CLONE_DEVICE_NAME               L"\\Device\\RamdiskClone%lu"
+#define CLONE_LINK_NAME                 L"\\DosDevices\\RamdiskClone%lu"
+#define MAX_DEVICE_NAME                 40 /* Characters. */
+#define MAX_DISKS                       32
+#define MAX_PARAMETERS_KEY              24 /* Characters. */
 
 #define DEFAULT_DISK_SIZE               (1024 * 1024)
+#define DEFAULT_CPUS_PER_QUEUE          1
+#define DEFAULT_MEMORY_BUDGET           0 /* No compression. */
+#define DEFAULT_LAZY_LOAD               0
+#define DEFAULT_QUOTA                   0 /* Only limited by the pool. */
+#define DEFAULT_POOL_SIZE               0 /* No limit. */
+#define DEFAULT_TRACE_RECORDS           0 /* No tracing. */
+#define DEFAULT_NUMA_POLICY             RAMDISK_NUMA_NONE
+#define DEFAULT_NUMA_STRIPE             (4 * 1024 * 1024)
+#define DEFAULT_SPLIT_THRESHOLD         0 /* No split unless tools/splitbench shows a gain on the host. */
+#define DEFAULT_SPLIT_WORKERS           0 /* One per processor but one. */
+#define DEFAULT_LARGE_PAGES             0
+#define DEFAULT_CACHE_SIZE              0 /* No cache: the whole disk is in memory. */
+#define DEFAULT_FLUSH_INTERVAL          5000 /* Milliseconds. */
+#define DEFAULT_DIRTY_LIMIT             0 /* A quarter of the cache. */
+#define DEFAULT_MIN_RESIDENT            0 /* Everything can be spilled. */
+#define DEFAULT_SECTOR_SIZE             512
+#define DEFAULT_PHYSICAL_SECTOR_SIZE    4096 /* 512e. */
+
+#define LOW_MEMORY_EVENT                L"\\KernelObjects\\LowMemoryCondition"
+
+#define COMPRESSION_PERIOD              1000 /* Milliseconds (also the period of the spill policy). */
+
+#define PREFETCH_PRIORITY               (LOW_PRIORITY + 1)
+#define PREFETCH_BACKOFF                10 /* Milliseconds. */
+
+#define THROTTLE_WAIT                   100 /* Milliseconds. */
+#define THROTTLE_MAX_WAITS              50
 
 typedef struct {
-	ULONG disk_size; /* Size in bytes. */
+	ULONGLONG disk_size; /* Size in bytes. */
+	ULONG cpus_per_queue; /* Processors sharing a per-CPU request context. */
+	ULONGLONG memory_budget; /* Compress cold chunks above this memory use (0: never). */
+	UNICODE_STRING image_file; /* Disk image saved across reboots (empty: none). */
+	ULONG lazy_load; /* Load the image on demand instead of in EvtDriverDeviceAdd. */
+	ULONGLONG quota; /* Memory of the chunks of the disk (0: only limited by the pool). */
+	ULONG trace_records; /* Records of the trace ring of each CPU queue (0: no tracing). */
+	ULONG numa_policy; /* Placement of the chunks on the NUMA nodes (RAMDISK_NUMA_xxx). */
+	ULONGLONG numa_stripe; /* Bytes placed on a node before moving to the next (RAMDISK_NUMA_INTERLEAVE). */
+	ULONGLONG cache_size; /* Memory caching the image file, used as a raw backing file (0: no cache). */
+	ULONG flush_interval; /* Milliseconds between the flushes of the cache. */
+	ULONGLONG dirty_limit; /* Dirty bytes of the cache above which the writes wait for the flushes. */
+	UNICODE_STRING spill_file; /* Cold chunks are spilled to this file under memory pressure (empty: never). */
+	ULONGLONG min_resident; /* Memory of the chunks which is never spilled. */
+	ULONG sector_size; /* Logical sector size, the unit of the requests (512 or 4096). */
+	ULONG physical_sector_size; /* Reported for the alignment of the I/O (at least sector_size). */
 	UCHAR partition_type;
 } DISK_INFO;
 
 typedef struct {
-	UCHAR          *disk_image;                              /* Pointer to beginning of disk image. */
+	ULONGLONG pool_size; /* Memory of all the disks (0: no limit). */
+	ULONGLONG split_threshold; /* Transfers copied in parallel from this size (0: never). */
+	ULONG split_workers; /* Threads copying the parts of those transfers (0: one per processor but one). */
+	ULONG large_pages; /* Carve the chunks from large pages. */
+} DRIVER_INFO;
+
+typedef struct {
+	CHUNK_POOL     pool;                                     /* Memory shared by all the disks. */
+	SPLIT_POOL     split_pool;                               /* Threads copying the parts of the large transfers. */
+	WDFWAITLOCK    lock;                                     /* Protects the disk numbers and the clones. */
+	ULONG          disks;                                    /* Bitmap of the disk numbers in use. */
+	WDFCOLLECTION  clones;                                   /* Devices created by IOCTL_RAMDISK_SNAPSHOT/CLONE. */
+	volatile LONG  last_clone;                               /* Number of the last clone created. */
+	PKEVENT        low_memory;                               /* Signaled while the system is low on memory (NULL: unknown). */
+	HANDLE         low_memory_handle;
+} DRIVER_EXTENSION;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DRIVER_EXTENSION, DriverGetExtension)
+
+/* Chunks being spilled together, locked until they are in the spill file. */
+typedef struct {
+	RANGE_LOCK_ENTRY entries[SPILL_MAX_BATCH];
+	ULONGLONG        indexes[SPILL_MAX_BATCH];
+	UCHAR            *buffer;                                /* SPILL.buffer_size bytes. */
+} SPILL_WORK;
+
+typedef struct {
+	CHUNK_TABLE    chunk_table;                              /* Disk image. */
+	CHUNK_QUOTA    quota;                                    /* Share of the pool (the clones use the quota of their disk). */
 	DISK_GEOMETRY  disk_geometry;                            /* Drive parameters. */
 	DISK_INFO      disk_info;                                /* Disk parameters. */
+	RANGE_LOCK     range_lock;                               /* Serializes overlapping requests. */
+	CPU_QUEUES     cpu_queues;                               /* Per-CPU request contexts and counters. */
+	ULONGLONG      timestamp_frequency;                      /* Of the request timestamps. */
+	WDFTIMER       compression_timer;                        /* Checks the memory budget and the memory pressure. */
+	WDFWORKITEM    compression_work_item;                    /* Compresses and spills cold chunks. */
+	WDFQUEUE       passive_queue;                            /* Requests handled at PASSIVE_LEVEL. */
+	BOOLEAN        save_image;                               /* The image file can be overwritten. */
+	IMAGE_FILE     image;                                    /* Image file, kept open for the checkpoints. */
+	KMUTEX         image_mutex;                              /* Serializes the saves and checkpoints. */
+	ATOMIC_BITMAP  dirty_chunks;                             /* Chunks changed since the last checkpoint. */
+	IMAGE_LOADER   image_loader;                             /* Lazy loading of the image. */
+	WDFQUEUE       load_queue;                               /* Requests waiting for their chunks to be loaded. */
+	UCHAR          *load_buffer;                             /* Buffer of the load queue. */
+	PKTHREAD       prefetch_thread;                          /* Loads the rest of the image. */
+	volatile LONG  stop_prefetch;
+	ULONGLONG      load_start;                               /* Interrupt time when the lazy loading started. */
+	CACHE          cache;                                    /* Write-back cache of the backing file (CacheSize). */
+	PKTHREAD       flusher_thread;                           /* Writes back the dirty chunks and evicts the clean ones. */
+	KEVENT         flush_event;                              /* Wakes up the flusher before its interval. */
+	KEVENT         flushed_event;                            /* Signaled after each pass of the flusher. */
+	volatile LONG  stop_flusher;
+	SPILL          spill;                                    /* Spill file of the cold chunks (SpillFile). */
+	SPILL_WORK     *spill_work;                              /* Allocated beforehand: it is needed when memory is short. */
+	MAPPING_SET    mappings;                                 /* Views of the disk in processes (IOCTL_RAMDISK_MAP). */
+	UNICODE_STRING device_name;
+	WCHAR          device_name_buffer[MAX_DEVICE_NAME];
+	ULONG          disk_number;                              /* Disk (the clones have the number of their disk). */
+	ULONG          clone_number;                             /* 0 if the device is not a clone. */
+	BOOLEAN        read_only;                                /* Snapshot. */
 } DEVICE_EXTENSION;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_EXTENSION, DeviceGetExtension)
@@ -38,7 +155,25 @@ typedef struct {
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_EXTENSION, QueueGetExtension)
 
+typedef struct {
+	WDFREQUEST       request;
+	UCHAR            operation;
+	ULONGLONG        offset;          /* Bytes read or written (the range might cover whole chunks). */
+	ULONGLONG        length;
+	RANGE_LOCK_ENTRY range;
+	KEVENT           *granted;        /* REQUEST_WAIT: signaled when the range is granted. */
+	ULONGLONG        start_time;      /* Timestamp when the request arrived. */
+	ULONGLONG        dispatch_time;   /* Timestamp when its range was granted (traced requests only). */
+	ULONG            counters;        /* Index of the counters of the operation. */
+	BOOLEAN          throttled;       /* The write has already waited for the flusher. */
+	RAMDISK_BATCH    *batch;          /* REQUEST_BATCH_*: the header of the descriptors (input buffer). */
+	UCHAR            *batch_buffer;   /* REQUEST_BATCH_*: the statuses and the data (output buffer). */
+} REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, RequestGetContext)
+
 DRIVER_INITIALIZE DriverEntry;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP EvtDriverCleanup;
 
 EVT_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd;
 EVT_WDF_DEVICE_CONTEXT_CLEANUP EvtCleanupCallback;
@@ -46,14 +181,86 @@ EVT_WDF_DEVICE_CONTEXT_CLEANUP EvtCleanupCallback;
 EVT_WDF_IO_QUEUE_IO_READ EvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE EvtIoWrite;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoPassiveDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEFAULT EvtIoLoad;
+EVT_WDFDEVICE_WDM_IRP_PREPROCESS EvtDeviceShutdown;
+EVT_WDFDEVICE_WDM_IRP_PREPROCESS EvtDeviceControlPreprocess;
+EVT_WDFDEVICE_WDM_IRP_PREPROCESS EvtDeviceCleanup;
+
+void start_request(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in ULONG counters);
+void complete_request(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in NTSTATUS status, __in ULONG_PTR information);
+ULONG counters_index(__in ULONG code);
+NTSTATUS query_statistics(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
+NTSTATUS query_numa(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
+
+void dispatch_request(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in ULONGLONG start, __in ULONGLONG end, __in UCHAR operation);
+void execute_requests(__in DEVICE_EXTENSION *device_extension, __in RANGE_LOCK_ENTRY *head);
+RANGE_LOCK_ENTRY *execute_request(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context);
+RANGE_LOCK_ENTRY *finish_request(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context, __in NTSTATUS status, __in SIZE_T length);
+SPLIT_COMPLETION complete_split;
+void wait_for_range(__in DEVICE_EXTENSION *device_extension, __out REQUEST_CONTEXT *context, __in ULONGLONG start, __in ULONGLONG end, __in BOOLEAN exclusive);
+void release_range(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context);
+RANGE_LOCK_ENTRY *forward_to_load_queue(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context);
+void claim_chunks(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context);
+void claim_range(__in DEVICE_EXTENSION *device_extension, __in ULONGLONG offset, __in ULONGLONG length);
+BOOLEAN chunks_loaded(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context);
+NTSTATUS load_chunks(__in DEVICE_EXTENSION *device_extension, __in REQUEST_CONTEXT *context);
+NTSTATUS load_range(__in DEVICE_EXTENSION *device_extension, __in ULONGLONG offset, __in ULONGLONG length);
+
+NTSTATUS restore_image(__in DEVICE_EXTENSION *device_extension);
+NTSTATUS create_load_objects(__in WDFDEVICE device);
+KSTART_ROUTINE prefetch;
+NTSTATUS load_image(__in DEVICE_EXTENSION *device_extension);
+NTSTATUS save_image(__in DEVICE_EXTENSION *device_extension);
+NTSTATUS checkpoint_image(__in DEVICE_EXTENSION *device_extension);
+NTSTATUS write_image(__in DEVICE_EXTENSION *device_extension);
+NTSTATUS write_dirty_chunks(__in DEVICE_EXTENSION *device_extension);
+
+NTSTATUS open_cache(__in DEVICE_EXTENSION *device_extension);
+NTSTATUS create_flusher(__in DEVICE_EXTENSION *device_extension);
+KSTART_ROUTINE flusher;
+NTSTATUS flush_cache(__in DEVICE_EXTENSION *device_extension, __in BOOLEAN wait);
+void evict_chunks(__in DEVICE_EXTENSION *device_extension);
+void throttle_writes(__in DEVICE_EXTENSION *device_extension);
+
+NTSTATUS open_spill(__in DEVICE_EXTENSION *device_extension);
+void spill_cold_chunks(__in DEVICE_EXTENSION *device_extension);
 
-void query_disk_parameters(__in PWSTR regpath, __in DISK_INFO *disk_info);
+NTSTATUS create_queues(__in WDFDEVICE device, __out WDFQUEUE *queue);
+NTSTATUS create_clone(__in DEVICE_EXTENSION *device_extension, __in BOOLEAN read_only, __out ULONG *number);
+NTSTATUS delete_clone(__in ULONG number);
+void delete_clones(__in ULONG disk_number);
+
+NTSTATUS assign_disk_number(__out ULONG *number);
+void release_disk_number(__in ULONG number);
+
+NTSTATUS resize_disk(__in DEVICE_EXTENSION *device_extension, __in ULONGLONG disk_size);
+NTSTATUS read_trace(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __out ULONG_PTR *information);
+
+EVT_WDF_TIMER EvtCompressionTimer;
+EVT_WDF_WORKITEM EvtCompressionWorkItem;
+NTSTATUS create_compression_objects(__in WDFDEVICE device);
+
+void query_disk_parameters(__in PWSTR regpath, __in ULONG number, __in DISK_INFO *disk_info);
+NTSTATUS query_parameters(__in PWSTR regpath, __in PWSTR key, __in BOOLEAN files, __inout DISK_INFO *disk_info);
+void query_driver_parameters(__in PWSTR regpath, __out DRIVER_INFO *driver_info);
+RTL_QUERY_REGISTRY_ROUTINE query_ulonglong;
 
 void set_disk_geometry(__in DEVICE_EXTENSION *device_extension);
-NTSTATUS query_device_name(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
-NTSTATUS query_unique_id(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
+NTSTATUS query_device_name(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
+NTSTATUS query_unique_id(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
 NTSTATUS get_length_info(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
 NTSTATUS get_hotplug_info(__in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
+NTSTATUS query_property(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters, __out size_t *length);
+
+void manage_data_set_attributes(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters);
+NTSTATUS trim(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request);
+
+void dispatch_batch(__in DEVICE_EXTENSION *device_extension, __in WDFREQUEST request, __in WDF_REQUEST_PARAMETERS parameters);
+
+NTSTATUS assign_mapping_callbacks(__in PWDFDEVICE_INIT device_init);
+NTSTATUS map_range(__in DEVICE_EXTENSION *device_extension, __in PIRP irp, __in BOOLEAN writable, __out ULONG_PTR *information);
+NTSTATUS unmap_range(__in DEVICE_EXTENSION *device_extension, __in PFILE_OBJECT owner, __in void *address);
 
 BOOLEAN check_parameters(__in DEVICE_EXTENSION *device_extension, __in LARGE_INTEGER offset, __in size_t length);
 
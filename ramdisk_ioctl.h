@@ -0,0 +1,151 @@
+#ifndef RAMDISK_IOCTL_H
+#define RAMDISK_IOCTL_H
+
+#include "trace_format.h"
+#include "batch_format.h"
+
+/*
+ * Private control codes of the ramdisk (also used by user-mode programs,
+ * which must include <winioctl.h> first).
+ */
+
+/* Save the disk image to the image file (ImageFile registry value). */
+#define IOCTL_RAMDISK_SAVE_IMAGE        CTL_CODE(FILE_DEVICE_DISK, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/* Write the chunks changed since the last checkpoint to the image file. */
+#define IOCTL_RAMDISK_CHECKPOINT        CTL_CODE(FILE_DEVICE_DISK, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*
+ * Create a read-only (snapshot) or writable (clone) copy of the disk, which
+ * shares the chunks with it until they are written. The copy is the device
+ * \\.\RamdiskClone<number>; the number is returned in a RAMDISK_CLONE.
+ */
+#define IOCTL_RAMDISK_SNAPSHOT          CTL_CODE(FILE_DEVICE_DISK, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_RAMDISK_CLONE             CTL_CODE(FILE_DEVICE_DISK, 0x803, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/* Delete the copy whose number is passed in a RAMDISK_CLONE. */
+#define IOCTL_RAMDISK_DELETE_CLONE      CTL_CODE(FILE_DEVICE_DISK, 0x804, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+typedef struct {
+	ULONG number;
+} RAMDISK_CLONE;
+
+/*
+ * Change the size of the disk (a multiple of the sector size) while it is in use.
+ * The disk can only shrink if the part removed has never been written, or
+ * has been trimmed. The I/O stops while the new size is installed. The
+ * volumes see the new size after IOCTL_DISK_UPDATE_PROPERTIES.
+ */
+#define IOCTL_RAMDISK_RESIZE            CTL_CODE(FILE_DEVICE_DISK, 0x805, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+typedef struct {
+	ULONGLONG disk_size;
+} RAMDISK_RESIZE;
+
+/*
+ * Per-operation counters of the disk since it was created, returned in a
+ * RAMDISK_STATISTICS. "code" is RAMDISK_OPERATION_READ, _WRITE, _OTHER_IOCTL
+ * (the control codes which are not counted separately) or a control code.
+ * latency[i] counts the requests completed in [2^(8 + i), 2^(9 + i)) ns;
+ * latency[0] also those faster and the last bucket those slower.
+ */
+#define IOCTL_RAMDISK_QUERY_STATISTICS  CTL_CODE(FILE_DEVICE_DISK, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define RAMDISK_OPERATION_READ          1
+#define RAMDISK_OPERATION_WRITE         2
+#define RAMDISK_OPERATION_OTHER_IOCTL   3
+
+#define RAMDISK_LATENCY_BUCKETS         24
+#define RAMDISK_MAX_OPERATIONS          32
+
+typedef struct {
+	ULONG     code;
+	ULONG     reserved;
+	ULONGLONG requests;                  /* Completed. */
+	ULONGLONG bytes;                     /* Transferred by the successful requests. */
+	ULONGLONG errors;
+	LONGLONG  in_flight;
+	ULONGLONG latency[RAMDISK_LATENCY_BUCKETS];
+} RAMDISK_OPERATION_STATISTICS;
+
+typedef struct {
+	ULONG                        noperations;
+	ULONG                        reserved;
+	RAMDISK_OPERATION_STATISTICS operations[RAMDISK_MAX_OPERATIONS];
+} RAMDISK_STATISTICS;
+
+/*
+ * Take the records of the trace of the requests (TraceRecords registry
+ * value) which have not been read yet. The output buffer receives a
+ * RAMDISK_TRACE followed by as many records as fit (see trace_format.h).
+ */
+#define IOCTL_RAMDISK_READ_TRACE        CTL_CODE(FILE_DEVICE_DISK, 0x807, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*
+ * Placement of the disk's memory on the NUMA nodes (NumaPolicy and
+ * NumaStripe registry values). With RAMDISK_NUMA_INTERLEAVE the disk is
+ * dealt to the nodes in stripes of "stripe_size" bytes; with
+ * RAMDISK_NUMA_PARTITION node i has the region of "region_size" bytes at
+ * i * region_size (the last node also what is beyond). node_bytes[i] is the
+ * memory of the disk and its clones placed on node i. On systems with a
+ * single node the policy is RAMDISK_NUMA_NONE.
+ */
+#define IOCTL_RAMDISK_QUERY_NUMA        CTL_CODE(FILE_DEVICE_DISK, 0x808, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define RAMDISK_NUMA_NONE               0
+#define RAMDISK_NUMA_INTERLEAVE         1
+#define RAMDISK_NUMA_PARTITION          2
+
+#define RAMDISK_MAX_NUMA_NODES          16
+
+typedef struct {
+	ULONG     policy;
+	ULONG     nodes;
+	ULONGLONG stripe_size;
+	ULONGLONG region_size;
+	ULONGLONG node_bytes[RAMDISK_MAX_NUMA_NODES];
+} RAMDISK_NUMA_INFO;
+
+/*
+ * Execute a batch of reads and writes with a single request (see
+ * batch_format.h). The descriptors are all validated before any of them is
+ * executed: if one is invalid, the request fails and nothing is done.
+ * Then they are executed in order, with their own status, and the request
+ * returns the bytes transferred by those which succeeded. The batch locks
+ * the disk from the first byte of its descriptors to the last one (for
+ * writing if any of them writes): the descriptors of a batch should be
+ * close to each other.
+ */
+#define IOCTL_RAMDISK_BATCH             CTL_CODE(FILE_DEVICE_DISK, 0x809, METHOD_OUT_DIRECT, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/*
+ * Map a range of the disk (a RAMDISK_MAP_RANGE, sector aligned) in the
+ * address space of the calling process, read-only or writable; the address
+ * of its first byte is returned in a RAMDISK_MAP_ADDRESS. The process
+ * accesses the memory of the disk directly: the requests see what it writes
+ * and the other way round, and it has to coordinate with them as with any
+ * other writer. The caller needs SeManageVolumePrivilege (and a handle with
+ * write access to map writable views), and the views are removed with
+ * IOCTL_RAMDISK_UNMAP (which takes the address returned) or when the handle
+ * they were created with is closed, at the latest when the process exits.
+ * Read-only disks (snapshots) and the disks with a cache or a spill file
+ * can't be mapped, nor those whose image is still being loaded; a disk with
+ * views can't be cloned, nor shrunk below them. A view covers at most
+ * RAMDISK_MAP_MAX_LENGTH bytes.
+ */
+#define IOCTL_RAMDISK_MAP               CTL_CODE(FILE_DEVICE_DISK, 0x80A, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_RAMDISK_MAP_WRITABLE      CTL_CODE(FILE_DEVICE_DISK, 0x80B, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_RAMDISK_UNMAP             CTL_CODE(FILE_DEVICE_DISK, 0x80C, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define RAMDISK_MAP_MAX_LENGTH          (1024 * 1024 * 1024)
+
+typedef struct {
+	ULONGLONG offset;
+	ULONGLONG length;
+} RAMDISK_MAP_RANGE;
+
+typedef struct {
+	ULONGLONG address;
+} RAMDISK_MAP_ADDRESS;
+
+#endif /* RAMDISK_IOCTL_H */
@@ -0,0 +1,147 @@
+#include "range_lock.h"
+
+#define OVERLAP(a, b)                   (((a)->start < (b)->end) && ((b)->start < (a)->end))
+#define CONFLICT(a, b)                  ((((a)->exclusive) || ((b)->exclusive)) && (OVERLAP((a), (b))))
+
+static BOOLEAN can_be_granted(__in RANGE_LOCK_ENTRY *entry);
+
+void range_lock_init(__out RANGE_LOCK *range_lock)
+{
+	port_lock_init(&range_lock->lock);
+
+	range_lock->head = NULL;
+	range_lock->tail = NULL;
+}
+
+void range_lock_destroy(__in RANGE_LOCK *range_lock)
+{
+	ASSERT(!range_lock->head);
+
+	port_lock_destroy(&range_lock->lock);
+}
+
+BOOLEAN range_lock_acquire(__in RANGE_LOCK *range_lock, __out RANGE_LOCK_ENTRY *entry, __in ULONGLONG start, __in ULONGLONG end, __in BOOLEAN exclusive)
+{
+	PORT_LOCK_STATE state;
+	BOOLEAN granted;
+
+	entry->start = start;
+	entry->end = end;
+	entry->exclusive = exclusive;
+	entry->next_granted = NULL;
+
+	port_lock_acquire(&range_lock->lock, &state);
+
+	/* Append the entry to the list. */
+	entry->prev = range_lock->tail;
+	entry->next = NULL;
+
+	if (range_lock->tail) {
+		range_lock->tail->next = entry;
+	} else {
+		range_lock->head = entry;
+	}
+
+	range_lock->tail = entry;
+
+	granted = can_be_granted(entry);
+	entry->granted = granted;
+
+	port_lock_release(&range_lock->lock, state);
+
+	return granted;
+}
+
+BOOLEAN range_lock_try_acquire(__in RANGE_LOCK *range_lock, __out RANGE_LOCK_ENTRY *entry, __in ULONGLONG start, __in ULONGLONG end, __in BOOLEAN exclusive)
+{
+	PORT_LOCK_STATE state;
+	BOOLEAN granted;
+
+	entry->start = start;
+	entry->end = end;
+	entry->exclusive = exclusive;
+	entry->next_granted = NULL;
+
+	port_lock_acquire(&range_lock->lock, &state);
+
+	/* Check against all the entries, as if the entry was appended at the tail. */
+	entry->prev = range_lock->tail;
+	entry->next = NULL;
+
+	if ((granted = can_be_granted(entry)) != FALSE) {
+		if (range_lock->tail) {
+			range_lock->tail->next = entry;
+		} else {
+			range_lock->head = entry;
+		}
+
+		range_lock->tail = entry;
+
+		entry->granted = TRUE;
+	}
+
+	port_lock_release(&range_lock->lock, state);
+
+	return granted;
+}
+
+RANGE_LOCK_ENTRY *range_lock_release(__in RANGE_LOCK *range_lock, __in RANGE_LOCK_ENTRY *entry)
+{
+	RANGE_LOCK_ENTRY *first;
+	RANGE_LOCK_ENTRY *last;
+	RANGE_LOCK_ENTRY *e;
+	PORT_LOCK_STATE state;
+
+	ASSERT(entry->granted);
+
+	first = NULL;
+	last = NULL;
+
+	port_lock_acquire(&range_lock->lock, &state);
+
+	/* Unlink the entry. */
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		range_lock->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		range_lock->tail = entry->prev;
+	}
+
+	/* Only the waiters which overlap the released range might be granted now. */
+	for (e = entry->next; e; e = e->next) {
+		if ((!e->granted) && (OVERLAP(e, entry)) && (can_be_granted(e))) {
+			e->granted = TRUE;
+			e->next_granted = NULL;
+
+			if (last) {
+				last->next_granted = e;
+			} else {
+				first = e;
+			}
+
+			last = e;
+		}
+	}
+
+	port_lock_release(&range_lock->lock, state);
+
+	return first;
+}
+
+BOOLEAN can_be_granted(__in RANGE_LOCK_ENTRY *entry)
+{
+	RANGE_LOCK_ENTRY *e;
+
+	for (e = entry->prev; e; e = e->prev) {
+		if (CONFLICT(e, entry)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
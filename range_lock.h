@@ -0,0 +1,48 @@
+#ifndef RANGE_LOCK_H
+#define RANGE_LOCK_H
+
+#include "port.h"
+
+/*
+ * Byte-range lock.
+ * Shared (read) ranges are compatible with each other; an exclusive (write)
+ * range conflicts with every range it overlaps. Ranges are granted in
+ * arrival order: an entry waits for all the conflicting entries which
+ * arrived before it, whether they have been granted or not.
+ * Acquiring never blocks: an entry which cannot be granted immediately is
+ * queued and returned later by range_lock_release() to the caller, which
+ * must then perform the operation on behalf of the waiter.
+ */
+
+typedef struct _RANGE_LOCK_ENTRY {
+	struct _RANGE_LOCK_ENTRY *prev;
+	struct _RANGE_LOCK_ENTRY *next;
+	struct _RANGE_LOCK_ENTRY *next_granted; /* Chain returned by range_lock_release(). */
+
+	ULONGLONG start; /* First byte. */
+	ULONGLONG end;   /* Last byte + 1. */
+
+	BOOLEAN exclusive;
+	BOOLEAN granted;
+} RANGE_LOCK_ENTRY;
+
+typedef struct {
+	PORT_LOCK lock;
+
+	RANGE_LOCK_ENTRY *head;
+	RANGE_LOCK_ENTRY *tail;
+} RANGE_LOCK;
+
+void range_lock_init(__out RANGE_LOCK *range_lock);
+void range_lock_destroy(__in RANGE_LOCK *range_lock);
+
+/* Returns TRUE if the range has been granted. */
+BOOLEAN range_lock_acquire(__in RANGE_LOCK *range_lock, __out RANGE_LOCK_ENTRY *entry, __in ULONGLONG start, __in ULONGLONG end, __in BOOLEAN exclusive);
+
+/* Like range_lock_acquire(), but the entry is not queued if it cannot be granted. */
+BOOLEAN range_lock_try_acquire(__in RANGE_LOCK *range_lock, __out RANGE_LOCK_ENTRY *entry, __in ULONGLONG start, __in ULONGLONG end, __in BOOLEAN exclusive);
+
+/* Returns the chain (linked through next_granted) of the entries granted by the release. */
+RANGE_LOCK_ENTRY *range_lock_release(__in RANGE_LOCK *range_lock, __in RANGE_LOCK_ENTRY *entry);
+
+#endif /* RANGE_LOCK_H */
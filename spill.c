@@ -0,0 +1,297 @@
+#include "spill.h"
+
+/******************************************************************************
+ ******************************************************************************
+ **                                                                          **
+ ** Spill of cold chunks to a local file under memory pressure.              **
+ **                                                                          **
+ ******************************************************************************
+ ******************************************************************************/
+
+static ULONG alloc_slots(__in SPILL *spill, __in ULONG count, __out ULONGLONG *slot);
+static void free_slot(__in SPILL *spill, __in CHUNK *chunk);
+static NTSTATUS transfer_slots(__in SPILL *spill, __in BOOLEAN write, __in ULONGLONG slot, __in ULONG count, __inout UCHAR *buffer);
+
+NTSTATUS spill_open(__out SPILL *spill, __in CHUNK_TABLE *table, __in PORT_PATH path, __in ULONGLONG min_resident)
+{
+	NTSTATUS status;
+
+	RtlZeroMemory(spill, sizeof(SPILL));
+
+	/* The slot is kept in a ULONG. */
+	if (table->nchunks > (ULONG) -1) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	status = atomic_bitmap_init(&spill->slots, table->nchunks);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* Whatever the file had belongs to a previous life of the disk. */
+	status = port_file_open(&spill->file, path, TRUE);
+	if (!NT_SUCCESS(status)) {
+		atomic_bitmap_free(&spill->slots);
+		return status;
+	}
+
+	/* The clock needs to know which chunks are in use. */
+	chunk_table_track_references(table);
+
+	spill->chunk_shift = table->chunk_shift;
+	spill->buffer_size = SPILL_MAX_BATCH << table->chunk_shift;
+	spill->min_resident = min_resident;
+	spill->open = TRUE;
+
+	return STATUS_SUCCESS;
+}
+
+void spill_close(__in SPILL *spill)
+{
+	if (spill->open) {
+		port_file_close(&spill->file);
+		atomic_bitmap_free(&spill->slots);
+
+		spill->open = FALSE;
+	}
+}
+
+ULONGLONG spill_target(__in SPILL *spill, __in ULONGLONG used, __in BOOLEAN pressure)
+{
+	LONGLONG spilled;
+	LONGLONG faulted;
+	ULONGLONG step;
+
+	spilled = spill->spilled - spill->last_spilled;
+	faulted = spill->faulted - spill->last_faulted;
+
+	spill->last_spilled = spill->spilled;
+	spill->last_faulted = spill->faulted;
+
+	if (!pressure) {
+		if ((spill->active) && (++spill->calm_periods >= SPILL_CALM_PERIODS)) {
+			spill->active = FALSE;
+		}
+
+		return used;
+	}
+
+	spill->calm_periods = 0;
+
+	step = used >> SPILL_STEP_SHIFT;
+
+	/* What has just been spilled is coming back: the hot set doesn't fit. */
+	if (faulted > spilled / 2) {
+		step >>= 2;
+	}
+
+	if (!spill->active) {
+		spill->active = TRUE;
+		spill->target = used - step;
+	} else if (used <= spill->target) {
+		spill->target = used - step;
+	}
+
+	if (spill->target < spill->min_resident) {
+		spill->target = spill->min_resident;
+	}
+
+	return (spill->target < used) ? spill->target : used;
+}
+
+NTSTATUS spill_chunks(__in SPILL *spill, __in CHUNK_TABLE *table, __in const ULONGLONG *indexes, __in ULONG count, __in UCHAR *buffer)
+{
+	ULONGLONG victims[SPILL_MAX_BATCH];
+	ULONGLONG slot;
+	ULONG nvictims;
+	ULONG nslots;
+	ULONG done;
+	ULONG i;
+	CHUNK *chunk;
+	BOOLEAN present;
+	NTSTATUS status;
+
+	ASSERT(count <= SPILL_MAX_BATCH);
+
+	/* The chunks might have been trimmed, compressed or faulted back since they were chosen. */
+	for (i = 0, nvictims = 0; i < count; i++) {
+		chunk = chunk_table_get_chunk(table, indexes[i]);
+
+		if ((chunk->data) && (!chunk->refs) && (!(chunk->flags & (CHUNK_COMPRESSED | CHUNK_NOT_LOADED)))) {
+			victims[nvictims++] = indexes[i];
+		}
+	}
+
+	/* Normally in a single run of slots. */
+	for (done = 0; done < nvictims; done += nslots) {
+		if ((nslots = alloc_slots(spill, nvictims - done, &slot)) == 0) {
+			return STATUS_DISK_FULL;
+		}
+
+		for (i = 0; i < nslots; i++) {
+			status = chunk_table_copy_chunk(table, victims[done + i], buffer + ((SIZE_T) i << spill->chunk_shift), &present);
+			if (!NT_SUCCESS(status)) {
+				atomic_bitmap_clear_range(&spill->slots, slot, nslots);
+				return status;
+			}
+		}
+
+		status = transfer_slots(spill, TRUE, slot, nslots, buffer);
+		if (!NT_SUCCESS(status)) {
+			atomic_bitmap_clear_range(&spill->slots, slot, nslots);
+			return status;
+		}
+
+		InterlockedIncrement64(&spill->transfers);
+
+		/* The data is in the file, drop it. */
+		for (i = 0; i < nslots; i++) {
+			chunk = chunk_table_get_chunk(table, victims[done + i]);
+
+			chunk_table_evict(table, victims[done + i]);
+
+			chunk->compressed_size = (ULONG) (slot + i);
+			InterlockedOr(&chunk->flags, CHUNK_SPILLED);
+		}
+
+		InterlockedExchangeAdd64(&spill->spilled, (LONGLONG) nslots);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS spill_load(__in SPILL *spill, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length, __out UCHAR *buffer)
+{
+	ULONGLONG index;
+	ULONGLONG last;
+	ULONGLONG first;
+	ULONGLONG end;
+	ULONGLONG i;
+	CHUNK *chunk;
+	NTSTATUS status;
+
+	if (length == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	index = offset >> table->chunk_shift;
+	last = (offset + length - 1) >> table->chunk_shift;
+
+	if (last >= table->nchunks) {
+		last = table->nchunks - 1;
+	}
+
+	while (index <= last) {
+		/* Skip the chunks which are loaded. */
+		for (; (index <= last) && (!(chunk_table_get_chunk(table, index)->flags & CHUNK_SPILLED)); index++);
+
+		if (index > last) {
+			break;
+		}
+
+		/* The following chunks which are in the following slots come in the same transfer. */
+		first = index;
+
+		for (end = first + 1;
+			 (end <= last) && (end - first < SPILL_MAX_BATCH) &&
+			 (chunk_table_get_chunk(table, end)->flags & CHUNK_SPILLED) &&
+			 (chunk_table_get_chunk(table, end)->compressed_size == chunk_table_get_chunk(table, first)->compressed_size + (end - first));
+			 end++);
+
+		status = transfer_slots(spill, FALSE, chunk_table_get_chunk(table, first)->compressed_size, (ULONG) (end - first), buffer);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		for (i = first; i < end; i++) {
+			chunk = chunk_table_get_chunk(table, i);
+
+			/* Not published yet: the chunk is still marked as not loaded. */
+			InterlockedAnd(&chunk->flags, ~CHUNK_SPILLED);
+			InterlockedOr(&chunk->flags, CHUNK_REFERENCED);
+
+			status = chunk_table_load_chunk(table, i, buffer + ((i - first) << table->chunk_shift));
+			if (!NT_SUCCESS(status)) {
+				InterlockedOr(&chunk->flags, CHUNK_SPILLED);
+				return status;
+			}
+
+			free_slot(spill, chunk);
+
+			InterlockedIncrement64(&spill->faulted);
+		}
+
+		index = end;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void spill_claim(__in SPILL *spill, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length)
+{
+	ULONGLONG index;
+	ULONGLONG end;
+	CHUNK *chunk;
+
+	index = (offset + ((ULONGLONG) 1 << table->chunk_shift) - 1) >> table->chunk_shift;
+	end = (offset + length) >> table->chunk_shift;
+
+	for (; index < end; index++) {
+		chunk = chunk_table_get_chunk(table, index);
+
+		if (chunk->flags & CHUNK_SPILLED) {
+			free_slot(spill, chunk);
+
+			InterlockedAnd(&chunk->flags, ~(CHUNK_SPILLED | CHUNK_NOT_LOADED));
+		}
+	}
+}
+
+ULONG alloc_slots(__in SPILL *spill, __in ULONG count, __out ULONGLONG *slot)
+{
+	ULONGLONG end;
+
+	/* Only the spiller allocates: the slots freed meanwhile only make more room. */
+	if ((!atomic_bitmap_find_clear(&spill->slots, spill->next_slot, slot)) &&
+		(!atomic_bitmap_find_clear(&spill->slots, 0, slot))) {
+		return 0;
+	}
+
+	for (end = *slot + 1; (end < spill->slots.nbits) && (end - *slot < count) && (!atomic_bitmap_test(&spill->slots, end)); end++);
+
+	atomic_bitmap_set_range(&spill->slots, *slot, end - *slot);
+
+	spill->next_slot = (end < spill->slots.nbits) ? end : 0;
+
+	return (ULONG) (end - *slot);
+}
+
+void free_slot(__in SPILL *spill, __in CHUNK *chunk)
+{
+	atomic_bitmap_clear_range(&spill->slots, chunk->compressed_size, 1);
+
+	chunk->compressed_size = 0;
+}
+
+NTSTATUS transfer_slots(__in SPILL *spill, __in BOOLEAN write, __in ULONGLONG slot, __in ULONG count, __inout UCHAR *buffer)
+{
+	PORT_FILE_IO io;
+	NTSTATUS status;
+
+	status = port_file_io_init(&io);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (write) {
+		port_file_begin_write(&spill->file, &io, slot << spill->chunk_shift, buffer, count << spill->chunk_shift);
+	} else {
+		port_file_begin_read(&spill->file, &io, slot << spill->chunk_shift, buffer, count << spill->chunk_shift);
+	}
+
+	status = port_file_wait(&io);
+
+	port_file_io_destroy(&io);
+
+	return status;
+}
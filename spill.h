@@ -0,0 +1,99 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include "port.h"
+#include "chunk_table.h"
+#include "bitmap.h"
+
+/*
+ * Spill of cold chunks to a local file under memory pressure.
+ * The file is divided in slots of one chunk, allocated from a bitmap. A
+ * spilled chunk has no data, is marked CHUNK_NOT_LOADED | CHUNK_SPILLED and
+ * keeps its slot in "compressed_size"; it is read back (faulted) the next
+ * time it is accessed, which frees the slot. The chunks spilled together go
+ * to consecutive slots and are written in a single transfer; consecutive
+ * chunks in consecutive slots are read back in a single transfer too.
+ * The file has no header: it is only valid while the disk exists, and it
+ * is truncated when opened.
+ * The caller serializes the accesses to the chunks with the range lock, as
+ * for the lazy loading of the images (IMAGE_LOADER).
+ *
+ * Policy (spill_target()), evaluated periodically with the memory pressure
+ * signal of the system:
+ *   - When the pressure appears, the target is set 1/2^SPILL_STEP_SHIFT
+ *     below the memory used, and the coldest chunks (clock of the chunk
+ *     table) are spilled down to it.
+ *   - While the pressure lasts, the target goes one more step down each
+ *     time it is reached. The target doesn't follow the memory used up:
+ *     what is faulted back meanwhile is spilled again if it gets cold.
+ *   - If the chunks spilled are being faulted back (more than half of the
+ *     chunks spilled in the period), the step is divided by 4: the hot
+ *     set doesn't fit, spilling faster would only thrash.
+ *   - Without pressure nothing is spilled; the targets are kept until there
+ *     has been no pressure for SPILL_CALM_PERIODS periods, so that a
+ *     pressure which flickers doesn't start over from the memory used.
+ *   - The chunks faulted back are marked as referenced (the clock gives
+ *     them a second chance) and the memory used never goes below
+ *     "min_resident".
+ */
+
+#define SPILL_MAX_BATCH                 16 /* Chunks per transfer. */
+#define SPILL_STEP_SHIFT                3
+#define SPILL_CALM_PERIODS              10
+
+typedef struct {
+	PORT_FILE         file;
+	BOOLEAN           open;
+	ATOMIC_BITMAP     slots;         /* Slots of the file in use (one per chunk of the disk at most). */
+	ULONGLONG         next_slot;     /* Where the search of free slots starts. */
+	ULONG             chunk_shift;
+	ULONG             buffer_size;   /* Size of the buffers passed to spill_chunks() and spill_load(). */
+	ULONGLONG         min_resident;  /* Memory which is never spilled. */
+
+	/* Policy. */
+	BOOLEAN           active;        /* There has been pressure lately. */
+	ULONG             calm_periods;  /* Periods without pressure. */
+	ULONGLONG         target;        /* Memory used to get down to. */
+	LONGLONG          last_spilled;  /* Statistics at the previous period. */
+	LONGLONG          last_faulted;
+
+	/* Statistics (chunks). */
+	volatile LONGLONG spilled;
+	volatile LONGLONG faulted;
+	volatile LONGLONG transfers;     /* Writes to the file. */
+} SPILL;
+
+/* Creates (or truncates) the spill file of the table. */
+NTSTATUS spill_open(__out SPILL *spill, __in CHUNK_TABLE *table, __in PORT_PATH path, __in ULONGLONG min_resident);
+void spill_close(__in SPILL *spill);
+
+/*
+ * Memory used (chunk_table_memory_used()) to get down to in this period,
+ * given the memory used now and whether the system is under pressure; the
+ * memory used itself if nothing has to be spilled. Called once per period.
+ */
+ULONGLONG spill_target(__in SPILL *spill, __in ULONGLONG used, __in BOOLEAN pressure);
+
+/* Next cold chunk which can be spilled; FALSE if there are none. */
+#define spill_next_victim(spill, table, index) chunk_table_next_victim((table), CHUNK_COMPRESSED, (index))
+
+/*
+ * Writes the chunks to free slots and drops their data; there must be no
+ * I/O on them. The chunks which no longer have data (or are compressed or
+ * shared) are skipped. "count" is at most SPILL_MAX_BATCH.
+ */
+NTSTATUS spill_chunks(__in SPILL *spill, __in CHUNK_TABLE *table, __in const ULONGLONG *indexes, __in ULONG count, __in UCHAR *buffer);
+
+/* Reads back the chunks of the range which are spilled. */
+NTSTATUS spill_load(__in SPILL *spill, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length, __out UCHAR *buffer);
+
+/*
+ * The chunks completely covered by a write or a trim don't have to be read
+ * back: their slots are freed and they read as zeros until written.
+ */
+void spill_claim(__in SPILL *spill, __in CHUNK_TABLE *table, __in ULONGLONG offset, __in ULONGLONG length);
+
+/* Some chunks are in the file: the requests have to check whether their chunks are loaded. */
+#define spill_pending(spill)            ((spill)->slots.count > 0)
+
+#endif /* SPILL_H */
@@ -0,0 +1,279 @@
+#include "split.h"
+#include "disk_io.h"
+
+static PORT_THREAD_ROUTINE worker;
+static BOOLEAN copy_part(__in SPLIT_PART *part);
+static void queue_part(__in SPLIT_POOL *pool, __in SPLIT_PART *part, __in ULONG node);
+
+#if !defined(RAMDISK_USER_MODE) && defined(ALLOC_PRAGMA)
+	#pragma alloc_text(PAGE, split_pool_init)
+	#pragma alloc_text(PAGE, split_pool_free)
+#endif
+
+NTSTATUS split_pool_init(__out SPLIT_POOL *pool, __in ULONG nthreads, __in SIZE_T threshold)
+{
+	SPLIT_QUEUE *queue;
+	NTSTATUS status;
+	ULONG nnodes;
+	ULONG i;
+
+	/* A queue per node with workers (a single one, of no node, without NUMA). */
+	nnodes = port_node_count();
+
+	pool->nqueues = ((nnodes > 1) && (nthreads > 1)) ? ((nthreads < nnodes) ? nthreads : nnodes) : 1;
+
+	for (i = 0; i < pool->nqueues; i++) {
+		queue = &pool->queues[i];
+
+		port_lock_init(&queue->lock);
+		port_semaphore_init(&queue->work);
+
+		queue->head = NULL;
+		queue->tail = NULL;
+		queue->node = (pool->nqueues > 1) ? i : PORT_NO_NODE;
+		queue->stop = FALSE;
+	}
+
+	pool->next_queue = 0;
+	pool->threads = NULL;
+	pool->nthreads = 0;
+	pool->threshold = threshold;
+
+	if ((nthreads == 0) || (threshold == 0)) {
+		return STATUS_SUCCESS;
+	}
+
+	if ((pool->threads = (PORT_THREAD *) port_alloc(nthreads * sizeof(PORT_THREAD))) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	/* The workers are dealt to the queues in turn; whatever threads could be created are used. */
+	for (; pool->nthreads < nthreads; pool->nthreads++) {
+		status = port_thread_create(&pool->threads[pool->nthreads], worker, &pool->queues[pool->nthreads % pool->nqueues]);
+		if (!NT_SUCCESS(status)) {
+			break;
+		}
+	}
+
+	/* Only the queues which got a worker are used. */
+	if (pool->nthreads < pool->nqueues) {
+		for (i = pool->nthreads; i < pool->nqueues; i++) {
+			port_semaphore_destroy(&pool->queues[i].work);
+			port_lock_destroy(&pool->queues[i].lock);
+		}
+
+		pool->nqueues = pool->nthreads;
+
+		if (pool->nthreads == 0) {
+			return status;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void split_pool_free(__in SPLIT_POOL *pool)
+{
+	SPLIT_QUEUE *queue;
+	ULONG nthreads;
+	ULONG i;
+
+	/* Nothing is queued any more: wake up the workers to let them exit. */
+	for (i = 0; i < pool->nqueues; i++) {
+		queue = &pool->queues[i];
+
+		ASSERT(!queue->head);
+
+		/* The workers of the queue are those of the same number modulo the queues. */
+		nthreads = (pool->nthreads / pool->nqueues) + ((i < pool->nthreads % pool->nqueues) ? 1 : 0);
+
+		queue->stop = TRUE;
+		port_semaphore_release(&queue->work, (LONG) nthreads);
+	}
+
+	for (i = 0; i < pool->nthreads; i++) {
+		port_thread_join(&pool->threads[i]);
+	}
+
+	if (pool->threads) {
+		port_free(pool->threads);
+		pool->threads = NULL;
+	}
+
+	pool->nthreads = 0;
+
+	for (i = 0; i < pool->nqueues; i++) {
+		port_semaphore_destroy(&pool->queues[i].work);
+		port_lock_destroy(&pool->queues[i].lock);
+	}
+
+	pool->nqueues = 0;
+}
+
+BOOLEAN split_execute(__in SPLIT_POOL *pool, __inout SPLIT_REQUEST *request, __in CHUNK_TABLE *table, __in UCHAR operation, __in ULONGLONG offset, __inout UCHAR *buffer, __in SIZE_T length)
+{
+	ULONGLONG chunk_mask;
+	ULONGLONG part_end;
+	ULONGLONG boundary;
+	ULONGLONG run;
+	ULONGLONG end;
+	SIZE_T part_size;
+	ULONG nodes[SPLIT_MAX_PARTS];
+	ULONG current_node;
+	ULONG nparts;
+	ULONG inline_part;
+	ULONG i;
+
+	request->table = table;
+	request->operation = operation;
+	request->status = STATUS_SUCCESS;
+
+	/* One part per worker and one for the caller, of whole chunks. */
+	nparts = pool->nthreads + 1;
+	if (nparts > SPLIT_MAX_PARTS) {
+		nparts = SPLIT_MAX_PARTS;
+	}
+
+	chunk_mask = ((ULONGLONG) 1 << table->chunk_shift) - 1;
+
+	part_size = (SIZE_T) (((length / nparts) + chunk_mask) & ~chunk_mask);
+	if (part_size == 0) {
+		part_size = (SIZE_T) chunk_mask + 1;
+	}
+
+	end = offset + length;
+
+	current_node = (pool->nqueues > 1) ? port_current_node() : PORT_NO_NODE;
+	inline_part = 0;
+
+	for (i = 0; offset < end; i++) {
+		/* The parts end at chunk boundaries, so that no chunk is shared by two of them; the last one takes the rest. */
+		part_end = (offset + part_size) & ~chunk_mask;
+		if ((part_end > end) || (i == nparts - 1)) {
+			part_end = end;
+		}
+
+		/* Keep the part on a node if it only has a little bit of the next one. */
+		run = numa_node_run(&table->numa, offset >> table->chunk_shift);
+
+		if ((i < nparts - 1) && (run < ((part_end - offset + chunk_mask) >> table->chunk_shift))) {
+			boundary = ((offset >> table->chunk_shift) + run) << table->chunk_shift;
+
+			if ((boundary < part_end) && (boundary - offset >= part_size / 2)) {
+				part_end = boundary;
+			}
+		}
+
+		nodes[i] = chunk_table_node(table, offset >> table->chunk_shift);
+
+		if ((nodes[i] == current_node) && (nodes[inline_part] != current_node)) {
+			inline_part = i;
+		}
+
+		request->parts[i].request = request;
+		request->parts[i].offset = offset;
+		request->parts[i].buffer = buffer;
+		request->parts[i].length = (SIZE_T) (part_end - offset);
+
+		buffer += request->parts[i].length;
+		offset = part_end;
+	}
+
+	nparts = i;
+	request->remaining = (LONG) nparts;
+
+	/* Queue the other parts. */
+	for (i = 0; i < nparts; i++) {
+		if (i != inline_part) {
+			queue_part(pool, &request->parts[i], nodes[i]);
+		}
+	}
+
+	/* The workers might have finished the other parts already. */
+	return copy_part(&request->parts[inline_part]);
+}
+
+void queue_part(__in SPLIT_POOL *pool, __in SPLIT_PART *part, __in ULONG node)
+{
+	SPLIT_QUEUE *queue;
+	PORT_LOCK_STATE state;
+
+	/* Nodes without a queue of their own share the queues of the others. */
+	if ((node == PORT_NO_NODE) || (pool->nqueues == 1)) {
+		queue = &pool->queues[(ULONG) InterlockedIncrement(&pool->next_queue) % pool->nqueues];
+	} else {
+		queue = &pool->queues[node % pool->nqueues];
+	}
+
+	part->next = NULL;
+
+	port_lock_acquire(&queue->lock, &state);
+
+	if (queue->tail) {
+		queue->tail->next = part;
+	} else {
+		queue->head = part;
+	}
+
+	queue->tail = part;
+
+	port_lock_release(&queue->lock, state);
+
+	port_semaphore_release(&queue->work, 1);
+}
+
+/* Returns TRUE if it was the last part of its request. */
+BOOLEAN copy_part(__in SPLIT_PART *part)
+{
+	SPLIT_REQUEST *request;
+	NTSTATUS status;
+
+	request = part->request;
+
+	status = disk_io_transfer(request->table, request->operation, part->offset, part->buffer, part->length);
+	if (!NT_SUCCESS(status)) {
+		InterlockedCompareExchange(&request->status, status, STATUS_SUCCESS);
+	}
+
+	/* The interlocked decrement also orders the copies before the completion. */
+	return (BOOLEAN) (InterlockedDecrement(&request->remaining) == 0);
+}
+
+void worker(__in void *context)
+{
+	SPLIT_QUEUE *queue;
+	SPLIT_PART *part;
+	PORT_LOCK_STATE state;
+
+	queue = (SPLIT_QUEUE *) context;
+
+	if (queue->node != PORT_NO_NODE) {
+		port_thread_set_node(queue->node);
+	}
+
+	for (;;) {
+		port_semaphore_wait(&queue->work);
+
+		port_lock_acquire(&queue->lock, &state);
+
+		if ((part = queue->head) != NULL) {
+			if ((queue->head = part->next) == NULL) {
+				queue->tail = NULL;
+			}
+		}
+
+		port_lock_release(&queue->lock, state);
+
+		if (!part) {
+			if (queue->stop) {
+				return;
+			}
+
+			continue;
+		}
+
+		if (copy_part(part)) {
+			part->request->completion(part->request);
+		}
+	}
+}
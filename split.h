@@ -0,0 +1,78 @@
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include "port.h"
+#include "chunk_table.h"
+
+/*
+ * Parallel copy of large transfers.
+ * A transfer is cut in parts of whole chunks: the worker threads of the
+ * pool copy all of them but one, which is copied by the thread which
+ * submits the transfer. Whoever finishes the last part completes the
+ * transfer, once, with the first error found.
+ * On NUMA systems the workers are spread over the nodes, each one running
+ * on the processors of its node, and a part is queued to the workers of
+ * the node holding its first chunk (a part ends at a node boundary when
+ * there is one in its second half). The submitting thread copies a part of
+ * its own node if there is one.
+ */
+#define SPLIT_MAX_PARTS                 16
+
+struct _SPLIT_REQUEST;
+
+/* Called by the worker which copies the last part. */
+typedef void SPLIT_COMPLETION(__in struct _SPLIT_REQUEST *request);
+
+typedef struct _SPLIT_PART {
+	struct _SPLIT_PART    *next;       /* Queue of the pool. */
+	struct _SPLIT_REQUEST *request;
+	ULONGLONG             offset;
+	UCHAR                 *buffer;
+	SIZE_T                length;
+} SPLIT_PART;
+
+typedef struct _SPLIT_REQUEST {
+	CHUNK_TABLE      *table;
+	UCHAR            operation;        /* REQUEST_READ or REQUEST_WRITE. */
+	volatile LONG    remaining;        /* Parts not copied yet. */
+	volatile LONG    status;           /* First error. */
+	SPLIT_COMPLETION *completion;
+	void             *context;         /* Of the completion routine. */
+	SPLIT_PART       parts[SPLIT_MAX_PARTS];
+} SPLIT_REQUEST;
+
+/* Parts waiting for the workers of a node. */
+typedef struct {
+	PORT_LOCK      lock;
+	SPLIT_PART     *head;
+	SPLIT_PART     *tail;
+	PORT_SEMAPHORE work;               /* Counts the parts queued. */
+	ULONG          node;               /* PORT_NO_NODE: the workers run anywhere. */
+	volatile LONG  stop;
+} SPLIT_QUEUE;
+
+typedef struct {
+	SPLIT_QUEUE    queues[PORT_MAX_NODES];
+	ULONG          nqueues;
+	volatile LONG  next_queue;         /* Parts of no particular node are dealt in turn. */
+	PORT_THREAD    *threads;
+	ULONG          nthreads;
+	SIZE_T         threshold;          /* Transfers split from this size (0: none). */
+} SPLIT_POOL;
+
+/* One queue per node (not more than threads). Without threads the pool never splits. PASSIVE_LEVEL only. */
+NTSTATUS split_pool_init(__out SPLIT_POOL *pool, __in ULONG nthreads, __in SIZE_T threshold);
+void split_pool_free(__in SPLIT_POOL *pool);
+
+#define split_pool_should_split(pool, length) \
+	(((pool)->nthreads > 0) && ((pool)->threshold > 0) && ((SIZE_T) (length) >= (pool)->threshold))
+
+/*
+ * Copies "length" bytes between "buffer" and the table (the caller holds
+ * the range). Returns TRUE if the transfer has finished when it returns,
+ * with its status in request->status; otherwise the completion routine is
+ * called by a worker later. "completion" and "context" must be set.
+ */
+BOOLEAN split_execute(__in SPLIT_POOL *pool, __inout SPLIT_REQUEST *request, __in CHUNK_TABLE *table, __in UCHAR operation, __in ULONGLONG offset, __inout UCHAR *buffer, __in SIZE_T length);
+
+#endif /* SPLIT_H */
@@ -0,0 +1,571 @@
+/*
+ * Benchmark of the batches of IOCTL_RAMDISK_BATCH in user mode: the same
+ * descriptors are executed one request at a time (validation, range lock,
+ * transfer and release for each one, as for EvtIoRead and EvtIoWrite) and
+ * then in batches (disk_io_check_batch() and disk_io_batch() under a single
+ * range), for several batch sizes. The cost of the framework for each
+ * request (the IRP, WdfRequestGetParameters, the completion) is not there
+ * in user mode, so the gain of the driver is larger than the one measured.
+ * Before the measures, the executor is checked against single requests.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o batchbench batchbench.c ../common/tools.c \
+ *       ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c ../../range_lock.c \
+ *       ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c ../../numa_layout.c ../../port_numa.c \
+ *       ../../port_page.c
+ *
+ * Usage: batchbench [options]
+ *   -s size      Disk size (K, M and G suffixes; default 256M).
+ *   -b size      Block size of the descriptors, 512 bytes to 1 MB (default 4K).
+ *   -t threads   Threads submitting requests (default 1).
+ *   -r percent   Reads, the rest are writes (default 100).
+ *   -n count     Descriptors per thread and batch size (default 200000).
+ *   -B sizes     Batch sizes, separated by commas (default 1,4,16,64,256).
+ *   -w size      The descriptors of a batch fall in a window of this size
+ *                (default 0: anywhere on the disk).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "disk_io.h"
+#include "range_lock.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-b size] [-t threads] [-r percent] [-n count] [-B sizes] [-w size]"
+#define MIN_BLOCK_SIZE                  512
+#define MAX_BLOCK_SIZE                  (1024 * 1024)
+#define SECTOR_SIZE                     512
+#define FILL_BLOCK_SIZE                 (1024 * 1024)
+#define MAX_BATCH_SIZES                 16
+#define DATA_ALIGNMENT                  4096 /* Of the data after the statuses. */
+
+typedef struct {
+	RANGE_LOCK_ENTRY range;            /* First member: the granted entries are cast back. */
+	volatile LONG    granted;
+} BATCH_REQUEST;
+
+typedef struct {
+	CHUNK_POOL    pool;
+	CHUNK_QUOTA   quota;
+	CHUNK_TABLE   chunk_table;
+	RANGE_LOCK    range_lock;
+	ATOMIC_BITMAP dirty_chunks;
+	ULONGLONG     disk_size;
+} BATCH_DISK;
+
+typedef struct {
+	BATCH_DISK          *disk;
+	pthread_t           thread;
+	ULONG               number;
+	ULONG               block_size;
+	ULONG               read_percent;
+	ULONGLONG           window;
+	ULONGLONG           count;
+	ULONG               batch_size;
+	BOOLEAN             batched;       /* Execute the batches as such, or one descriptor at a time. */
+
+	RAMDISK_BATCH_ENTRY *entries;
+	UCHAR               *buffer;       /* Statuses and data, as the output buffer of the request. */
+
+	ULONGLONG           elapsed;
+	ULONGLONG           ndescriptors;
+	ULONGLONG           errors;
+} BATCH_THREAD;
+
+BOOLEAN parse_batch_sizes(char *s, ULONG *sizes, ULONG *nsizes);
+ULONGLONG run(BATCH_THREAD *threads, ULONG nthreads, ULONG batch_size, BOOLEAN batched, ULONGLONG *errors);
+void acquire(BATCH_DISK *disk, BATCH_REQUEST *request, ULONGLONG start, ULONGLONG end, BOOLEAN exclusive);
+void release(BATCH_DISK *disk, BATCH_REQUEST *request);
+NTSTATUS execute_single(BATCH_DISK *disk, const RAMDISK_BATCH_ENTRY *entry, UCHAR *buffer);
+NTSTATUS execute_batch(BATCH_DISK *disk, const RAMDISK_BATCH_ENTRY *entries, ULONG count, UCHAR *buffer, ULONGLONG buffer_length);
+void *worker(void *arg);
+BOOLEAN check(BATCH_DISK *disk, ULONG block_size);
+
+int main(int argc, char **argv)
+{
+	BATCH_DISK disk;
+	BATCH_THREAD *threads;
+	ULONGLONG window;
+	ULONGLONG size;
+	ULONGLONG count;
+	ULONGLONG offset;
+	ULONGLONG single;
+	ULONGLONG batched;
+	ULONGLONG errors;
+	ULONGLONG buffer_size;
+	UCHAR *buffer;
+	ULONG sizes[MAX_BATCH_SIZES];
+	ULONG nsizes;
+	ULONG max_batch;
+	ULONG nthreads;
+	ULONG block_size;
+	ULONG read_percent;
+	ULONG i;
+	ULONG t;
+	int opt;
+
+	memset(&disk, 0, sizeof(disk));
+
+	disk.disk_size = 256ULL << 20;
+	block_size = 4096;
+	nthreads = 1;
+	read_percent = 100;
+	count = 200000;
+	window = 0;
+
+	sizes[0] = 1;
+	sizes[1] = 4;
+	sizes[2] = 16;
+	sizes[3] = 64;
+	sizes[4] = 256;
+	nsizes = 5;
+
+	while ((opt = getopt(argc, argv, "s:b:t:r:n:B:w:")) != -1) {
+		switch (opt) {
+			case 's':
+				if ((!parse_size(optarg, &disk.disk_size)) || (disk.disk_size == 0) || (disk.disk_size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'b':
+				if ((!parse_size(optarg, &size)) || (size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE) || (size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				block_size = (ULONG) size;
+				break;
+			case 't':
+				if ((nthreads = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'r':
+				if ((read_percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'B':
+				if (!parse_batch_sizes(optarg, sizes, &nsizes)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'w':
+				if (!parse_size(optarg, &window)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((optind != argc) || (block_size > disk.disk_size) || ((window != 0) && (window < block_size))) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	if ((window == 0) || (window > disk.disk_size)) {
+		window = disk.disk_size;
+	}
+
+	for (i = 0, max_batch = 0; i < nsizes; i++) {
+		if (sizes[i] > max_batch) {
+			max_batch = sizes[i];
+		}
+	}
+
+	if (!NT_SUCCESS(chunk_table_init(&disk.chunk_table, disk.disk_size, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Cannot create the disk.\n");
+		return 1;
+	}
+
+	/* The chunks come from a pool, as in the driver. */
+	chunk_pool_init(&disk.pool, DEFAULT_CHUNK_SHIFT, 0, CHUNK_POOL_CACHE);
+	chunk_quota_init(&disk.quota, &disk.pool, 0);
+
+	chunk_table_set_quota(&disk.chunk_table, &disk.quota);
+
+	range_lock_init(&disk.range_lock);
+
+	/* Write the whole disk first, so that the reads find the chunks allocated. */
+	if ((buffer = (UCHAR *) malloc(FILL_BLOCK_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	memset(buffer, 0xa5, FILL_BLOCK_SIZE);
+
+	for (offset = 0; offset < disk.disk_size; offset += FILL_BLOCK_SIZE) {
+		chunk_table_write(&disk.chunk_table, offset, buffer, ((disk.disk_size - offset) < FILL_BLOCK_SIZE) ? (SIZE_T) (disk.disk_size - offset) : FILL_BLOCK_SIZE);
+	}
+
+	free(buffer);
+
+	if (!check(&disk, block_size)) {
+		printf("FAILED: the batches differ from the single requests\n");
+		return 1;
+	}
+
+	if ((threads = (BATCH_THREAD *) calloc(nthreads, sizeof(BATCH_THREAD))) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	buffer_size = ((RAMDISK_BATCH_STATUS_SIZE(max_batch) + DATA_ALIGNMENT - 1) & ~((ULONGLONG) DATA_ALIGNMENT - 1)) + (ULONGLONG) max_batch * block_size;
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].disk = &disk;
+		threads[t].number = t;
+		threads[t].block_size = block_size;
+		threads[t].read_percent = read_percent;
+		threads[t].window = window;
+		threads[t].count = count;
+
+		if (((threads[t].entries = (RAMDISK_BATCH_ENTRY *) malloc(max_batch * sizeof(RAMDISK_BATCH_ENTRY))) == NULL) ||
+			((threads[t].buffer = (UCHAR *) malloc((size_t) buffer_size)) == NULL)) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+
+		memset(threads[t].buffer, 0x5a, (size_t) buffer_size);
+	}
+
+	printf("%8s %14s %14s %10s %10s %8s\n", "Batch", "Single IOPS", "Batch IOPS", "Single ns", "Batch ns", "Speedup");
+
+	for (i = 0, errors = 0; i < nsizes; i++) {
+		single = run(threads, nthreads, sizes[i], FALSE, &errors);
+		batched = run(threads, nthreads, sizes[i], TRUE, &errors);
+
+		/* The times are summed over the threads: nanoseconds per descriptor of a thread, and IOPS of all of them. */
+		printf("%8lu %14.0f %14.0f %10.1f %10.1f %7.2fx\n",
+			   (unsigned long) sizes[i],
+			   (double) count * nthreads * nthreads * 1e9 / (double) single,
+			   (double) count * nthreads * nthreads * 1e9 / (double) batched,
+			   (double) single / (double) (count * nthreads),
+			   (double) batched / (double) (count * nthreads),
+			   (double) single / (double) batched);
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		free(threads[t].entries);
+		free(threads[t].buffer);
+	}
+
+	free(threads);
+
+	range_lock_destroy(&disk.range_lock);
+	chunk_table_free(&disk.chunk_table);
+	chunk_pool_free(&disk.pool);
+
+	if (errors) {
+		printf("FAILED: %" PRIu64 " errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN parse_batch_sizes(char *s, ULONG *sizes, ULONG *nsizes)
+{
+	char *token;
+	char *end;
+
+	for (*nsizes = 0, token = strtok(s, ","); token; token = strtok(NULL, ",")) {
+		if (*nsizes == MAX_BATCH_SIZES) {
+			return FALSE;
+		}
+
+		sizes[*nsizes] = (ULONG) strtoul(token, &end, 10);
+
+		if ((end == token) || (*end) || (sizes[*nsizes] == 0) || (sizes[*nsizes] > RAMDISK_BATCH_MAX_ENTRIES)) {
+			return FALSE;
+		}
+
+		(*nsizes)++;
+	}
+
+	return (BOOLEAN) (*nsizes > 0);
+}
+
+/* Returns the sum of the times of the threads (nanoseconds). */
+ULONGLONG run(BATCH_THREAD *threads, ULONG nthreads, ULONG batch_size, BOOLEAN batched, ULONGLONG *errors)
+{
+	ULONGLONG elapsed;
+	ULONG t;
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].batch_size = batch_size;
+		threads[t].batched = batched;
+		threads[t].elapsed = 0;
+		threads[t].ndescriptors = 0;
+		threads[t].errors = 0;
+
+		if (pthread_create(&threads[t].thread, NULL, worker, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	for (t = 0, elapsed = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+
+		elapsed += threads[t].elapsed;
+		*errors += threads[t].errors;
+	}
+
+	return elapsed;
+}
+
+void acquire(BATCH_DISK *disk, BATCH_REQUEST *request, ULONGLONG start, ULONGLONG end, BOOLEAN exclusive)
+{
+	request->granted = FALSE;
+
+	/* The driver executes the waiters on behalf of the thread which releases the range; here they spin. */
+	if (!range_lock_acquire(&disk->range_lock, &request->range, start, end, exclusive)) {
+		while (!request->granted) {
+			sched_yield();
+		}
+	}
+}
+
+void release(BATCH_DISK *disk, BATCH_REQUEST *request)
+{
+	RANGE_LOCK_ENTRY *granted;
+	RANGE_LOCK_ENTRY *next;
+
+	for (granted = range_lock_release(&disk->range_lock, &request->range); granted; granted = next) {
+		/* The waiter might return (and reuse its entry) as soon as it sees the flag. */
+		next = granted->next_granted;
+		InterlockedIncrement(&((BATCH_REQUEST *) granted)->granted);
+	}
+}
+
+/* What the driver does for each read or write. */
+NTSTATUS execute_single(BATCH_DISK *disk, const RAMDISK_BATCH_ENTRY *entry, UCHAR *buffer)
+{
+	BATCH_REQUEST request;
+	NTSTATUS status;
+
+	if (!disk_io_check(disk->disk_size, SECTOR_SIZE, (LONGLONG) entry->offset, entry->length)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	acquire(disk, &request, entry->offset, entry->offset + entry->length, (BOOLEAN) (entry->operation != REQUEST_READ));
+
+	status = disk_io_transfer(&disk->chunk_table, (UCHAR) entry->operation, entry->offset, buffer, entry->length);
+
+	if (entry->operation != REQUEST_READ) {
+		disk_io_mark_dirty(&disk->dirty_chunks, disk->chunk_table.chunk_shift, entry->offset, entry->offset + entry->length);
+	}
+
+	release(disk, &request);
+
+	return status;
+}
+
+/* What the driver does for a batch (dispatch_batch() and execute_request()). */
+NTSTATUS execute_batch(BATCH_DISK *disk, const RAMDISK_BATCH_ENTRY *entries, ULONG count, UCHAR *buffer, ULONGLONG buffer_length)
+{
+	BATCH_REQUEST request;
+	ULONGLONG start;
+	ULONGLONG end;
+	BOOLEAN write;
+
+	if (!disk_io_check_batch(disk->disk_size, SECTOR_SIZE, entries, count, buffer_length, &start, &end, &write)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (start < end) {
+		acquire(disk, &request, start, end, write);
+
+		disk_io_batch(&disk->chunk_table, &disk->dirty_chunks, entries, count, buffer);
+
+		release(disk, &request);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void *worker(void *arg)
+{
+	BATCH_THREAD *thread;
+	ULONGLONG window_blocks;
+	ULONGLONG window_start;
+	ULONGLONG nblocks;
+	ULONGLONG random;
+	ULONGLONG data_offset;
+	ULONGLONG buffer_length;
+	ULONGLONG start;
+	ULONG count;
+	ULONG i;
+	NTSTATUS status;
+
+	thread = (BATCH_THREAD *) arg;
+
+	nblocks = thread->disk->disk_size / thread->block_size;
+	window_blocks = thread->window / thread->block_size;
+
+	data_offset = (RAMDISK_BATCH_STATUS_SIZE(thread->batch_size) + DATA_ALIGNMENT - 1) & ~((ULONGLONG) DATA_ALIGNMENT - 1);
+	buffer_length = data_offset + (ULONGLONG) thread->batch_size * thread->block_size;
+
+	/* The same descriptors for both ways of executing them. */
+	random = 0x9e3779b97f4a7c15ULL * (thread->number + 1);
+
+	while (thread->ndescriptors < thread->count) {
+		count = ((thread->count - thread->ndescriptors) < thread->batch_size) ? (ULONG) (thread->count - thread->ndescriptors) : thread->batch_size;
+
+		window_start = random % (nblocks - window_blocks + 1);
+
+		for (i = 0; i < count; i++) {
+			next_random(&random);
+
+			thread->entries[i].operation = (((random >> 32) % 100) < thread->read_percent) ? RAMDISK_BATCH_READ : RAMDISK_BATCH_WRITE;
+			thread->entries[i].length = thread->block_size;
+			thread->entries[i].offset = (window_start + (random % window_blocks)) * thread->block_size;
+			thread->entries[i].buffer_offset = data_offset + (ULONGLONG) i * thread->block_size;
+		}
+
+		start = port_timestamp();
+
+		if (thread->batched) {
+			status = execute_batch(thread->disk, thread->entries, count, thread->buffer, buffer_length);
+		} else {
+			for (i = 0, status = STATUS_SUCCESS; i < count; i++) {
+				((LONG *) thread->buffer)[i] = execute_single(thread->disk, &thread->entries[i], thread->buffer + thread->entries[i].buffer_offset);
+			}
+		}
+
+		thread->elapsed += port_timestamp() - start;
+
+		if (!NT_SUCCESS(status)) {
+			thread->errors += count;
+		} else {
+			for (i = 0; i < count; i++) {
+				if (!NT_SUCCESS(((LONG *) thread->buffer)[i])) {
+					thread->errors++;
+				}
+			}
+		}
+
+		thread->ndescriptors += count;
+	}
+
+	return NULL;
+}
+
+/* The descriptors of a batch are executed in order, with the results of single requests; invalid batches do nothing. */
+BOOLEAN check(BATCH_DISK *disk, ULONG block_size)
+{
+	RAMDISK_BATCH_ENTRY entries[4];
+	ULONGLONG buffer_length;
+	ULONGLONG data_offset;
+	ULONGLONG start;
+	ULONGLONG end;
+	UCHAR *buffer;
+	UCHAR *expected;
+	BOOLEAN write;
+	BOOLEAN ok;
+
+	data_offset = DATA_ALIGNMENT;
+	buffer_length = data_offset + 4ULL * block_size;
+
+	if (((buffer = (UCHAR *) malloc((size_t) buffer_length)) == NULL) || ((expected = (UCHAR *) malloc(block_size)) == NULL)) {
+		fprintf(stderr, "Out of memory.\n");
+		return FALSE;
+	}
+
+	memset(buffer + data_offset, 0x11, block_size);
+	memset(buffer + data_offset + block_size, 0x22, block_size);
+	memset(buffer + data_offset + 2 * block_size, 0x33, block_size);
+	memset(buffer + data_offset + 3 * block_size, 0, block_size);
+
+	/* Two writes of the first block (the second one wins), a write of the last block and a read of the first block. */
+	entries[0].operation = RAMDISK_BATCH_WRITE;
+	entries[0].length = block_size;
+	entries[0].offset = 0;
+	entries[0].buffer_offset = data_offset;
+
+	entries[1] = entries[0];
+	entries[1].buffer_offset = data_offset + block_size;
+
+	entries[2].operation = RAMDISK_BATCH_WRITE;
+	entries[2].length = block_size;
+	entries[2].offset = ((disk->disk_size / block_size) - 1) * block_size;
+	entries[2].buffer_offset = data_offset + 2 * block_size;
+
+	entries[3].operation = RAMDISK_BATCH_READ;
+	entries[3].length = block_size;
+	entries[3].offset = 0;
+	entries[3].buffer_offset = data_offset + 3 * block_size;
+
+	ok = (BOOLEAN) (NT_SUCCESS(execute_batch(disk, entries, 4, buffer, buffer_length)) &&
+					(NT_SUCCESS(((LONG *) buffer)[0])) && (NT_SUCCESS(((LONG *) buffer)[1])) &&
+					(NT_SUCCESS(((LONG *) buffer)[2])) && (NT_SUCCESS(((LONG *) buffer)[3])));
+
+	memset(expected, 0x22, block_size);
+	ok = (BOOLEAN) (ok && (memcmp(buffer + data_offset + 3 * block_size, expected, block_size) == 0));
+
+	/* Single requests see what the batch wrote. */
+	entries[2].operation = RAMDISK_BATCH_READ;
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(execute_single(disk, &entries[2], expected))) && (memcmp(expected, buffer + data_offset + 2 * block_size, block_size) == 0));
+
+	/* A descriptor beyond the disk, or with its data over the statuses, fails the whole batch. */
+	entries[0].operation = RAMDISK_BATCH_WRITE;
+	entries[0].buffer_offset = data_offset + 2 * block_size;
+	entries[1].offset = disk->disk_size;
+	ok = (BOOLEAN) (ok && (execute_batch(disk, entries, 2, buffer, buffer_length) == STATUS_INVALID_PARAMETER));
+
+	entries[1].offset = 0;
+	entries[1].buffer_offset = 0;
+	ok = (BOOLEAN) (ok && (execute_batch(disk, entries, 2, buffer, buffer_length) == STATUS_INVALID_PARAMETER));
+
+	/* Data longer than the whole buffer, or running past its end. */
+	entries[1].offset = 0;
+	entries[1].buffer_offset = data_offset;
+	entries[1].length = (ULONG) ((buffer_length + SECTOR_SIZE) & ~((ULONGLONG) SECTOR_SIZE - 1));
+	ok = (BOOLEAN) (ok && (execute_batch(disk, entries, 2, buffer, buffer_length) == STATUS_INVALID_PARAMETER));
+
+	entries[1].buffer_offset = buffer_length - block_size + SECTOR_SIZE;
+	entries[1].length = block_size;
+	ok = (BOOLEAN) (ok && (execute_batch(disk, entries, 2, buffer, buffer_length) == STATUS_INVALID_PARAMETER));
+
+	/* A 1 MB read into a buffer with room for a status and a sector. */
+	entries[1].operation = RAMDISK_BATCH_READ;
+	entries[1].buffer_offset = 8;
+	entries[1].length = (disk->disk_size < 1024 * 1024) ? (ULONG) disk->disk_size : 1024 * 1024;
+	ok = (BOOLEAN) (ok && (!disk_io_check_batch(disk->disk_size, SECTOR_SIZE, &entries[1], 1, 8 + SECTOR_SIZE, &start, &end, &write)));
+
+	/* Nothing was written by them. */
+	entries[3].buffer_offset = data_offset;
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(execute_single(disk, &entries[3], expected))));
+
+	memset(buffer, 0x22, block_size);
+	ok = (BOOLEAN) (ok && (memcmp(expected, buffer, block_size) == 0));
+
+	free(expected);
+	free(buffer);
+
+	return ok;
+}
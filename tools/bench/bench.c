@@ -0,0 +1,581 @@
+/*
+ * Benchmark of the storage core of the driver (chunk table, range lock and
+ * request path) in user mode, so that regressions can be found without
+ * loading the driver. Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o bench bench.c ../common/tools.c \
+ *       ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c ../../range_lock.c \
+ *       ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c ../../numa_layout.c ../../port_numa.c \
+ *       ../../port_page.c
+ * (add -DRAMDISK_LIBNUMA ... -lnuma to place the chunks on the real nodes).
+ *
+ * Usage: bench [options]
+ *   -s size      Disk size (K, M and G suffixes; default 1G).
+ *   -b size      Block size, 512 bytes to 4 MB (default 4K).
+ *   -t threads   Threads submitting requests (default 1).
+ *   -r percent   Reads, the rest are writes (default 100).
+ *   -p pattern   "seq" or "rand" (default "rand").
+ *   -n count     Requests per thread (default 100000).
+ *   -T file      Replay a trace saved by "ramstat -t" instead (the
+ *                records are dealt to the threads in turn).
+ *   -e           Start with an empty disk (by default it is written first).
+ *   -d           Track the dirty chunks, as with an image file.
+ *   -P policy    Place the chunks on the NUMA nodes: "none", "interleave"
+ *                or "partition" (default "none").
+ *   -S size      Stripe of "interleave" (default 4M).
+ *   -N nodes     Nodes of the simulated topology (default 1; ignored with
+ *                libnuma).
+ *   -L           Carve the chunks from large pages (hugetlbfs, or else
+ *                transparent huge pages).
+ * Prints the requests per second, the throughput and the latency
+ * percentiles, and the memory placed on each node.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "disk_io.h"
+#include "range_lock.h"
+#include "trace_format.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-b block_size] [-t threads] [-r read_percent] [-p seq|rand] [-n count] [-T trace] [-e] [-d] [-P none|interleave|partition] [-S stripe] [-N nodes] [-L]"
+#define MIN_BLOCK_SIZE                  512
+#define MAX_BLOCK_SIZE                  (4 * 1024 * 1024)
+#define SECTOR_SIZE                     512
+#define FILL_BLOCK_SIZE                 (1024 * 1024)
+#define DEFAULT_NUMA_STRIPE             (4 * 1024 * 1024)
+
+typedef struct {
+	RANGE_LOCK_ENTRY range;            /* First member: the granted entries are cast back. */
+	volatile LONG    granted;
+} BENCH_REQUEST;
+
+typedef struct {
+	CHUNK_POOL    pool;
+	CHUNK_QUOTA   quota;
+	CHUNK_TABLE   chunk_table;
+	RANGE_LOCK    range_lock;
+	ATOMIC_BITMAP dirty_chunks;
+	ULONGLONG     disk_size;
+} BENCH_DISK;
+
+typedef struct {
+	BENCH_DISK           *disk;
+	pthread_t            thread;
+	ULONG                number;
+	ULONG                nthreads;
+
+	/* Synthetic workload. */
+	ULONG                block_size;
+	ULONG                read_percent;
+	BOOLEAN              sequential;
+	ULONGLONG            count;
+
+	/* Trace replay. */
+	RAMDISK_TRACE_RECORD *records;
+	ULONGLONG            nrecords;
+	ULONG                buffer_size;
+
+	ULONGLONG            *latencies;   /* Nanoseconds, one per request. */
+	ULONGLONG            nrequests;
+	ULONGLONG            bytes;
+	ULONGLONG            errors;
+} BENCH_THREAD;
+
+NTSTATUS execute(BENCH_DISK *disk, UCHAR operation, ULONGLONG offset, UCHAR *buffer, ULONG length);
+void *synthetic(void *arg);
+void *replay(void *arg);
+BOOLEAN load_trace(const char *filename, RAMDISK_TRACE_RECORD **records, ULONGLONG *nrecords);
+int compare(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+	BENCH_DISK disk;
+	BENCH_THREAD *threads;
+	RAMDISK_TRACE_RECORD *records;
+	ULONGLONG *latencies;
+	ULONGLONG nrecords;
+	ULONGLONG nrequests;
+	ULONGLONG bytes;
+	ULONGLONG errors;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG offset;
+	ULONGLONG size;
+	const char *trace;
+	UCHAR *buffer;
+	ULONG nthreads;
+	ULONG block_size;
+	ULONG read_percent;
+	ULONG max_length;
+	BOOLEAN sequential;
+	BOOLEAN fill;
+	BOOLEAN track_dirty;
+	BOOLEAN large_pages;
+	ULONG numa_policy;
+	ULONGLONG numa_stripe;
+	ULONGLONG count;
+	ULONGLONG i;
+	ULONG t;
+	int opt;
+
+	disk.disk_size = 1ULL << 30;
+	block_size = 4096;
+	nthreads = 1;
+	read_percent = 100;
+	sequential = FALSE;
+	count = 100000;
+	trace = NULL;
+	fill = TRUE;
+	track_dirty = FALSE;
+	large_pages = FALSE;
+	numa_policy = NUMA_POLICY_NONE;
+	numa_stripe = DEFAULT_NUMA_STRIPE;
+
+	while ((opt = getopt(argc, argv, "s:b:t:r:p:n:T:edP:S:N:L")) != -1) {
+		switch (opt) {
+			case 's':
+				if ((!parse_size(optarg, &disk.disk_size)) || (disk.disk_size == 0) || (disk.disk_size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'b':
+				if ((!parse_size(optarg, &size)) || (size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE) || (size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				block_size = (ULONG) size;
+				break;
+			case 't':
+				if ((nthreads = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'r':
+				if ((read_percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'p':
+				if (strcmp(optarg, "seq") == 0) {
+					sequential = TRUE;
+				} else if (strcmp(optarg, "rand") == 0) {
+					sequential = FALSE;
+				} else {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'T':
+				trace = optarg;
+				break;
+			case 'e':
+				fill = FALSE;
+				break;
+			case 'd':
+				track_dirty = TRUE;
+				break;
+			case 'P':
+				if (strcmp(optarg, "none") == 0) {
+					numa_policy = NUMA_POLICY_NONE;
+				} else if (strcmp(optarg, "interleave") == 0) {
+					numa_policy = NUMA_POLICY_INTERLEAVE;
+				} else if (strcmp(optarg, "partition") == 0) {
+					numa_policy = NUMA_POLICY_PARTITION;
+				} else {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'S':
+				if ((!parse_size(optarg, &numa_stripe)) || (numa_stripe == 0)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'N':
+				if (atoi(optarg) <= 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				port_simulate_nodes((ULONG) atoi(optarg));
+				break;
+			case 'L':
+				large_pages = TRUE;
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((!trace) && (block_size > disk.disk_size)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	records = NULL;
+	nrecords = 0;
+	max_length = block_size;
+
+	if (trace) {
+		if (!load_trace(trace, &records, &nrecords)) {
+			return 1;
+		}
+
+		/* The buffers must hold the longest transfer. */
+		for (i = 0, max_length = SECTOR_SIZE; i < nrecords; i++) {
+			if ((records[i].operation != RAMDISK_TRACE_TRIM) && (records[i].length > max_length) && (records[i].length <= MAX_BLOCK_SIZE)) {
+				max_length = (ULONG) records[i].length;
+			}
+		}
+	}
+
+	if (!NT_SUCCESS(chunk_table_init(&disk.chunk_table, disk.disk_size, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Cannot create the disk.\n");
+		return 1;
+	}
+
+	/* The chunks come from a pool, as in the driver. */
+	chunk_pool_init(&disk.pool, DEFAULT_CHUNK_SHIFT, 0, CHUNK_POOL_CACHE);
+	chunk_quota_init(&disk.quota, &disk.pool, 0);
+
+	if (large_pages) {
+		chunk_pool_use_large_pages(&disk.pool);
+	}
+
+	chunk_table_set_quota(&disk.chunk_table, &disk.quota);
+	chunk_table_set_numa(&disk.chunk_table, numa_policy, numa_stripe);
+
+	range_lock_init(&disk.range_lock);
+
+	disk.dirty_chunks.words = NULL;
+	disk.dirty_chunks.nbits = 0;
+
+	if ((track_dirty) && (!NT_SUCCESS(atomic_bitmap_init(&disk.dirty_chunks, disk.chunk_table.nchunks)))) {
+		fprintf(stderr, "Cannot allocate the dirty bitmap.\n");
+		return 1;
+	}
+
+	/* Reads of chunks never written don't touch memory: write them first. */
+	if (fill) {
+		if ((buffer = (UCHAR *) malloc(FILL_BLOCK_SIZE)) == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+
+		memset(buffer, 0xa5, FILL_BLOCK_SIZE);
+
+		for (offset = 0; offset < disk.disk_size; offset += size) {
+			size = ((disk.disk_size - offset) < FILL_BLOCK_SIZE) ? (disk.disk_size - offset) : FILL_BLOCK_SIZE;
+
+			if (!NT_SUCCESS(disk_io_transfer(&disk.chunk_table, REQUEST_WRITE, offset, buffer, (SIZE_T) size))) {
+				fprintf(stderr, "Cannot fill the disk.\n");
+				return 1;
+			}
+		}
+
+		free(buffer);
+	}
+
+	if ((threads = (BENCH_THREAD *) calloc(nthreads, sizeof(BENCH_THREAD))) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].disk = &disk;
+		threads[t].number = t;
+		threads[t].nthreads = nthreads;
+		threads[t].block_size = block_size;
+		threads[t].read_percent = read_percent;
+		threads[t].sequential = sequential;
+		threads[t].count = trace ? (nrecords / nthreads) + (t < nrecords % nthreads) : count;
+		threads[t].records = records;
+		threads[t].nrecords = nrecords;
+		threads[t].buffer_size = max_length;
+
+		if ((threads[t].latencies = (ULONGLONG *) malloc((threads[t].count + 1) * sizeof(ULONGLONG))) == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+	}
+
+	start = port_timestamp();
+
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t].thread, NULL, trace ? replay : synthetic, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			return 1;
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	elapsed = port_timestamp() - start;
+
+	/* Merge the latencies of all the threads. */
+	for (t = 0, nrequests = 0, bytes = 0, errors = 0; t < nthreads; t++) {
+		nrequests += threads[t].nrequests;
+		bytes += threads[t].bytes;
+		errors += threads[t].errors;
+	}
+
+	if ((nrequests == 0) || ((latencies = (ULONGLONG *) malloc(nrequests * sizeof(ULONGLONG))) == NULL)) {
+		fprintf(stderr, "No requests.\n");
+		return 1;
+	}
+
+	for (t = 0, i = 0; t < nthreads; t++) {
+		memcpy(latencies + i, threads[t].latencies, threads[t].nrequests * sizeof(ULONGLONG));
+		i += threads[t].nrequests;
+		free(threads[t].latencies);
+	}
+
+	qsort(latencies, nrequests, sizeof(ULONGLONG), compare);
+
+	printf("Requests: %" PRIu64 " (%" PRIu64 " errors) in %.3f s\n", nrequests, errors, (double) elapsed / 1e9);
+	printf("IOPS: %.0f\n", (double) nrequests * 1e9 / (double) elapsed);
+	printf("Throughput: %.3f GB/s\n", (double) bytes / (double) elapsed);
+	printf("Latency: p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+		   latencies[(nrequests - 1) * 50 / 100],
+		   latencies[(nrequests - 1) * 99 / 100],
+		   latencies[(nrequests - 1) * 999 / 1000],
+		   latencies[nrequests - 1]);
+
+	if (disk.chunk_table.numa.policy != NUMA_POLICY_NONE) {
+		for (t = 0; t < disk.chunk_table.numa.nnodes; t++) {
+			printf("Node %lu: %" PRIu64 " MB\n", (unsigned long) t, (uint64_t) (chunk_quota_node_used(&disk.quota, t) >> 20));
+		}
+	}
+
+	if (large_pages) {
+		printf("Large pages: %" PRIu64 " of %" PRIu64 " MB\n", (uint64_t) (chunk_pool_large_bytes(&disk.pool) >> 20), (uint64_t) (chunk_pool_block_bytes(&disk.pool) >> 20));
+	}
+
+	free(latencies);
+	free(threads);
+	free(records);
+
+	atomic_bitmap_free(&disk.dirty_chunks);
+	range_lock_destroy(&disk.range_lock);
+	chunk_table_free(&disk.chunk_table);
+	chunk_pool_free(&disk.pool);
+
+	return 0;
+}
+
+/* Like the driver: reads share the range, the other operations lock it exclusively. */
+NTSTATUS execute(BENCH_DISK *disk, UCHAR operation, ULONGLONG offset, UCHAR *buffer, ULONG length)
+{
+	BENCH_REQUEST request;
+	RANGE_LOCK_ENTRY *granted;
+	RANGE_LOCK_ENTRY *next;
+	NTSTATUS status;
+
+	request.granted = FALSE;
+
+	/* The driver executes the waiters on behalf of the thread which releases the range; here they spin. */
+	if (!range_lock_acquire(&disk->range_lock, &request.range, offset, offset + length, (BOOLEAN) (operation != REQUEST_READ))) {
+		while (!request.granted) {
+			YieldProcessor();
+		}
+	}
+
+	if (operation == REQUEST_TRIM) {
+		chunk_table_trim(&disk->chunk_table, offset, length);
+		status = STATUS_SUCCESS;
+	} else {
+		status = disk_io_transfer(&disk->chunk_table, operation, offset, buffer, length);
+	}
+
+	if (operation != REQUEST_READ) {
+		disk_io_mark_dirty(&disk->dirty_chunks, disk->chunk_table.chunk_shift, offset, offset + length);
+	}
+
+	for (granted = range_lock_release(&disk->range_lock, &request.range); granted; granted = next) {
+		/* The waiter might return (and reuse its entry) as soon as it sees the flag. */
+		next = granted->next_granted;
+		InterlockedIncrement(&((BENCH_REQUEST *) granted)->granted);
+	}
+
+	return status;
+}
+
+void *synthetic(void *arg)
+{
+	BENCH_THREAD *thread;
+	ULONGLONG nblocks;
+	ULONGLONG block;
+	ULONGLONG random;
+	ULONGLONG start;
+	UCHAR operation;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	thread = (BENCH_THREAD *) arg;
+
+	if ((buffer = (UCHAR *) malloc(thread->block_size)) == NULL) {
+		return NULL;
+	}
+
+	memset(buffer, 0x5a, thread->block_size);
+
+	nblocks = thread->disk->disk_size / thread->block_size;
+
+	/* Each thread starts at its own part of the disk. */
+	block = (nblocks * thread->number) / thread->nthreads;
+	random = 0x9e3779b97f4a7c15ULL * (thread->number + 1);
+
+	for (thread->nrequests = 0; thread->nrequests < thread->count; thread->nrequests++) {
+		next_random(&random);
+
+		if (thread->sequential) {
+			block = (block + 1 < nblocks) ? block + 1 : 0;
+		} else {
+			block = random % nblocks;
+		}
+
+		operation = (((random >> 32) % 100) < thread->read_percent) ? REQUEST_READ : REQUEST_WRITE;
+
+		start = port_timestamp();
+		status = execute(thread->disk, operation, block * thread->block_size, buffer, thread->block_size);
+		thread->latencies[thread->nrequests] = port_timestamp() - start;
+
+		if (NT_SUCCESS(status)) {
+			thread->bytes += thread->block_size;
+		} else {
+			thread->errors++;
+		}
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+void *replay(void *arg)
+{
+	RAMDISK_TRACE_RECORD *record;
+	BENCH_THREAD *thread;
+	ULONGLONG start;
+	ULONGLONG i;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	thread = (BENCH_THREAD *) arg;
+
+	if ((buffer = (UCHAR *) calloc(1, thread->buffer_size)) == NULL) {
+		return NULL;
+	}
+
+	for (i = thread->number; i < thread->nrecords; i += thread->nthreads) {
+		record = &thread->records[i];
+
+		/* Requests which don't fit the disk (or the buffers) are skipped. */
+		if ((!disk_io_check(thread->disk->disk_size, SECTOR_SIZE, (LONGLONG) record->offset, record->length)) ||
+			((record->operation != RAMDISK_TRACE_TRIM) && (record->length > thread->buffer_size))) {
+			thread->errors++;
+			continue;
+		}
+
+		start = port_timestamp();
+		status = execute(thread->disk, record->operation, record->offset, buffer, (ULONG) record->length);
+		thread->latencies[thread->nrequests++] = port_timestamp() - start;
+
+		if (NT_SUCCESS(status)) {
+			if (record->operation != RAMDISK_TRACE_TRIM) {
+				thread->bytes += record->length;
+			}
+		} else {
+			thread->errors++;
+		}
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+BOOLEAN load_trace(const char *filename, RAMDISK_TRACE_RECORD **records, ULONGLONG *nrecords)
+{
+	RAMDISK_TRACE_RECORD *r;
+	RAMDISK_TRACE trace;
+	ULONGLONG size;
+	FILE *file;
+
+	if ((file = fopen(filename, "rb")) == NULL) {
+		fprintf(stderr, "Cannot open %s.\n", filename);
+		return FALSE;
+	}
+
+	*records = NULL;
+	*nrecords = 0;
+	size = 0;
+
+	while (fread(&trace, sizeof(trace), 1, file) == 1) {
+		if (trace.version != RAMDISK_TRACE_VERSION) {
+			fprintf(stderr, "%s: unknown trace format.\n", filename);
+			break;
+		}
+
+		if (*nrecords + trace.nrecords > size) {
+			size = (*nrecords + trace.nrecords) * 2;
+
+			if ((r = (RAMDISK_TRACE_RECORD *) realloc(*records, size * sizeof(RAMDISK_TRACE_RECORD))) == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				break;
+			}
+
+			*records = r;
+		}
+
+		if (fread(*records + *nrecords, sizeof(RAMDISK_TRACE_RECORD), trace.nrecords, file) != trace.nrecords) {
+			fprintf(stderr, "%s: truncated trace.\n", filename);
+			break;
+		}
+
+		*nrecords += trace.nrecords;
+	}
+
+	if ((!feof(file)) || (*nrecords == 0)) {
+		fclose(file);
+		free(*records);
+		return FALSE;
+	}
+
+	fclose(file);
+
+	return TRUE;
+}
+
+int compare(const void *a, const void *b)
+{
+	ULONGLONG x = *((const ULONGLONG *) a);
+	ULONGLONG y = *((const ULONGLONG *) b);
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,536 @@
+/*
+ * Stress test of the lock-free bitmap (ATOMIC_BITMAP, bitmap.c) on Linux.
+ * It checks that:
+ *   - random set and clear ranges (within a word, across words, whole
+ *     words, up to the last bit of a bitmap which isn't a whole number of
+ *     words) give the bits and the count of a plain array of flags, and
+ *     that the searches find the same bits;
+ *   - threads setting and clearing their own bits, interleaved with the
+ *     bits of the other threads in the same words, never lose an update:
+ *     each thread reads its bits back after every change, and at the end
+ *     the bitmap is the union of the bits of the threads;
+ *   - threads setting and clearing the same bits at random leave the count
+ *     equal to the number of bits set.
+ * Then it measures the updates per second from 1 to "max_threads" threads
+ * setting bits which are already set (no write), setting and clearing bits
+ * of their own cache lines, and of the same cache line.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o bitmapcheck bitmapcheck.c ../common/tools.c ../../bitmap.c
+ *
+ * Usage: bitmapcheck [options]
+ *   -t threads   Maximum number of threads (default: processors, at least 4).
+ *   -n count     Updates per thread (default 1000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "bitmap.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-t threads] [-n count]"
+#define CHECK_BITS                      (64 * 100 + 37) /* Not a whole number of words. */
+#define MAX_RANGE                       200
+#define MAX_THREADS                     64
+#define BLOCK_BITS                      8 /* Bits of a thread between those of the others. */
+#define LINE_BITS                       512
+#define ROUNDS                          200000
+
+#define MODE_SET                        0
+#define MODE_OWN_LINES                  1
+#define MODE_SAME_LINE                  2
+
+typedef struct {
+	ATOMIC_BITMAP *bitmap;
+	pthread_t     thread;
+	ULONG         id;
+	ULONG         nthreads;
+	ULONGLONG     count;
+	ULONGLONG     seed;
+	UCHAR         *bits;         /* Reference of the bits of the thread. */
+	int           mode;
+	BOOLEAN       ok;
+} BITMAP_THREAD;
+
+BOOLEAN check_ranges(void);
+BOOLEAN check_searches(void);
+BOOLEAN check_own_bits(ULONG nthreads, ULONGLONG count);
+BOOLEAN check_same_bits(ULONG nthreads, ULONGLONG count);
+double measure(ULONG nthreads, ULONGLONG count, int mode);
+void run_threads(BITMAP_THREAD *threads, ULONG nthreads, void *(*routine)(void *));
+void *update_own_bits(void *arg);
+void *update_same_bits(void *arg);
+void *update(void *arg);
+BOOLEAN matches(ATOMIC_BITMAP *bitmap, const UCHAR *bits);
+
+int main(int argc, char **argv)
+{
+	ULONGLONG count;
+	ULONG max_threads;
+	ULONG nthreads;
+	double rates[3];
+	BOOLEAN ok;
+	int mode;
+	int opt;
+
+	max_threads = port_cpu_count();
+	if (max_threads < 4) {
+		max_threads = 4;
+	} else if (max_threads > MAX_THREADS) {
+		max_threads = MAX_THREADS;
+	}
+
+	count = 1000000;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+			case 't':
+				if (((max_threads = (ULONG) atoi(optarg)) == 0) || (max_threads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "Ranges give the bits and the count of an array", (check_ranges()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Searches find the bits of the array", (check_searches()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Threads sharing words never lose an update", (check_own_bits(max_threads, count / 10)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Racing updates of the same bits keep the count", (check_same_bits(max_threads, count / 10)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		printf("\nUpdates per second (millions), %u processors:\n", port_cpu_count());
+		printf("%8s %12s %12s %12s\n", "Threads", "Already set", "Own lines", "Same line");
+
+		for (nthreads = 1; nthreads <= max_threads; nthreads = (nthreads < 4) ? nthreads + 1 : nthreads * 2) {
+			for (mode = MODE_SET; mode <= MODE_SAME_LINE; mode++) {
+				rates[mode] = measure(nthreads, count, mode);
+			}
+
+			printf("%8u %12.2f %12.2f %12.2f\n", nthreads, rates[MODE_SET], rates[MODE_OWN_LINES], rates[MODE_SAME_LINE]);
+		}
+	}
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_ranges(void)
+{
+	ATOMIC_BITMAP bitmap;
+	UCHAR bits[CHECK_BITS];
+	ULONGLONG seed;
+	ULONGLONG first;
+	ULONGLONG count;
+	ULONGLONG bit;
+	ULONGLONG r;
+	ULONG round;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(atomic_bitmap_init(&bitmap, CHECK_BITS))) {
+		return FALSE;
+	}
+
+	memset(bits, 0, sizeof(bits));
+	seed = RANDOM_SEED;
+
+	/* The whole bitmap, then nothing. */
+	atomic_bitmap_set_range(&bitmap, 0, CHECK_BITS);
+	ok = (BOOLEAN) (bitmap.count == CHECK_BITS);
+
+	atomic_bitmap_clear_range(&bitmap, 0, CHECK_BITS);
+	ok = (BOOLEAN) (ok && (bitmap.count == 0) && (matches(&bitmap, bits)));
+
+	for (round = 0; (ok) && (round < ROUNDS); round++) {
+		r = next_random(&seed);
+
+		/* Some of the ranges on the word boundaries, some up to the last bit. */
+		switch ((r >> 8) % 4) {
+			case 0:
+				first = ((r >> 16) % (CHECK_BITS / 64)) * 64;
+				count = 64 * (1 + (r >> 40) % 3);
+				break;
+			case 1:
+				count = 1 + (r >> 40) % MAX_RANGE;
+				first = CHECK_BITS - count;
+				break;
+			default:
+				first = (r >> 16) % CHECK_BITS;
+				count = 1 + (r >> 40) % MAX_RANGE;
+		}
+
+		if (first + count > CHECK_BITS) {
+			count = CHECK_BITS - first;
+		}
+
+		if (r & 1) {
+			atomic_bitmap_set_range(&bitmap, first, count);
+		} else {
+			atomic_bitmap_clear_range(&bitmap, first, count);
+		}
+
+		memset(bits + first, (int) (r & 1), (SIZE_T) count);
+
+		/* The whole bitmap now and then, the range every time. */
+		if (round % 1000 == 0) {
+			ok = (BOOLEAN) (matches(&bitmap, bits));
+		} else {
+			for (bit = first; (ok) && (bit < first + count); bit++) {
+				ok = (BOOLEAN) (atomic_bitmap_test(&bitmap, bit) == bits[bit]);
+			}
+
+			for (bit = 0, count = 0; bit < CHECK_BITS; bit++) {
+				count += bits[bit];
+			}
+
+			ok = (BOOLEAN) (ok && (bitmap.count == (LONGLONG) count));
+		}
+	}
+
+	/* The bits past the end are never set. */
+	atomic_bitmap_set_range(&bitmap, 0, CHECK_BITS);
+
+	ok = (BOOLEAN) (ok && ((ULONGLONG) bitmap.words[CHECK_BITS >> 6] == ((ULONGLONG) 1 << (CHECK_BITS & 63)) - 1));
+
+	atomic_bitmap_free(&bitmap);
+
+	return ok;
+}
+
+BOOLEAN check_searches(void)
+{
+	static const ULONG densities[] = { 0, 250, 500, 750, 999 }; /* Per mille. */
+	ATOMIC_BITMAP bitmap;
+	UCHAR bits[CHECK_BITS];
+	ULONGLONG seed;
+	ULONGLONG first;
+	ULONGLONG expected;
+	ULONGLONG index;
+	ULONGLONG r;
+	ULONG round;
+	ULONG d;
+	BOOLEAN found;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(atomic_bitmap_init(&bitmap, CHECK_BITS))) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) ((!atomic_bitmap_find_set(&bitmap, 0, &index)) && (atomic_bitmap_find_clear(&bitmap, 0, &index)) && (index == 0));
+
+	seed = RANDOM_SEED;
+
+	/* From empty to almost full (one bit in a thousand clear). */
+	for (d = 0; (ok) && (d < sizeof(densities) / sizeof(densities[0])); d++) {
+		memset(bits, 0, sizeof(bits));
+		atomic_bitmap_clear_range(&bitmap, 0, CHECK_BITS);
+
+		for (index = 0; index < CHECK_BITS; index++) {
+			if ((next_random(&seed) % 1000) < densities[d]) {
+				bits[index] = 1;
+				atomic_bitmap_set_range(&bitmap, index, 1);
+			}
+		}
+
+		for (round = 0; (ok) && (round < ROUNDS / 100); round++) {
+			r = next_random(&seed);
+			first = (r >> 16) % (CHECK_BITS + 10);
+
+			/* find_set() */
+			for (expected = first; (expected < CHECK_BITS) && (!bits[expected]); expected++);
+
+			found = atomic_bitmap_find_set(&bitmap, first, &index);
+			ok = (BOOLEAN) ((found == (expected < CHECK_BITS)) && ((!found) || (index == expected)));
+
+			/* find_clear(): the bits past the end are not clear bits. */
+			for (expected = first; (expected < CHECK_BITS) && (bits[expected]); expected++);
+
+			found = atomic_bitmap_find_clear(&bitmap, first, &index);
+			ok = (BOOLEAN) (ok && (found == (expected < CHECK_BITS)) && ((!found) || (index == expected)));
+		}
+	}
+
+	/* Full: no clear bit, even in the word of the last bits. */
+	atomic_bitmap_set_range(&bitmap, 0, CHECK_BITS);
+
+	ok = (BOOLEAN) (ok && (!atomic_bitmap_find_clear(&bitmap, 0, &index)) && (!atomic_bitmap_find_clear(&bitmap, CHECK_BITS - 1, &index)));
+	ok = (BOOLEAN) (ok && (atomic_bitmap_find_set(&bitmap, CHECK_BITS - 1, &index)) && (index == CHECK_BITS - 1));
+
+	atomic_bitmap_free(&bitmap);
+
+	return ok;
+}
+
+BOOLEAN check_own_bits(ULONG nthreads, ULONGLONG count)
+{
+	BITMAP_THREAD threads[MAX_THREADS];
+	ATOMIC_BITMAP bitmap;
+	UCHAR *bits;
+	ULONGLONG bit;
+	ULONG t;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(atomic_bitmap_init(&bitmap, CHECK_BITS))) {
+		return FALSE;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].bitmap = &bitmap;
+		threads[t].id = t;
+		threads[t].nthreads = nthreads;
+		threads[t].count = count;
+		threads[t].seed = RANDOM_SEED + t;
+		threads[t].ok = TRUE;
+
+		if ((threads[t].bits = (UCHAR *) calloc(1, CHECK_BITS)) == NULL) {
+			return FALSE;
+		}
+	}
+
+	run_threads(threads, nthreads, update_own_bits);
+
+	/* The bitmap is the union of the bits of the threads. */
+	if ((bits = (UCHAR *) calloc(1, CHECK_BITS)) == NULL) {
+		return FALSE;
+	}
+
+	ok = TRUE;
+
+	for (t = 0; t < nthreads; t++) {
+		ok = (BOOLEAN) (ok && (threads[t].ok));
+
+		for (bit = 0; bit < CHECK_BITS; bit++) {
+			bits[bit] |= threads[t].bits[bit];
+		}
+
+		free(threads[t].bits);
+	}
+
+	ok = (BOOLEAN) (ok && (matches(&bitmap, bits)));
+
+	free(bits);
+	atomic_bitmap_free(&bitmap);
+
+	return ok;
+}
+
+BOOLEAN check_same_bits(ULONG nthreads, ULONGLONG count)
+{
+	BITMAP_THREAD threads[MAX_THREADS];
+	ATOMIC_BITMAP bitmap;
+	ULONGLONG bit;
+	LONGLONG set;
+	ULONG t;
+	BOOLEAN ok;
+
+	/* A few words, so that the threads keep racing. */
+	if (!NT_SUCCESS(atomic_bitmap_init(&bitmap, 4 * 64 + 5))) {
+		return FALSE;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].bitmap = &bitmap;
+		threads[t].count = count;
+		threads[t].seed = RANDOM_SEED + t;
+	}
+
+	run_threads(threads, nthreads, update_same_bits);
+
+	for (bit = 0, set = 0; bit < bitmap.nbits; bit++) {
+		set += atomic_bitmap_test(&bitmap, bit);
+	}
+
+	ok = (BOOLEAN) (bitmap.count == set);
+
+	/* And it still counts down to 0. */
+	atomic_bitmap_clear_range(&bitmap, 0, bitmap.nbits);
+
+	ok = (BOOLEAN) (ok && (bitmap.count == 0));
+
+	atomic_bitmap_free(&bitmap);
+
+	return ok;
+}
+
+double measure(ULONG nthreads, ULONGLONG count, int mode)
+{
+	BITMAP_THREAD threads[MAX_THREADS];
+	ATOMIC_BITMAP bitmap;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONG t;
+
+	if (!NT_SUCCESS(atomic_bitmap_init(&bitmap, (ULONGLONG) MAX_THREADS * LINE_BITS))) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	if (mode == MODE_SET) {
+		atomic_bitmap_set_range(&bitmap, 0, bitmap.nbits);
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].bitmap = &bitmap;
+		threads[t].id = t;
+		threads[t].count = count;
+		threads[t].seed = RANDOM_SEED + t;
+		threads[t].mode = mode;
+	}
+
+	start = port_timestamp();
+
+	run_threads(threads, nthreads, update);
+
+	elapsed = port_timestamp() - start;
+
+	atomic_bitmap_free(&bitmap);
+
+	return (double) nthreads * count / (double) elapsed * 1e3;
+}
+
+void run_threads(BITMAP_THREAD *threads, ULONG nthreads, void *(*routine)(void *))
+{
+	ULONG t;
+
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t].thread, NULL, routine, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+}
+
+/* The bits of a thread are its blocks of BLOCK_BITS bits, one in "nthreads". */
+void *update_own_bits(void *arg)
+{
+	BITMAP_THREAD *thread;
+	ULONGLONG nblocks;
+	ULONGLONG block;
+	ULONGLONG first;
+	ULONGLONG count;
+	ULONGLONG r;
+	ULONGLONG i;
+	ULONGLONG bit;
+
+	thread = (BITMAP_THREAD *) arg;
+
+	nblocks = (CHECK_BITS / BLOCK_BITS + thread->nthreads - 1 - thread->id) / thread->nthreads;
+
+	for (i = 0; (thread->ok) && (i < thread->count); i++) {
+		r = next_random(&thread->seed);
+
+		block = ((r >> 16) % nblocks) * thread->nthreads + thread->id;
+		first = block * BLOCK_BITS + (r >> 8) % BLOCK_BITS;
+		count = 1 + (r >> 40) % (BLOCK_BITS - (first % BLOCK_BITS));
+
+		if (r & 1) {
+			atomic_bitmap_set_range(thread->bitmap, first, count);
+		} else {
+			atomic_bitmap_clear_range(thread->bitmap, first, count);
+		}
+
+		memset(thread->bits + first, (int) (r & 1), (SIZE_T) count);
+
+		/* Nobody else touches the block. */
+		for (bit = block * BLOCK_BITS; bit < (block + 1) * BLOCK_BITS; bit++) {
+			thread->ok = (BOOLEAN) ((thread->ok) && (atomic_bitmap_test(thread->bitmap, bit) == thread->bits[bit]));
+		}
+	}
+
+	return NULL;
+}
+
+void *update_same_bits(void *arg)
+{
+	BITMAP_THREAD *thread;
+	ULONGLONG first;
+	ULONGLONG count;
+	ULONGLONG r;
+	ULONGLONG i;
+
+	thread = (BITMAP_THREAD *) arg;
+
+	for (i = 0; i < thread->count; i++) {
+		r = next_random(&thread->seed);
+
+		first = (r >> 16) % thread->bitmap->nbits;
+		count = 1 + (r >> 40) % (thread->bitmap->nbits - first);
+
+		if (r & 1) {
+			atomic_bitmap_set_range(thread->bitmap, first, count);
+		} else {
+			atomic_bitmap_clear_range(thread->bitmap, first, count);
+		}
+	}
+
+	return NULL;
+}
+
+void *update(void *arg)
+{
+	BITMAP_THREAD *thread;
+	ULONGLONG first;
+	ULONGLONG i;
+
+	thread = (BITMAP_THREAD *) arg;
+
+	/* A cache line of its own, or the first one for all. */
+	first = (thread->mode == MODE_SAME_LINE) ? 0 : (ULONGLONG) thread->id * LINE_BITS;
+
+	for (i = 0; i < thread->count; i++) {
+		if (thread->mode == MODE_SET) {
+			atomic_bitmap_set_range(thread->bitmap, first + (i & (LINE_BITS - 1)), 1);
+		} else if (i & 1) {
+			atomic_bitmap_clear_range(thread->bitmap, first + ((i >> 1) & (LINE_BITS - 1)), 1);
+		} else {
+			atomic_bitmap_set_range(thread->bitmap, first + ((i >> 1) & (LINE_BITS - 1)), 1);
+		}
+	}
+
+	return NULL;
+}
+
+BOOLEAN matches(ATOMIC_BITMAP *bitmap, const UCHAR *bits)
+{
+	ULONGLONG bit;
+	LONGLONG count;
+
+	for (bit = 0, count = 0; bit < bitmap->nbits; bit++) {
+		if (atomic_bitmap_test(bitmap, bit) != bits[bit]) {
+			return FALSE;
+		}
+
+		count += bits[bit];
+	}
+
+	return (BOOLEAN) (bitmap->count == count);
+}
@@ -0,0 +1,728 @@
+/*
+ * End-to-end test of the write-back cache (cache.c) on Linux, against a
+ * local backing file: worker threads read and write blocks through the
+ * cache while a flusher thread writes back the dirty chunks and evicts the
+ * clean ones, as the driver does. Every read is compared with a copy of the
+ * disk kept in memory; at the end the cache is flushed and closed, and the
+ * file is read back through a new cache and compared too.
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o cachebench cachebench.c ../common/tools.c \
+ *       ../../cache.c ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c \
+ *       ../../range_lock.c ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c ../../port_file.c
+ *
+ * Usage: cachebench [options] file
+ *   -s size      Disk size (K, M and G suffixes; default 256M).
+ *   -c size      Cache size (default 64M).
+ *   -l size      Dirty limit (default a quarter of the cache).
+ *   -b size      Block size, 512 bytes to 1 MB (default 4K).
+ *   -t threads   Threads submitting requests (default 4).
+ *   -r percent   Reads, the rest are writes (default 70).
+ *   -h percent   Requests going to the first tenth of the disk (default 90).
+ *   -n count     Requests per thread (default 100000).
+ *   -i ms        Flush interval (default 100).
+ * The file keeps its contents between runs: they are read first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "port.h"
+#include "cache.h"
+#include "disk_io.h"
+#include "range_lock.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-c size] [-l size] [-b size] [-t threads] [-r percent] [-h percent] [-n count] [-i ms] file"
+#define MIN_BLOCK_SIZE                  512
+#define MAX_BLOCK_SIZE                  (1024 * 1024)
+#define SECTOR_SIZE                     512
+#define VERIFY_BLOCK_SIZE               (1024 * 1024)
+#define THROTTLE_WAIT                   1000 /* Microseconds. */
+#define THROTTLE_MAX_WAITS              1000
+
+typedef struct {
+	RANGE_LOCK_ENTRY range;            /* First member: the granted entries are cast back. */
+	volatile LONG    granted;
+} CACHE_REQUEST;
+
+typedef struct {
+	CHUNK_POOL     pool;
+	CHUNK_QUOTA    quota;
+	CHUNK_TABLE    chunk_table;
+	RANGE_LOCK     range_lock;
+	ATOMIC_BITMAP  dirty_chunks;
+	CACHE          cache;
+	ULONGLONG      disk_size;
+	UCHAR          *reference;         /* What the disk must contain. */
+	pthread_mutex_t load_mutex;        /* The loads are sequential, as in the load queue of the driver. */
+
+	/* Flusher. */
+	pthread_t      flusher;
+	sem_t          wake;
+	volatile LONG  wake_pending;
+	volatile LONG  passes;
+	volatile LONG  stop;
+	ULONG          flush_interval;
+	UCHAR          *flush_buffer;
+} CACHE_DISK;
+
+typedef struct {
+	CACHE_DISK *disk;
+	pthread_t  thread;
+	ULONG      number;
+	ULONG      block_size;
+	ULONG      read_percent;
+	ULONG      hot_percent;
+	ULONGLONG  count;
+	UCHAR      *load_buffer;
+
+	ULONGLONG  *latencies;             /* Nanoseconds, one per request. */
+	ULONGLONG  nrequests;
+	ULONGLONG  hits;
+	ULONGLONG  errors;
+	ULONGLONG  mismatches;
+} CACHE_THREAD;
+
+BOOLEAN open_disk(CACHE_DISK *disk, const char *path, ULONGLONG cache_size, ULONGLONG dirty_limit);
+void close_disk(CACHE_DISK *disk);
+BOOLEAN read_file(const char *path, UCHAR *data, ULONGLONG size);
+NTSTATUS execute(CACHE_THREAD *thread, UCHAR operation, ULONGLONG offset, UCHAR *buffer, ULONG length);
+void throttle_writes(CACHE_DISK *disk);
+void wake_flusher(CACHE_DISK *disk);
+void *flusher(void *arg);
+NTSTATUS flush_cache(CACHE_DISK *disk);
+void evict_chunks(CACHE_DISK *disk);
+void release(CACHE_DISK *disk, CACHE_REQUEST *request);
+void *worker(void *arg);
+ULONGLONG verify(const char *path, ULONGLONG disk_size, const UCHAR *reference);
+int compare(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+	CACHE_DISK disk;
+	CACHE_THREAD *threads;
+	ULONGLONG *latencies;
+	ULONGLONG cache_size;
+	ULONGLONG dirty_limit;
+	ULONGLONG size;
+	ULONGLONG count;
+	ULONGLONG nrequests;
+	ULONGLONG hits;
+	ULONGLONG errors;
+	ULONGLONG mismatches;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG i;
+	ULONG nthreads;
+	ULONG block_size;
+	ULONG read_percent;
+	ULONG hot_percent;
+	ULONG t;
+	NTSTATUS status;
+	int opt;
+
+	memset(&disk, 0, sizeof(disk));
+
+	disk.disk_size = 256ULL << 20;
+	disk.flush_interval = 100;
+	cache_size = 64ULL << 20;
+	dirty_limit = 0;
+	block_size = 4096;
+	nthreads = 4;
+	read_percent = 70;
+	hot_percent = 90;
+	count = 100000;
+
+	while ((opt = getopt(argc, argv, "s:c:l:b:t:r:h:n:i:")) != -1) {
+		switch (opt) {
+			case 's':
+				if ((!parse_size(optarg, &disk.disk_size)) || (disk.disk_size == 0) || (disk.disk_size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'c':
+				if ((!parse_size(optarg, &cache_size)) || (cache_size == 0)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'l':
+				if (!parse_size(optarg, &dirty_limit)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'b':
+				if ((!parse_size(optarg, &size)) || (size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE) || (size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				block_size = (ULONG) size;
+				break;
+			case 't':
+				if ((nthreads = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'r':
+				if ((read_percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'h':
+				if ((hot_percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'i':
+				if ((disk.flush_interval = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((optind != argc - 1) || (block_size * 10ULL > disk.disk_size)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	/* As in the driver. */
+	if ((dirty_limit == 0) || (dirty_limit > cache_size)) {
+		dirty_limit = cache_size >> 2;
+	}
+
+	/* The disk as it is in the file now. */
+	if ((disk.reference = (UCHAR *) calloc(1, (size_t) disk.disk_size)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	if (!read_file(argv[optind], disk.reference, disk.disk_size)) {
+		return 1;
+	}
+
+	if (!open_disk(&disk, argv[optind], cache_size, dirty_limit)) {
+		return 1;
+	}
+
+	if ((threads = (CACHE_THREAD *) calloc(nthreads, sizeof(CACHE_THREAD))) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].disk = &disk;
+		threads[t].number = t;
+		threads[t].block_size = block_size;
+		threads[t].read_percent = read_percent;
+		threads[t].hot_percent = hot_percent;
+		threads[t].count = count;
+
+		if (((threads[t].latencies = (ULONGLONG *) malloc(count * sizeof(ULONGLONG))) == NULL) ||
+			((threads[t].load_buffer = (UCHAR *) malloc(disk.cache.buffer_size)) == NULL)) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+	}
+
+	if (pthread_create(&disk.flusher, NULL, flusher, &disk) != 0) {
+		fprintf(stderr, "Cannot create the flusher.\n");
+		return 1;
+	}
+
+	start = port_timestamp();
+
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t].thread, NULL, worker, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			return 1;
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	elapsed = port_timestamp() - start;
+
+	InterlockedIncrement(&disk.stop);
+	sem_post(&disk.wake);
+	pthread_join(disk.flusher, NULL);
+
+	/* What is left, as the checkpoint of the driver does on shutdown. */
+	status = flush_cache(&disk);
+	if ((!NT_SUCCESS(status)) || (disk.dirty_chunks.count != 0)) {
+		fprintf(stderr, "The cache cannot be flushed (status 0x%08x, %" PRId64 " dirty chunks).\n", (unsigned) status, (int64_t) disk.dirty_chunks.count);
+		return 1;
+	}
+
+	/* Merge the results of all the threads. */
+	for (t = 0, nrequests = 0, hits = 0, errors = 0, mismatches = 0; t < nthreads; t++) {
+		nrequests += threads[t].nrequests;
+		hits += threads[t].hits;
+		errors += threads[t].errors;
+		mismatches += threads[t].mismatches;
+	}
+
+	if ((latencies = (ULONGLONG *) malloc(nrequests * sizeof(ULONGLONG))) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (t = 0, i = 0; t < nthreads; t++) {
+		memcpy(latencies + i, threads[t].latencies, threads[t].nrequests * sizeof(ULONGLONG));
+		i += threads[t].nrequests;
+		free(threads[t].latencies);
+		free(threads[t].load_buffer);
+	}
+
+	qsort(latencies, nrequests, sizeof(ULONGLONG), compare);
+
+	printf("Requests: %" PRIu64 " (%" PRIu64 " errors) in %.3f s\n", nrequests, errors, (double) elapsed / 1e9);
+	printf("IOPS: %.0f\n", (double) nrequests * 1e9 / (double) elapsed);
+	printf("Hit rate: %.1f%%\n", (double) hits * 100.0 / (double) nrequests);
+	printf("Latency: p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+		   latencies[(nrequests - 1) * 50 / 100],
+		   latencies[(nrequests - 1) * 99 / 100],
+		   latencies[(nrequests - 1) * 999 / 1000],
+		   latencies[nrequests - 1]);
+	printf("Chunks: %" PRId64 " read, %" PRId64 " flushed, %" PRId64 " evicted (%ld flusher passes)\n",
+		   (int64_t) disk.cache.misses, (int64_t) disk.cache.flushed, (int64_t) disk.cache.evicted, (long) disk.passes);
+	printf("Memory: %" PRIu64 " MB of %" PRIu64 " MB\n", chunk_table_memory_used(&disk.chunk_table) >> 20, cache_size >> 20);
+
+	free(latencies);
+	free(threads);
+
+	close_disk(&disk);
+
+	/* Read the file back through a new cache. */
+	mismatches += verify(argv[optind], disk.disk_size, disk.reference);
+
+	free(disk.reference);
+
+	if ((mismatches) || (errors)) {
+		printf("FAILED: %" PRIu64 " mismatches, %" PRIu64 " errors\n", mismatches, errors);
+		return 1;
+	}
+
+	printf("Verified\n");
+
+	return 0;
+}
+
+BOOLEAN open_disk(CACHE_DISK *disk, const char *path, ULONGLONG cache_size, ULONGLONG dirty_limit)
+{
+	NTSTATUS status;
+
+	if (!NT_SUCCESS(chunk_table_init(&disk->chunk_table, disk->disk_size, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Cannot create the disk.\n");
+		return FALSE;
+	}
+
+	/* The chunks come from a pool, as in the driver. */
+	chunk_pool_init(&disk->pool, DEFAULT_CHUNK_SHIFT, 0, CHUNK_POOL_CACHE);
+	chunk_quota_init(&disk->quota, &disk->pool, 0);
+
+	chunk_table_set_quota(&disk->chunk_table, &disk->quota);
+
+	range_lock_init(&disk->range_lock);
+
+	if (!NT_SUCCESS(atomic_bitmap_init(&disk->dirty_chunks, disk->chunk_table.nchunks))) {
+		fprintf(stderr, "Cannot allocate the dirty bitmap.\n");
+		return FALSE;
+	}
+
+	status = cache_open(&disk->cache, &disk->chunk_table, &disk->dirty_chunks, path, disk->disk_size, cache_size, dirty_limit);
+	if (!NT_SUCCESS(status)) {
+		fprintf(stderr, "Cannot open %s (status 0x%08x).\n", path, (unsigned) status);
+		return FALSE;
+	}
+
+	if ((disk->flush_buffer = (UCHAR *) malloc(disk->cache.buffer_size)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return FALSE;
+	}
+
+	sem_init(&disk->wake, 0, 0);
+	pthread_mutex_init(&disk->load_mutex, NULL);
+
+	return TRUE;
+}
+
+void close_disk(CACHE_DISK *disk)
+{
+	cache_close(&disk->cache);
+
+	pthread_mutex_destroy(&disk->load_mutex);
+	sem_destroy(&disk->wake);
+	free(disk->flush_buffer);
+
+	atomic_bitmap_free(&disk->dirty_chunks);
+	range_lock_destroy(&disk->range_lock);
+	chunk_table_free(&disk->chunk_table);
+	chunk_pool_free(&disk->pool);
+}
+
+/* A missing or shorter file reads as zeros. */
+BOOLEAN read_file(const char *path, UCHAR *data, ULONGLONG size)
+{
+	FILE *file;
+
+	if ((file = fopen(path, "rb")) == NULL) {
+		if (errno == ENOENT) {
+			return TRUE;
+		}
+
+		fprintf(stderr, "Cannot open %s.\n", path);
+		return FALSE;
+	}
+
+	fread(data, 1, (size_t) size, file);
+
+	if (ferror(file)) {
+		fprintf(stderr, "Cannot read %s.\n", path);
+		fclose(file);
+		return FALSE;
+	}
+
+	fclose(file);
+
+	return TRUE;
+}
+
+/* The order of execute_request() and EvtIoLoad in the driver. */
+NTSTATUS execute(CACHE_THREAD *thread, UCHAR operation, ULONGLONG offset, UCHAR *buffer, ULONG length)
+{
+	CACHE_DISK *disk;
+	CACHE_REQUEST request;
+	NTSTATUS status;
+
+	disk = thread->disk;
+
+	/* Beyond the dirty limit, the writes wait for the flusher. */
+	if (operation == REQUEST_WRITE) {
+		throttle_writes(disk);
+	}
+
+	request.granted = FALSE;
+
+	/* The driver executes the waiters on behalf of the thread which releases the range; here they wait. */
+	if (!range_lock_acquire(&disk->range_lock, &request.range, offset, offset + length, (BOOLEAN) (operation != REQUEST_READ))) {
+		while (!request.granted) {
+			sched_yield();
+		}
+	}
+
+	if (operation == REQUEST_WRITE) {
+		cache_claim(&disk->cache, &disk->chunk_table, offset, length);
+	}
+
+	status = STATUS_SUCCESS;
+
+	if (chunk_table_is_loaded(&disk->chunk_table, offset, length)) {
+		thread->hits++;
+	} else {
+		pthread_mutex_lock(&disk->load_mutex);
+		status = cache_load(&disk->cache, &disk->chunk_table, offset, length, thread->load_buffer);
+		pthread_mutex_unlock(&disk->load_mutex);
+	}
+
+	if (NT_SUCCESS(status)) {
+		status = disk_io_transfer(&disk->chunk_table, operation, offset, buffer, length);
+	}
+
+	/* The range is still held: the reference has the same contents as the disk. */
+	if (NT_SUCCESS(status)) {
+		if (operation == REQUEST_READ) {
+			if (memcmp(buffer, disk->reference + offset, length) != 0) {
+				thread->mismatches++;
+			}
+		} else {
+			memcpy(disk->reference + offset, buffer, length);
+		}
+	}
+
+	if (operation != REQUEST_READ) {
+		disk_io_mark_dirty(&disk->dirty_chunks, disk->chunk_table.chunk_shift, offset, offset + length);
+	}
+
+	release(disk, &request);
+
+	/* Don't wait for the interval when the cache is over its limits. */
+	if ((cache_over_size(&disk->cache, &disk->chunk_table)) || ((operation != REQUEST_READ) && (cache_over_dirty_limit(&disk->cache)))) {
+		wake_flusher(disk);
+	}
+
+	return status;
+}
+
+/* Bounded, so that the writes go on even if the file cannot be written. */
+void throttle_writes(CACHE_DISK *disk)
+{
+	LONG passes;
+	ULONG waits;
+
+	for (waits = 0; (waits < THROTTLE_MAX_WAITS) && (cache_over_dirty_limit(&disk->cache)); waits++) {
+		passes = disk->passes;
+
+		wake_flusher(disk);
+
+		while ((disk->passes == passes) && (waits < THROTTLE_MAX_WAITS)) {
+			usleep(THROTTLE_WAIT);
+			waits++;
+		}
+	}
+}
+
+void wake_flusher(CACHE_DISK *disk)
+{
+	if (InterlockedCompareExchange(&disk->wake_pending, 1, 0) == 0) {
+		sem_post(&disk->wake);
+	}
+}
+
+void *flusher(void *arg)
+{
+	CACHE_DISK *disk;
+	struct timespec timeout;
+	NTSTATUS status;
+
+	disk = (CACHE_DISK *) arg;
+
+	while (!disk->stop) {
+		/* Every interval, or as soon as the cache goes over its limits. */
+		clock_gettime(CLOCK_REALTIME, &timeout);
+
+		timeout.tv_nsec += (long) (disk->flush_interval % 1000) * 1000000L;
+		timeout.tv_sec += (time_t) (disk->flush_interval / 1000) + (timeout.tv_nsec / 1000000000L);
+		timeout.tv_nsec %= 1000000000L;
+
+		sem_timedwait(&disk->wake, &timeout);
+
+		InterlockedAnd(&disk->wake_pending, 0);
+
+		if (disk->stop) {
+			break;
+		}
+
+		if (disk->dirty_chunks.count > 0) {
+			status = flush_cache(disk);
+			if (!NT_SUCCESS(status)) {
+				fprintf(stderr, "The cache cannot be flushed (status 0x%08x).\n", (unsigned) status);
+			}
+		}
+
+		/* The chunks which have just been flushed can be evicted. */
+		if (cache_over_size(&disk->cache, &disk->chunk_table)) {
+			evict_chunks(disk);
+		}
+
+		/* Let the throttled writes go on. */
+		InterlockedIncrement(&disk->passes);
+	}
+
+	return NULL;
+}
+
+/* The runs being written are skipped, they are flushed next time. */
+NTSTATUS flush_cache(CACHE_DISK *disk)
+{
+	CACHE_REQUEST request;
+	ULONGLONG index;
+	ULONGLONG first;
+	ULONGLONG end;
+	ULONGLONG start;
+	ULONGLONG stop;
+	NTSTATUS status;
+
+	status = STATUS_SUCCESS;
+
+	for (index = 0; cache_next_dirty(&disk->cache, index, &first, &end); index = end) {
+		start = first << disk->chunk_table.chunk_shift;
+		stop = ((end << disk->chunk_table.chunk_shift) < disk->disk_size) ? (end << disk->chunk_table.chunk_shift) : disk->disk_size;
+
+		if (!range_lock_try_acquire(&disk->range_lock, &request.range, start, stop, FALSE)) {
+			continue;
+		}
+
+		status = cache_flush(&disk->cache, &disk->chunk_table, first, end, disk->flush_buffer);
+
+		release(disk, &request);
+
+		if (!NT_SUCCESS(status)) {
+			break;
+		}
+	}
+
+	return status;
+}
+
+void evict_chunks(CACHE_DISK *disk)
+{
+	CACHE_REQUEST request;
+	CHUNK_TABLE *chunk_table;
+	ULONGLONG index;
+	ULONGLONG start;
+	ULONGLONG attempts;
+
+	chunk_table = &disk->chunk_table;
+
+	for (attempts = 0; (attempts < chunk_table->nchunks) && (chunk_table_memory_used(chunk_table) > cache_low_watermark(&disk->cache)); attempts++) {
+		if (!cache_next_victim(&disk->cache, chunk_table, &index)) {
+			break;
+		}
+
+		/* Skip the chunk if there is I/O on it. */
+		start = index << chunk_table->chunk_shift;
+		if (!range_lock_try_acquire(&disk->range_lock, &request.range, start, start + ((ULONGLONG) 1 << chunk_table->chunk_shift), TRUE)) {
+			continue;
+		}
+
+		cache_evict(&disk->cache, chunk_table, index);
+
+		release(disk, &request);
+	}
+}
+
+void release(CACHE_DISK *disk, CACHE_REQUEST *request)
+{
+	RANGE_LOCK_ENTRY *granted;
+	RANGE_LOCK_ENTRY *next;
+
+	for (granted = range_lock_release(&disk->range_lock, &request->range); granted; granted = next) {
+		/* The waiter might return (and reuse its entry) as soon as it sees the flag. */
+		next = granted->next_granted;
+		InterlockedIncrement(&((CACHE_REQUEST *) granted)->granted);
+	}
+}
+
+void *worker(void *arg)
+{
+	CACHE_THREAD *thread;
+	ULONGLONG nblocks;
+	ULONGLONG nhot;
+	ULONGLONG block;
+	ULONGLONG random;
+	ULONGLONG start;
+	UCHAR operation;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	thread = (CACHE_THREAD *) arg;
+
+	if ((buffer = (UCHAR *) malloc(thread->block_size)) == NULL) {
+		return NULL;
+	}
+
+	nblocks = thread->disk->disk_size / thread->block_size;
+	nhot = nblocks / 10;
+
+	random = 0x9e3779b97f4a7c15ULL * (thread->number + 1);
+
+	for (thread->nrequests = 0; thread->nrequests < thread->count; thread->nrequests++) {
+		next_random(&random);
+
+		/* Most of the requests go to the hot part of the disk. */
+		if (((random >> 40) % 100) < thread->hot_percent) {
+			block = random % nhot;
+		} else {
+			block = nhot + (random % (nblocks - nhot));
+		}
+
+		operation = (((random >> 32) % 100) < thread->read_percent) ? REQUEST_READ : REQUEST_WRITE;
+
+		if (operation == REQUEST_WRITE) {
+			/* Something which tells the blocks and the writes apart. */
+			memset(buffer, (int) (random >> 56), thread->block_size);
+			memcpy(buffer, &random, sizeof(random));
+		}
+
+		start = port_timestamp();
+		status = execute(thread, operation, block * thread->block_size, buffer, thread->block_size);
+		thread->latencies[thread->nrequests] = port_timestamp() - start;
+
+		if (!NT_SUCCESS(status)) {
+			thread->errors++;
+		}
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+/* Returns the blocks of the file which differ from the reference. */
+ULONGLONG verify(const char *path, ULONGLONG disk_size, const UCHAR *reference)
+{
+	CACHE_DISK disk;
+	ULONGLONG offset;
+	ULONGLONG mismatches;
+	ULONG length;
+	UCHAR *buffer;
+	UCHAR *load_buffer;
+
+	memset(&disk, 0, sizeof(disk));
+
+	disk.disk_size = disk_size;
+
+	if (!open_disk(&disk, path, disk_size, disk_size)) {
+		return 1;
+	}
+
+	if (((buffer = (UCHAR *) malloc(VERIFY_BLOCK_SIZE)) == NULL) || ((load_buffer = (UCHAR *) malloc(disk.cache.buffer_size)) == NULL)) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (offset = 0, mismatches = 0; offset < disk_size; offset += length) {
+		length = ((disk_size - offset) < VERIFY_BLOCK_SIZE) ? (ULONG) (disk_size - offset) : VERIFY_BLOCK_SIZE;
+
+		if ((!NT_SUCCESS(cache_load(&disk.cache, &disk.chunk_table, offset, length, load_buffer))) ||
+			(!NT_SUCCESS(disk_io_transfer(&disk.chunk_table, REQUEST_READ, offset, buffer, length))) ||
+			(memcmp(buffer, reference + offset, length) != 0)) {
+			mismatches++;
+		}
+	}
+
+	free(load_buffer);
+	free(buffer);
+
+	close_disk(&disk);
+
+	return mismatches;
+}
+
+int compare(const void *a, const void *b)
+{
+	ULONGLONG x = *((const ULONGLONG *) a);
+	ULONGLONG y = *((const ULONGLONG *) b);
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,387 @@
+/*
+ * Test and benchmark of the allocate-on-write chunk table on Linux.
+ * It checks that:
+ *   - the chunks are allocated the first time they are written, and only
+ *     those written, whatever the offset and length of the writes;
+ *   - reading chunks never written returns zeros and allocates nothing;
+ *   - chunk_table_memory_used() follows the chunks written, and goes back
+ *     to zero with the table;
+ *   - random writes and reads of any length, crossing chunks, read back
+ *     what a flat copy of the disk holds.
+ * Then it compares the chunk table with a single flat allocation of the
+ * whole disk (the image before the chunk table): random reads and writes
+ * of "block_size" bytes, and the memory used by each one with a part of
+ * the disk written.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o chunkcheck chunkcheck.c ../common/tools.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ *
+ * Usage: chunkcheck [options]
+ *   -s size      Disk size (K, M and G suffixes; default 256M).
+ *   -b size      Block size of the benchmark, 512 bytes to 1 MB (default 4K).
+ *   -w percent   Part of the disk written before the benchmark (default 10).
+ *   -n count     Requests of each kind (default 1000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-b size] [-w percent] [-n count]"
+#define MIN_BLOCK_SIZE                  512
+#define MAX_BLOCK_SIZE                  (1024 * 1024)
+#define SECTOR_SIZE                     512
+#define CHECK_SIZE                      (16ULL * 1024 * 1024)
+#define CHECK_REQUESTS                  100000
+
+BOOLEAN check_allocation(void);
+BOOLEAN check_zeros(void);
+BOOLEAN check_random(void);
+void benchmark(ULONGLONG size, ULONG block_size, ULONG percent, ULONGLONG count);
+ULONGLONG allocated_chunks(CHUNK_TABLE *table);
+
+int main(int argc, char **argv)
+{
+	ULONGLONG size;
+	ULONGLONG block_size;
+	ULONGLONG count;
+	ULONG percent;
+	BOOLEAN ok;
+	int opt;
+
+	size = 256ULL << 20;
+	block_size = 4096;
+	percent = 10;
+	count = 1000000;
+
+	while ((opt = getopt(argc, argv, "s:b:w:n:")) != -1) {
+		switch (opt) {
+			case 's':
+				if ((!parse_size(optarg, &size)) || (size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'b':
+				if ((!parse_size(optarg, &block_size)) || (block_size < MIN_BLOCK_SIZE) || (block_size > MAX_BLOCK_SIZE) || (block_size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'w':
+				if ((percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((optind != argc) || (size < block_size)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "Chunks are allocated on the first write", (check_allocation()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Chunks never written read as zeros", (check_zeros()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Random transfers read back what was written", (check_random()) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	benchmark(size, (ULONG) block_size, percent, count);
+
+	return 0;
+}
+
+BOOLEAN check_allocation(void)
+{
+	CHUNK_TABLE table;
+	UCHAR buffer[3 * SECTOR_SIZE];
+	ULONG chunk_size;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, CHECK_SIZE, DEFAULT_CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+
+	ok = (BOOLEAN) ((table.nchunks == CHECK_SIZE / chunk_size) && (chunk_table_memory_used(&table) == 0) && (allocated_chunks(&table) == 0));
+
+	memset(buffer, 0x11, sizeof(buffer));
+
+	/* A sector in the middle of chunk 3: only chunk 3. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, 3ULL * chunk_size + 8 * SECTOR_SIZE, buffer, SECTOR_SIZE))));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&table, 3)->data) && (allocated_chunks(&table) == 1) && (chunk_table_memory_used(&table) == chunk_size));
+
+	/* Written again: nothing more. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, 3ULL * chunk_size, buffer, sizeof(buffer)))) && (allocated_chunks(&table) == 1));
+
+	/* Across the end of chunk 5: chunks 5 and 6. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, 6ULL * chunk_size - SECTOR_SIZE, buffer, sizeof(buffer)))));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&table, 5)->data) && (chunk_table_get_chunk(&table, 6)->data) && (!chunk_table_get_chunk(&table, 4)->data));
+	ok = (BOOLEAN) (ok && (allocated_chunks(&table) == 3) && (chunk_table_memory_used(&table) == 3ULL * chunk_size));
+
+	/* The last sector of the disk. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, CHECK_SIZE - SECTOR_SIZE, buffer, SECTOR_SIZE))));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&table, table.nchunks - 1)->data) && (allocated_chunks(&table) == 4));
+
+	ok = (BOOLEAN) (ok && ((ULONGLONG) table.nallocated == allocated_chunks(&table)));
+
+	chunk_table_free(&table);
+
+	return (BOOLEAN) (ok && (chunk_table_memory_used(&table) == 0));
+}
+
+BOOLEAN check_zeros(void)
+{
+	CHUNK_TABLE table;
+	UCHAR *buffer;
+	ULONGLONG offset;
+	ULONG chunk_size;
+	ULONG i;
+	BOOLEAN ok;
+
+	chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+
+	if ((buffer = (UCHAR *) malloc(2 * chunk_size)) == NULL) {
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(chunk_table_init(&table, CHECK_SIZE, DEFAULT_CHUNK_SHIFT))) {
+		free(buffer);
+		return FALSE;
+	}
+
+	ok = TRUE;
+
+	/* The whole disk, two chunks at a time, from the middle of a chunk. */
+	for (offset = chunk_size / 2; (ok) && (offset + 2 * chunk_size <= CHECK_SIZE); offset += 2 * chunk_size) {
+		memset(buffer, 0xff, 2 * chunk_size);
+
+		ok = (BOOLEAN) (NT_SUCCESS(chunk_table_read(&table, offset, buffer, 2 * chunk_size)));
+
+		for (i = 0; (ok) && (i < 2 * chunk_size); i++) {
+			ok = (BOOLEAN) (buffer[i] == 0);
+		}
+	}
+
+	ok = (BOOLEAN) (ok && (allocated_chunks(&table) == 0) && (chunk_table_memory_used(&table) == 0));
+
+	/* Zeros around a chunk written. */
+	memset(buffer, 0x22, chunk_size);
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, 2ULL * chunk_size, buffer, chunk_size))));
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_read(&table, chunk_size + chunk_size / 2, buffer, 2 * chunk_size))));
+
+	for (i = 0; (ok) && (i < 2 * chunk_size); i++) {
+		ok = (BOOLEAN) (buffer[i] == (((i >= chunk_size / 2) && (i < chunk_size + chunk_size / 2)) ? 0x22 : 0));
+	}
+
+	ok = (BOOLEAN) (ok && (allocated_chunks(&table) == 1));
+
+	chunk_table_free(&table);
+	free(buffer);
+
+	return ok;
+}
+
+BOOLEAN check_random(void)
+{
+	CHUNK_TABLE table;
+	UCHAR *copy;
+	UCHAR *buffer;
+	ULONGLONG seed;
+	ULONGLONG offset;
+	ULONGLONG r;
+	ULONGLONG written;
+	ULONGLONG i;
+	ULONG length;
+	ULONG max_length;
+	BOOLEAN ok;
+
+	max_length = 4UL << DEFAULT_CHUNK_SHIFT;
+
+	copy = (UCHAR *) calloc(1, CHECK_SIZE);
+	buffer = (UCHAR *) malloc(max_length);
+
+	if ((!copy) || (!buffer) || (!NT_SUCCESS(chunk_table_init(&table, CHECK_SIZE, DEFAULT_CHUNK_SHIFT)))) {
+		free(buffer);
+		free(copy);
+		return FALSE;
+	}
+
+	seed = RANDOM_SEED;
+	ok = TRUE;
+
+	for (i = 0; (ok) && (i < CHECK_REQUESTS); i++) {
+		r = next_random(&seed);
+
+		length = (ULONG) ((r % (max_length / SECTOR_SIZE)) + 1) * SECTOR_SIZE;
+		offset = ((r >> 32) % (CHECK_SIZE / SECTOR_SIZE)) * SECTOR_SIZE;
+
+		if (offset + length > CHECK_SIZE) {
+			length = (ULONG) (CHECK_SIZE - offset);
+		}
+
+		/* Half writes (of a non-zero byte), half reads. */
+		if (r & (1ULL << 31)) {
+			memset(buffer, (int) (i % 255) + 1, length);
+			memcpy(copy + offset, buffer, length);
+
+			ok = (BOOLEAN) (NT_SUCCESS(chunk_table_write(&table, offset, buffer, length)));
+		} else {
+			ok = (BOOLEAN) ((NT_SUCCESS(chunk_table_read(&table, offset, buffer, length))) && (memcmp(buffer, copy + offset, length) == 0));
+		}
+	}
+
+	/* Exactly the chunks with something written. */
+	written = 0;
+
+	for (i = 0; i < table.nchunks; i++) {
+		for (r = 0; r < (1ULL << DEFAULT_CHUNK_SHIFT); r++) {
+			if (copy[(i << DEFAULT_CHUNK_SHIFT) + r]) {
+				written++;
+				break;
+			}
+		}
+	}
+
+	ok = (BOOLEAN) (ok && (allocated_chunks(&table) == written) && (chunk_table_memory_used(&table) == (written << DEFAULT_CHUNK_SHIFT)));
+
+	chunk_table_free(&table);
+	free(buffer);
+	free(copy);
+
+	return ok;
+}
+
+void benchmark(ULONGLONG size, ULONG block_size, ULONG percent, ULONGLONG count)
+{
+	CHUNK_TABLE table;
+	UCHAR *flat;
+	UCHAR *buffer;
+	ULONGLONG nblocks;
+	ULONGLONG nwritten;
+	ULONGLONG offset;
+	ULONGLONG seed;
+	ULONGLONG start;
+	ULONGLONG elapsed[2][2];
+	ULONGLONG i;
+	ULONG kind;
+	ULONG write;
+
+	static const char *kinds[] = {"chunk table", "flat image"};
+
+	buffer = (UCHAR *) malloc(block_size);
+
+	/* The flat image is the whole disk, touched so that it is really there. */
+	flat = (UCHAR *) malloc(size);
+
+	if ((!buffer) || (!flat) || (!NT_SUCCESS(chunk_table_init(&table, size, DEFAULT_CHUNK_SHIFT)))) {
+		fprintf(stderr, "Out of memory.\n");
+		free(flat);
+		free(buffer);
+		return;
+	}
+
+	memset(flat, 0, size);
+
+	/* The first "percent" of the disk written in both; the requests go there. */
+	nblocks = size / block_size;
+	nwritten = nblocks * percent / 100;
+	if (nwritten == 0) {
+		nwritten = 1;
+	}
+
+	memset(buffer, 0x5a, block_size);
+
+	for (i = 0; i < nwritten; i++) {
+		chunk_table_write(&table, i * block_size, buffer, block_size);
+		memcpy(flat + i * block_size, buffer, block_size);
+	}
+
+	for (kind = 0; kind < 2; kind++) {
+		for (write = 0; write < 2; write++) {
+			seed = RANDOM_SEED;
+			start = port_timestamp();
+
+			for (i = 0; i < count; i++) {
+				offset = (next_random(&seed) % nwritten) * block_size;
+
+				if (kind == 0) {
+					if (write) {
+						chunk_table_write(&table, offset, buffer, block_size);
+					} else {
+						chunk_table_read(&table, offset, buffer, block_size);
+					}
+				} else {
+					if (write) {
+						memcpy(flat + offset, buffer, block_size);
+					} else {
+						memcpy(buffer, flat + offset, block_size);
+					}
+				}
+			}
+
+			elapsed[kind][write] = port_timestamp() - start;
+		}
+	}
+
+	printf("\n%" PRIu64 " MB disk, %" PRIu64 " MB written, random requests of %u bytes:\n", size >> 20, (nwritten * block_size) >> 20, block_size);
+	printf("%-16s %12s %12s %12s %12s %14s\n", "", "Read ns", "Read MB/s", "Write ns", "Write MB/s", "Memory MB");
+
+	for (kind = 0; kind < 2; kind++) {
+		printf("%-16s %12.1f %12.0f %12.1f %12.0f %14" PRIu64 "\n",
+			   kinds[kind],
+			   (double) elapsed[kind][0] / count,
+			   (double) count * block_size / elapsed[kind][0] * 1e3,
+			   (double) elapsed[kind][1] / count,
+			   (double) count * block_size / elapsed[kind][1] * 1e3,
+			   ((kind == 0) ? chunk_table_memory_used(&table) : size) >> 20);
+	}
+
+	chunk_table_free(&table);
+	free(flat);
+	free(buffer);
+}
+
+ULONGLONG allocated_chunks(CHUNK_TABLE *table)
+{
+	ULONGLONG index;
+	ULONGLONG count;
+
+	count = 0;
+
+	for (index = 0; index < table->nchunks; index++) {
+		if (chunk_table_get_chunk(table, index)->data) {
+			count++;
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,524 @@
+/*
+ * Test of the copy-on-write clones (chunk_table_clone()) and benchmark of
+ * the clone churn: clones created, partly written and freed over and over,
+ * as the snapshots of a disk in use. It checks that:
+ *   - a clone shares every chunk (compressed or not) and the shared chunks
+ *     are not accounted in chunk_table_memory_used();
+ *   - the first write of a shared chunk copies it, the tables don't see
+ *     each other's writes, and the last table takes the data over;
+ *   - the references count the tables sharing the data, across clones of
+ *     clones, and the memory goes back to the quota with the last table;
+ *   - a clone which fails (out of memory) leaves "table" as it was: the
+ *     chunks it had started to share are private again, those shared with
+ *     an earlier clone keep their references.
+ * The failures are injected by wrapping malloc() (port_alloc() in user
+ * mode), hence the -Wl,--wrap=malloc.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -Wl,--wrap=malloc -o clonecheck clonecheck.c ../common/tools.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ *
+ * Usage: clonecheck [options]
+ *   -s size      Disk size (K, M and G suffixes; default 256M).
+ *   -w percent   Chunks written in each clone of the benchmark (default 10).
+ *   -n count     Clones of the benchmark (default 200).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-w percent] [-n count]"
+#define CHECK_CHUNKS                    64
+
+typedef struct {
+	CHUNK_POOL  pool;
+	CHUNK_QUOTA quota;
+	CHUNK_TABLE table;
+	ULONG       chunk_size;
+	UCHAR       *buffer;
+} CLONE_DISK;
+
+/* Countdown of the allocations of a reference count before one fails (0: none fails). */
+static volatile ULONG fail_refs_after;
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size);
+
+BOOLEAN check_sharing(CLONE_DISK *disk);
+BOOLEAN check_copy_on_write(CLONE_DISK *disk);
+BOOLEAN check_references(CLONE_DISK *disk);
+BOOLEAN check_failed_clone(CLONE_DISK *disk);
+void churn(CLONE_DISK *disk, ULONGLONG size, ULONG percent, ULONG count);
+void fill(CLONE_DISK *disk, ULONGLONG index, UCHAR value);
+BOOLEAN chunk_equals(CHUNK_TABLE *table, CLONE_DISK *disk, ULONGLONG index, UCHAR value);
+
+int main(int argc, char **argv)
+{
+	CLONE_DISK disk;
+	ULONGLONG size;
+	ULONG percent;
+	ULONG count;
+	BOOLEAN ok;
+	int opt;
+
+	memset(&disk, 0, sizeof(disk));
+
+	size = 256ULL << 20;
+	percent = 10;
+	count = 200;
+
+	while ((opt = getopt(argc, argv, "s:w:n:")) != -1) {
+		switch (opt) {
+			case 's':
+				if (!parse_size(optarg, &size)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'w':
+				if ((percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	disk.chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+
+	if ((optind != argc) || (size < (ULONGLONG) CHECK_CHUNKS * disk.chunk_size)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	chunk_pool_init(&disk.pool, DEFAULT_CHUNK_SHIFT, 0, CHUNK_POOL_CACHE);
+	chunk_quota_init(&disk.quota, &disk.pool, 0);
+
+	if (((disk.buffer = (UCHAR *) malloc(disk.chunk_size)) == NULL) ||
+		(!NT_SUCCESS(chunk_table_init(&disk.table, (ULONGLONG) CHECK_CHUNKS * disk.chunk_size, DEFAULT_CHUNK_SHIFT)))) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	chunk_table_set_quota(&disk.table, &disk.quota);
+
+	if (!NT_SUCCESS(chunk_table_enable_compression(&disk.table))) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "A clone shares every chunk", (check_sharing(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Shared chunks are copied on the first write", (check_copy_on_write(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "References count the tables sharing the data", (check_references(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "A failed clone leaves the table as it was", (check_failed_clone(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	chunk_table_free(&disk.table);
+
+	printf("%-52s %s\n", "The memory goes back to the quota", (disk.quota.used == 0) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		churn(&disk, size, percent, count);
+	}
+
+	chunk_pool_free(&disk.pool);
+	free(disk.buffer);
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+void *__wrap_malloc(size_t size)
+{
+	/* Only the reference counts are that small. */
+	if ((size == sizeof(LONG)) && (fail_refs_after > 0) && (--fail_refs_after == 0)) {
+		return NULL;
+	}
+
+	return __real_malloc(size);
+}
+
+BOOLEAN check_sharing(CLONE_DISK *disk)
+{
+	CHUNK_TABLE clone;
+	ULONGLONG i;
+	BOOLEAN ok;
+
+	/* Chunks 0 to 15 written, 4 to 7 compressed. */
+	for (i = 0; i < 16; i++) {
+		fill(disk, i, (UCHAR) (i + 1));
+	}
+
+	for (i = 4; i < 8; i++) {
+		if (!chunk_table_compress(&disk->table, i)) {
+			return FALSE;
+		}
+	}
+
+	if (!NT_SUCCESS(chunk_table_clone(&clone, &disk->table))) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) ((disk->table.nshared == 16) && (clone.nshared == 16) && (disk->table.nallocated == 0) && (clone.nallocated == 0));
+	ok = (BOOLEAN) (ok && (chunk_table_memory_used(&disk->table) == 0) && (chunk_table_memory_used(&clone) == 0));
+	ok = (BOOLEAN) (ok && (chunk_table_is_shared(&clone, 0, 16ULL * disk->chunk_size)) && (!chunk_table_is_shared(&clone, 16ULL * disk->chunk_size, disk->chunk_size)));
+
+	/* The same data (compressed or not) in both, nothing copied. */
+	for (i = 0; i < 16; i++) {
+		ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&clone, i)->data == chunk_table_get_chunk(&disk->table, i)->data));
+		ok = (BOOLEAN) (ok && (*chunk_table_get_chunk(&clone, i)->refs == 2));
+	}
+
+	ok = (BOOLEAN) (ok && (disk->quota.used == 12));
+
+	/* Readable from both; each table decompresses its own copy of the compressed chunks. */
+	for (i = 0; i < 16; i++) {
+		ok = (BOOLEAN) (ok && (chunk_equals(&clone, disk, i, (UCHAR) (i + 1))) && (chunk_equals(&disk->table, disk, i, (UCHAR) (i + 1))));
+	}
+
+	ok = (BOOLEAN) (ok && (disk->quota.used == 20) && (disk->table.nshared == 12) && (disk->table.nallocated == 4));
+
+	/* The last table takes the data over. */
+	chunk_table_free(&clone);
+
+	ok = (BOOLEAN) (ok && (disk->quota.used == 16));
+
+	for (i = 0; i < 16; i++) {
+		if ((i >= 4) && (i < 8)) {
+			ok = (BOOLEAN) (ok && (!chunk_table_get_chunk(&disk->table, i)->refs));
+		} else {
+			ok = (BOOLEAN) (ok && (*chunk_table_get_chunk(&disk->table, i)->refs == 1));
+		}
+
+		ok = (BOOLEAN) (ok && (chunk_equals(&disk->table, disk, i, (UCHAR) (i + 1))));
+	}
+
+	return ok;
+}
+
+BOOLEAN check_copy_on_write(CLONE_DISK *disk)
+{
+	CHUNK_TABLE clone;
+	ULONGLONG i;
+	BOOLEAN ok;
+
+	for (i = 0; i < 16; i++) {
+		fill(disk, i, (UCHAR) (i + 1));
+	}
+
+	if (!NT_SUCCESS(chunk_table_clone(&clone, &disk->table))) {
+		return FALSE;
+	}
+
+	/* The clone writes the even chunks, the table the odd ones. */
+	for (i = 0; i < 16; i++) {
+		memset(disk->buffer, 0x80 | (int) i, disk->chunk_size);
+
+		if (!NT_SUCCESS(chunk_table_write((i & 1) ? &disk->table : &clone, i * disk->chunk_size, disk->buffer, disk->chunk_size))) {
+			chunk_table_free(&clone);
+			return FALSE;
+		}
+	}
+
+	ok = (BOOLEAN) ((disk->table.nshared == 8) && (clone.nshared == 8) && (disk->table.nallocated == 8) && (clone.nallocated == 8));
+	ok = (BOOLEAN) (ok && (disk->quota.used == 32));
+
+	for (i = 0; i < 16; i++) {
+		ok = (BOOLEAN) (ok && (chunk_equals(&disk->table, disk, i, (UCHAR) ((i & 1) ? (0x80 | i) : (i + 1)))));
+		ok = (BOOLEAN) (ok && (chunk_equals(&clone, disk, i, (UCHAR) ((i & 1) ? (i + 1) : (0x80 | i)))));
+	}
+
+	/* A part of a chunk copies it too: the rest of the chunk comes along. */
+	memset(disk->buffer, 0x7f, 512);
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&clone, 3 * disk->chunk_size, disk->buffer, 512))));
+	ok = (BOOLEAN) (ok && (clone.nshared == 7) && (disk->table.nshared == 8) && (chunk_equals(&disk->table, disk, 3, 0x83)));
+
+	/* The table is alone with its shared chunks: writing them takes the data over. */
+	chunk_table_free(&clone);
+
+	ok = (BOOLEAN) (ok && (disk->quota.used == 16));
+
+	for (i = 0; i < 16; i += 2) {
+		memset(disk->buffer, 0x40, disk->chunk_size);
+		ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&disk->table, i * disk->chunk_size, disk->buffer, disk->chunk_size))));
+	}
+
+	ok = (BOOLEAN) (ok && (disk->table.nshared == 0) && (disk->table.nallocated == 16) && (disk->quota.used == 16));
+
+	return ok;
+}
+
+BOOLEAN check_references(CLONE_DISK *disk)
+{
+	CHUNK_TABLE clones[3];
+	ULONGLONG i;
+	BOOLEAN ok;
+
+	chunk_table_trim(&disk->table, 0, chunk_table_size(&disk->table));
+
+	for (i = 0; i < 4; i++) {
+		fill(disk, i, (UCHAR) (i + 1));
+	}
+
+	/* A clone, a clone of the table and a clone of the clone. */
+	if (!NT_SUCCESS(chunk_table_clone(&clones[0], &disk->table))) {
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(chunk_table_clone(&clones[1], &disk->table))) {
+		chunk_table_free(&clones[0]);
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(chunk_table_clone(&clones[2], &clones[0]))) {
+		chunk_table_free(&clones[1]);
+		chunk_table_free(&clones[0]);
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) (disk->quota.used == 4);
+
+	for (i = 0; i < 4; i++) {
+		ok = (BOOLEAN) (ok && (*chunk_table_get_chunk(&disk->table, i)->refs == 4));
+	}
+
+	/* A write drops one reference; a trim of the whole chunk another one. */
+	memset(disk->buffer, 0x55, disk->chunk_size);
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&clones[1], 0, disk->buffer, disk->chunk_size))));
+	chunk_table_trim(&clones[2], 0, disk->chunk_size);
+
+	ok = (BOOLEAN) (ok && (*chunk_table_get_chunk(&disk->table, 0)->refs == 2) && (disk->quota.used == 5));
+	ok = (BOOLEAN) (ok && (chunk_equals(&clones[0], disk, 0, 1)) && (chunk_equals(&clones[2], disk, 0, 0)));
+
+	/* The clone of the clone outlives both of them. */
+	chunk_table_free(&clones[0]);
+	chunk_table_free(&disk->table);
+
+	ok = (BOOLEAN) (ok && (*chunk_table_get_chunk(&clones[2], 1)->refs == 2) && (disk->quota.used == 4));
+
+	chunk_table_free(&clones[1]);
+
+	ok = (BOOLEAN) (ok && (*chunk_table_get_chunk(&clones[2], 1)->refs == 1) && (disk->quota.used == 3));
+
+	for (i = 1; i < 4; i++) {
+		ok = (BOOLEAN) (ok && (chunk_equals(&clones[2], disk, i, (UCHAR) (i + 1))));
+	}
+
+	/* The clone of the clone becomes the disk of the next checks. */
+	disk->table = clones[2];
+
+	return (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_enable_compression(&disk->table))));
+}
+
+BOOLEAN check_failed_clone(CLONE_DISK *disk)
+{
+	CHUNK_TABLE clones[2];
+	volatile LONG *refs[CHECK_CHUNKS];
+	LONG nallocated;
+	LONG nshared;
+	LONGLONG compressed_bytes;
+	LONGLONG used;
+	ULONGLONG i;
+	ULONG fail;
+	BOOLEAN ok;
+
+	chunk_table_trim(&disk->table, 0, chunk_table_size(&disk->table));
+
+	if (disk->table.nallocated + disk->table.nshared != 0) {
+		return FALSE;
+	}
+
+	/* Chunks 0 to 31 written; 8 to 15 compressed. */
+	for (i = 0; i < 32; i++) {
+		fill(disk, i, (UCHAR) (i + 1));
+	}
+
+	for (i = 8; i < 16; i++) {
+		if (!chunk_table_compress(&disk->table, i)) {
+			return FALSE;
+		}
+	}
+
+	/* Chunks 16 to 23 already shared with a first clone. */
+	if (!NT_SUCCESS(chunk_table_clone(&clones[0], &disk->table))) {
+		return FALSE;
+	}
+
+	chunk_table_trim(&clones[0], 0, 16ULL * disk->chunk_size);
+	chunk_table_trim(&clones[0], 24ULL * disk->chunk_size, 8ULL * disk->chunk_size);
+
+	for (i = 0; i < 32; i++) {
+		if ((i < 16) || (i >= 24)) {
+			memset(disk->buffer, (int) (i + 1), disk->chunk_size);
+			chunk_table_write(&disk->table, i * disk->chunk_size, disk->buffer, disk->chunk_size);
+		}
+	}
+
+	for (i = 8; i < 16; i++) {
+		chunk_table_compress(&disk->table, i);
+	}
+
+	nallocated = disk->table.nallocated;
+	nshared = disk->table.nshared;
+	compressed_bytes = disk->table.compressed_bytes;
+	used = disk->quota.used;
+
+	for (i = 0; i < CHECK_CHUNKS; i++) {
+		refs[i] = chunk_table_get_chunk(&disk->table, i)->refs;
+	}
+
+	ok = (BOOLEAN) ((nshared == 8) && (nallocated == 16) && (compressed_bytes > 0));
+
+	/* Fails at the first, in the middle (after the compressed chunks) and at the last private chunk. */
+	for (fail = 1; (ok) && (fail <= 24); fail += (fail == 1) ? 11 : 12) {
+		fail_refs_after = fail;
+
+		ok = (BOOLEAN) (chunk_table_clone(&clones[1], &disk->table) == STATUS_INSUFFICIENT_RESOURCES);
+
+		fail_refs_after = 0;
+
+		ok = (BOOLEAN) (ok && (disk->table.nallocated == nallocated) && (disk->table.nshared == nshared));
+		ok = (BOOLEAN) (ok && (disk->table.compressed_bytes == compressed_bytes) && (disk->quota.used == used));
+
+		for (i = 0; i < CHECK_CHUNKS; i++) {
+			ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->table, i)->refs == refs[i]));
+		}
+
+		ok = (BOOLEAN) (ok && (*chunk_table_get_chunk(&disk->table, 16)->refs == 2));
+	}
+
+	for (i = 0; i < 32; i++) {
+		ok = (BOOLEAN) (ok && (chunk_equals(&disk->table, disk, i, (UCHAR) (i + 1))));
+	}
+
+	/* The table can still be cloned. */
+	if ((ok) && (NT_SUCCESS(chunk_table_clone(&clones[1], &disk->table)))) {
+		ok = (BOOLEAN) ((disk->table.nshared == 32) && (*chunk_table_get_chunk(&disk->table, 16)->refs == 3));
+		chunk_table_free(&clones[1]);
+	} else {
+		ok = FALSE;
+	}
+
+	chunk_table_free(&clones[0]);
+
+	return ok;
+}
+
+void churn(CLONE_DISK *disk, ULONGLONG size, ULONG percent, ULONG count)
+{
+	CHUNK_TABLE table;
+	CHUNK_TABLE clone;
+	ULONGLONG nwrites;
+	ULONGLONG seed;
+	ULONGLONG start;
+	ULONGLONG elapsed[3];
+	ULONGLONG t;
+	ULONGLONG i;
+	ULONG n;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, size, DEFAULT_CHUNK_SHIFT))) {
+		return;
+	}
+
+	chunk_table_set_quota(&table, &disk->quota);
+
+	/* The whole disk written. */
+	memset(disk->buffer, 0x5a, disk->chunk_size);
+
+	for (i = 0; i < table.nchunks; i++) {
+		chunk_table_write(&table, i << table.chunk_shift, disk->buffer, disk->chunk_size);
+	}
+
+	nwrites = table.nchunks * percent / 100;
+	seed = RANDOM_SEED;
+
+	memset(elapsed, 0, sizeof(elapsed));
+
+	for (n = 0; n < count; n++) {
+		start = port_timestamp();
+
+		if (!NT_SUCCESS(chunk_table_clone(&clone, &table))) {
+			break;
+		}
+
+		t = port_timestamp();
+		elapsed[0] += t - start;
+
+		/* Writes of random chunks of the table: the first one of each chunk copies it. */
+		for (i = 0; i < nwrites; i++) {
+			next_random(&seed);
+
+			chunk_table_write(&table, (seed % table.nchunks) << table.chunk_shift, disk->buffer, 4096);
+		}
+
+		start = port_timestamp();
+		elapsed[1] += start - t;
+
+		chunk_table_free(&clone);
+
+		elapsed[2] += port_timestamp() - start;
+	}
+
+	printf("\nClone churn: %" PRIu64 " chunks of %u KB, %" PRIu64 " writes per clone, %u clones.\n",
+		   table.nchunks,
+		   disk->chunk_size >> 10,
+		   nwrites,
+		   n);
+
+	if (n > 0) {
+		printf("%-20s %12s %12s\n", "", "us/clone", "ns/chunk");
+		printf("%-20s %12.1f %12.1f\n", "clone", (double) elapsed[0] / n / 1000.0, (double) elapsed[0] / n / (double) table.nchunks);
+		printf("%-20s %12.1f %12.1f\n", "writes", (double) elapsed[1] / n / 1000.0, (nwrites > 0) ? (double) elapsed[1] / n / (double) nwrites : 0.0);
+		printf("%-20s %12.1f %12.1f\n", "free", (double) elapsed[2] / n / 1000.0, (double) elapsed[2] / n / (double) table.nchunks);
+	}
+
+	chunk_table_free(&table);
+}
+
+void fill(CLONE_DISK *disk, ULONGLONG index, UCHAR value)
+{
+	memset(disk->buffer, value, disk->chunk_size);
+	chunk_table_write(&disk->table, index * disk->chunk_size, disk->buffer, disk->chunk_size);
+}
+
+BOOLEAN chunk_equals(CHUNK_TABLE *table, CLONE_DISK *disk, ULONGLONG index, UCHAR value)
+{
+	ULONG i;
+
+	if (!NT_SUCCESS(chunk_table_read(table, index * disk->chunk_size, disk->buffer, disk->chunk_size))) {
+		return FALSE;
+	}
+
+	for (i = 0; i < disk->chunk_size; i++) {
+		if (disk->buffer[i] != value) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tools/common/tools.h"
+
+BOOLEAN parse_size(const char *s, ULONGLONG *size)
+{
+	char *end;
+
+	*size = strtoull(s, &end, 10);
+
+	switch (*end) {
+		case 'K': case 'k': *size <<= 10; end++; break;
+		case 'M': case 'm': *size <<= 20; end++; break;
+		case 'G': case 'g': *size <<= 30; end++; break;
+	}
+
+	return (BOOLEAN) ((end != s) && (*end == 0));
+}
+
+void usage(const char *program, const char *options)
+{
+	fprintf(stderr, "Usage: %s%s%s\n", program, (*options) ? " " : "", options);
+}
@@ -0,0 +1,30 @@
+#ifndef TOOLS_H
+#define TOOLS_H
+
+#include "port.h"
+
+/*
+ * Helpers shared by the user-mode tools, built with each of them:
+ *   gcc ... -I../.. -o tool tool.c ../common/tools.c ...
+ */
+
+/* First state of next_random(); the threads of a tool add their number to it. */
+#define RANDOM_SEED                     88172645463325252ULL
+
+/* xorshift64: advances the (non-zero) state and returns it. Inline, for the loops of the benchmarks. */
+static inline ULONGLONG next_random(ULONGLONG *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+
+	return *seed;
+}
+
+/* A number of bytes with an optional K, M or G suffix. */
+BOOLEAN parse_size(const char *s, ULONGLONG *size);
+
+/* Prints "Usage: program options" to stderr ("options" can be empty). */
+void usage(const char *program, const char *options);
+
+#endif /* TOOLS_H */
@@ -0,0 +1,360 @@
+/*
+ * Benchmark of the compression of cold chunks on Linux.
+ * First the codec (lz.c) on a chunk of each kind of data: log-like text,
+ * build intermediates (code-like words and binary fields mixed), and random
+ * data; every chunk is decompressed and compared.
+ * Then the clock (chunk_table_next_victim()/chunk_table_compress()) under
+ * a memory budget: a disk full of log-like chunks is read with most of the
+ * accesses on a hot set, and every "period" accesses the loop of the
+ * compression work item brings the memory used a sixteenth below the budget.
+ * It reports the memory used against the budget, the chunks compressed and
+ * the accesses which had to decompress their chunk (those are the ones the
+ * clock should keep away from the hot set).
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o compressbench compressbench.c ../common/tools.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ *
+ * Usage: compressbench [options]
+ *   -s size      Disk size (K, M and G suffixes; default 256M).
+ *   -b percent   Memory budget, in percent of the disk (default 50).
+ *   -h percent   Hot set, in percent of the disk (default 10).
+ *   -n count     Accesses of the clock run (default 200000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "lz.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-b percent] [-h percent] [-n count]"
+#define HOT_ACCESSES                    90 /* Percent of the accesses on the hot set. */
+#define PERIOD                          10000 /* Accesses between two runs of the compression. */
+#define CODEC_BYTES                     (64ULL * 1024 * 1024) /* Compressed for each kind of data. */
+
+BOOLEAN codec(ULONG chunk_size);
+BOOLEAN clock_run(ULONGLONG size, ULONG budget_percent, ULONG hot_percent, ULONGLONG count);
+void fill(UCHAR *data, ULONG length, int kind, ULONGLONG *seed);
+ULONGLONG compress_cold(CHUNK_TABLE *table, ULONGLONG budget);
+
+int main(int argc, char **argv)
+{
+	ULONGLONG size;
+	ULONGLONG count;
+	ULONG budget_percent;
+	ULONG hot_percent;
+	BOOLEAN ok;
+	int opt;
+
+	size = 256ULL << 20;
+	budget_percent = 50;
+	hot_percent = 10;
+	count = 200000;
+
+	while ((opt = getopt(argc, argv, "s:b:h:n:")) != -1) {
+		switch (opt) {
+			case 's':
+				if (!parse_size(optarg, &size)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'b':
+				if (((budget_percent = (ULONG) atoi(optarg)) == 0) || (budget_percent > 100)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'h':
+				if (((hot_percent = (ULONG) atoi(optarg)) == 0) || (hot_percent > 100)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((optind != argc) || (size < (100ULL << DEFAULT_CHUNK_SHIFT))) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = (BOOLEAN) ((codec(1UL << DEFAULT_CHUNK_SHIFT)) && (clock_run(size, budget_percent, hot_percent, count)));
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN codec(ULONG chunk_size)
+{
+	UCHAR *chunk;
+	UCHAR *compressed;
+	UCHAR *decompressed;
+	void *work;
+	ULONGLONG seed;
+	ULONGLONG start;
+	ULONGLONG elapsed[2];
+	ULONGLONG passes;
+	ULONGLONG i;
+	ULONG size;
+	int kind;
+	BOOLEAN ok;
+
+	static const char *kinds[] = {"log", "build", "random"};
+
+	chunk = (UCHAR *) malloc(chunk_size);
+	compressed = (UCHAR *) malloc(chunk_size);
+	decompressed = (UCHAR *) malloc(chunk_size);
+	work = malloc(LZ_WORK_SIZE);
+
+	if ((!chunk) || (!compressed) || (!decompressed) || (!work)) {
+		fprintf(stderr, "Out of memory.\n");
+		return FALSE;
+	}
+
+	passes = CODEC_BYTES / chunk_size;
+	seed = RANDOM_SEED;
+	ok = TRUE;
+
+	printf("Codec, chunks of %u KB:\n", chunk_size >> 10);
+	printf("%-10s %10s %16s %16s\n", "Data", "Ratio", "Compress MB/s", "Decompress MB/s");
+
+	for (kind = 0; kind < 3; kind++) {
+		fill(chunk, chunk_size, kind, &seed);
+		size = 0;
+
+		start = port_timestamp();
+
+		for (i = 0; i < passes; i++) {
+			size = lz_compress(chunk, chunk_size, compressed, chunk_size, work);
+		}
+
+		elapsed[0] = port_timestamp() - start;
+
+		if (size > 0) {
+			start = port_timestamp();
+
+			for (i = 0; i < passes; i++) {
+				ok = (BOOLEAN) (ok && (lz_decompress(compressed, size, decompressed, chunk_size)));
+			}
+
+			elapsed[1] = port_timestamp() - start;
+
+			ok = (BOOLEAN) (ok && (memcmp(chunk, decompressed, chunk_size) == 0));
+
+			printf("%-10s %9.2fx %16.0f %16.0f\n",
+				   kinds[kind],
+				   (double) chunk_size / size,
+				   (double) CODEC_BYTES / elapsed[0] * 1e3,
+				   (double) CODEC_BYTES / elapsed[1] * 1e3);
+		} else {
+			printf("%-10s %10s %16.0f %16s\n", kinds[kind], "-", (double) CODEC_BYTES / elapsed[0] * 1e3, "-");
+		}
+	}
+
+	printf("%-43s %s\n", "Chunks decompressed as they were", ok ? "ok" : "FAILED");
+
+	free(work);
+	free(decompressed);
+	free(compressed);
+	free(chunk);
+
+	return ok;
+}
+
+BOOLEAN clock_run(ULONGLONG size, ULONG budget_percent, ULONG hot_percent, ULONGLONG count)
+{
+	CHUNK_TABLE table;
+	CHUNK *chunk;
+	UCHAR *buffer;
+	ULONGLONG budget;
+	ULONGLONG nhot;
+	ULONGLONG index;
+	ULONGLONG seed;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG compressed;
+	ULONGLONG faults[2];
+	ULONGLONG accesses[2];
+	ULONGLONG peak;
+	ULONGLONG i;
+	ULONG chunk_size;
+	BOOLEAN hot;
+	BOOLEAN ok;
+
+	chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, size, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Out of memory.\n");
+		return FALSE;
+	}
+
+	if (((buffer = (UCHAR *) malloc(chunk_size)) == NULL) || (!NT_SUCCESS(chunk_table_enable_compression(&table)))) {
+		fprintf(stderr, "Out of memory.\n");
+		free(buffer);
+		chunk_table_free(&table);
+		return FALSE;
+	}
+
+	budget = chunk_table_size(&table) / 100 * budget_percent;
+	nhot = table.nchunks * hot_percent / 100;
+	seed = RANDOM_SEED;
+
+	for (index = 0; index < table.nchunks; index++) {
+		fill(buffer, chunk_size, 0, &seed);
+		chunk_table_write(&table, index << DEFAULT_CHUNK_SHIFT, buffer, chunk_size);
+	}
+
+	compressed = compress_cold(&table, budget);
+
+	memset(faults, 0, sizeof(faults));
+	memset(accesses, 0, sizeof(accesses));
+
+	peak = 0;
+	elapsed = 0;
+	ok = TRUE;
+
+	for (i = 0; i < count; i++) {
+		hot = (BOOLEAN) ((next_random(&seed) % 100) < HOT_ACCESSES);
+
+		index = next_random(&seed) % ((hot) ? nhot : table.nchunks - nhot);
+		if (!hot) {
+			index += nhot;
+		}
+
+		/* Scatter the hot set: a multiplicative permutation of the indexes. */
+		index = (index * 2654435761ULL) % table.nchunks;
+
+		chunk = chunk_table_get_chunk(&table, index);
+		if (chunk->flags & CHUNK_COMPRESSED) {
+			faults[hot]++;
+		}
+
+		accesses[hot]++;
+
+		ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_read(&table, (index << DEFAULT_CHUNK_SHIFT) + (next_random(&seed) % chunk_size & ~511ULL), buffer, 512))));
+
+		if (chunk_table_memory_used(&table) > peak) {
+			peak = chunk_table_memory_used(&table);
+		}
+
+		if ((i + 1) % PERIOD == 0) {
+			start = port_timestamp();
+			compressed += compress_cold(&table, budget);
+			elapsed += port_timestamp() - start;
+		}
+	}
+
+	printf("\nClock, %" PRIu64 " chunks, budget %" PRIu64 " MB, hot set %" PRIu64 " chunks (%u%% of the accesses):\n",
+		   table.nchunks,
+		   budget >> 20,
+		   nhot,
+		   HOT_ACCESSES);
+
+	printf("  Memory used %" PRIu64 " MB (peak %" PRIu64 " MB), %" PRIu64 " MB of it compressed\n",
+		   chunk_table_memory_used(&table) >> 20,
+		   peak >> 20,
+		   (ULONGLONG) table.compressed_bytes >> 20);
+
+	printf("  %" PRIu64 " chunks compressed, %.1f us each\n", compressed, (compressed > 0) ? (double) elapsed / compressed / 1000.0 : 0.0);
+
+	printf("  Accesses decompressing their chunk: hot %.2f%%, cold %.2f%%\n",
+		   (accesses[1] > 0) ? 100.0 * faults[1] / accesses[1] : 0.0,
+		   (accesses[0] > 0) ? 100.0 * faults[0] / accesses[0] : 0.0);
+
+	printf("%-43s %s\n", "Reads of the clock run", ok ? "ok" : "FAILED");
+
+	free(buffer);
+	chunk_table_free(&table);
+
+	return ok;
+}
+
+void fill(UCHAR *data, ULONG length, int kind, ULONGLONG *seed)
+{
+	static const char *words[] = {
+		"INFO", "WARN", "request", "completed", "offset", "length", "status", "0x00000000",
+		"static", "void", "return", "if", "struct", "const", "unsigned", "int"
+	};
+
+	ULONG i;
+	ULONG n;
+	ULONGLONG r;
+
+	i = 0;
+
+	while (i < length) {
+		r = next_random(seed);
+
+		switch (kind) {
+			case 0:
+				/* Log lines: a timestamp and a few words. */
+				n = (ULONG) snprintf((char *) data + i, length - i, "2024-05-%02u %02u:%02u:%02u.%03u %s %s %s %u\n",
+									 (unsigned) (r % 28) + 1, (unsigned) (r >> 8) % 24, (unsigned) (r >> 16) % 60, (unsigned) (r >> 24) % 60, (unsigned) (r >> 32) % 1000,
+									 words[(r >> 42) & 1], words[2 + ((r >> 44) & 1)], words[4 + ((r >> 46) & 3)], (unsigned) (r >> 48) & 0xfff);
+				break;
+			case 1:
+				/* Words and binary fields. */
+				if (r & 1) {
+					n = (ULONG) snprintf((char *) data + i, length - i, "%s ", words[8 + ((r >> 1) & 7)]);
+				} else {
+					n = (length - i < 8) ? length - i : 8;
+					memcpy(data + i, &r, n);
+				}
+
+				break;
+			default:
+				n = (length - i < 8) ? length - i : 8;
+				memcpy(data + i, &r, n);
+		}
+
+		/* snprintf() returns what it would have written. */
+		i += (n < length - i) ? n : length - i;
+	}
+}
+
+ULONGLONG compress_cold(CHUNK_TABLE *table, ULONGLONG budget)
+{
+	ULONGLONG low_watermark;
+	ULONGLONG attempts;
+	ULONGLONG index;
+	ULONGLONG count;
+
+	/* As EvtCompressionWorkItem(). */
+	low_watermark = budget - (budget >> 4);
+	count = 0;
+
+	for (attempts = 0; (attempts < table->nchunks) && (chunk_table_memory_used(table) > low_watermark); attempts++) {
+		if (!chunk_table_next_victim(table, CHUNK_COMPRESSED | CHUNK_INCOMPRESSIBLE, &index)) {
+			break;
+		}
+
+		if (chunk_table_compress(table, index)) {
+			count++;
+		}
+	}
+
+	return count;
+}
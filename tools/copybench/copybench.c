@@ -0,0 +1,157 @@
+/*
+ * Compares the copy kernels of copy.c on Linux: regular copies against
+ * non-temporal stores, for several transfer sizes, and how much each one
+ * slows down a thread walking a working set which fits in the caches.
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o copybench copybench.c ../common/tools.c ../../copy.c
+ * (add -mavx2 for the AVX2 kernel).
+ * Usage: copybench [working_set_kb]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "port.h"
+#include "copy.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[working_set_kb]"
+#define MIN_SIZE                        (4 * 1024)
+#define MAX_SIZE                        (64 * 1024 * 1024)
+#define BYTES_PER_SIZE                  (2ULL * 1024 * 1024 * 1024) /* Copied for each size. */
+#define POLLUTION_COPIES                32
+#define DEFAULT_WORKING_SET             1024 /* KB. */
+
+typedef struct {
+	UCHAR         *buffer;
+	SIZE_T        size;
+	volatile LONG stop;
+	ULONGLONG     passes;
+	ULONGLONG     elapsed;
+	ULONGLONG     sum;
+} VICTIM;
+
+double measure(UCHAR *destination, const UCHAR *source, SIZE_T size, BOOLEAN streaming);
+void *walk(void *arg);
+double pollution(UCHAR *destination, const UCHAR *source, VICTIM *victim, int kernel);
+
+int main(int argc, char **argv)
+{
+	VICTIM victim;
+	UCHAR *source;
+	UCHAR *destination;
+	SIZE_T size;
+
+	victim.size = (SIZE_T) ((argc > 1) ? atoi(argv[1]) : DEFAULT_WORKING_SET) * 1024;
+	if (victim.size == 0) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	source = (UCHAR *) malloc(MAX_SIZE);
+	destination = (UCHAR *) malloc(MAX_SIZE);
+	victim.buffer = (UCHAR *) malloc(victim.size);
+
+	if ((!source) || (!destination) || (!victim.buffer)) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	memset(source, 0x5a, MAX_SIZE);
+	memset(destination, 0, MAX_SIZE);
+	memset(victim.buffer, 1, victim.size);
+
+	printf("%10s %12s %12s\n", "Size", "Copy GB/s", "Stream GB/s");
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size <<= 2) {
+		printf("%10zu %12.2f %12.2f\n", size, measure(destination, source, size, FALSE), measure(destination, source, size, TRUE));
+	}
+
+	printf("\nWalk of %zu KB while copying %d MB transfers (ns per pass):\n", victim.size / 1024, MAX_SIZE / (1024 * 1024));
+	printf("  Idle:   %.0f\n", pollution(destination, source, &victim, 0));
+	printf("  Copy:   %.0f\n", pollution(destination, source, &victim, 1));
+	printf("  Stream: %.0f\n", pollution(destination, source, &victim, 2));
+
+	free(victim.buffer);
+	free(destination);
+	free(source);
+
+	return 0;
+}
+
+double measure(UCHAR *destination, const UCHAR *source, SIZE_T size, BOOLEAN streaming)
+{
+	ULONGLONG iterations;
+	ULONGLONG start;
+	ULONGLONG i;
+
+	iterations = BYTES_PER_SIZE / size;
+
+	/* Warm up. */
+	copy_memory(destination, source, size, streaming);
+
+	start = port_timestamp();
+
+	for (i = 0; i < iterations; i++) {
+		copy_memory(destination, source, size, streaming);
+	}
+
+	return (double) (iterations * size) / (double) (port_timestamp() - start);
+}
+
+void *walk(void *arg)
+{
+	VICTIM *victim;
+	ULONGLONG start;
+	ULONGLONG sum;
+	SIZE_T i;
+
+	victim = (VICTIM *) arg;
+
+	start = port_timestamp();
+
+	for (sum = 0; !victim->stop; victim->passes++) {
+		/* One load per cache line. */
+		for (i = 0; i < victim->size; i += 64) {
+			sum += *((volatile UCHAR *) &victim->buffer[i]);
+		}
+	}
+
+	victim->elapsed = port_timestamp() - start;
+	victim->sum = sum;
+
+	return NULL;
+}
+
+/* Kernel 0: nothing is copied; 1: regular copies; 2: non-temporal stores. */
+double pollution(UCHAR *destination, const UCHAR *source, VICTIM *victim, int kernel)
+{
+	pthread_t thread;
+	ULONGLONG start;
+	int i;
+
+	victim->stop = FALSE;
+	victim->passes = 0;
+
+	if (pthread_create(&thread, NULL, walk, victim) != 0) {
+		return 0;
+	}
+
+	start = port_timestamp();
+
+	for (i = 0; i < POLLUTION_COPIES; i++) {
+		if (kernel > 0) {
+			copy_memory(destination, source, MAX_SIZE, (BOOLEAN) (kernel == 2));
+		}
+	}
+
+	/* Keep the idle run about as long as the others. */
+	while ((kernel == 0) && (port_timestamp() - start < 1000000000ULL)) {
+		YieldProcessor();
+	}
+
+	victim->stop = TRUE;
+	pthread_join(thread, NULL);
+
+	return (victim->passes > 0) ? (double) victim->elapsed / (double) victim->passes : 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * Test of what the disk tells about its sectors (geometry.c) and of the
+ * validation of the requests with each sector size (disk_io_check()), on
+ * Linux. For every supported pair of sector sizes (512n, 512e and 4Kn) it
+ * checks the DISK_GEOMETRY of several disk sizes and the answers to the
+ * queries of IOCTL_STORAGE_QUERY_PROPERTY (alignment, seek penalty and
+ * trim) with buffers of every size, and that the unsupported pairs are
+ * refused.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o geometrycheck geometrycheck.c \
+ *       ../../geometry.c ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c \
+ *       ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c ../../numa_layout.c \
+ *       ../../port_numa.c ../../port_page.c
+ *
+ * Usage: geometrycheck
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "geometry.h"
+#include "disk_io.h"
+
+#define FILL                            0xcc
+
+typedef struct {
+	ULONG sector_size;
+	ULONG physical_sector_size;
+	const char *name;
+} SECTOR_SIZES;
+
+static const SECTOR_SIZES supported[] = {
+	{512, 512, "512n"},
+	{512, 4096, "512e"},
+	{4096, 4096, "4Kn"}
+};
+
+static const SECTOR_SIZES unsupported[] = {
+	{4096, 512, NULL},
+	{1024, 4096, NULL},
+	{512, 8192, NULL},
+	{0, 0, NULL},
+	{2048, 2048, NULL}
+};
+
+BOOLEAN check_geometry(const SECTOR_SIZES *sizes);
+BOOLEAN check_requests(const SECTOR_SIZES *sizes);
+BOOLEAN check_alignment(const SECTOR_SIZES *sizes);
+BOOLEAN check_flag_property(const SECTOR_SIZES *sizes, STORAGE_PROPERTY_ID property_id, ULONG size, BOOLEAN value);
+BOOLEAN check_queries(const SECTOR_SIZES *sizes);
+BOOLEAN check_header_only(const SECTOR_SIZES *sizes, STORAGE_PROPERTY_ID property_id, ULONG size);
+
+int main(int argc, char **argv)
+{
+	char name[64];
+	unsigned i;
+	BOOLEAN ok;
+	BOOLEAN refused;
+
+	if (argc != 1) {
+		fprintf(stderr, "Usage: %s\n", argv[0]);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	for (i = 0; i < sizeof(supported) / sizeof(supported[0]); i++) {
+		snprintf(name, sizeof(name), "%s: geometry", supported[i].name);
+		printf("%-40s %s\n", name, (check_geometry(&supported[i])) ? "ok" : (ok = FALSE, "FAILED"));
+
+		snprintf(name, sizeof(name), "%s: requests", supported[i].name);
+		printf("%-40s %s\n", name, (check_requests(&supported[i])) ? "ok" : (ok = FALSE, "FAILED"));
+
+		snprintf(name, sizeof(name), "%s: access alignment", supported[i].name);
+		printf("%-40s %s\n", name, (check_alignment(&supported[i])) ? "ok" : (ok = FALSE, "FAILED"));
+
+		snprintf(name, sizeof(name), "%s: seek penalty", supported[i].name);
+		printf("%-40s %s\n",
+			   name,
+			   (check_flag_property(&supported[i], StorageDeviceSeekPenaltyProperty, sizeof(DEVICE_SEEK_PENALTY_DESCRIPTOR), FALSE)) ? "ok" : (ok = FALSE, "FAILED"));
+
+		snprintf(name, sizeof(name), "%s: trim", supported[i].name);
+		printf("%-40s %s\n",
+			   name,
+			   (check_flag_property(&supported[i], StorageDeviceTrimProperty, sizeof(DEVICE_TRIM_DESCRIPTOR), TRUE)) ? "ok" : (ok = FALSE, "FAILED"));
+
+		snprintf(name, sizeof(name), "%s: other queries", supported[i].name);
+		printf("%-40s %s\n", name, (check_queries(&supported[i])) ? "ok" : (ok = FALSE, "FAILED"));
+
+		if (!geometry_check_sectors(supported[i].sector_size, supported[i].physical_sector_size)) {
+			ok = FALSE;
+		}
+	}
+
+	refused = TRUE;
+
+	for (i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++) {
+		if (geometry_check_sectors(unsupported[i].sector_size, unsupported[i].physical_sector_size)) {
+			refused = FALSE;
+		}
+	}
+
+	printf("%-40s %s\n", "Unsupported sector sizes", (refused) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_geometry(const SECTOR_SIZES *sizes)
+{
+	DISK_GEOMETRY geometry;
+	ULONGLONG cylinder;
+	ULONGLONG disk_sizes[4];
+	unsigned i;
+
+	cylinder = (ULONGLONG) sizes->sector_size * GEOMETRY_SECTORS_PER_TRACK * GEOMETRY_TRACKS_PER_CYLINDER;
+
+	/* Whole cylinders, a partial one, less than a cylinder and a large disk. */
+	disk_sizes[0] = 1024 * cylinder;
+	disk_sizes[1] = 1024 * cylinder + sizes->sector_size;
+	disk_sizes[2] = sizes->sector_size;
+	disk_sizes[3] = 1ULL << 40;
+
+	for (i = 0; i < 4; i++) {
+		memset(&geometry, FILL, sizeof(geometry));
+
+		geometry_build(disk_sizes[i], sizes->sector_size, &geometry);
+
+		if ((geometry.BytesPerSector != sizes->sector_size) ||
+			(geometry.SectorsPerTrack != GEOMETRY_SECTORS_PER_TRACK) ||
+			(geometry.TracksPerCylinder != GEOMETRY_TRACKS_PER_CYLINDER) ||
+			(geometry.MediaType != FixedMedia) ||
+			((ULONGLONG) geometry.Cylinders.QuadPart != disk_sizes[i] / cylinder)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+BOOLEAN check_requests(const SECTOR_SIZES *sizes)
+{
+	ULONGLONG disk_size;
+	ULONG sector_size;
+
+	disk_size = 64ULL << 20;
+	sector_size = sizes->sector_size;
+
+	/* Whole sectors within the disk. */
+	if ((!disk_io_check(disk_size, sector_size, 0, sector_size)) ||
+		(!disk_io_check(disk_size, sector_size, (LONGLONG) (disk_size - sector_size), sector_size)) ||
+		(!disk_io_check(disk_size, sector_size, 0, disk_size)) ||
+		(!disk_io_check(disk_size, sector_size, sector_size, 0))) {
+		return FALSE;
+	}
+
+	/* Beyond the end, a negative offset, and lengths and offsets which are not whole sectors. */
+	if ((disk_io_check(disk_size, sector_size, (LONGLONG) disk_size, sector_size)) ||
+		(disk_io_check(disk_size, sector_size, 0, disk_size + sector_size)) ||
+		(disk_io_check(disk_size, sector_size, -(LONGLONG) sector_size, sector_size)) ||
+		(disk_io_check(disk_size, sector_size, 0, sector_size / 2)) ||
+		(disk_io_check(disk_size, sector_size, sector_size / 2, sector_size)) ||
+		(disk_io_check(disk_size, sector_size, 1, sector_size))) {
+		return FALSE;
+	}
+
+	/* 512-byte requests on a 4Kn disk. */
+	if ((sector_size > 512) && ((disk_io_check(disk_size, sector_size, 0, 512)) || (disk_io_check(disk_size, sector_size, 512, sector_size)))) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOLEAN check_alignment(const SECTOR_SIZES *sizes)
+{
+	STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR descriptor;
+	ULONG length;
+
+	memset(&descriptor, FILL, sizeof(descriptor));
+
+	if ((!NT_SUCCESS(geometry_query_property(sizes->sector_size,
+											 sizes->physical_sector_size,
+											 StorageAccessAlignmentProperty,
+											 PropertyStandardQuery,
+											 &descriptor,
+											 sizeof(descriptor),
+											 &length))) ||
+		(length != sizeof(descriptor))) {
+		return FALSE;
+	}
+
+	if ((descriptor.Version != sizeof(descriptor)) ||
+		(descriptor.Size != sizeof(descriptor)) ||
+		(descriptor.BytesPerCacheLine != GEOMETRY_CACHE_LINE) ||
+		(descriptor.BytesOffsetForCacheAlignment != 0) ||
+		(descriptor.BytesPerLogicalSector != sizes->sector_size) ||
+		(descriptor.BytesPerPhysicalSector != sizes->physical_sector_size) ||
+		(descriptor.BytesOffsetForSectorAlignment != 0)) {
+		return FALSE;
+	}
+
+	return check_header_only(sizes, StorageAccessAlignmentProperty, sizeof(descriptor));
+}
+
+BOOLEAN check_flag_property(const SECTOR_SIZES *sizes, STORAGE_PROPERTY_ID property_id, ULONG size, BOOLEAN value)
+{
+	/* The flag of both descriptors follows the header. */
+	DEVICE_SEEK_PENALTY_DESCRIPTOR descriptor;
+	ULONG length;
+
+	if (size != sizeof(descriptor)) {
+		return FALSE;
+	}
+
+	memset(&descriptor, FILL, sizeof(descriptor));
+
+	if ((!NT_SUCCESS(geometry_query_property(sizes->sector_size, sizes->physical_sector_size, property_id, PropertyStandardQuery, &descriptor, sizeof(descriptor), &length))) ||
+		(length != size) ||
+		(descriptor.Version != size) ||
+		(descriptor.Size != size) ||
+		(descriptor.IncursSeekPenalty != value)) {
+		return FALSE;
+	}
+
+	return check_header_only(sizes, property_id, size);
+}
+
+BOOLEAN check_queries(const SECTOR_SIZES *sizes)
+{
+	static const STORAGE_PROPERTY_ID reported[] = {StorageAccessAlignmentProperty, StorageDeviceSeekPenaltyProperty, StorageDeviceTrimProperty};
+	UCHAR buffer[64];
+	ULONG length;
+	unsigned i;
+
+	for (i = 0; i < sizeof(reported) / sizeof(reported[0]); i++) {
+		/* The property exists; nothing is written. */
+		memset(buffer, FILL, sizeof(buffer));
+
+		if ((geometry_query_property(sizes->sector_size, sizes->physical_sector_size, reported[i], PropertyExistsQuery, NULL, 0, &length) != STATUS_SUCCESS) ||
+			(length != 0) ||
+			(geometry_query_property(sizes->sector_size, sizes->physical_sector_size, reported[i], PropertyExistsQuery, buffer, sizeof(buffer), &length) != STATUS_SUCCESS) ||
+			(length != 0) ||
+			(buffer[0] != FILL)) {
+			return FALSE;
+		}
+
+		/* Masks are not supported. */
+		if ((geometry_query_property(sizes->sector_size, sizes->physical_sector_size, reported[i], PropertyMaskQuery, buffer, sizeof(buffer), &length) != STATUS_INVALID_PARAMETER) ||
+			(length != 0)) {
+			return FALSE;
+		}
+
+		/* No room for the header. */
+		if ((geometry_query_property(sizes->sector_size, sizes->physical_sector_size, reported[i], PropertyStandardQuery, buffer, sizeof(STORAGE_DESCRIPTOR_HEADER) - 1, &length) != STATUS_BUFFER_TOO_SMALL) ||
+			(length != 0) ||
+			(geometry_query_property(sizes->sector_size, sizes->physical_sector_size, reported[i], PropertyStandardQuery, NULL, 0, &length) != STATUS_BUFFER_TOO_SMALL)) {
+			return FALSE;
+		}
+	}
+
+	/* The other properties are left to the caller. */
+	if ((geometry_query_property(sizes->sector_size, sizes->physical_sector_size, StorageDeviceProperty, PropertyStandardQuery, buffer, sizeof(buffer), &length) != STATUS_NOT_SUPPORTED) ||
+		(length != 0) ||
+		(geometry_query_property(sizes->sector_size, sizes->physical_sector_size, StorageDeviceProperty, PropertyExistsQuery, NULL, 0, &length) != STATUS_NOT_SUPPORTED)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOLEAN check_header_only(const SECTOR_SIZES *sizes, STORAGE_PROPERTY_ID property_id, ULONG size)
+{
+	UCHAR buffer[64];
+	STORAGE_DESCRIPTOR_HEADER *header;
+	ULONG buffer_length;
+	ULONG length;
+
+	header = (STORAGE_DESCRIPTOR_HEADER *) buffer;
+
+	/* Every buffer with room for the header but not for the descriptor. */
+	for (buffer_length = sizeof(STORAGE_DESCRIPTOR_HEADER); buffer_length < size; buffer_length++) {
+		memset(buffer, FILL, sizeof(buffer));
+
+		if ((geometry_query_property(sizes->sector_size, sizes->physical_sector_size, property_id, PropertyStandardQuery, buffer, buffer_length, &length) != STATUS_SUCCESS) ||
+			(length != sizeof(STORAGE_DESCRIPTOR_HEADER)) ||
+			(header->Version != size) ||
+			(header->Size != size) ||
+			(buffer[sizeof(STORAGE_DESCRIPTOR_HEADER)] != FILL)) {
+			return FALSE;
+		}
+	}
+
+	/* A larger buffer only receives the descriptor. */
+	memset(buffer, FILL, sizeof(buffer));
+
+	if ((geometry_query_property(sizes->sector_size, sizes->physical_sector_size, property_id, PropertyStandardQuery, buffer, sizeof(buffer), &length) != STATUS_SUCCESS) ||
+		(length != size) ||
+		(buffer[size] != FILL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
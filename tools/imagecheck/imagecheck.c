@@ -0,0 +1,590 @@
+/*
+ * Round-trip test of the disk images (image.c) on Linux: disks of random
+ * content are saved to a file, restored in new tables and compared with a
+ * copy kept in memory. It checks that:
+ *   - a restored disk has the content of the saved one: chunks with data,
+ *     compressed chunks, chunks written with zeros (not allocated once
+ *     restored) and a last chunk beyond the end of the disk;
+ *   - only the chunks with data take space in the file, which is sparse;
+ *   - an image restores in a table of another chunk size, and in a smaller
+ *     or larger disk (the common part only, the rest reads as zeros);
+ *   - the chunks written in place (image_write_chunks()) and the bitmap
+ *     restore as the disk they were written from, and a chunk size which
+ *     differs from the image's is refused;
+ *   - image_open() refuses a missing file, a bad header (as left by an
+ *     interrupted save) and data overlapping the bitmap, and a file cut short
+ *     fails the restore.
+ * Then it measures the save and restore rates of a disk half full.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o imagecheck imagecheck.c ../common/tools.c \
+ *       ../../image.c ../../port_file.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ *
+ * Usage: imagecheck [options]
+ *   -f file      Image file, removed at the end (default imagecheck.img).
+ *   -s size      Disk size of the benchmark (K, M and G suffixes; default 256M).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "image.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-f file] [-s size]"
+#define CHECK_SIZE                      (8ULL * 1024 * 1024 + 3 * 512) /* Not a multiple of the chunk size. */
+#define CHECK_CHUNK_SHIFT               16
+#define COMPARE_SIZE                    (64 * 1024)
+
+typedef struct {
+	CHUNK_TABLE table;
+	ULONGLONG   size;
+	UCHAR       *copy;     /* Content of the disk. */
+	ULONGLONG   nchunks;   /* Chunks with data (not zeros). */
+	ULONGLONG   seed;
+} IMAGE_DISK;
+
+BOOLEAN check_round_trip(const char *path);
+BOOLEAN check_chunk_sizes(const char *path);
+BOOLEAN check_disk_sizes(const char *path);
+BOOLEAN check_in_place(const char *path);
+BOOLEAN check_invalid(const char *path);
+void measure(const char *path, ULONGLONG size);
+BOOLEAN create_disk(IMAGE_DISK *disk, ULONGLONG size, ULONG chunk_shift, ULONGLONG seed, BOOLEAN copy);
+void fill_chunk(IMAGE_DISK *disk, ULONGLONG index);
+void free_disk(IMAGE_DISK *disk);
+BOOLEAN restore(const char *path, CHUNK_TABLE *table, ULONGLONG size, ULONG chunk_shift);
+BOOLEAN table_equals(CHUNK_TABLE *table, const UCHAR *copy, ULONGLONG size, ULONGLONG limit);
+BOOLEAN corrupt(const char *path, ULONGLONG offset, const void *data, ULONG length);
+
+int main(int argc, char **argv)
+{
+	const char *path;
+	ULONGLONG size;
+	BOOLEAN ok;
+	int opt;
+
+	path = "imagecheck.img";
+	size = 256ULL << 20;
+
+	while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+		switch (opt) {
+			case 'f':
+				path = optarg;
+				break;
+			case 's':
+				if ((!parse_size(optarg, &size)) || (size < (1ULL << DEFAULT_CHUNK_SHIFT))) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "A saved disk restores as it was", (check_round_trip(path)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Images restore with other chunk sizes", (check_chunk_sizes(path)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Images restore in smaller and larger disks", (check_disk_sizes(path)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Chunks written in place restore", (check_in_place(path)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Invalid images are refused", (check_invalid(path)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		measure(path, size);
+	}
+
+	unlink(path);
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_round_trip(const char *path)
+{
+	IMAGE_DISK disk;
+	IMAGE_FILE image;
+	CHUNK_TABLE table;
+	struct stat st;
+	ULONGLONG index;
+	ULONGLONG stored;
+	ULONG chunk_size;
+	BOOLEAN ok;
+
+	if (!create_disk(&disk, CHECK_SIZE, CHECK_CHUNK_SHIFT, 1, TRUE)) {
+		return FALSE;
+	}
+
+	chunk_size = 1UL << CHECK_CHUNK_SHIFT;
+
+	ok = (BOOLEAN) (NT_SUCCESS(image_save(&disk.table, disk.size, path)));
+
+	/* The header and the bitmap describe the disk. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(image_open(&image, path))));
+
+	if (ok) {
+		ok = (BOOLEAN) ((image.header.disk_size == disk.size) && (image.header.chunk_shift == CHECK_CHUNK_SHIFT) && (image.nchunks == disk.table.nchunks));
+		ok = (BOOLEAN) (ok && (image.header.data_offset % IMAGE_ALIGNMENT == 0));
+
+		for (index = 0, stored = 0; (ok) && (index < image.nchunks); index++) {
+			if ((image.bitmap[index >> 6] >> (index & 63)) & 1) {
+				ok = (BOOLEAN) (chunk_table_get_chunk(&disk.table, index)->data != NULL);
+				stored++;
+			} else {
+				ok = (BOOLEAN) (chunk_table_get_chunk(&disk.table, index)->data == NULL);
+			}
+		}
+
+		ok = (BOOLEAN) (ok && (stored == disk.nchunks));
+
+		image_close(&image);
+	}
+
+	/* Sparse: the file takes the header, the bitmap and the chunks with data. */
+	ok = (BOOLEAN) (ok && (stat(path, &st) == 0));
+	ok = (BOOLEAN) (ok && ((ULONGLONG) st.st_size == image.header.data_offset + (disk.table.nchunks << CHECK_CHUNK_SHIFT)));
+	ok = (BOOLEAN) (ok && ((ULONGLONG) st.st_blocks * 512 <= image.header.data_offset + disk.nchunks * chunk_size));
+
+	/* The chunks of zeros are not allocated again. */
+	ok = (BOOLEAN) (ok && (restore(path, &table, disk.size, CHECK_CHUNK_SHIFT)));
+
+	if (ok) {
+		ok = (BOOLEAN) ((table_equals(&table, disk.copy, disk.size, disk.size)) && (chunk_table_memory_used(&table) == disk.nchunks * chunk_size));
+
+		chunk_table_free(&table);
+	}
+
+	free_disk(&disk);
+
+	return ok;
+}
+
+BOOLEAN check_chunk_sizes(const char *path)
+{
+	static const ULONG shifts[] = { 12, 14, 16, 20 };
+	IMAGE_DISK disk;
+	CHUNK_TABLE table;
+	ULONG i;
+	ULONG j;
+	BOOLEAN ok;
+
+	ok = TRUE;
+
+	/* Every saved chunk size restored with every chunk size. */
+	for (i = 0; (ok) && (i < sizeof(shifts) / sizeof(shifts[0])); i++) {
+		if (!create_disk(&disk, CHECK_SIZE, shifts[i], 2 + i, TRUE)) {
+			return FALSE;
+		}
+
+		ok = (BOOLEAN) (NT_SUCCESS(image_save(&disk.table, disk.size, path)));
+
+		for (j = 0; (ok) && (j < sizeof(shifts) / sizeof(shifts[0])); j++) {
+			ok = (BOOLEAN) (restore(path, &table, disk.size, shifts[j]));
+
+			if (ok) {
+				ok = (BOOLEAN) (table_equals(&table, disk.copy, disk.size, disk.size));
+				chunk_table_free(&table);
+			}
+		}
+
+		free_disk(&disk);
+	}
+
+	return ok;
+}
+
+BOOLEAN check_disk_sizes(const char *path)
+{
+	IMAGE_DISK disk;
+	CHUNK_TABLE table;
+	ULONGLONG size;
+	BOOLEAN ok;
+
+	if (!create_disk(&disk, CHECK_SIZE, CHECK_CHUNK_SHIFT, 10, TRUE)) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) (NT_SUCCESS(image_save(&disk.table, disk.size, path)));
+
+	/* Smaller: cut in the middle of a chunk. */
+	size = disk.size / 2 + 1000 * 512;
+
+	ok = (BOOLEAN) (ok && (restore(path, &table, size, CHECK_CHUNK_SHIFT)));
+
+	if (ok) {
+		ok = (BOOLEAN) (table_equals(&table, disk.copy, size, size));
+		chunk_table_free(&table);
+	}
+
+	/* Larger: the rest is zeros, and nothing is allocated for it. */
+	size = disk.size * 2;
+
+	ok = (BOOLEAN) (ok && (restore(path, &table, size, CHECK_CHUNK_SHIFT)));
+
+	if (ok) {
+		ok = (BOOLEAN) ((table_equals(&table, disk.copy, size, disk.size)) && (chunk_table_memory_used(&table) == disk.nchunks << CHECK_CHUNK_SHIFT));
+		chunk_table_free(&table);
+	}
+
+	free_disk(&disk);
+
+	return ok;
+}
+
+BOOLEAN check_in_place(const char *path)
+{
+	IMAGE_DISK disk;
+	IMAGE_FILE image;
+	CHUNK_TABLE table;
+	ULONGLONG index;
+	ULONGLONG first;
+	ULONGLONG count;
+	ULONG chunk_size;
+	UCHAR *buffer;
+	ULONG round;
+	BOOLEAN ok;
+
+	if (!create_disk(&disk, CHECK_SIZE, CHECK_CHUNK_SHIFT, 20, TRUE)) {
+		return FALSE;
+	}
+
+	chunk_size = 1UL << CHECK_CHUNK_SHIFT;
+
+	if ((buffer = (UCHAR *) malloc(4 * chunk_size)) == NULL) {
+		free_disk(&disk);
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) ((NT_SUCCESS(image_save(&disk.table, disk.size, path))) && (NT_SUCCESS(image_open(&image, path))));
+
+	/* Checkpoints of a few ranges of chunks, some rewritten, some trimmed, some zeroed. */
+	for (round = 0; (ok) && (round < 10); round++) {
+		first = next_random(&disk.seed) % disk.table.nchunks;
+		count = 1 + next_random(&disk.seed) % 16;
+
+		if (first + count > disk.table.nchunks) {
+			count = disk.table.nchunks - first;
+		}
+
+		for (index = first; index < first + count; index++) {
+			fill_chunk(&disk, index);
+		}
+
+		/* Odd buffer: the runs are cut by the holes and by the buffer size. */
+		ok = (BOOLEAN) (NT_SUCCESS(image_write_chunks(&image, &disk.table, first, count, buffer, 3 * chunk_size)));
+	}
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(image_write_bitmap(&image))));
+
+	if (image.open) {
+		image_close(&image);
+	}
+
+	ok = (BOOLEAN) (ok && (restore(path, &table, disk.size, CHECK_CHUNK_SHIFT)));
+
+	if (ok) {
+		ok = (BOOLEAN) (table_equals(&table, disk.copy, disk.size, disk.size));
+		chunk_table_free(&table);
+	}
+
+	/* The chunks are written as they are in the table: same chunk size only. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(image_open(&image, path))) && (NT_SUCCESS(chunk_table_init(&table, disk.size, CHECK_CHUNK_SHIFT - 1))));
+
+	if (ok) {
+		ok = (BOOLEAN) (image_write_chunks(&image, &table, 0, 1, buffer, 4 * chunk_size) == STATUS_INVALID_PARAMETER);
+
+		chunk_table_free(&table);
+		image_close(&image);
+	}
+
+	free(buffer);
+	free_disk(&disk);
+
+	return ok;
+}
+
+BOOLEAN check_invalid(const char *path)
+{
+	IMAGE_DISK disk;
+	IMAGE_FILE image;
+	IMAGE_HEADER header;
+	CHUNK_TABLE table;
+	UCHAR zeros[sizeof(IMAGE_HEADER)];
+	ULONG version;
+	BOOLEAN ok;
+
+	unlink(path);
+
+	ok = (BOOLEAN) (image_open(&image, path) == STATUS_OBJECT_NAME_NOT_FOUND);
+
+	if (!create_disk(&disk, CHECK_SIZE, CHECK_CHUNK_SHIFT, 30, TRUE)) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(image_save(&disk.table, disk.size, path))) && (NT_SUCCESS(image_open(&image, path))));
+
+	if (ok) {
+		header = image.header;
+		image_close(&image);
+	}
+
+	/* A save interrupted before the header. */
+	memset(zeros, 0, sizeof(zeros));
+
+	ok = (BOOLEAN) (ok && (corrupt(path, 0, zeros, sizeof(zeros))) && (image_open(&image, path) == STATUS_DATA_ERROR));
+
+	/* Another version. */
+	version = IMAGE_VERSION + 1;
+
+	ok = (BOOLEAN) (ok && (corrupt(path, 0, &header, sizeof(header))) && (corrupt(path, offsetof(IMAGE_HEADER, version), &version, sizeof(version))));
+	ok = (BOOLEAN) (ok && (image_open(&image, path) == STATUS_DATA_ERROR));
+
+	/* The data overlapping the bitmap. */
+	header.data_offset = header.bitmap_offset;
+
+	ok = (BOOLEAN) (ok && (corrupt(path, 0, &header, sizeof(header))) && (image_open(&image, path) == STATUS_DATA_ERROR));
+
+	/* A file cut short opens, but its chunks cannot all be read. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(image_save(&disk.table, disk.size, path))) && (truncate(path, (off_t) (IMAGE_ALIGNMENT * 4)) == 0));
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(image_open(&image, path))));
+
+	if (ok) {
+		ok = (BOOLEAN) (NT_SUCCESS(chunk_table_init(&table, disk.size, CHECK_CHUNK_SHIFT)));
+
+		ok = (BOOLEAN) (ok && (image_restore(&table, disk.size, &image) == STATUS_END_OF_FILE));
+
+		chunk_table_free(&table);
+		image_close(&image);
+	}
+
+	free_disk(&disk);
+
+	return ok;
+}
+
+void measure(const char *path, ULONGLONG size)
+{
+	IMAGE_DISK disk;
+	CHUNK_TABLE table;
+	ULONGLONG start;
+	ULONGLONG elapsed[2];
+	ULONGLONG bytes;
+
+	if (!create_disk(&disk, size, DEFAULT_CHUNK_SHIFT, 40, FALSE)) {
+		fprintf(stderr, "Out of memory.\n");
+		return;
+	}
+
+	bytes = disk.nchunks << DEFAULT_CHUNK_SHIFT;
+
+	start = port_timestamp();
+
+	if (!NT_SUCCESS(image_save(&disk.table, disk.size, path))) {
+		printf("(save failed)\n");
+		free_disk(&disk);
+		return;
+	}
+
+	elapsed[0] = port_timestamp() - start;
+
+	start = port_timestamp();
+
+	if (!restore(path, &table, disk.size, DEFAULT_CHUNK_SHIFT)) {
+		printf("(restore failed)\n");
+		free_disk(&disk);
+		return;
+	}
+
+	elapsed[1] = port_timestamp() - start;
+
+	printf("\n%" PRIu64 " MB disk, %" PRIu64 " MB of data in %u KB chunks:\n", size >> 20, bytes >> 20, (1U << DEFAULT_CHUNK_SHIFT) >> 10);
+	printf("%-20s %12s %12s\n", "", "ms", "MB/s");
+	printf("%-20s %12.1f %12.0f\n", "save", (double) elapsed[0] / 1e6, (double) bytes / (double) elapsed[0] * 1e3);
+	printf("%-20s %12.1f %12.0f\n", "restore", (double) elapsed[1] / 1e6, (double) bytes / (double) elapsed[1] * 1e3);
+
+	chunk_table_free(&table);
+	free_disk(&disk);
+}
+
+/*
+ * A disk of random content, kept in "copy" if asked: a third of the chunks
+ * without data, a tenth written with zeros, a fifth compressed, the rest
+ * random bytes.
+ */
+BOOLEAN create_disk(IMAGE_DISK *disk, ULONGLONG size, ULONG chunk_shift, ULONGLONG seed, BOOLEAN copy)
+{
+	ULONGLONG index;
+
+	disk->size = size;
+	disk->nchunks = 0;
+	disk->seed = RANDOM_SEED + seed;
+	disk->copy = NULL;
+
+	if (!NT_SUCCESS(chunk_table_init(&disk->table, size, chunk_shift))) {
+		return FALSE;
+	}
+
+	if ((copy) && ((disk->copy = (UCHAR *) calloc(1, (SIZE_T) chunk_table_size(&disk->table))) == NULL)) {
+		chunk_table_free(&disk->table);
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(chunk_table_enable_compression(&disk->table))) {
+		free_disk(disk);
+		return FALSE;
+	}
+
+	for (index = 0; index < disk->table.nchunks; index++) {
+		fill_chunk(disk, index);
+	}
+
+	return TRUE;
+}
+
+void fill_chunk(IMAGE_DISK *disk, ULONGLONG index)
+{
+	static UCHAR *buffer;
+	static ULONG buffer_size;
+	CHUNK *chunk;
+	ULONGLONG r;
+	ULONG chunk_size;
+	ULONG i;
+
+	chunk_size = 1UL << disk->table.chunk_shift;
+
+	if (buffer_size < chunk_size) {
+		free(buffer);
+
+		if ((buffer = (UCHAR *) malloc(chunk_size)) == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+
+		buffer_size = chunk_size;
+	}
+
+	chunk = chunk_table_get_chunk(&disk->table, index);
+
+	if (chunk->data) {
+		disk->nchunks--;
+	}
+
+	r = next_random(&disk->seed) % 100;
+
+	if (r < 33) {
+		chunk_table_trim(&disk->table, index << disk->table.chunk_shift, chunk_size);
+		memset(buffer, 0, chunk_size);
+	} else if (r < 43) {
+		memset(buffer, 0, chunk_size);
+		chunk_table_write(&disk->table, index << disk->table.chunk_shift, buffer, chunk_size);
+	} else if (r < 63) {
+		/* Text-like: a few distinct bytes, with repeats the codec finds. */
+		for (i = 0; i < chunk_size; i++) {
+			buffer[i] = (UCHAR) ('a' + (i * 7 + (ULONG) (index & 15)) % 13);
+		}
+
+		chunk_table_write(&disk->table, index << disk->table.chunk_shift, buffer, chunk_size);
+		chunk_table_compress(&disk->table, index);
+	} else {
+		for (i = 0; i < chunk_size; i += sizeof(ULONGLONG)) {
+			r = next_random(&disk->seed);
+			memcpy(buffer + i, &r, sizeof(r));
+		}
+
+		chunk_table_write(&disk->table, index << disk->table.chunk_shift, buffer, chunk_size);
+	}
+
+	if (chunk->data) {
+		disk->nchunks++;
+	}
+
+	if (disk->copy) {
+		memcpy(disk->copy + (index << disk->table.chunk_shift), buffer, chunk_size);
+	}
+}
+
+void free_disk(IMAGE_DISK *disk)
+{
+	chunk_table_free(&disk->table);
+	free(disk->copy);
+}
+
+BOOLEAN restore(const char *path, CHUNK_TABLE *table, ULONGLONG size, ULONG chunk_shift)
+{
+	IMAGE_FILE image;
+	NTSTATUS status;
+
+	if (!NT_SUCCESS(image_open(&image, path))) {
+		return FALSE;
+	}
+
+	status = chunk_table_init(table, size, chunk_shift);
+	if (NT_SUCCESS(status)) {
+		status = image_restore(table, size, &image);
+		if (!NT_SUCCESS(status)) {
+			chunk_table_free(table);
+		}
+	}
+
+	image_close(&image);
+
+	return (BOOLEAN) (NT_SUCCESS(status));
+}
+
+/* The first "limit" bytes are those of "copy", the rest zeros. */
+BOOLEAN table_equals(CHUNK_TABLE *table, const UCHAR *copy, ULONGLONG size, ULONGLONG limit)
+{
+	static UCHAR buffer[COMPARE_SIZE];
+	ULONGLONG offset;
+	ULONGLONG length;
+	ULONGLONG i;
+
+	for (offset = 0; offset < size; offset += length) {
+		length = (size - offset < COMPARE_SIZE) ? size - offset : COMPARE_SIZE;
+
+		if (!NT_SUCCESS(chunk_table_read(table, offset, buffer, (SIZE_T) length))) {
+			return FALSE;
+		}
+
+		for (i = 0; i < length; i++) {
+			if (buffer[i] != ((offset + i < limit) ? copy[offset + i] : 0)) {
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+BOOLEAN corrupt(const char *path, ULONGLONG offset, const void *data, ULONG length)
+{
+	FILE *file;
+	BOOLEAN ok;
+
+	if ((file = fopen(path, "r+b")) == NULL) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) ((fseek(file, (long) offset, SEEK_SET) == 0) && (fwrite(data, 1, length, file) == length));
+
+	return (BOOLEAN) ((fclose(file) == 0) && (ok));
+}
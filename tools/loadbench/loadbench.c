@@ -0,0 +1,570 @@
+/*
+ * Simulation of the start of a disk restored from its image (image.c) on
+ * Linux: time to the first I/O, and latency of the I/Os while the image is
+ * still being loaded, with the image restored before the first I/O and with
+ * the lazy loader.
+ * The lazy loader runs as in the driver: a prefetch thread loads the image
+ * in the background (range_lock_try_acquire() on the chunks, a back-off when
+ * they have I/O) and the I/Os on chunks not loaded yet load them first, one
+ * at a time (the load queue). The reads of the image go through a simulated
+ * device, "-l" microseconds per transfer and "-b" MB/s shared by all the
+ * transfers (the file itself is in the page cache), by wrapping pread(),
+ * hence the -Wl,--wrap=pread.
+ * It checks that the disk lazily loaded, with writes while it was loading,
+ * has the content of the image updated by the writes.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -Wl,--wrap=pread -o loadbench loadbench.c ../common/tools.c \
+ *       ../../image.c ../../port_file.c ../../range_lock.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ *
+ * Usage: loadbench [options]
+ *   -f file      Image file, removed at the end (default loadbench.img).
+ *   -s size      Disk size (K, M and G suffixes; default 256M).
+ *   -u percent   Part of the disk with data (default 50).
+ *   -t threads   Threads doing I/O (default 2).
+ *   -l latency   Latency of the device in microseconds (default 100).
+ *   -b rate      Bandwidth of the device in MB/s (default 1000, 0: unlimited).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "image.h"
+#include "range_lock.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-f file] [-s size] [-u percent] [-t threads] [-l latency] [-b rate]"
+#define IO_SIZE                         4096
+#define WRITE_PERCENT                   30
+#define MAX_THREADS                     64
+#define MAX_SAMPLES                     (1 << 20) /* Latencies kept per thread. */
+#define PREFETCH_BACKOFF                10 /* Milliseconds, as the driver. */
+#define COMPARE_SIZE                    (1024 * 1024)
+
+typedef struct _LOAD_DISK LOAD_DISK;
+
+typedef struct {
+	LOAD_DISK *disk;
+	pthread_t thread;
+	ULONGLONG seed;
+	ULONGLONG *samples;        /* Latencies (ns) of the I/Os while loading. */
+	ULONG     nsamples;
+	ULONGLONG nios;
+	ULONGLONG first_io;        /* Completion of its first I/O, since the start. */
+	UCHAR     *buffer;         /* Of the load queue: a buffer of the loader. */
+	UCHAR     data[IO_SIZE];
+	BOOLEAN   ok;
+} IO_THREAD;
+
+struct _LOAD_DISK {
+	CHUNK_TABLE     table;
+	IMAGE_FILE      image;
+	IMAGE_LOADER    loader;
+	RANGE_LOCK      range_lock;
+	pthread_mutex_t load_queue;    /* The loads on demand are sequential. */
+	ULONGLONG       size;
+	UCHAR           *copy;         /* Content of the image, then of the disk. */
+	volatile LONG   stop;
+	ULONGLONG       start;         /* Of the restore. */
+	ULONGLONG       loaded;        /* End of the background load, since the start. */
+	ULONG           nthreads;
+	IO_THREAD       threads[MAX_THREADS];
+};
+
+/* The simulated device. */
+static ULONGLONG device_latency;   /* ns per transfer. */
+static ULONGLONG device_rate;      /* Bytes per second (0: unlimited). */
+static ULONGLONG device_free;      /* Time at which the device is done with the transfers queued. */
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ssize_t __real_pread(int fd, void *buffer, size_t count, off_t offset);
+ssize_t __wrap_pread(int fd, void *buffer, size_t count, off_t offset);
+
+BOOLEAN create_image(const char *path, ULONGLONG size, ULONG percent, UCHAR **copy);
+BOOLEAN run(const char *path, ULONGLONG size, UCHAR *copy, ULONG nthreads, BOOLEAN lazy);
+void *prefetch(void *arg);
+void *do_io(void *arg);
+BOOLEAN table_equals(CHUNK_TABLE *table, const UCHAR *copy, ULONGLONG size);
+void report(const char *name, LOAD_DISK *disk);
+int compare_samples(const void *a, const void *b);
+void sleep_until(ULONGLONG time);
+
+int main(int argc, char **argv)
+{
+	const char *path;
+	ULONGLONG size;
+	ULONG percent;
+	ULONG nthreads;
+	UCHAR *copy;
+	BOOLEAN ok;
+	int opt;
+
+	path = "loadbench.img";
+	size = 256ULL << 20;
+	percent = 50;
+	nthreads = 2;
+	device_latency = 100 * 1000;
+	device_rate = 1000ULL * 1000 * 1000;
+
+	while ((opt = getopt(argc, argv, "f:s:u:t:l:b:")) != -1) {
+		switch (opt) {
+			case 'f':
+				path = optarg;
+				break;
+			case 's':
+				if ((!parse_size(optarg, &size)) || (size < (1ULL << DEFAULT_CHUNK_SHIFT))) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'u':
+				if ((percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 't':
+				if (((nthreads = (ULONG) atoi(optarg)) == 0) || (nthreads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'l':
+				device_latency = strtoull(optarg, NULL, 10) * 1000;
+				break;
+			case 'b':
+				device_rate = strtoull(optarg, NULL, 10) * 1000 * 1000;
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	if (!create_image(path, size, percent, &copy)) {
+		fprintf(stderr, "The image cannot be created.\n");
+		unlink(path);
+		return 1;
+	}
+
+	printf("%" PRIu64 " MB disk, %u%% with data, device: %" PRIu64 " us per transfer, ", size >> 20, percent, device_latency / 1000);
+
+	if (device_rate) {
+		printf("%" PRIu64 " MB/s\n", device_rate / 1000 / 1000);
+	} else {
+		printf("unlimited bandwidth\n");
+	}
+
+	printf("%-12s %14s %12s %12s %12s %12s %12s\n", "", "First I/O ms", "Loaded ms", "I/Os", "p50 us", "p99 us", "Max us");
+
+	ok = (BOOLEAN) (run(path, size, copy, nthreads, FALSE) && run(path, size, copy, nthreads, TRUE));
+
+	unlink(path);
+	free(copy);
+
+	printf("\n%-52s %s\n", "The disk loaded lazily has the image and the writes", (ok) ? "ok" : "FAILED");
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* A transfer waits for the transfers queued before it, then for its own. */
+ssize_t __wrap_pread(int fd, void *buffer, size_t count, off_t offset)
+{
+	ULONGLONG start;
+	ULONGLONG done;
+
+	pthread_mutex_lock(&device_lock);
+
+	start = port_timestamp();
+	if (start < device_free) {
+		start = device_free;
+	}
+
+	done = start + ((device_rate) ? (ULONGLONG) count * 1000000000ULL / device_rate : 0);
+	device_free = done;
+
+	pthread_mutex_unlock(&device_lock);
+
+	sleep_until(done + device_latency);
+
+	return __real_pread(fd, buffer, count, offset);
+}
+
+/* "percent" of the chunks, at random, with random data. */
+BOOLEAN create_image(const char *path, ULONGLONG size, ULONG percent, UCHAR **copy)
+{
+	CHUNK_TABLE table;
+	ULONGLONG seed;
+	ULONGLONG index;
+	ULONGLONG r;
+	ULONG chunk_size;
+	ULONG i;
+	UCHAR *data;
+	NTSTATUS status;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, size, DEFAULT_CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	if ((*copy = (UCHAR *) calloc(1, (SIZE_T) chunk_table_size(&table))) == NULL) {
+		chunk_table_free(&table);
+		return FALSE;
+	}
+
+	chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+	seed = RANDOM_SEED;
+
+	for (index = 0; index < table.nchunks; index++) {
+		if (next_random(&seed) % 100 >= percent) {
+			continue;
+		}
+
+		data = *copy + (index << DEFAULT_CHUNK_SHIFT);
+
+		for (i = 0; i < chunk_size; i += sizeof(ULONGLONG)) {
+			r = next_random(&seed);
+			memcpy(data + i, &r, sizeof(r));
+		}
+
+		chunk_table_write(&table, index << DEFAULT_CHUNK_SHIFT, data, chunk_size);
+	}
+
+	status = image_save(&table, size, path);
+
+	chunk_table_free(&table);
+
+	return (BOOLEAN) (NT_SUCCESS(status));
+}
+
+BOOLEAN run(const char *path, ULONGLONG size, UCHAR *copy, ULONG nthreads, BOOLEAN lazy)
+{
+	LOAD_DISK *disk;
+	IO_THREAD *thread;
+	pthread_t prefetch_thread;
+	ULONG t;
+	BOOLEAN ok;
+
+	if ((disk = (LOAD_DISK *) calloc(1, sizeof(LOAD_DISK))) == NULL) {
+		return FALSE;
+	}
+
+	disk->size = size;
+	disk->nthreads = nthreads;
+
+	/* The writes of the lazy run are checked against a copy of their own. */
+	if ((disk->copy = (UCHAR *) malloc((SIZE_T) size)) == NULL) {
+		free(disk);
+		return FALSE;
+	}
+
+	memcpy(disk->copy, copy, (SIZE_T) size);
+
+	range_lock_init(&disk->range_lock);
+	pthread_mutex_init(&disk->load_queue, NULL);
+
+	for (t = 0; t < nthreads; t++) {
+		thread = &disk->threads[t];
+
+		thread->disk = disk;
+		thread->seed = RANDOM_SEED + t;
+		thread->ok = TRUE;
+
+		if (((thread->samples = (ULONGLONG *) malloc(MAX_SAMPLES * sizeof(ULONGLONG))) == NULL) ||
+			((thread->buffer = (UCHAR *) malloc(IMAGE_TRANSFER_SIZE)) == NULL)) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	ok = FALSE;
+
+	/* From here, as the driver when the disk is created. */
+	disk->start = port_timestamp();
+
+	if ((!NT_SUCCESS(image_open(&disk->image, path))) || (!NT_SUCCESS(chunk_table_init(&disk->table, size, DEFAULT_CHUNK_SHIFT)))) {
+		goto out;
+	}
+
+	if (lazy) {
+		if (!NT_SUCCESS(image_loader_init(&disk->loader, &disk->image, &disk->table, size))) {
+			goto out;
+		}
+
+		if (pthread_create(&prefetch_thread, NULL, prefetch, disk) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	} else {
+		if (!NT_SUCCESS(image_restore(&disk->table, size, &disk->image))) {
+			goto out;
+		}
+
+		disk->loaded = port_timestamp() - disk->start;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&disk->threads[t].thread, NULL, do_io, &disk->threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	/* Restored: the latencies of a loaded disk, for reference. */
+	if (!lazy) {
+		usleep(200000);
+		disk->stop = TRUE;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(disk->threads[t].thread, NULL);
+	}
+
+	if (lazy) {
+		pthread_join(prefetch_thread, NULL);
+	}
+
+	ok = TRUE;
+
+	for (t = 0; t < nthreads; t++) {
+		ok = (BOOLEAN) (ok && (disk->threads[t].ok));
+	}
+
+	ok = (BOOLEAN) (ok && (!image_loader_pending(&disk->loader)) && (table_equals(&disk->table, disk->copy, size)));
+
+	report((lazy) ? "lazy" : "restored", disk);
+
+out:
+	if (disk->image.open) {
+		image_close(&disk->image);
+	}
+
+	chunk_table_free(&disk->table);
+	range_lock_destroy(&disk->range_lock);
+	pthread_mutex_destroy(&disk->load_queue);
+
+	for (t = 0; t < nthreads; t++) {
+		free(disk->threads[t].samples);
+		free(disk->threads[t].buffer);
+	}
+
+	free(disk->copy);
+	free(disk);
+
+	return ok;
+}
+
+/* As prefetch() in the driver. */
+void *prefetch(void *arg)
+{
+	LOAD_DISK *disk;
+	RANGE_LOCK_ENTRY entry;
+	ULONGLONG offset;
+	ULONGLONG length;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	disk = (LOAD_DISK *) arg;
+
+	if ((buffer = (UCHAR *) malloc(disk->loader.buffer_size)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	while (image_loader_pending(&disk->loader)) {
+		if (!image_loader_next(&disk->loader, &disk->table, &offset, &length)) {
+			break;
+		}
+
+		/* The chunks with I/O are being loaded by the load queue, come back later. */
+		if (!range_lock_try_acquire(&disk->range_lock, &entry, offset, offset + length, TRUE)) {
+			usleep(PREFETCH_BACKOFF * 1000);
+			continue;
+		}
+
+		status = image_loader_load(&disk->loader, &disk->table, offset, length, buffer);
+
+		/* The waiters execute themselves (they wait for their "granted" flag). */
+		range_lock_release(&disk->range_lock, &entry);
+
+		if (!NT_SUCCESS(status)) {
+			fprintf(stderr, "Prefetching failed (0x%08x).\n", status);
+			break;
+		}
+	}
+
+	disk->loaded = port_timestamp() - disk->start;
+	disk->stop = TRUE;
+
+	free(buffer);
+
+	return NULL;
+}
+
+void *do_io(void *arg)
+{
+	IO_THREAD *thread;
+	LOAD_DISK *disk;
+	RANGE_LOCK_ENTRY entry;
+	ULONGLONG offset;
+	ULONGLONG start;
+	ULONGLONG r;
+	ULONG i;
+	BOOLEAN write;
+
+	thread = (IO_THREAD *) arg;
+	disk = thread->disk;
+
+	while (!disk->stop) {
+		r = next_random(&thread->seed);
+
+		offset = ((r >> 16) % (disk->size / IO_SIZE)) * IO_SIZE;
+		write = (BOOLEAN) ((r & 0xffff) % 100 < WRITE_PERCENT);
+
+		start = port_timestamp();
+
+		/* The driver would execute the request on behalf of this thread when it is granted. */
+		if (!range_lock_acquire(&disk->range_lock, &entry, offset, offset + IO_SIZE, write)) {
+			while (!*((volatile BOOLEAN *) &entry.granted)) {
+				sched_yield();
+			}
+		}
+
+		/* The load queue. */
+		if ((image_loader_pending(&disk->loader)) && (!chunk_table_is_loaded(&disk->table, offset, IO_SIZE))) {
+			pthread_mutex_lock(&disk->load_queue);
+
+			if (!NT_SUCCESS(image_loader_load(&disk->loader, &disk->table, offset, IO_SIZE, thread->buffer))) {
+				thread->ok = FALSE;
+			}
+
+			pthread_mutex_unlock(&disk->load_queue);
+		}
+
+		if (write) {
+			for (i = 0; i < IO_SIZE; i++) {
+				thread->data[i] = (UCHAR) (r >> (i & 31));
+			}
+
+			thread->ok = (BOOLEAN) ((thread->ok) && (NT_SUCCESS(chunk_table_write(&disk->table, offset, thread->data, IO_SIZE))));
+			memcpy(disk->copy + offset, thread->data, IO_SIZE);
+		} else {
+			thread->ok = (BOOLEAN) ((thread->ok) && (NT_SUCCESS(chunk_table_read(&disk->table, offset, thread->data, IO_SIZE))));
+			thread->ok = (BOOLEAN) ((thread->ok) && (memcmp(thread->data, disk->copy + offset, IO_SIZE) == 0));
+		}
+
+		range_lock_release(&disk->range_lock, &entry);
+
+		if (thread->nsamples < MAX_SAMPLES) {
+			thread->samples[thread->nsamples++] = port_timestamp() - start;
+		}
+
+		if (thread->nios++ == 0) {
+			thread->first_io = port_timestamp() - disk->start;
+		}
+	}
+
+	return NULL;
+}
+
+BOOLEAN table_equals(CHUNK_TABLE *table, const UCHAR *copy, ULONGLONG size)
+{
+	static UCHAR buffer[COMPARE_SIZE];
+	ULONGLONG offset;
+	ULONGLONG length;
+
+	for (offset = 0; offset < size; offset += length) {
+		length = (size - offset < COMPARE_SIZE) ? size - offset : COMPARE_SIZE;
+
+		if ((!NT_SUCCESS(chunk_table_read(table, offset, buffer, (SIZE_T) length))) || (memcmp(buffer, copy + offset, (SIZE_T) length) != 0)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+void report(const char *name, LOAD_DISK *disk)
+{
+	ULONGLONG *samples;
+	ULONGLONG first_io;
+	ULONGLONG nios;
+	ULONG n;
+	ULONG t;
+
+	/* The first I/O of all the threads. */
+	first_io = disk->threads[0].first_io;
+
+	for (t = 0, n = 0, nios = 0; t < disk->nthreads; t++) {
+		n += disk->threads[t].nsamples;
+		nios += disk->threads[t].nios;
+
+		if (disk->threads[t].first_io < first_io) {
+			first_io = disk->threads[t].first_io;
+		}
+	}
+
+	if ((n == 0) || ((samples = (ULONGLONG *) malloc(n * sizeof(ULONGLONG))) == NULL)) {
+		printf("%-12s %14.1f %12.1f %12s\n", name, (double) first_io / 1e6, (double) disk->loaded / 1e6, "-");
+		return;
+	}
+
+	for (t = 0, n = 0; t < disk->nthreads; t++) {
+		memcpy(samples + n, disk->threads[t].samples, disk->threads[t].nsamples * sizeof(ULONGLONG));
+		n += disk->threads[t].nsamples;
+	}
+
+	qsort(samples, n, sizeof(ULONGLONG), compare_samples);
+
+	printf("%-12s %14.1f %12.1f %12" PRIu64 " %12.1f %12.1f %12.1f\n",
+		   name,
+		   (double) first_io / 1e6,
+		   (double) disk->loaded / 1e6,
+		   nios,
+		   (double) samples[n / 2] / 1e3,
+		   (double) samples[(ULONG) ((ULONGLONG) n * 99 / 100)] / 1e3,
+		   (double) samples[n - 1] / 1e3);
+
+	free(samples);
+}
+
+int compare_samples(const void *a, const void *b)
+{
+	ULONGLONG x;
+	ULONGLONG y;
+
+	x = *(const ULONGLONG *) a;
+	y = *(const ULONGLONG *) b;
+
+	return (x > y) - (x < y);
+}
+
+void sleep_until(ULONGLONG time)
+{
+	struct timespec ts;
+	ULONGLONG now;
+
+	if ((now = port_timestamp()) < time) {
+		ts.tv_sec = (time_t) ((time - now) / 1000000000ULL);
+		ts.tv_nsec = (long) ((time - now) % 1000000000ULL);
+
+		while (nanosleep(&ts, &ts) != 0);
+	}
+}
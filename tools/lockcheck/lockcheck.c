@@ -0,0 +1,480 @@
+/*
+ * Test and scaling benchmark of the range lock (range_lock.c) on Linux.
+ * The requests are executed as in the driver: the thread which gets a
+ * range executes the request and then, on behalf of their threads, the
+ * chain of requests granted by each release (execute_requests()); the
+ * threads never wait for a range, only for a free slot of their own.
+ * It checks that:
+ *   - disjoint ranges, and overlapping shared ones, are granted at once;
+ *   - the ranges are granted in arrival order: a shared range waits behind
+ *     a conflicting exclusive one which is queued, not only granted;
+ *   - a release returns the waiters it grants, and only those;
+ *   - range_lock_try_acquire() fails on a conflict and doesn't queue;
+ *   - a long chain of overlapping requests is executed without recursion;
+ *   - under a random mix of overlapping requests from several threads, no
+ *     two conflicting ranges are ever executed at the same time and every
+ *     request is executed once (a lost wake-up stops the test).
+ * Then it measures the requests per second from 1 to "max_threads"
+ * threads with disjoint ranges, overlapping reads and a mix of overlapping
+ * reads and writes.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o lockcheck lockcheck.c ../common/tools.c ../../range_lock.c
+ *
+ * Usage: lockcheck [options]
+ *   -t threads   Maximum number of threads (default: processors, at least 4).
+ *   -n count     Requests per thread (default 50000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "range_lock.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-t threads] [-n count]"
+#define UNIT_SIZE                       512
+#define UNITS                           4096 /* 2 MB of disk. */
+#define DEPTH                           8 /* Requests of a thread in flight. */
+#define MAX_THREADS                     64
+#define MAX_UNITS_PER_REQUEST           16
+#define CHAIN_LENGTH                    100000
+#define EXCLUSIVE_OWNER                 0x10000
+#define WATCHDOG_SECONDS                10
+
+#define MODE_DISJOINT                   0
+#define MODE_SHARED                     1
+#define MODE_MIXED                      2
+
+typedef struct {
+	RANGE_LOCK_ENTRY range;            /* First: the entries are the requests. */
+	volatile LONG    done;
+	ULONGLONG        executions;
+} LOCK_REQUEST;
+
+typedef struct _LOCK_TEST LOCK_TEST;
+
+typedef struct {
+	LOCK_TEST    *test;
+	pthread_t    thread;
+	ULONG        id;
+	ULONGLONG    seed;
+	LOCK_REQUEST requests[DEPTH];
+} LOCK_THREAD;
+
+struct _LOCK_TEST {
+	RANGE_LOCK    range_lock;
+	volatile LONG owners[UNITS];       /* Shared holders, plus EXCLUSIVE_OWNER for a writer. */
+	volatile LONG violations;
+	volatile LONGLONG completed;
+	ULONGLONG     count;
+	ULONG         nthreads;
+	int           mode;
+	LOCK_THREAD   threads[MAX_THREADS];
+};
+
+BOOLEAN check_grants(void);
+BOOLEAN check_try_acquire(void);
+BOOLEAN check_chain(void);
+BOOLEAN stress(LOCK_TEST *test, ULONG nthreads, ULONGLONG count, int mode, double *rate);
+void *submit(void *arg);
+void execute_requests(LOCK_TEST *test, RANGE_LOCK_ENTRY *head);
+RANGE_LOCK_ENTRY *execute_request(LOCK_TEST *test, LOCK_REQUEST *request);
+
+int main(int argc, char **argv)
+{
+	LOCK_TEST *test;
+	ULONGLONG count;
+	ULONG max_threads;
+	ULONG nthreads;
+	double rates[3];
+	BOOLEAN ok;
+	int mode;
+	int opt;
+
+	max_threads = port_cpu_count();
+	if (max_threads < 4) {
+		max_threads = 4;
+	} else if (max_threads > MAX_THREADS) {
+		max_threads = MAX_THREADS;
+	}
+
+	count = 50000;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+			case 't':
+				if (((max_threads = (ULONG) atoi(optarg)) == 0) || (max_threads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((optind != argc) || ((test = (LOCK_TEST *) calloc(1, sizeof(LOCK_TEST))) == NULL)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "Ranges are granted in arrival order", (check_grants()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "A failed try doesn't queue", (check_try_acquire()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Long chains of waiters are executed in order", (check_chain()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Concurrent overlapping requests never conflict", (stress(test, max_threads, count, MODE_MIXED, &rates[0])) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		printf("\nRequests per second (millions), %u in flight per thread, %u processors:\n", DEPTH, port_cpu_count());
+		printf("%8s %12s %12s %12s\n", "Threads", "Disjoint", "Shared", "Mixed");
+
+		for (nthreads = 1; (ok) && (nthreads <= max_threads); nthreads = (nthreads < 4) ? nthreads + 1 : nthreads * 2) {
+			for (mode = MODE_DISJOINT; mode <= MODE_MIXED; mode++) {
+				ok = (BOOLEAN) (ok && (stress(test, nthreads, count, mode, &rates[mode])));
+			}
+
+			printf("%8u %12.2f %12.2f %12.2f\n", nthreads, rates[MODE_DISJOINT], rates[MODE_SHARED], rates[MODE_MIXED]);
+		}
+	}
+
+	free(test);
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_grants(void)
+{
+	RANGE_LOCK range_lock;
+	RANGE_LOCK_ENTRY entries[6];
+	RANGE_LOCK_ENTRY *granted;
+	BOOLEAN ok;
+
+	range_lock_init(&range_lock);
+
+	/* Disjoint writes, and reads sharing a range. */
+	ok = (BOOLEAN) ((range_lock_acquire(&range_lock, &entries[0], 0, 100, TRUE)) && (range_lock_acquire(&range_lock, &entries[1], 100, 200, TRUE)));
+	ok = (BOOLEAN) (ok && (range_lock_acquire(&range_lock, &entries[2], 300, 400, FALSE)) && (range_lock_acquire(&range_lock, &entries[3], 350, 450, FALSE)));
+
+	/* A write behind the reads waits; a read behind it too, even if it only overlaps the reads. */
+	ok = (BOOLEAN) (ok && (!range_lock_acquire(&range_lock, &entries[4], 320, 360, TRUE)) && (!range_lock_acquire(&range_lock, &entries[5], 340, 350, FALSE)));
+
+	/* The first write goes: nothing was waiting for it. */
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[0]) == NULL));
+
+	/* Both reads have to go for the write, and the write for the last read. */
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[2]) == NULL) && (!entries[4].granted));
+
+	granted = range_lock_release(&range_lock, &entries[3]);
+	ok = (BOOLEAN) (ok && (granted == &entries[4]) && (granted->next_granted == NULL) && (entries[4].granted) && (!entries[5].granted));
+
+	granted = range_lock_release(&range_lock, &entries[4]);
+	ok = (BOOLEAN) (ok && (granted == &entries[5]) && (granted->next_granted == NULL));
+
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[5]) == NULL) && (range_lock_release(&range_lock, &entries[1]) == NULL));
+
+	/* A write releasing several waiters returns them all, in arrival order. */
+	ok = (BOOLEAN) (ok && (range_lock_acquire(&range_lock, &entries[0], 0, 1000, TRUE)));
+	ok = (BOOLEAN) (ok && (!range_lock_acquire(&range_lock, &entries[1], 0, 10, FALSE)) && (!range_lock_acquire(&range_lock, &entries[2], 500, 600, TRUE)));
+	ok = (BOOLEAN) (ok && (!range_lock_acquire(&range_lock, &entries[3], 5, 20, FALSE)) && (!range_lock_acquire(&range_lock, &entries[4], 550, 560, FALSE)));
+
+	granted = range_lock_release(&range_lock, &entries[0]);
+
+	ok = (BOOLEAN) (ok && (granted == &entries[1]) && (entries[1].next_granted == &entries[2]) && (entries[2].next_granted == &entries[3]));
+	ok = (BOOLEAN) (ok && (entries[3].next_granted == NULL) && (!entries[4].granted));
+
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[1]) == NULL) && (range_lock_release(&range_lock, &entries[3]) == NULL));
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[2]) == &entries[4]) && (range_lock_release(&range_lock, &entries[4]) == NULL));
+
+	ok = (BOOLEAN) (ok && (range_lock.head == NULL) && (range_lock.tail == NULL));
+
+	range_lock_destroy(&range_lock);
+
+	return ok;
+}
+
+BOOLEAN check_try_acquire(void)
+{
+	RANGE_LOCK range_lock;
+	RANGE_LOCK_ENTRY entries[4];
+	BOOLEAN ok;
+
+	range_lock_init(&range_lock);
+
+	ok = (BOOLEAN) (range_lock_acquire(&range_lock, &entries[0], 0, 100, FALSE));
+
+	/* Conflicts with a granted range, and with a queued one. */
+	ok = (BOOLEAN) (ok && (!range_lock_try_acquire(&range_lock, &entries[1], 50, 150, TRUE)));
+	ok = (BOOLEAN) (ok && (range_lock_try_acquire(&range_lock, &entries[1], 50, 150, FALSE)));
+	ok = (BOOLEAN) (ok && (!range_lock_acquire(&range_lock, &entries[2], 120, 130, TRUE)));
+	ok = (BOOLEAN) (ok && (!range_lock_try_acquire(&range_lock, &entries[3], 125, 200, FALSE)));
+
+	/* The failed tries were not queued: the releases only grant the write. */
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[0]) == NULL));
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[1]) == &entries[2]) && (entries[2].next_granted == NULL));
+	ok = (BOOLEAN) (ok && (range_lock_release(&range_lock, &entries[2]) == NULL));
+
+	ok = (BOOLEAN) (ok && (range_lock.head == NULL));
+
+	range_lock_destroy(&range_lock);
+
+	return ok;
+}
+
+BOOLEAN check_chain(void)
+{
+	LOCK_TEST *test;
+	LOCK_REQUEST *requests;
+	ULONG i;
+	BOOLEAN ok;
+
+	if (((test = (LOCK_TEST *) calloc(1, sizeof(LOCK_TEST))) == NULL) || ((requests = (LOCK_REQUEST *) calloc(CHAIN_LENGTH, sizeof(LOCK_REQUEST))) == NULL)) {
+		free(test);
+		return FALSE;
+	}
+
+	range_lock_init(&test->range_lock);
+
+	/* Every write overlaps the previous one only: each release grants the next one. */
+	ok = TRUE;
+
+	for (i = 0; (ok) && (i < CHAIN_LENGTH); i++) {
+		ok = (BOOLEAN) (range_lock_acquire(&test->range_lock, &requests[i].range, i % UNITS * UNIT_SIZE, (i % UNITS + 2) * UNIT_SIZE, TRUE) == (i == 0));
+	}
+
+	if (ok) {
+		execute_requests(test, &requests[0].range);
+	}
+
+	for (i = 0; (ok) && (i < CHAIN_LENGTH); i++) {
+		ok = (BOOLEAN) ((requests[i].done) && (requests[i].executions == 1));
+	}
+
+	ok = (BOOLEAN) (ok && (test->violations == 0) && (test->range_lock.head == NULL));
+
+	range_lock_destroy(&test->range_lock);
+
+	free(requests);
+	free(test);
+
+	return ok;
+}
+
+BOOLEAN stress(LOCK_TEST *test, ULONG nthreads, ULONGLONG count, int mode, double *rate)
+{
+	LOCK_THREAD *thread;
+	ULONGLONG start;
+	ULONGLONG last;
+	ULONGLONG completed;
+	ULONGLONG stalled;
+	ULONG t;
+	ULONG i;
+	BOOLEAN ok;
+
+	memset((void *) test->owners, 0, sizeof(test->owners));
+
+	range_lock_init(&test->range_lock);
+
+	test->violations = 0;
+	test->completed = 0;
+	test->count = count;
+	test->nthreads = nthreads;
+	test->mode = mode;
+
+	start = port_timestamp();
+
+	for (t = 0; t < nthreads; t++) {
+		thread = &test->threads[t];
+
+		thread->test = test;
+		thread->id = t;
+		thread->seed = RANDOM_SEED + t;
+
+		for (i = 0; i < DEPTH; i++) {
+			thread->requests[i].done = TRUE;
+			thread->requests[i].executions = 0;
+		}
+
+		if (pthread_create(&thread->thread, NULL, submit, thread) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	/* A request which is never granted stops every thread. */
+	last = 0;
+	stalled = 0;
+
+	while ((completed = (ULONGLONG) test->completed) < nthreads * count) {
+		usleep(100000);
+
+		if (completed == last) {
+			if (++stalled == WATCHDOG_SECONDS * 10) {
+				printf("  no progress after %" PRIu64 " of %" PRIu64 " requests\n", completed, nthreads * count);
+				return FALSE;
+			}
+		} else {
+			stalled = 0;
+			last = completed;
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(test->threads[t].thread, NULL);
+	}
+
+	*rate = (double) nthreads * count / (double) (port_timestamp() - start) * 1e3;
+
+	ok = (BOOLEAN) ((test->violations == 0) && (test->range_lock.head == NULL));
+
+	for (t = 0; t < nthreads; t++) {
+		for (i = 0; i < DEPTH; i++) {
+			ok = (BOOLEAN) (ok && (test->threads[t].requests[i].done));
+		}
+	}
+
+	range_lock_destroy(&test->range_lock);
+
+	return ok;
+}
+
+void *submit(void *arg)
+{
+	LOCK_THREAD *thread;
+	LOCK_TEST *test;
+	LOCK_REQUEST *request;
+	ULONGLONG first;
+	ULONGLONG nunits;
+	ULONGLONG r;
+	ULONGLONG i;
+	BOOLEAN exclusive;
+
+	thread = (LOCK_THREAD *) arg;
+	test = thread->test;
+
+	for (i = 0; i < test->count; i++) {
+		request = &thread->requests[i % DEPTH];
+
+		/* Wait for the slot: its request is executed by whichever thread released its range. */
+		while (!request->done) {
+			sched_yield();
+		}
+
+		request->done = FALSE;
+
+		r = next_random(&thread->seed);
+		nunits = (r % MAX_UNITS_PER_REQUEST) + 1;
+
+		switch (test->mode) {
+			case MODE_DISJOINT:
+				/* Each thread in its own part of the disk, each request of a thread in its own slice. */
+				first = (UNITS / test->nthreads) * thread->id + (r >> 32) % (UNITS / test->nthreads - nunits + 1);
+				exclusive = TRUE;
+				break;
+			case MODE_SHARED:
+				first = (r >> 32) % (UNITS - nunits + 1);
+				exclusive = FALSE;
+				break;
+			default:
+				/* A hot area of 64 units, 30% writes. */
+				first = (r >> 32) % (64 - nunits + 1);
+				exclusive = (BOOLEAN) (((r >> 16) % 10) < 3);
+		}
+
+		if (range_lock_acquire(&test->range_lock, &request->range, first * UNIT_SIZE, (first + nunits) * UNIT_SIZE, exclusive)) {
+			execute_requests(test, &request->range);
+		}
+	}
+
+	/* The last requests might still be executed by other threads. */
+	for (i = 0; i < DEPTH; i++) {
+		while (!thread->requests[i].done) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+/* As execute_requests() in the driver: the waiters are queued, not executed recursively. */
+void execute_requests(LOCK_TEST *test, RANGE_LOCK_ENTRY *head)
+{
+	RANGE_LOCK_ENTRY *tail;
+	RANGE_LOCK_ENTRY *entry;
+	RANGE_LOCK_ENTRY *granted;
+
+	for (tail = head; tail->next_granted; tail = tail->next_granted);
+
+	do {
+		entry = head;
+		if ((head = entry->next_granted) == NULL) {
+			tail = NULL;
+		}
+
+		granted = execute_request(test, (LOCK_REQUEST *) entry);
+		if (granted) {
+			if (tail) {
+				tail->next_granted = granted;
+			} else {
+				head = granted;
+			}
+
+			for (tail = granted; tail->next_granted; tail = tail->next_granted);
+		}
+	} while (head);
+}
+
+RANGE_LOCK_ENTRY *execute_request(LOCK_TEST *test, LOCK_REQUEST *request)
+{
+	RANGE_LOCK_ENTRY *granted;
+	ULONGLONG unit;
+	ULONGLONG first;
+	ULONGLONG last;
+	LONG value;
+	LONG add;
+
+	first = request->range.start / UNIT_SIZE;
+	last = request->range.end / UNIT_SIZE;
+
+	add = (request->range.exclusive) ? EXCLUSIVE_OWNER : 1;
+
+	/* A writer must be alone on its units, a reader must not see a writer. */
+	for (unit = first; unit < last; unit++) {
+		value = InterlockedExchangeAdd(&test->owners[unit], add) + add;
+
+		if ((request->range.exclusive) ? (value != EXCLUSIVE_OWNER) : (value >= EXCLUSIVE_OWNER)) {
+			InterlockedIncrement(&test->violations);
+		}
+	}
+
+	for (unit = first; unit < last; unit++) {
+		InterlockedExchangeAdd(&test->owners[unit], -add);
+	}
+
+	request->executions++;
+
+	granted = range_lock_release(&test->range_lock, &request->range);
+
+	/* The owner reuses the slot as soon as it sees the flag. */
+	InterlockedIncrement64(&test->completed);
+	InterlockedIncrement(&request->done);
+
+	return granted;
+}
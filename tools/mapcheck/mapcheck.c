@@ -0,0 +1,547 @@
+/*
+ * Test of the views of the disk in the address space of processes
+ * (IOCTL_RAMDISK_MAP, mapping.c) on Linux, where the chunks are mapped a
+ * second time with mmap()/mremap() instead of with an MDL. The chunks come
+ * from shared memory (port_share_memory()) placed on simulated nodes, the
+ * rest is the code of the driver. It checks that:
+ *   - the views and the requests (disk_io_transfer()) see each other's
+ *     writes, and the chunks never written read as zeros;
+ *   - the read-only views can't be written;
+ *   - the pinned chunks are not compressed, freed by trims or writes of
+ *     zeros, cloned nor dropped by a shrink;
+ *   - the views of an owner (a handle) go away with it, and with them the
+ *     pins, and the chunks of the writable ones are marked dirty.
+ * Then it compares random reads through a view with reads through the
+ * request path.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o mapcheck mapcheck.c ../common/tools.c \
+ *       ../../mapping.c ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c \
+ *       ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c ../../numa_layout.c \
+ *       ../../port_numa.c ../../port_page.c
+ *
+ * Usage: mapcheck [options]
+ *   -s size      Disk size (K, M and G suffixes; default 64M).
+ *   -b size      Block size of the reads, 512 bytes to 1 MB (default 4K).
+ *   -n count     Reads of each kind (default 1000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <setjmp.h>
+
+#include "port.h"
+#include "mapping.h"
+#include "disk_io.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-b size] [-n count]"
+#define MIN_BLOCK_SIZE                  512
+#define MAX_BLOCK_SIZE                  (1024 * 1024)
+#define SECTOR_SIZE                     512
+#define SIMULATED_NODES                 2
+
+typedef struct {
+	CHUNK_POOL    pool;
+	CHUNK_QUOTA   quota;
+	CHUNK_TABLE   chunk_table;
+	MAPPING_SET   mappings;
+	ATOMIC_BITMAP dirty_chunks;
+	ULONGLONG     disk_size;
+	ULONG         chunk_size;
+} MAP_DISK;
+
+static sigjmp_buf fault_jump;
+
+BOOLEAN check_coherence(MAP_DISK *disk);
+BOOLEAN check_read_only(MAP_DISK *disk);
+BOOLEAN check_pins(MAP_DISK *disk);
+BOOLEAN check_teardown(MAP_DISK *disk);
+void compare_reads(MAP_DISK *disk, ULONG block_size, ULONGLONG count);
+BOOLEAN faults(volatile UCHAR *p, BOOLEAN write);
+void on_fault(int sig);
+BOOLEAN transfer_equals(MAP_DISK *disk, ULONGLONG offset, const UCHAR *data, ULONG length);
+
+int main(int argc, char **argv)
+{
+	MAP_DISK disk;
+	ULONGLONG size;
+	ULONGLONG count;
+	ULONG block_size;
+	BOOLEAN ok;
+	int opt;
+
+	memset(&disk, 0, sizeof(disk));
+
+	disk.disk_size = 64ULL << 20;
+	block_size = 4096;
+	count = 1000000;
+
+	while ((opt = getopt(argc, argv, "s:b:n:")) != -1) {
+		switch (opt) {
+			case 's':
+				if ((!parse_size(optarg, &disk.disk_size)) || (disk.disk_size == 0) || (disk.disk_size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'b':
+				if ((!parse_size(optarg, &size)) || (size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE) || (size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				block_size = (ULONG) size;
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	disk.chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+
+	/* The checks use 8 chunks, the view of the comparison the whole disk. */
+	if ((optind != argc) || (disk.disk_size < 8ULL * disk.chunk_size) || (disk.disk_size > MAPPING_MAX_LENGTH) || (block_size > disk.disk_size)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	/* The memory of the chunks has to be mapped shared to be mapped again. */
+	port_share_memory();
+	port_simulate_nodes(SIMULATED_NODES);
+
+	if (!NT_SUCCESS(chunk_table_init(&disk.chunk_table, disk.disk_size, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Cannot create the disk.\n");
+		return 1;
+	}
+
+	/* The chunks come from a pool, as in the driver, placed on the nodes: port_alloc_node() memory. */
+	chunk_pool_init(&disk.pool, DEFAULT_CHUNK_SHIFT, 0, CHUNK_POOL_CACHE);
+	chunk_quota_init(&disk.quota, &disk.pool, 0);
+
+	chunk_table_set_quota(&disk.chunk_table, &disk.quota);
+	chunk_table_set_numa(&disk.chunk_table, NUMA_POLICY_INTERLEAVE, disk.chunk_size);
+
+	if ((!NT_SUCCESS(chunk_table_enable_compression(&disk.chunk_table))) ||
+		(!NT_SUCCESS(atomic_bitmap_init(&disk.dirty_chunks, disk.chunk_table.nchunks)))) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	mapping_set_init(&disk.mappings);
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "Views and requests see each other's writes", (check_coherence(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Read-only views can't be written", (check_read_only(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Pinned chunks stay in place", (check_pins(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Views go away with their owner", (check_teardown(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		compare_reads(&disk, block_size, count);
+	}
+
+	mapping_set_free(&disk.mappings);
+	atomic_bitmap_free(&disk.dirty_chunks);
+	chunk_table_free(&disk.chunk_table);
+	chunk_pool_free(&disk.pool);
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_coherence(MAP_DISK *disk)
+{
+	UCHAR *view;
+	UCHAR *data;
+	ULONGLONG offset;
+	ULONG length;
+	ULONG i;
+	int owner;
+	BOOLEAN ok;
+
+	/* Three chunks and a half, from the middle of a chunk: the view covers four chunks. */
+	offset = disk->chunk_size + 4096;
+	length = 3 * disk->chunk_size + disk->chunk_size / 2;
+
+	if ((data = (UCHAR *) malloc(length)) == NULL) {
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(mapping_create(&disk->mappings, &disk->chunk_table, &owner, offset, length, TRUE, (void **) &view))) {
+		free(data);
+		return FALSE;
+	}
+
+	/* Never written. */
+	memset(data, 0, length);
+	ok = (BOOLEAN) (memcmp(view, data, length) == 0);
+
+	/* A write request is seen in the view... */
+	for (i = 0; i < length; i++) {
+		data[i] = (UCHAR) (i * 7 + 1);
+	}
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(disk_io_transfer(&disk->chunk_table, REQUEST_WRITE, offset, data, length))) && (memcmp(view, data, length) == 0));
+
+	/* ...and a write through the view by the read requests, across the chunks. */
+	for (i = 0; i < length; i += 3) {
+		view[i] = (UCHAR) ~data[i];
+		data[i] = view[i];
+	}
+
+	ok = (BOOLEAN) (ok && (transfer_equals(disk, offset, data, length)));
+
+	/* The rest of the chunks of the view is the disk too. */
+	memset(view - 4096, 0x3c, 4096);
+	memset(data, 0x3c, 4096);
+	ok = (BOOLEAN) (ok && (transfer_equals(disk, disk->chunk_size, data, 4096)));
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(mapping_remove(&disk->mappings, &disk->chunk_table, &owner, view, &disk->dirty_chunks))));
+
+	/* The data stays on the disk after the view. */
+	ok = (BOOLEAN) (ok && (transfer_equals(disk, disk->chunk_size, data, 4096)) && (disk->chunk_table.npinned == 0));
+
+	free(data);
+
+	return ok;
+}
+
+BOOLEAN check_read_only(MAP_DISK *disk)
+{
+	UCHAR *view;
+	UCHAR *data;
+	ULONGLONG offset;
+	int owner;
+	BOOLEAN ok;
+
+	offset = 5ULL * disk->chunk_size;
+
+	if ((data = (UCHAR *) malloc(disk->chunk_size)) == NULL) {
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(mapping_create(&disk->mappings, &disk->chunk_table, &owner, offset, disk->chunk_size, FALSE, (void **) &view))) {
+		free(data);
+		return FALSE;
+	}
+
+	memset(data, 0x77, disk->chunk_size);
+
+	ok = (BOOLEAN) ((NT_SUCCESS(disk_io_transfer(&disk->chunk_table, REQUEST_WRITE, offset, data, disk->chunk_size))) && (memcmp(view, data, disk->chunk_size) == 0));
+
+	/* Read, but not written. */
+	ok = (BOOLEAN) (ok && (!faults(view + 100, FALSE)) && (faults(view + 100, TRUE)) && (transfer_equals(disk, offset, data, disk->chunk_size)));
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(mapping_remove(&disk->mappings, &disk->chunk_table, &owner, view, &disk->dirty_chunks))));
+
+	/* A read-only view doesn't dirty its chunks. */
+	ok = (BOOLEAN) (ok && (!atomic_bitmap_test(&disk->dirty_chunks, offset / disk->chunk_size)));
+
+	free(data);
+
+	return ok;
+}
+
+BOOLEAN check_pins(MAP_DISK *disk)
+{
+	CHUNK_TABLE clone;
+	CHUNK_TABLE_RESIZE resize;
+	UCHAR *view;
+	UCHAR *data;
+	UCHAR *zeros;
+	ULONGLONG first;
+	ULONGLONG index;
+	ULONGLONG i;
+	ULONGLONG offset;
+	int owner;
+	BOOLEAN ok;
+
+	first = 6;
+	offset = first * disk->chunk_size;
+
+	if (((data = (UCHAR *) malloc(disk->chunk_size)) == NULL) || ((zeros = (UCHAR *) calloc(1, disk->chunk_size)) == NULL)) {
+		free(data);
+		return FALSE;
+	}
+
+	/* Compressible chunks around the view, and in it. */
+	memset(data, 0x11, disk->chunk_size);
+
+	for (i = 0; i < 8; i++) {
+		disk_io_transfer(&disk->chunk_table, REQUEST_WRITE, i * disk->chunk_size, data, disk->chunk_size);
+	}
+
+	if (!NT_SUCCESS(mapping_create(&disk->mappings, &disk->chunk_table, &owner, offset, 2 * disk->chunk_size, TRUE, (void **) &view))) {
+		free(zeros);
+		free(data);
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) (disk->chunk_table.npinned == 2);
+
+	/* The clock never picks the pinned chunks, and they are not compressed if asked. */
+	for (i = 0; i < 2 * disk->chunk_table.nchunks; i++) {
+		if (chunk_table_next_victim(&disk->chunk_table, CHUNK_COMPRESSED | CHUNK_INCOMPRESSIBLE, &index)) {
+			if ((index >= first) && (index < first + 2)) {
+				ok = FALSE;
+			}
+
+			chunk_table_compress(&disk->chunk_table, index);
+		}
+	}
+
+	ok = (BOOLEAN) (ok && (!chunk_table_compress(&disk->chunk_table, first)) && (chunk_table_get_chunk(&disk->chunk_table, first - 1)->flags & CHUNK_COMPRESSED));
+
+	/* A trim or a write of zeros of the whole chunk zeroes it in place. */
+	chunk_table_trim(&disk->chunk_table, offset, disk->chunk_size);
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->chunk_table, first)->data) && (memcmp(view, zeros, disk->chunk_size) == 0));
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(disk_io_transfer(&disk->chunk_table, REQUEST_WRITE, offset + disk->chunk_size, zeros, disk->chunk_size))));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->chunk_table, first + 1)->data) && (memcmp(view + disk->chunk_size, zeros, disk->chunk_size) == 0));
+
+	/* The view keeps working after them. */
+	memset(view, 0x42, disk->chunk_size);
+	memset(data, 0x42, disk->chunk_size);
+	ok = (BOOLEAN) (ok && (transfer_equals(disk, offset, data, disk->chunk_size)));
+
+	/* No clone, no shrink below the view. */
+	ok = (BOOLEAN) (ok && (chunk_table_clone(&clone, &disk->chunk_table) == STATUS_DEVICE_BUSY));
+
+	if (NT_SUCCESS(chunk_table_prepare_resize(&disk->chunk_table, offset, &resize))) {
+		ok = (BOOLEAN) (ok && (chunk_table_resize(&disk->chunk_table, &resize) == STATUS_DEVICE_BUSY));
+		chunk_table_end_resize(&resize);
+	} else {
+		ok = FALSE;
+	}
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(mapping_remove(&disk->mappings, &disk->chunk_table, &owner, view, &disk->dirty_chunks))));
+
+	/* Unpinned, the chunks are candidates again, and the table can be cloned. */
+	ok = (BOOLEAN) (ok && (disk->chunk_table.npinned == 0) && (chunk_table_compress(&disk->chunk_table, first)));
+
+	if ((ok) && (NT_SUCCESS(chunk_table_clone(&clone, &disk->chunk_table)))) {
+		chunk_table_free(&clone);
+	} else {
+		ok = FALSE;
+	}
+
+	ok = (BOOLEAN) (ok && (transfer_equals(disk, offset, data, disk->chunk_size)));
+
+	free(zeros);
+	free(data);
+
+	return ok;
+}
+
+BOOLEAN check_teardown(MAP_DISK *disk)
+{
+	UCHAR *views[3];
+	UCHAR *data;
+	int owners[2];
+	BOOLEAN ok;
+
+	if ((data = (UCHAR *) malloc(disk->chunk_size)) == NULL) {
+		return FALSE;
+	}
+
+	atomic_bitmap_clear_range(&disk->dirty_chunks, 0, disk->dirty_chunks.nbits);
+
+	/* Two views of the first owner (one overlapping the other) and one of the second. */
+	if ((!NT_SUCCESS(mapping_create(&disk->mappings, &disk->chunk_table, &owners[0], 0, 2 * disk->chunk_size, TRUE, (void **) &views[0]))) ||
+		(!NT_SUCCESS(mapping_create(&disk->mappings, &disk->chunk_table, &owners[0], disk->chunk_size, disk->chunk_size, FALSE, (void **) &views[1]))) ||
+		(!NT_SUCCESS(mapping_create(&disk->mappings, &disk->chunk_table, &owners[1], disk->chunk_size, 2 * disk->chunk_size, TRUE, (void **) &views[2])))) {
+		free(data);
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) ((mapping_count(&disk->mappings) == 3) && (disk->chunk_table.npinned == 3));
+
+	/* The same chunk in three views. */
+	views[0][disk->chunk_size] = 0x99;
+	ok = (BOOLEAN) (ok && (views[1][0] == 0x99) && (views[2][0] == 0x99));
+
+	/* Only the views of an owner are found by it. */
+	ok = (BOOLEAN) (ok && (mapping_remove(&disk->mappings, &disk->chunk_table, &owners[1], views[0], &disk->dirty_chunks) == STATUS_INVALID_PARAMETER));
+
+	/* The first handle is closed. */
+	mapping_remove_owner(&disk->mappings, &disk->chunk_table, &owners[0], &disk->dirty_chunks);
+
+	ok = (BOOLEAN) (ok && (mapping_count(&disk->mappings) == 1) && (disk->chunk_table.npinned == 2));
+	ok = (BOOLEAN) (ok && (faults(views[0], FALSE)) && (faults(views[1], FALSE)) && (!faults(views[2], TRUE)));
+	ok = (BOOLEAN) (ok && (atomic_bitmap_test(&disk->dirty_chunks, 0)) && (atomic_bitmap_test(&disk->dirty_chunks, 1)) && (!atomic_bitmap_test(&disk->dirty_chunks, 2)));
+
+	/* The checkpoints see the writable views which are still there. */
+	mapping_mark_dirty(&disk->mappings, &disk->dirty_chunks);
+	ok = (BOOLEAN) (ok && (atomic_bitmap_test(&disk->dirty_chunks, 2)));
+
+	memset(views[2] + disk->chunk_size, 0x55, disk->chunk_size);
+
+	mapping_remove_owner(&disk->mappings, &disk->chunk_table, &owners[1], &disk->dirty_chunks);
+
+	ok = (BOOLEAN) (ok && (mapping_count(&disk->mappings) == 0) && (disk->chunk_table.npinned == 0) && (faults(views[2], FALSE)));
+
+	memset(data, 0x55, disk->chunk_size);
+	ok = (BOOLEAN) (ok && (transfer_equals(disk, 2ULL * disk->chunk_size, data, disk->chunk_size)));
+
+	free(data);
+
+	return ok;
+}
+
+void compare_reads(MAP_DISK *disk, ULONG block_size, ULONGLONG count)
+{
+	UCHAR *view;
+	UCHAR *buffer;
+	ULONGLONG nblocks;
+	ULONGLONG offset;
+	ULONGLONG seed;
+	ULONGLONG start;
+	ULONGLONG elapsed[3];
+	ULONGLONG sum;
+	ULONGLONG i;
+	ULONG k;
+	ULONG kind;
+	int owner;
+
+	static const char *kinds[] = {"request (copy)", "view (copy)", "view (in place)"};
+
+	if ((buffer = (UCHAR *) malloc(block_size)) == NULL) {
+		return;
+	}
+
+	/* The whole disk, written, in a single view. */
+	memset(buffer, 0xa5, block_size);
+
+	for (offset = 0; offset + block_size <= disk->disk_size; offset += block_size) {
+		disk_io_transfer(&disk->chunk_table, REQUEST_WRITE, offset, buffer, block_size);
+	}
+
+	if (!NT_SUCCESS(mapping_create(&disk->mappings, &disk->chunk_table, &owner, 0, disk->disk_size, FALSE, (void **) &view))) {
+		free(buffer);
+		return;
+	}
+
+	nblocks = disk->disk_size / block_size;
+	sum = 0;
+
+	for (kind = 0; kind < 3; kind++) {
+		seed = RANDOM_SEED;
+		start = port_timestamp();
+
+		for (i = 0; i < count; i++) {
+			next_random(&seed);
+
+			offset = (seed % nblocks) * block_size;
+
+			/* The data is used, one word per cache line, in all the cases. */
+			if (kind == 0) {
+				disk_io_transfer(&disk->chunk_table, REQUEST_READ, offset, buffer, block_size);
+
+				for (k = 0; k < block_size; k += 64) {
+					sum += buffer[k];
+				}
+			} else if (kind == 1) {
+				memcpy(buffer, view + offset, block_size);
+
+				for (k = 0; k < block_size; k += 64) {
+					sum += buffer[k];
+				}
+			} else {
+				for (k = 0; k < block_size; k += 64) {
+					sum += view[offset + k];
+				}
+			}
+		}
+
+		elapsed[kind] = port_timestamp() - start;
+	}
+
+	printf("\n%-20s %12s %12s\n", "Reads", "ns/read", "GB/s");
+
+	for (kind = 0; kind < 3; kind++) {
+		printf("%-20s %12.1f %12.2f\n",
+			   kinds[kind],
+			   (double) elapsed[kind] / (double) count,
+			   (double) count * block_size / (double) elapsed[kind]);
+	}
+
+	/* Keeps the sums from being optimized away. */
+	if (sum == 0) {
+		printf("(no data)\n");
+	}
+
+	mapping_remove(&disk->mappings, &disk->chunk_table, &owner, view, &disk->dirty_chunks);
+
+	free(buffer);
+}
+
+BOOLEAN faults(volatile UCHAR *p, BOOLEAN write)
+{
+	struct sigaction action;
+	struct sigaction old_segv;
+	struct sigaction old_bus;
+	BOOLEAN faulted;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_fault;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGSEGV, &action, &old_segv);
+	sigaction(SIGBUS, &action, &old_bus);
+
+	if (sigsetjmp(fault_jump, 1) == 0) {
+		if (write) {
+			*p = *p;
+		} else {
+			(void) *p;
+		}
+
+		faulted = FALSE;
+	} else {
+		faulted = TRUE;
+	}
+
+	sigaction(SIGSEGV, &old_segv, NULL);
+	sigaction(SIGBUS, &old_bus, NULL);
+
+	return faulted;
+}
+
+void on_fault(int sig)
+{
+	(void) sig;
+
+	siglongjmp(fault_jump, 1);
+}
+
+BOOLEAN transfer_equals(MAP_DISK *disk, ULONGLONG offset, const UCHAR *data, ULONG length)
+{
+	UCHAR *buffer;
+	BOOLEAN equal;
+
+	if ((buffer = (UCHAR *) malloc(length)) == NULL) {
+		return FALSE;
+	}
+
+	equal = (BOOLEAN) ((NT_SUCCESS(disk_io_transfer(&disk->chunk_table, REQUEST_READ, offset, buffer, length))) && (memcmp(buffer, data, length) == 0));
+
+	free(buffer);
+
+	return equal;
+}
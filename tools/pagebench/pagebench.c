@@ -0,0 +1,150 @@
+/*
+ * Random reads on Linux over a disk whose chunks come from small pages and
+ * then from large pages (chunk_pool_use_large_pages()), with the same
+ * sequence of offsets, to measure what the TLB misses cost.
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o pagebench pagebench.c ../common/tools.c \
+ *       ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c ../../bitmap.c \
+ *       ../../zero.c ../../copy.c ../../lz.c ../../numa_layout.c \
+ *       ../../port_numa.c ../../port_page.c
+ * The large pages come from hugetlbfs if some are reserved
+ * (echo N > /proc/sys/vm/nr_hugepages, N pages of 2 MB), or else are
+ * transparent huge pages, unless those are disabled.
+ * Usage: pagebench [disk_mb [reads [block_size]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "disk_io.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[disk_mb [reads [block_size]]]"
+#define DEFAULT_DISK_SIZE               4096 /* MB. */
+#define DEFAULT_READS                   10000000
+#define DEFAULT_BLOCK_SIZE              4096
+#define FILL_BLOCK_SIZE                 (1024 * 1024)
+#define SEED                            0x9e3779b97f4a7c15ULL
+
+double measure(ULONGLONG disk_size, ULONGLONG nreads, ULONG block_size, BOOLEAN large_pages);
+void print_transparent_huge_pages(void);
+
+int main(int argc, char **argv)
+{
+	ULONGLONG disk_size;
+	ULONGLONG nreads;
+	ULONG block_size;
+	double small;
+	double large;
+
+	disk_size = (ULONGLONG) ((argc > 1) ? atoi(argv[1]) : DEFAULT_DISK_SIZE) << 20;
+	nreads = (argc > 2) ? (ULONGLONG) atoll(argv[2]) : DEFAULT_READS;
+	block_size = (argc > 3) ? (ULONG) atoi(argv[3]) : DEFAULT_BLOCK_SIZE;
+
+	if ((disk_size == 0) || (nreads == 0) || (block_size == 0) || (block_size % 512 != 0) || (block_size > FILL_BLOCK_SIZE) || (disk_size < FILL_BLOCK_SIZE)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	print_transparent_huge_pages();
+
+	printf("%" PRIu64 " random reads of %lu bytes over %" PRIu64 " MB\n", nreads, (unsigned long) block_size, disk_size >> 20);
+
+	small = measure(disk_size, nreads, block_size, FALSE);
+	large = measure(disk_size, nreads, block_size, TRUE);
+
+	printf("Gain: %.1f%%\n", ((small / large) - 1.0) * 100.0);
+
+	return 0;
+}
+
+/* Returns the nanoseconds per read. */
+double measure(ULONGLONG disk_size, ULONGLONG nreads, ULONG block_size, BOOLEAN large_pages)
+{
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quota;
+	CHUNK_TABLE table;
+	UCHAR *buffer;
+	ULONGLONG nblocks;
+	ULONGLONG offset;
+	ULONGLONG state;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG i;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, disk_size, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Cannot create the disk.\n");
+		exit(1);
+	}
+
+	chunk_pool_init(&pool, DEFAULT_CHUNK_SHIFT, 0, CHUNK_POOL_CACHE);
+	chunk_quota_init(&quota, &pool, 0);
+
+	if (large_pages) {
+		chunk_pool_use_large_pages(&pool);
+	}
+
+	chunk_table_set_quota(&table, &quota);
+
+	if ((buffer = (UCHAR *) malloc(FILL_BLOCK_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	/* Every chunk is allocated, so that the reads touch memory. */
+	memset(buffer, 0xa5, FILL_BLOCK_SIZE);
+
+	for (offset = 0; offset + FILL_BLOCK_SIZE <= disk_size; offset += FILL_BLOCK_SIZE) {
+		if (!NT_SUCCESS(disk_io_transfer(&table, REQUEST_WRITE, offset, buffer, FILL_BLOCK_SIZE))) {
+			fprintf(stderr, "Cannot fill the disk.\n");
+			exit(1);
+		}
+	}
+
+	nblocks = disk_size / block_size;
+	state = SEED;
+
+	start = port_timestamp();
+
+	for (i = 0; i < nreads; i++) {
+		/* The same offsets on every run. */
+		next_random(&state);
+
+		disk_io_transfer(&table, REQUEST_READ, (state % nblocks) * block_size, buffer, block_size);
+	}
+
+	elapsed = port_timestamp() - start;
+
+	printf("%-12s %8.1f ns/read %10.0f reads/s", large_pages ? "Large pages:" : "Small pages:", (double) elapsed / (double) nreads, (double) nreads * 1e9 / (double) elapsed);
+
+	if (large_pages) {
+		printf(" (%" PRIu64 " of %" PRIu64 " MB in large pages)", chunk_pool_large_bytes(&pool) >> 20, chunk_pool_block_bytes(&pool) >> 20);
+	}
+
+	printf("\n");
+
+	free(buffer);
+	chunk_table_free(&table);
+	chunk_pool_free(&pool);
+
+	return (double) elapsed / (double) nreads;
+}
+
+/* With "always" the small pages might be merged in huge pages too. */
+void print_transparent_huge_pages(void)
+{
+	char mode[128];
+	FILE *file;
+
+	if ((file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) == NULL) {
+		return;
+	}
+
+	if (fgets(mode, sizeof(mode), file)) {
+		printf("Transparent huge pages: %s", mode);
+	}
+
+	fclose(file);
+}
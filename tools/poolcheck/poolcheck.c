@@ -0,0 +1,667 @@
+/*
+ * Test of the chunk pool and of the disk quotas (chunk_pool.c) on Linux.
+ * It checks that:
+ *   - a quota allocates up to its limit and then fails with
+ *     STATUS_DISK_FULL, charging nothing, unless forced; the chunks
+ *     released can be allocated again;
+ *   - the limit of the pool applies to all its quotas together, and a
+ *     quota charged for an allocation the pool refuses is uncharged;
+ *   - a disk over its quota fails its writes with STATUS_DISK_FULL and
+ *     leaves the chunks without data, while the writes of zeros, the writes
+ *     of chunks which have data and the loads of chunks (data already on
+ *     the disk) still succeed; a trim makes room again;
+ *   - each node (and PORT_NO_NODE) keeps its own free list of at most
+ *     "max_free" chunks, a chunk is reused on the node it was released on
+ *     only, and the chunks placed on each node are counted per quota, also
+ *     for a disk interleaved on the nodes;
+ *   - the chunks carved from blocks (large pages, or small pages when
+ *     there are none) are all kept, and the blocks are only allocated when
+ *     their chunks are used up;
+ *   - threads allocating and releasing against a quota never hold more
+ *     chunks than its limit, and leave nothing charged.
+ * Then it measures the allocations (and releases) per second from 1 to
+ * "max_threads" threads, with the free lists, without them and from blocks.
+ * The nodes are simulated.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o poolcheck poolcheck.c ../common/tools.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ *
+ * Usage: poolcheck [options]
+ *   -t threads   Maximum number of threads (default: processors, at least 4).
+ *   -n count     Allocations per thread (default 1000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "chunk_pool.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-t threads] [-n count]"
+#define CHUNK_SHIFT                     12 /* Small chunks: many of them in a large page. */
+#define CHUNK_SIZE                      (1UL << CHUNK_SHIFT)
+#define QUOTA_CHUNKS                    64
+#define NNODES                          4
+#define MAX_FREE                        8
+#define MAX_THREADS                     64
+#define MAX_HELD                        16 /* Chunks held by a thread. */
+
+#define MODE_FREE_LISTS                 0
+#define MODE_NO_FREE_LISTS              1
+#define MODE_BLOCKS                     2
+
+typedef struct {
+	CHUNK_QUOTA       *quota;
+	pthread_t         thread;
+	ULONG             id;
+	ULONGLONG         count;
+	ULONGLONG         seed;
+	volatile LONGLONG *held;     /* Chunks held by all the threads. */
+	BOOLEAN           ok;
+} POOL_THREAD;
+
+BOOLEAN check_quota(void);
+BOOLEAN check_pool_limit(void);
+BOOLEAN check_disk_full(void);
+BOOLEAN check_nodes(void);
+BOOLEAN check_blocks(void);
+BOOLEAN check_threads(ULONG nthreads, ULONGLONG count);
+double measure(ULONG nthreads, ULONGLONG count, int mode);
+void run_threads(POOL_THREAD *threads, ULONG nthreads, void *(*routine)(void *));
+void *alloc_release(void *arg);
+void *alloc_release_fast(void *arg);
+BOOLEAN alloc_chunks(CHUNK_QUOTA *quota, ULONG node, ULONG count, UCHAR **chunks);
+
+int main(int argc, char **argv)
+{
+	ULONGLONG count;
+	ULONG max_threads;
+	ULONG nthreads;
+	double rates[3];
+	BOOLEAN ok;
+	int mode;
+	int opt;
+
+	max_threads = port_cpu_count();
+	if (max_threads < 4) {
+		max_threads = 4;
+	} else if (max_threads > MAX_THREADS) {
+		max_threads = MAX_THREADS;
+	}
+
+	count = 1000000;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+			case 't':
+				if (((max_threads = (ULONG) atoi(optarg)) == 0) || (max_threads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	port_simulate_nodes(NNODES);
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "A quota fails with STATUS_DISK_FULL at its limit", (check_quota()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "The limit of the pool covers all its quotas", (check_pool_limit()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "A full disk fails the writes which need memory", (check_disk_full()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Each node has its own free list and counts", (check_nodes()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "The chunks of the blocks are all kept", (check_blocks()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Threads never hold more than the quota", (check_threads(max_threads, count / 10)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		printf("\nAllocations per second (millions), %u KB chunks, %u processors:\n", (ULONG) (CHUNK_SIZE >> 10), port_cpu_count());
+		printf("%8s %12s %12s %12s\n", "Threads", "Free lists", "No lists", "Blocks");
+
+		for (nthreads = 1; nthreads <= max_threads; nthreads = (nthreads < 4) ? nthreads + 1 : nthreads * 2) {
+			for (mode = MODE_FREE_LISTS; mode <= MODE_BLOCKS; mode++) {
+				rates[mode] = measure(nthreads, count, mode);
+			}
+
+			printf("%8u %12.2f %12.2f %12.2f\n", nthreads, rates[MODE_FREE_LISTS], rates[MODE_NO_FREE_LISTS], rates[MODE_BLOCKS]);
+		}
+	}
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_quota(void)
+{
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quota;
+	UCHAR *chunks[QUOTA_CHUNKS + 2];
+	UCHAR *data;
+	ULONG i;
+	BOOLEAN ok;
+
+	chunk_pool_init(&pool, CHUNK_SHIFT, 0, MAX_FREE);
+
+	/* The limit is rounded down to whole chunks. */
+	chunk_quota_init(&quota, &pool, QUOTA_CHUNKS * CHUNK_SIZE + CHUNK_SIZE - 1);
+
+	ok = (BOOLEAN) ((quota.limit == QUOTA_CHUNKS) && (alloc_chunks(&quota, PORT_NO_NODE, QUOTA_CHUNKS, chunks)));
+
+	/* Full: refused and not charged, unless forced. */
+	ok = (BOOLEAN) (ok && (chunk_pool_alloc(&quota, PORT_NO_NODE, FALSE, &data) == STATUS_DISK_FULL));
+	ok = (BOOLEAN) (ok && (chunk_pool_alloc(&quota, 0, FALSE, &data) == STATUS_DISK_FULL));
+	ok = (BOOLEAN) (ok && (quota.used == QUOTA_CHUNKS) && (pool.used == QUOTA_CHUNKS) && (quota.node_used[0] == 0));
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_pool_alloc(&quota, PORT_NO_NODE, TRUE, &chunks[QUOTA_CHUNKS]))));
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_pool_alloc(&quota, PORT_NO_NODE, TRUE, &chunks[QUOTA_CHUNKS + 1]))));
+	ok = (BOOLEAN) (ok && (chunk_quota_used(&quota) == (QUOTA_CHUNKS + 2) * CHUNK_SIZE));
+
+	/* Over the limit, until two chunks below it. */
+	if (ok) {
+		chunk_pool_release(&quota, PORT_NO_NODE, chunks[QUOTA_CHUNKS + 1]);
+		chunk_pool_release(&quota, PORT_NO_NODE, chunks[QUOTA_CHUNKS]);
+		chunk_pool_release(&quota, PORT_NO_NODE, chunks[0]);
+
+		ok = (BOOLEAN) (NT_SUCCESS(chunk_pool_alloc(&quota, PORT_NO_NODE, FALSE, &chunks[0])));
+		ok = (BOOLEAN) (ok && (chunk_pool_alloc(&quota, PORT_NO_NODE, FALSE, &data) == STATUS_DISK_FULL));
+	}
+
+	if (ok) {
+		for (i = 0; i < QUOTA_CHUNKS; i++) {
+			chunk_pool_release(&quota, PORT_NO_NODE, chunks[i]);
+		}
+	}
+
+	ok = (BOOLEAN) (ok && (quota.used == 0) && (pool.used == 0));
+
+	/* No limit: only the memory limits. */
+	chunk_quota_init(&quota, &pool, 0);
+
+	ok = (BOOLEAN) (ok && (alloc_chunks(&quota, PORT_NO_NODE, QUOTA_CHUNKS + 2, chunks)));
+
+	if (ok) {
+		for (i = 0; i < QUOTA_CHUNKS + 2; i++) {
+			chunk_pool_release(&quota, PORT_NO_NODE, chunks[i]);
+		}
+	}
+
+	chunk_pool_free(&pool);
+
+	return ok;
+}
+
+BOOLEAN check_pool_limit(void)
+{
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quotas[2];
+	UCHAR *chunks[2][QUOTA_CHUNKS];
+	UCHAR *data;
+	ULONG i;
+	BOOLEAN ok;
+
+	/* Two disks of QUOTA_CHUNKS, one pool of QUOTA_CHUNKS + QUOTA_CHUNKS / 2. */
+	chunk_pool_init(&pool, CHUNK_SHIFT, (QUOTA_CHUNKS + QUOTA_CHUNKS / 2) * CHUNK_SIZE, MAX_FREE);
+	chunk_quota_init(&quotas[0], &pool, QUOTA_CHUNKS * CHUNK_SIZE);
+	chunk_quota_init(&quotas[1], &pool, QUOTA_CHUNKS * CHUNK_SIZE);
+
+	/* The first disk takes its whole quota, the second one gets what is left. */
+	ok = (BOOLEAN) ((alloc_chunks(&quotas[0], PORT_NO_NODE, QUOTA_CHUNKS, chunks[0])) && (alloc_chunks(&quotas[1], PORT_NO_NODE, QUOTA_CHUNKS / 2, chunks[1])));
+
+	ok = (BOOLEAN) (ok && (chunk_pool_alloc(&quotas[1], PORT_NO_NODE, FALSE, &data) == STATUS_DISK_FULL));
+	ok = (BOOLEAN) (ok && (quotas[1].used == QUOTA_CHUNKS / 2) && (pool.used == QUOTA_CHUNKS + QUOTA_CHUNKS / 2));
+
+	/* The limits are not reservations: what the first disk releases goes to the second one. */
+	if (ok) {
+		for (i = 0; i < QUOTA_CHUNKS / 2; i++) {
+			chunk_pool_release(&quotas[0], PORT_NO_NODE, chunks[0][QUOTA_CHUNKS / 2 + i]);
+		}
+
+		ok = (BOOLEAN) (alloc_chunks(&quotas[1], PORT_NO_NODE, QUOTA_CHUNKS / 2, chunks[1] + QUOTA_CHUNKS / 2));
+		ok = (BOOLEAN) (ok && (chunk_pool_alloc(&quotas[0], PORT_NO_NODE, FALSE, &data) == STATUS_DISK_FULL));
+		ok = (BOOLEAN) (ok && (quotas[0].used == QUOTA_CHUNKS / 2) && (quotas[1].used == QUOTA_CHUNKS));
+	}
+
+	if (ok) {
+		for (i = 0; i < QUOTA_CHUNKS; i++) {
+			chunk_pool_release(&quotas[1], PORT_NO_NODE, chunks[1][i]);
+		}
+
+		for (i = 0; i < QUOTA_CHUNKS / 2; i++) {
+			chunk_pool_release(&quotas[0], PORT_NO_NODE, chunks[0][i]);
+		}
+	}
+
+	ok = (BOOLEAN) (ok && (pool.used == 0) && (quotas[0].used == 0) && (quotas[1].used == 0));
+
+	chunk_pool_free(&pool);
+
+	return ok;
+}
+
+BOOLEAN check_disk_full(void)
+{
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quota;
+	CHUNK_TABLE table;
+	UCHAR buffer[CHUNK_SIZE];
+	UCHAR zeros[CHUNK_SIZE];
+	ULONGLONG index;
+	BOOLEAN ok;
+
+	chunk_pool_init(&pool, CHUNK_SHIFT, 0, MAX_FREE);
+	chunk_quota_init(&quota, &pool, QUOTA_CHUNKS * CHUNK_SIZE);
+
+	if (!NT_SUCCESS(chunk_table_init(&table, 4 * QUOTA_CHUNKS * CHUNK_SIZE, CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	chunk_table_set_quota(&table, &quota);
+
+	memset(buffer, 0x5a, sizeof(buffer));
+	memset(zeros, 0, sizeof(zeros));
+
+	ok = TRUE;
+
+	for (index = 0; (ok) && (index < QUOTA_CHUNKS); index++) {
+		ok = (BOOLEAN) (NT_SUCCESS(chunk_table_write(&table, index * CHUNK_SIZE, buffer, CHUNK_SIZE)));
+	}
+
+	/* A new chunk is refused, even for a sector; the chunk stays without data. */
+	ok = (BOOLEAN) (ok && (chunk_table_write(&table, index * CHUNK_SIZE + 512, buffer, 512) == STATUS_DISK_FULL));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&table, index)->data == NULL) && (quota.used == QUOTA_CHUNKS));
+
+	/* A write crossing into a new chunk writes the first part only. */
+	ok = (BOOLEAN) (ok && (chunk_table_write(&table, index * CHUNK_SIZE - 512, buffer, 1024) == STATUS_DISK_FULL));
+
+	/* No memory needed: zeros, and chunks which have data. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, (index + 1) * CHUNK_SIZE, zeros, CHUNK_SIZE))));
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, 3 * CHUNK_SIZE + 100, zeros, 1000))));
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, 5 * CHUNK_SIZE, buffer, CHUNK_SIZE))));
+
+	/* Data already on the disk always finds room. */
+	chunk_table_get_chunk(&table, index + 2)->flags |= CHUNK_NOT_LOADED;
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_load_chunk(&table, index + 2, buffer))) && (quota.used == QUOTA_CHUNKS + 1));
+
+	/* A trim of two chunks makes room for one. */
+	chunk_table_trim(&table, 0, 2 * CHUNK_SIZE);
+
+	ok = (BOOLEAN) (ok && (quota.used == QUOTA_CHUNKS - 1));
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_write(&table, index * CHUNK_SIZE, buffer, CHUNK_SIZE))));
+	ok = (BOOLEAN) (ok && (chunk_table_write(&table, (index + 3) * CHUNK_SIZE, buffer, CHUNK_SIZE) == STATUS_DISK_FULL));
+
+	/* What was refused reads as zeros. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_read(&table, (index + 3) * CHUNK_SIZE, buffer, CHUNK_SIZE))) && (memcmp(buffer, zeros, CHUNK_SIZE) == 0));
+
+	chunk_table_free(&table);
+
+	ok = (BOOLEAN) (ok && (quota.used == 0) && (pool.used == 0));
+
+	chunk_pool_free(&pool);
+
+	return ok;
+}
+
+BOOLEAN check_nodes(void)
+{
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quota;
+	CHUNK_TABLE table;
+	UCHAR *chunks[NNODES + 1][2 * MAX_FREE];
+	UCHAR *data;
+	UCHAR buffer[CHUNK_SIZE];
+	ULONGLONG index;
+	ULONG node;
+	ULONG n;
+	ULONG i;
+	BOOLEAN ok;
+
+	chunk_pool_init(&pool, CHUNK_SHIFT, 0, MAX_FREE);
+	chunk_quota_init(&quota, &pool, 0);
+
+	ok = (BOOLEAN) (port_node_count() == NNODES);
+
+	/* Node n is chunks[n + 1], PORT_NO_NODE chunks[0]; twice as many chunks as the lists keep. */
+	for (n = 0; (ok) && (n <= NNODES); n++) {
+		ok = (BOOLEAN) (alloc_chunks(&quota, n - 1, 2 * MAX_FREE, chunks[n]));
+	}
+
+	for (n = 0; (ok) && (n < NNODES); n++) {
+		ok = (BOOLEAN) (quota.node_used[n] == 2 * MAX_FREE);
+	}
+
+	ok = (BOOLEAN) (ok && (quota.used == (NNODES + 1) * 2 * MAX_FREE));
+
+	/* Each list keeps "max_free" chunks, the others are freed. */
+	if (ok) {
+		for (n = 0; n <= NNODES; n++) {
+			for (i = 0; i < 2 * MAX_FREE; i++) {
+				chunk_pool_release(&quota, n - 1, chunks[n][i]);
+			}
+		}
+	}
+
+	for (n = 0; (ok) && (n <= NNODES); n++) {
+		ok = (BOOLEAN) (pool.free_lists[n].nfree == MAX_FREE);
+	}
+
+	for (n = 0; (ok) && (n < NNODES); n++) {
+		ok = (BOOLEAN) (quota.node_used[n] == 0);
+	}
+
+	/* A node gets back its own chunks (the first ones released), never those of another node. */
+	for (n = 0; (ok) && (n <= NNODES); n++) {
+		for (i = 0; (ok) && (i < MAX_FREE); i++) {
+			ok = (BOOLEAN) (NT_SUCCESS(chunk_pool_alloc(&quota, n - 1, FALSE, &data)));
+			ok = (BOOLEAN) (ok && (data == chunks[n][MAX_FREE - 1 - i]));
+
+			chunks[n][MAX_FREE - 1 - i] = data;
+		}
+
+		ok = (BOOLEAN) (ok && (pool.free_lists[n].nfree == 0));
+	}
+
+	if (ok) {
+		for (n = 0; n <= NNODES; n++) {
+			for (i = 0; i < MAX_FREE; i++) {
+				chunk_pool_release(&quota, n - 1, chunks[n][i]);
+			}
+		}
+	}
+
+	/* A disk interleaved on the nodes: each node gets its share. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_init(&table, NNODES * QUOTA_CHUNKS * CHUNK_SIZE, CHUNK_SHIFT))));
+
+	if (ok) {
+		chunk_table_set_quota(&table, &quota);
+		chunk_table_set_numa(&table, NUMA_POLICY_INTERLEAVE, 4 * CHUNK_SIZE);
+
+		memset(buffer, 0x5a, sizeof(buffer));
+
+		for (index = 0; (ok) && (index < table.nchunks); index++) {
+			ok = (BOOLEAN) (NT_SUCCESS(chunk_table_write(&table, index * CHUNK_SIZE, buffer, CHUNK_SIZE)));
+			ok = (BOOLEAN) (ok && (chunk_table_node(&table, index) == (ULONG) ((index / 4) % NNODES)));
+		}
+
+		for (node = 0; (ok) && (node < NNODES); node++) {
+			ok = (BOOLEAN) (chunk_quota_node_used(&quota, node) == QUOTA_CHUNKS * CHUNK_SIZE);
+		}
+
+		chunk_table_free(&table);
+	}
+
+	for (node = 0; (ok) && (node < NNODES); node++) {
+		ok = (BOOLEAN) (quota.node_used[node] == 0);
+	}
+
+	ok = (BOOLEAN) (ok && (quota.used == 0) && (pool.used == 0));
+
+	chunk_pool_free(&pool);
+
+	return ok;
+}
+
+BOOLEAN check_blocks(void)
+{
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quota;
+	UCHAR **chunks;
+	ULONG per_block;
+	ULONG i;
+	BOOLEAN ok;
+
+	per_block = (ULONG) (PORT_LARGE_PAGE_SIZE >> CHUNK_SHIFT);
+
+	if ((chunks = (UCHAR **) malloc(2 * per_block * sizeof(UCHAR *))) == NULL) {
+		return FALSE;
+	}
+
+	chunk_pool_init(&pool, CHUNK_SHIFT, 0, MAX_FREE);
+	chunk_pool_use_large_pages(&pool);
+	chunk_quota_init(&quota, &pool, 0);
+
+	/* One block for the first chunks, the second one with the first chunk past them. */
+	ok = (BOOLEAN) ((alloc_chunks(&quota, 0, per_block, chunks)) && (pool.nblocks == 1) && (pool.free_lists[1].nfree == 0));
+	ok = (BOOLEAN) (ok && (alloc_chunks(&quota, 0, 1, chunks + per_block)) && (pool.nblocks == 2) && (pool.free_lists[1].nfree == per_block - 1));
+
+	/* The chunks are consecutive in the block, in order. */
+	for (i = 1; (ok) && (i < per_block); i++) {
+		ok = (BOOLEAN) (chunks[i] == chunks[0] + (SIZE_T) i * CHUNK_SIZE);
+	}
+
+	/* Every chunk is kept, whatever "max_free". */
+	if (ok) {
+		for (i = 0; i <= per_block; i++) {
+			chunk_pool_release(&quota, 0, chunks[i]);
+		}
+	}
+
+	ok = (BOOLEAN) (ok && (pool.free_lists[1].nfree == 2 * per_block) && (pool.used == 0));
+	ok = (BOOLEAN) (ok && (chunk_pool_block_bytes(&pool) == 2 * PORT_LARGE_PAGE_SIZE) && (chunk_pool_large_bytes(&pool) <= chunk_pool_block_bytes(&pool)));
+
+	/* And reused: no more blocks. */
+	ok = (BOOLEAN) (ok && (alloc_chunks(&quota, 0, 2 * per_block, chunks)) && (pool.nblocks == 2));
+
+	if (ok) {
+		for (i = 0; i < 2 * per_block; i++) {
+			chunk_pool_release(&quota, 0, chunks[i]);
+		}
+	}
+
+	chunk_pool_free(&pool);
+	free(chunks);
+
+	return ok;
+}
+
+BOOLEAN check_threads(ULONG nthreads, ULONGLONG count)
+{
+	POOL_THREAD threads[MAX_THREADS];
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quota;
+	volatile LONGLONG held;
+	ULONG t;
+	BOOLEAN ok;
+
+	/* Less than the threads would hold together: some allocations fail. */
+	chunk_pool_init(&pool, CHUNK_SHIFT, 0, MAX_FREE);
+	chunk_quota_init(&quota, &pool, (ULONGLONG) nthreads * MAX_HELD / 2 * CHUNK_SIZE);
+
+	held = 0;
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].quota = &quota;
+		threads[t].id = t;
+		threads[t].count = count;
+		threads[t].seed = RANDOM_SEED + t;
+		threads[t].held = &held;
+		threads[t].ok = TRUE;
+	}
+
+	run_threads(threads, nthreads, alloc_release);
+
+	ok = (BOOLEAN) ((quota.used == 0) && (pool.used == 0) && (held == 0));
+
+	for (t = 0; t < nthreads; t++) {
+		ok = (BOOLEAN) (ok && (threads[t].ok));
+	}
+
+	for (t = 0; (ok) && (t < NNODES); t++) {
+		ok = (BOOLEAN) (quota.node_used[t] == 0);
+	}
+
+	chunk_pool_free(&pool);
+
+	return ok;
+}
+
+double measure(ULONG nthreads, ULONGLONG count, int mode)
+{
+	POOL_THREAD threads[MAX_THREADS];
+	CHUNK_POOL pool;
+	CHUNK_QUOTA quota;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONG t;
+
+	chunk_pool_init(&pool, CHUNK_SHIFT, 0, (mode == MODE_NO_FREE_LISTS) ? 0 : CHUNK_POOL_CACHE);
+
+	if (mode == MODE_BLOCKS) {
+		chunk_pool_use_large_pages(&pool);
+	}
+
+	chunk_quota_init(&quota, &pool, 0);
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].quota = &quota;
+		threads[t].id = t;
+		threads[t].count = count;
+	}
+
+	start = port_timestamp();
+
+	run_threads(threads, nthreads, alloc_release_fast);
+
+	elapsed = port_timestamp() - start;
+
+	chunk_pool_free(&pool);
+
+	return (double) nthreads * count / (double) elapsed * 1e3;
+}
+
+void run_threads(POOL_THREAD *threads, ULONG nthreads, void *(*routine)(void *))
+{
+	ULONG t;
+
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t].thread, NULL, routine, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+}
+
+/* Random allocations and releases on random nodes, up to MAX_HELD chunks. */
+void *alloc_release(void *arg)
+{
+	POOL_THREAD *thread;
+	UCHAR *chunks[MAX_HELD];
+	ULONG nodes[MAX_HELD];
+	ULONG nheld;
+	ULONGLONG r;
+	ULONGLONG i;
+	NTSTATUS status;
+
+	thread = (POOL_THREAD *) arg;
+	nheld = 0;
+
+	for (i = 0; i < thread->count; i++) {
+		r = next_random(&thread->seed);
+
+		if ((nheld < MAX_HELD) && ((nheld == 0) || (r & 1))) {
+			nodes[nheld] = (ULONG) ((r >> 8) % (NNODES + 1)) - 1;
+
+			status = chunk_pool_alloc(thread->quota, nodes[nheld], FALSE, &chunks[nheld]);
+
+			if (NT_SUCCESS(status)) {
+				/* The chunk is ours: write it all. */
+				memset(chunks[nheld], (int) thread->id, CHUNK_SIZE);
+
+				if (InterlockedIncrement64(thread->held) > thread->quota->limit) {
+					thread->ok = FALSE;
+				}
+
+				nheld++;
+			} else if (status != STATUS_DISK_FULL) {
+				thread->ok = FALSE;
+			}
+		} else {
+			r = (r >> 8) % nheld;
+
+			/* Nobody else wrote to it. */
+			if ((chunks[r][0] != (UCHAR) thread->id) || (chunks[r][CHUNK_SIZE - 1] != (UCHAR) thread->id)) {
+				thread->ok = FALSE;
+			}
+
+			InterlockedDecrement64(thread->held);
+			chunk_pool_release(thread->quota, nodes[r], chunks[r]);
+
+			nheld--;
+			chunks[r] = chunks[nheld];
+			nodes[r] = nodes[nheld];
+		}
+	}
+
+	while (nheld > 0) {
+		nheld--;
+
+		InterlockedDecrement64(thread->held);
+		chunk_pool_release(thread->quota, nodes[nheld], chunks[nheld]);
+	}
+
+	return NULL;
+}
+
+/* A chunk allocated and released on the node of the thread, over and over. */
+void *alloc_release_fast(void *arg)
+{
+	POOL_THREAD *thread;
+	UCHAR *data;
+	ULONGLONG i;
+	ULONG node;
+
+	thread = (POOL_THREAD *) arg;
+	node = thread->id % NNODES;
+
+	for (i = 0; i < thread->count; i++) {
+		if (!NT_SUCCESS(chunk_pool_alloc(thread->quota, node, FALSE, &data))) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+
+		chunk_pool_release(thread->quota, node, data);
+	}
+
+	return NULL;
+}
+
+BOOLEAN alloc_chunks(CHUNK_QUOTA *quota, ULONG node, ULONG count, UCHAR **chunks)
+{
+	ULONG i;
+
+	for (i = 0; i < count; i++) {
+		if (!NT_SUCCESS(chunk_pool_alloc(quota, node, FALSE, &chunks[i]))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
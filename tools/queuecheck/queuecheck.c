@@ -0,0 +1,401 @@
+/*
+ * Test of the per-CPU request contexts (cpu_queue.c) on Linux, with
+ * threads pinned to processors. It checks that:
+ *   - the contexts are padded to whole cache lines and aligned, so that two
+ *     of them never share a line;
+ *   - each processor selects the context of its group of "cpus_per_queue"
+ *     processors, the last group being smaller, and the processors beyond
+ *     the count wrap around;
+ *   - the counters of threads pinned to processors end up in the contexts
+ *     of these processors, and their sum is what the threads counted;
+ *   - requests started on a processor and completed on another one leave
+ *     "in_flight" unbalanced per context but not in the sum.
+ * Then it measures the counter updates per second of threads pinned to
+ * their own processor with one context per processor, with the counters
+ * packed next to each other (not padded) and with a single context.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o queuecheck queuecheck.c ../common/tools.c \
+ *       ../../cpu_queue.c ../../io_counters.c ../../trace.c
+ *
+ * Usage: queuecheck [options]
+ *   -t threads   Threads of the benchmark (default: processors allowed).
+ *   -n count     Requests per thread (default 1000000).
+ */
+
+#define _GNU_SOURCE /* Processor affinity. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "cpu_queue.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-t threads] [-n count]"
+#define MAX_THREADS                     256
+#define LATENCY                         1000 /* ns, bucket 2. */
+#define OPERATION                       3
+
+#define LAYOUT_PER_CPU                  0
+#define LAYOUT_PACKED                   1
+#define LAYOUT_SHARED                   2
+
+typedef struct {
+	pthread_t   thread;
+	ULONG       cpu;
+	ULONGLONG   count;
+	ULONGLONG   bytes;           /* Per request. */
+	CPU_QUEUES  *cpu_queues;
+	IO_COUNTERS *packed;         /* Indexed by processor, not padded. */
+	int         layout;
+	BOOLEAN     pinned;          /* Ran on its processor only. */
+} QUEUE_THREAD;
+
+BOOLEAN check_layout(void);
+BOOLEAN check_selection(void);
+BOOLEAN check_pinned(const ULONG *cpus, ULONG ncpus_allowed, ULONGLONG count);
+BOOLEAN check_migration(void);
+double measure_updates(const ULONG *cpus, ULONG ncpus_allowed, ULONG nthreads, ULONGLONG count, int layout);
+void run_threads(QUEUE_THREAD *threads, ULONG nthreads);
+void *count_requests(void *arg);
+ULONG allowed_cpus(ULONG *cpus);
+
+int main(int argc, char **argv)
+{
+	ULONG cpus[MAX_THREADS];
+	ULONG ncpus_allowed;
+	ULONG nthreads;
+	ULONGLONG count;
+	BOOLEAN ok;
+	int opt;
+
+	if ((ncpus_allowed = allowed_cpus(cpus)) == 0) {
+		fprintf(stderr, "Cannot get the processors of the process.\n");
+		return 1;
+	}
+
+	nthreads = ncpus_allowed;
+	count = 1000000;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+			case 't':
+				if (((nthreads = (ULONG) atoi(optarg)) == 0) || (nthreads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "Contexts are padded and aligned to cache lines", (check_layout()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Processors select the context of their group", (check_selection()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Pinned threads count in their own contexts", (check_pinned(cpus, ncpus_allowed, count / 10)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Requests moving between processors are balanced", (check_migration()) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		printf("\nCounter updates per second (millions), %u threads on %u processors:\n", nthreads, ncpus_allowed);
+		printf("%-30s %12.2f\n", "one context per processor", measure_updates(cpus, ncpus_allowed, nthreads, count, LAYOUT_PER_CPU));
+		printf("%-30s %12.2f\n", "counters packed, not padded", measure_updates(cpus, ncpus_allowed, nthreads, count, LAYOUT_PACKED));
+		printf("%-30s %12.2f\n", "single context", measure_updates(cpus, ncpus_allowed, nthreads, count, LAYOUT_SHARED));
+	}
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_layout(void)
+{
+	CPU_QUEUES cpu_queues;
+	ULONG i;
+	BOOLEAN ok;
+
+	ok = (BOOLEAN) ((sizeof(CPU_QUEUE) % CACHE_LINE_SIZE == 0) && (sizeof(CPU_QUEUE) >= sizeof(CPU_QUEUE_DATA)));
+	ok = (BOOLEAN) (ok && (sizeof(CPU_QUEUE) - sizeof(CPU_QUEUE_DATA) < CACHE_LINE_SIZE));
+
+	/* malloc() doesn't align to cache lines: the queues are aligned whatever the allocation. */
+	for (i = 1; (ok) && (i <= 7); i++) {
+		ok = (BOOLEAN) (NT_SUCCESS(cpu_queues_init(&cpu_queues, i * 3, 1, 16)));
+
+		ok = (BOOLEAN) (ok && (((ULONG_PTR) cpu_queues.queues & (CACHE_LINE_SIZE - 1)) == 0) && (cpu_queues.nqueues == i * 3));
+		ok = (BOOLEAN) (ok && ((UCHAR *) &cpu_queues.queues[cpu_queues.nqueues] <= (UCHAR *) cpu_queues.memory + cpu_queues.nqueues * sizeof(CPU_QUEUE) + CACHE_LINE_SIZE));
+		ok = (BOOLEAN) (ok && ((ULONG_PTR) cpu_queues_select(&cpu_queues, 1) - (ULONG_PTR) cpu_queues_select(&cpu_queues, 0) == sizeof(CPU_QUEUE)));
+
+		cpu_queues_free(&cpu_queues);
+	}
+
+	return ok;
+}
+
+BOOLEAN check_selection(void)
+{
+	static const ULONG groups[] = { 1, 2, 3, 4, 8, 64, 100 };
+	CPU_QUEUES cpu_queues;
+	ULONG hits[64];
+	ULONG ncpus;
+	ULONG queue;
+	ULONG cpu;
+	ULONG g;
+	BOOLEAN ok;
+
+	ok = (BOOLEAN) ((cpu_queues_init(&cpu_queues, 0, 1, 0) == STATUS_INVALID_PARAMETER) && (cpu_queues_init(&cpu_queues, 4, 0, 0) == STATUS_INVALID_PARAMETER));
+
+	for (ncpus = 1; (ok) && (ncpus <= 64); ncpus++) {
+		for (g = 0; (ok) && (g < sizeof(groups) / sizeof(groups[0])); g++) {
+			ok = (BOOLEAN) (NT_SUCCESS(cpu_queues_init(&cpu_queues, ncpus, groups[g], 0)));
+
+			/* More processors per context than processors: a single context. */
+			ok = (BOOLEAN) (ok && (cpu_queues.nqueues == (ncpus + groups[g] - 1) / groups[g]));
+			ok = (BOOLEAN) (ok && ((groups[g] < ncpus) || (cpu_queues.nqueues == 1)));
+
+			/* Each context has "cpus_per_queue" consecutive processors, the last one the rest. */
+			RtlZeroMemory(hits, sizeof(hits));
+
+			for (cpu = 0; (ok) && (cpu < ncpus); cpu++) {
+				queue = (ULONG) (((UCHAR *) cpu_queues_select(&cpu_queues, cpu) - (UCHAR *) cpu_queues.queues) / sizeof(CPU_QUEUE));
+
+				ok = (BOOLEAN) ((queue < cpu_queues.nqueues) && (queue == cpu / ((groups[g] < ncpus) ? groups[g] : ncpus)));
+				ok = (BOOLEAN) (ok && (cpu_queues_select(&cpu_queues, cpu + ncpus) == cpu_queues_select(&cpu_queues, cpu)));
+
+				hits[queue]++;
+			}
+
+			for (queue = 0; (ok) && (queue < cpu_queues.nqueues); queue++) {
+				ok = (BOOLEAN) ((hits[queue] == cpu_queues.cpus_per_queue) || ((queue == cpu_queues.nqueues - 1) && (hits[queue] == ncpus - queue * cpu_queues.cpus_per_queue)));
+			}
+
+			cpu_queues_free(&cpu_queues);
+		}
+	}
+
+	return ok;
+}
+
+BOOLEAN check_pinned(const ULONG *cpus, ULONG ncpus_allowed, ULONGLONG count)
+{
+	QUEUE_THREAD threads[MAX_THREADS];
+	CPU_QUEUES cpu_queues;
+	IO_COUNTERS expected;
+	IO_COUNTERS counters;
+	ULONG nthreads;
+	ULONG per_queue;
+	ULONG queue;
+	ULONG t;
+	BOOLEAN ok;
+
+	/* Two threads on each processor, and contexts of two processors. */
+	nthreads = (2 * ncpus_allowed < MAX_THREADS) ? 2 * ncpus_allowed : MAX_THREADS;
+
+	ok = TRUE;
+
+	for (per_queue = 1; (ok) && (per_queue <= 2); per_queue++) {
+		if (!NT_SUCCESS(cpu_queues_init(&cpu_queues, port_cpu_count(), per_queue, 0))) {
+			return FALSE;
+		}
+
+		for (t = 0; t < nthreads; t++) {
+			threads[t].cpu = cpus[t % ncpus_allowed];
+			threads[t].count = count;
+			threads[t].bytes = t + 1;
+			threads[t].cpu_queues = &cpu_queues;
+			threads[t].layout = LAYOUT_PER_CPU;
+		}
+
+		run_threads(threads, nthreads);
+
+		/* Each context has the requests of the threads of its processors, nothing else. */
+		for (queue = 0; (ok) && (queue < cpu_queues.nqueues); queue++) {
+			RtlZeroMemory(&expected, sizeof(expected));
+
+			for (t = 0; t < nthreads; t++) {
+				ok = (BOOLEAN) (ok && (threads[t].pinned));
+
+				if (cpu_queues_select(&cpu_queues, threads[t].cpu) == &cpu_queues.queues[queue].data) {
+					expected.requests += (LONGLONG) count;
+					expected.bytes += (LONGLONG) (count * threads[t].bytes);
+				}
+			}
+
+			counters = cpu_queues.queues[queue].data.counters[OPERATION];
+
+			ok = (BOOLEAN) (ok && (counters.requests == expected.requests) && (counters.bytes == expected.bytes));
+			ok = (BOOLEAN) (ok && (counters.in_flight == 0) && (counters.latency[io_latency_bucket(LATENCY)] == expected.requests));
+			ok = (BOOLEAN) (ok && (cpu_queues.queues[queue].data.counters[OPERATION - 1].requests == 0));
+		}
+
+		/* The sum is what all the threads counted. */
+		cpu_queues_get_counters(&cpu_queues, OPERATION, &counters);
+
+		ok = (BOOLEAN) (ok && (counters.requests == (LONGLONG) (nthreads * count)));
+		ok = (BOOLEAN) (ok && (counters.bytes == (LONGLONG) (count * nthreads * (nthreads + 1) / 2)) && (counters.errors == 0));
+
+		cpu_queues_free(&cpu_queues);
+	}
+
+	return ok;
+}
+
+BOOLEAN check_migration(void)
+{
+	CPU_QUEUES cpu_queues;
+	IO_COUNTERS counters;
+	ULONG ncpus;
+	ULONG i;
+	BOOLEAN ok;
+
+	ncpus = 8;
+
+	if (!NT_SUCCESS(cpu_queues_init(&cpu_queues, ncpus, 1, 0))) {
+		return FALSE;
+	}
+
+	/* Started on processor i, completed on processor i + 1 (the last one on 0); one still in flight on 0. */
+	for (i = 0; i < ncpus; i++) {
+		io_counters_start(&cpu_queues_select(&cpu_queues, i)->counters[OPERATION]);
+		io_counters_complete(&cpu_queues_select(&cpu_queues, i + 1)->counters[OPERATION], 4096, (BOOLEAN) (i == 0), LATENCY);
+	}
+
+	io_counters_start(&cpu_queues_select(&cpu_queues, 0)->counters[OPERATION]);
+
+	ok = (BOOLEAN) (cpu_queues.queues[0].data.counters[OPERATION].in_flight == 1);
+
+	for (i = 1; i < ncpus; i++) {
+		ok = (BOOLEAN) (ok && (cpu_queues.queues[i].data.counters[OPERATION].in_flight == 0));
+	}
+
+	cpu_queues_get_counters(&cpu_queues, OPERATION, &counters);
+
+	ok = (BOOLEAN) (ok && (counters.in_flight == 1) && (counters.requests == ncpus) && (counters.errors == 1));
+	ok = (BOOLEAN) (ok && (counters.bytes == (LONGLONG) (ncpus - 1) * 4096));
+
+	cpu_queues_free(&cpu_queues);
+
+	return ok;
+}
+
+double measure_updates(const ULONG *cpus, ULONG ncpus_allowed, ULONG nthreads, ULONGLONG count, int layout)
+{
+	QUEUE_THREAD threads[MAX_THREADS];
+	CPU_QUEUES cpu_queues;
+	IO_COUNTERS *packed;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONG t;
+
+	if ((!NT_SUCCESS(cpu_queues_init(&cpu_queues, port_cpu_count(), (layout == LAYOUT_SHARED) ? port_cpu_count() : 1, 0))) ||
+		((packed = (IO_COUNTERS *) calloc(port_cpu_count(), sizeof(IO_COUNTERS))) == NULL)) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].cpu = cpus[t % ncpus_allowed];
+		threads[t].count = count;
+		threads[t].bytes = 4096;
+		threads[t].cpu_queues = &cpu_queues;
+		threads[t].packed = packed;
+		threads[t].layout = layout;
+	}
+
+	start = port_timestamp();
+
+	run_threads(threads, nthreads);
+
+	elapsed = port_timestamp() - start;
+
+	cpu_queues_free(&cpu_queues);
+	free(packed);
+
+	return (double) nthreads * count / (double) elapsed * 1e3;
+}
+
+void run_threads(QUEUE_THREAD *threads, ULONG nthreads)
+{
+	ULONG t;
+
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t].thread, NULL, count_requests, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+}
+
+void *count_requests(void *arg)
+{
+	QUEUE_THREAD *thread;
+	IO_COUNTERS *counters;
+	cpu_set_t cpus;
+	ULONGLONG i;
+
+	thread = (QUEUE_THREAD *) arg;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(thread->cpu, &cpus);
+
+	thread->pinned = (BOOLEAN) (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+
+	for (i = 0; i < thread->count; i++) {
+		/* As the driver: the context of the processor, looked up for each request. */
+		if (thread->layout == LAYOUT_PACKED) {
+			counters = &thread->packed[port_current_cpu()];
+		} else {
+			counters = &cpu_queues_current(thread->cpu_queues)->counters[OPERATION];
+		}
+
+		io_counters_start(counters);
+		io_counters_complete(counters, thread->bytes, FALSE, LATENCY);
+	}
+
+	thread->pinned = (BOOLEAN) (thread->pinned && (port_current_cpu() == thread->cpu));
+
+	return NULL;
+}
+
+/* The processors the process may run on, at most MAX_THREADS of them. */
+ULONG allowed_cpus(ULONG *cpus)
+{
+	cpu_set_t set;
+	ULONG ncpus;
+	ULONG cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		return 0;
+	}
+
+	for (cpu = 0, ncpus = 0; (cpu < CPU_SETSIZE) && (cpu < port_cpu_count()) && (ncpus < MAX_THREADS); cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus[ncpus++] = cpu;
+		}
+	}
+
+	return ncpus;
+}
@@ -0,0 +1,300 @@
+/*
+ * Prints the counters of a ramdisk (IOCTL_RAMDISK_QUERY_STATISTICS), or
+ * appends its request trace to a file (IOCTL_RAMDISK_READ_TRACE) every
+ * second until a key is pressed; tools/tracedump decodes the file.
+ * "-n" prints the placement of the disk on the NUMA nodes instead
+ * (IOCTL_RAMDISK_QUERY_NUMA).
+ * Usage: ramstat [-t file | -n] [device]
+ * The default device is the first disk; the other disks are
+ * \\.\GLOBALROOT\Device\Ramdisk<n> and the clones \\.\RamdiskClone<n>.
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <mountmgr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <conio.h>
+
+#include "ramdisk_ioctl.h"
+
+#define DEFAULT_DEVICE                  "\\\\.\\GLOBALROOT\\Device\\Ramdisk"
+#define TRACE_BUFFER_SIZE               (4 * 1024 * 1024)
+#define TRACE_PERIOD                    1000 /* Milliseconds. */
+
+typedef struct {
+	ULONG code;
+	const char *name;
+} OPERATION_NAME;
+
+const OPERATION_NAME operation_names[] = {
+	{RAMDISK_OPERATION_READ, "Read"},
+	{RAMDISK_OPERATION_WRITE, "Write"},
+	{RAMDISK_OPERATION_OTHER_IOCTL, "Other IOCTLs"},
+	{IOCTL_DISK_GET_PARTITION_INFO, "IOCTL_DISK_GET_PARTITION_INFO"},
+	{IOCTL_DISK_SET_PARTITION_INFO, "IOCTL_DISK_SET_PARTITION_INFO"},
+	{IOCTL_DISK_GET_DRIVE_GEOMETRY, "IOCTL_DISK_GET_DRIVE_GEOMETRY"},
+	{IOCTL_DISK_GET_MEDIA_TYPES, "IOCTL_DISK_GET_MEDIA_TYPES"},
+	{IOCTL_STORAGE_GET_MEDIA_TYPES, "IOCTL_STORAGE_GET_MEDIA_TYPES"},
+	{IOCTL_DISK_UPDATE_PROPERTIES, "IOCTL_DISK_UPDATE_PROPERTIES"},
+	{IOCTL_DISK_CHECK_VERIFY, "IOCTL_DISK_CHECK_VERIFY"},
+	{IOCTL_STORAGE_CHECK_VERIFY, "IOCTL_STORAGE_CHECK_VERIFY"},
+	{IOCTL_DISK_IS_WRITABLE, "IOCTL_DISK_IS_WRITABLE"},
+	{IOCTL_MOUNTDEV_QUERY_DEVICE_NAME, "IOCTL_MOUNTDEV_QUERY_DEVICE_NAME"},
+	{IOCTL_MOUNTDEV_QUERY_UNIQUE_ID, "IOCTL_MOUNTDEV_QUERY_UNIQUE_ID"},
+	{IOCTL_DISK_MEDIA_REMOVAL, "IOCTL_DISK_MEDIA_REMOVAL"},
+	{IOCTL_STORAGE_MEDIA_REMOVAL, "IOCTL_STORAGE_MEDIA_REMOVAL"},
+	{IOCTL_DISK_GET_LENGTH_INFO, "IOCTL_DISK_GET_LENGTH_INFO"},
+	{IOCTL_STORAGE_GET_HOTPLUG_INFO, "IOCTL_STORAGE_GET_HOTPLUG_INFO"},
+	{IOCTL_STORAGE_QUERY_PROPERTY, "IOCTL_STORAGE_QUERY_PROPERTY"},
+	{IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, "IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES"},
+	{IOCTL_RAMDISK_SAVE_IMAGE, "IOCTL_RAMDISK_SAVE_IMAGE"},
+	{IOCTL_RAMDISK_CHECKPOINT, "IOCTL_RAMDISK_CHECKPOINT"},
+	{IOCTL_RAMDISK_SNAPSHOT, "IOCTL_RAMDISK_SNAPSHOT"},
+	{IOCTL_RAMDISK_CLONE, "IOCTL_RAMDISK_CLONE"},
+	{IOCTL_RAMDISK_DELETE_CLONE, "IOCTL_RAMDISK_DELETE_CLONE"},
+	{IOCTL_RAMDISK_RESIZE, "IOCTL_RAMDISK_RESIZE"},
+	{IOCTL_RAMDISK_QUERY_STATISTICS, "IOCTL_RAMDISK_QUERY_STATISTICS"},
+	{IOCTL_RAMDISK_READ_TRACE, "IOCTL_RAMDISK_READ_TRACE"},
+	{IOCTL_RAMDISK_QUERY_NUMA, "IOCTL_RAMDISK_QUERY_NUMA"},
+	{IOCTL_RAMDISK_BATCH, "IOCTL_RAMDISK_BATCH"}
+};
+
+const char *operation_name(ULONG code);
+ULONG percentile(const RAMDISK_OPERATION_STATISTICS *operation, ULONG percent);
+void print_bucket(ULONG bucket);
+void print_operation(const RAMDISK_OPERATION_STATISTICS *operation);
+int print_statistics(HANDLE handle);
+int save_trace(HANDLE handle, const char *filename);
+int print_numa(HANDLE handle);
+
+int main(int argc, char **argv)
+{
+	const char *device;
+	const char *trace;
+	HANDLE handle;
+	BOOL numa;
+	int i;
+	int ret;
+
+	trace = NULL;
+	numa = FALSE;
+	device = DEFAULT_DEVICE;
+
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc) && (!numa)) {
+			trace = argv[++i];
+		} else if ((strcmp(argv[i], "-n") == 0) && (!trace)) {
+			numa = TRUE;
+		} else if ((argv[i][0] != '-') && (i + 1 == argc)) {
+			device = argv[i];
+		} else {
+			fprintf(stderr, "Usage: %s [-t file | -n] [device]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	handle = CreateFileA(device, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Cannot open %s (error %lu).\n", device, GetLastError());
+		return 1;
+	}
+
+	if (trace) {
+		ret = save_trace(handle, trace);
+	} else if (numa) {
+		ret = print_numa(handle);
+	} else {
+		ret = print_statistics(handle);
+	}
+
+	CloseHandle(handle);
+
+	return ret;
+}
+
+int print_statistics(HANDLE handle)
+{
+	RAMDISK_STATISTICS statistics;
+	DWORD length;
+	ULONG i;
+
+	if (!DeviceIoControl(handle, IOCTL_RAMDISK_QUERY_STATISTICS, NULL, 0, &statistics, sizeof(statistics), &length, NULL)) {
+		fprintf(stderr, "IOCTL_RAMDISK_QUERY_STATISTICS failed (error %lu).\n", GetLastError());
+		return 1;
+	}
+
+	for (i = 0; (i < statistics.noperations) && (i < RAMDISK_MAX_OPERATIONS); i++) {
+		/* Skip the operations which have never been seen. */
+		if ((statistics.operations[i].requests > 0) || (statistics.operations[i].in_flight != 0)) {
+			print_operation(&statistics.operations[i]);
+		}
+	}
+
+	return 0;
+}
+
+int save_trace(HANDLE handle, const char *filename)
+{
+	RAMDISK_TRACE *trace;
+	ULONGLONG records;
+	ULONGLONG lost;
+	DWORD length;
+	FILE *file;
+
+	if ((trace = (RAMDISK_TRACE *) malloc(TRACE_BUFFER_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	if ((file = fopen(filename, "ab")) == NULL) {
+		fprintf(stderr, "Cannot open %s.\n", filename);
+		free(trace);
+		return 1;
+	}
+
+	printf("Tracing to %s, press a key to stop.\n", filename);
+
+	records = 0;
+	lost = 0;
+
+	do {
+		/* Drain what has been traced so far (the buffer comes back full while there is more), then wait. */
+		do {
+			if (!DeviceIoControl(handle, IOCTL_RAMDISK_READ_TRACE, NULL, 0, trace, TRACE_BUFFER_SIZE, &length, NULL)) {
+				fprintf(stderr, "IOCTL_RAMDISK_READ_TRACE failed (error %lu).\n", GetLastError());
+				fclose(file);
+				free(trace);
+				return 1;
+			}
+
+			if ((trace->nrecords > 0) || (trace->lost > 0)) {
+				if (fwrite(trace, length, 1, file) != 1) {
+					fprintf(stderr, "Cannot write to %s.\n", filename);
+					fclose(file);
+					free(trace);
+					return 1;
+				}
+
+				records += trace->nrecords;
+				lost += trace->lost;
+			}
+		} while (trace->nrecords == (TRACE_BUFFER_SIZE - sizeof(RAMDISK_TRACE)) / sizeof(RAMDISK_TRACE_RECORD));
+
+		Sleep(TRACE_PERIOD);
+	} while (!_kbhit());
+
+	printf("%I64u records saved, %I64u lost.\n", records, lost);
+
+	fclose(file);
+	free(trace);
+
+	return 0;
+}
+
+int print_numa(HANDLE handle)
+{
+	RAMDISK_NUMA_INFO info;
+	DWORD length;
+	ULONG i;
+
+	if (!DeviceIoControl(handle, IOCTL_RAMDISK_QUERY_NUMA, NULL, 0, &info, sizeof(info), &length, NULL)) {
+		fprintf(stderr, "IOCTL_RAMDISK_QUERY_NUMA failed (error %lu).\n", GetLastError());
+		return 1;
+	}
+
+	switch (info.policy) {
+		case RAMDISK_NUMA_INTERLEAVE:
+			printf("Interleaved on %lu nodes in stripes of %I64u KB.\n", info.nodes, info.stripe_size >> 10);
+			break;
+		case RAMDISK_NUMA_PARTITION:
+			printf("Partitioned on %lu nodes in regions of %I64u MB.\n", info.nodes, info.region_size >> 20);
+			break;
+		default:
+			printf("Not placed on NUMA nodes (%lu nodes).\n", info.nodes);
+			return 0;
+	}
+
+	for (i = 0; (i < info.nodes) && (i < RAMDISK_MAX_NUMA_NODES); i++) {
+		printf("Node %2lu: %10I64u KB\n", i, info.node_bytes[i] >> 10);
+	}
+
+	return 0;
+}
+
+const char *operation_name(ULONG code)
+{
+	ULONG i;
+
+	for (i = 0; i < sizeof(operation_names) / sizeof(operation_names[0]); i++) {
+		if (operation_names[i].code == code) {
+			return operation_names[i].name;
+		}
+	}
+
+	return "Unknown";
+}
+
+/* Latency bucket which contains the percentile. */
+ULONG percentile(const RAMDISK_OPERATION_STATISTICS *operation, ULONG percent)
+{
+	ULONGLONG total;
+	ULONGLONG count;
+	ULONG i;
+
+	total = 0;
+	for (i = 0; i < RAMDISK_LATENCY_BUCKETS; i++) {
+		total += operation->latency[i];
+	}
+
+	count = 0;
+	for (i = 0; i < RAMDISK_LATENCY_BUCKETS - 1; i++) {
+		count += operation->latency[i];
+		if (count * 100 >= total * percent) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+void print_bucket(ULONG bucket)
+{
+	/* The last bucket has no upper bound. */
+	if (bucket == RAMDISK_LATENCY_BUCKETS - 1) {
+		printf(">= %10I64u ns", 256ULL << bucket);
+	} else {
+		printf("<  %10I64u ns", 512ULL << bucket);
+	}
+}
+
+void print_operation(const RAMDISK_OPERATION_STATISTICS *operation)
+{
+	ULONG i;
+
+	printf("%s (0x%08lx)\n", operation_name(operation->code), operation->code);
+	printf("  Requests: %I64u, bytes: %I64u, errors: %I64u, in flight: %I64d\n",
+		   operation->requests,
+		   operation->bytes,
+		   operation->errors,
+		   operation->in_flight);
+
+	if (operation->requests == 0) {
+		return;
+	}
+
+	printf("  p50: ");
+	print_bucket(percentile(operation, 50));
+	printf(", p99: ");
+	print_bucket(percentile(operation, 99));
+	printf("\n");
+
+	for (i = 0; i < RAMDISK_LATENCY_BUCKETS; i++) {
+		if (operation->latency[i] > 0) {
+			printf("    ");
+			print_bucket(i);
+			printf(": %I64u\n", operation->latency[i]);
+		}
+	}
+}
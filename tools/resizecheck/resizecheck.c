@@ -0,0 +1,690 @@
+/*
+ * Test of the online resize of the chunk table (chunk_table_prepare_resize(),
+ * chunk_table_resize() and chunk_table_end_resize()) on Linux.
+ * It checks that:
+ *   - growing keeps the data of the chunks where it is (only the
+ *     descriptors of a short last segment are copied, the full segments
+ *     don't move), and the new part of the disk reads as zeros;
+ *   - shrinking fails with STATUS_DEVICE_BUSY, changing nothing, while a
+ *     chunk beyond the new size has data, and zeroes the rest of the last
+ *     chunk;
+ *   - a resize prepared but not installed leaves the table as it was;
+ *   - under I/O from several threads, resized as the driver does it
+ *     (prepared during the I/O, installed with the whole disk locked
+ *     exclusively with the range lock, the tail trimmed before shrinking),
+ *     every sector reads what was last written to it, or zeros if it has
+ *     been trimmed or cut off, the requests validated with the old size
+ *     and granted after a shrink are refused, and the shrinks succeed once
+ *     the tail is trimmed, even if the disk doesn't end on a chunk.
+ * Then it prints the time the I/O was stopped for the resizes (the
+ * quiesce) and the worst latency of the requests.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o resizecheck resizecheck.c ../common/tools.c \
+ *       ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c ../../range_lock.c \
+ *       ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c ../../numa_layout.c \
+ *       ../../port_numa.c ../../port_page.c
+ *
+ * Usage: resizecheck [options]
+ *   -t threads   Threads submitting requests (default 4).
+ *   -r count     Resizes (default 200).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "disk_io.h"
+#include "range_lock.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-t threads] [-r count]"
+#define CHUNK_SHIFT                     DEFAULT_CHUNK_SHIFT
+#define CHUNK_SIZE                      (1UL << CHUNK_SHIFT)
+#define SECTOR_SIZE                     512
+#define GB                              (1ULL << 30) /* The disk crosses segments. */
+#define MAX_SIZE                        (3 * GB)
+#define UNIFORM_SLOTS                   512
+#define MAX_SLOTS                       (UNIFORM_SLOTS + 64)
+#define MAX_THREADS                     64
+
+/* The sector of a slot is read (50%), written (40%) or trimmed (10%). */
+#define READ_PERCENT                    50
+#define WRITE_PERCENT                   40
+
+typedef struct {
+	RANGE_LOCK_ENTRY range;            /* First: the entries are the requests. */
+	volatile LONG    granted;
+} RESIZE_REQUEST;
+
+/*
+ * The threads access a fixed set of sectors (the slots), all over the
+ * largest disk and on both sides of every size, so that the memory used
+ * stays small. The version of a slot (0: zeros) is only changed with its
+ * sector locked.
+ */
+typedef struct {
+	CHUNK_TABLE        table;
+	RANGE_LOCK         range_lock;
+	volatile ULONGLONG disk_size;
+	volatile ULONGLONG limit;          /* The writes stay below it (a shrink is coming). */
+	ULONGLONG          slots[MAX_SLOTS];
+	ULONG              versions[MAX_SLOTS];
+	ULONG              nslots;
+	volatile LONG      stop;
+	volatile LONG      errors;
+	volatile LONGLONG  refused;        /* Validated with the old size, refused after a shrink. */
+} RESIZE_DISK;
+
+typedef struct {
+	RESIZE_DISK *disk;
+	pthread_t   thread;
+	ULONGLONG   seed;
+	ULONGLONG   nrequests;
+	ULONGLONG   max_latency;
+} IO_THREAD;
+
+typedef struct {
+	ULONG     grown;
+	ULONG     shrunk;
+	ULONG     busy;
+	ULONGLONG total_quiesce;
+	ULONGLONG max_quiesce;
+	ULONGLONG max_prepare;
+} RESIZE_STATS;
+
+BOOLEAN check_grow(void);
+BOOLEAN check_shrink(void);
+BOOLEAN check_abandon(void);
+BOOLEAN stress(RESIZE_DISK *disk, ULONG nthreads, ULONG nresizes, RESIZE_STATS *stats, IO_THREAD *threads);
+NTSTATUS resize(RESIZE_DISK *disk, ULONGLONG size, RESIZE_STATS *stats);
+NTSTATUS resize_table(CHUNK_TABLE *table, ULONGLONG size);
+void *do_io(void *arg);
+NTSTATUS execute(RESIZE_DISK *disk, UCHAR operation, ULONGLONG start, ULONGLONG end, ULONG slot);
+void init_slots(RESIZE_DISK *disk, const ULONGLONG *sizes, ULONG nsizes);
+void fill_sector(UCHAR *buffer, ULONGLONG offset, ULONG version);
+BOOLEAN write_sector(CHUNK_TABLE *table, ULONGLONG offset, ULONG version);
+BOOLEAN check_sector(CHUNK_TABLE *table, ULONGLONG offset, ULONG version);
+
+static const ULONGLONG sizes[] = {
+	16 * 1024 * 1024 + SECTOR_SIZE,
+	64 * 1024 * 1024,
+	GB - CHUNK_SIZE,
+	GB - SECTOR_SIZE,
+	GB,
+	GB + SECTOR_SIZE,
+	GB + CHUNK_SIZE + 4096,
+	2 * GB - 3 * SECTOR_SIZE,
+	2 * GB,
+	2 * GB + 1024 * 1024 + 3 * SECTOR_SIZE,
+	MAX_SIZE - CHUNK_SIZE / 2,
+	MAX_SIZE
+};
+
+int main(int argc, char **argv)
+{
+	IO_THREAD threads[MAX_THREADS];
+	RESIZE_DISK *disk;
+	RESIZE_STATS stats;
+	ULONGLONG nrequests;
+	ULONGLONG max_latency;
+	ULONG nthreads;
+	ULONG nresizes;
+	ULONG t;
+	BOOLEAN ok;
+	int opt;
+
+	nthreads = 4;
+	nresizes = 200;
+
+	while ((opt = getopt(argc, argv, "t:r:")) != -1) {
+		switch (opt) {
+			case 't':
+				if (((nthreads = (ULONG) atoi(optarg)) == 0) || (nthreads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'r':
+				if ((nresizes = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((optind != argc) || ((disk = (RESIZE_DISK *) calloc(1, sizeof(RESIZE_DISK))) == NULL)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "Growing keeps the chunks and adds zeros", (check_grow()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Shrinking needs an unused tail and zeroes the rest", (check_shrink()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "A resize not installed changes nothing", (check_abandon()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Resizes under I/O keep every sector", (stress(disk, nthreads, nresizes, &stats, threads)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		nrequests = 0;
+		max_latency = 0;
+
+		for (t = 0; t < nthreads; t++) {
+			nrequests += threads[t].nrequests;
+
+			if (threads[t].max_latency > max_latency) {
+				max_latency = threads[t].max_latency;
+			}
+		}
+
+		printf("\n%u resizes (%u grown, %u shrunk, %u refused as busy), %" PRIu64 " requests (%" PRId64 " refused after a shrink), %u threads, %u processors:\n",
+			nresizes, stats.grown, stats.shrunk, stats.busy, nrequests, disk->refused, nthreads, port_cpu_count());
+		printf("  %-24s %10.1f us average, %10.1f us max\n", "I/O stopped", (double) stats.total_quiesce / (stats.grown + stats.shrunk + stats.busy) / 1e3, (double) stats.max_quiesce / 1e3);
+		printf("  %-24s %10.1f us max\n", "Prepared during the I/O", (double) stats.max_prepare / 1e3);
+		printf("  %-24s %10.1f us max\n", "Request latency", (double) max_latency / 1e3);
+	}
+
+	free(disk);
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_grow(void)
+{
+	CHUNK_TABLE table;
+	CHUNK *first;
+	UCHAR *data;
+	ULONGLONG size;
+	BOOLEAN ok;
+
+	/* Half a segment and a sector: the only segment is short. */
+	size = GB / 2 + SECTOR_SIZE;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, size, CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) ((write_sector(&table, 0, 1)) && (write_sector(&table, size - SECTOR_SIZE, 2)));
+
+	data = chunk_table_get_chunk(&table, 0)->data;
+
+	/* The short segment is copied, its chunks are not. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(resize_table(&table, 2 * GB + SECTOR_SIZE))));
+	ok = (BOOLEAN) (ok && (table.nsegments == 3) && (table.nchunks == (2 * GB >> CHUNK_SHIFT) + 1) && (table.nallocated == 2));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&table, 0)->data == data));
+	ok = (BOOLEAN) (ok && (check_sector(&table, 0, 1)) && (check_sector(&table, size - SECTOR_SIZE, 2)));
+	ok = (BOOLEAN) (ok && (check_sector(&table, size, 0)) && (check_sector(&table, GB, 0)) && (check_sector(&table, 2 * GB, 0)));
+	ok = (BOOLEAN) (ok && (write_sector(&table, 2 * GB, 3)) && (write_sector(&table, GB + SECTOR_SIZE, 4)));
+
+	/* The full segments stay where they are. */
+	first = chunk_table_get_chunk(&table, 0);
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(resize_table(&table, MAX_SIZE))));
+	ok = (BOOLEAN) (ok && (table.nsegments == 3) && (chunk_table_get_chunk(&table, 0) == first));
+	ok = (BOOLEAN) (ok && (check_sector(&table, 2 * GB, 3)) && (check_sector(&table, GB + SECTOR_SIZE, 4)) && (check_sector(&table, MAX_SIZE - SECTOR_SIZE, 0)));
+	ok = (BOOLEAN) (ok && (write_sector(&table, MAX_SIZE - SECTOR_SIZE, 5)) && (table.nallocated == 5));
+
+	chunk_table_free(&table);
+
+	return ok;
+}
+
+BOOLEAN check_shrink(void)
+{
+	CHUNK_TABLE table;
+	ULONGLONG size;
+	ULONGLONG end;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, MAX_SIZE, CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	/* The new last chunk is written on both sides of the new size. */
+	size = GB + CHUNK_SIZE + 4096;
+	end = (size + CHUNK_SIZE - 1) & ~((ULONGLONG) CHUNK_SIZE - 1);
+
+	ok = (BOOLEAN) ((write_sector(&table, size - SECTOR_SIZE, 1)) && (write_sector(&table, size, 2)) && (write_sector(&table, 2 * GB, 3)));
+
+	/* Refused: nothing changes. */
+	ok = (BOOLEAN) (ok && (resize_table(&table, size) == STATUS_DEVICE_BUSY));
+	ok = (BOOLEAN) (ok && (table.nsegments == 3) && (table.nchunks == MAX_SIZE >> CHUNK_SHIFT) && (table.nallocated == 2));
+	ok = (BOOLEAN) (ok && (check_sector(&table, size, 2)) && (check_sector(&table, 2 * GB, 3)));
+
+	/* Once the chunks beyond the new last one are trimmed. */
+	chunk_table_trim(&table, end, MAX_SIZE - end);
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(resize_table(&table, size))));
+	ok = (BOOLEAN) (ok && (table.nsegments == 2) && (table.nchunks == end >> CHUNK_SHIFT) && (table.nallocated == 1));
+	ok = (BOOLEAN) (ok && (check_sector(&table, size - SECTOR_SIZE, 1)));
+
+	/* Growing again: what was cut off reads as zeros. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(resize_table(&table, 2 * GB + SECTOR_SIZE))));
+	ok = (BOOLEAN) (ok && (check_sector(&table, size - SECTOR_SIZE, 1)) && (check_sector(&table, size, 0)) && (check_sector(&table, 2 * GB, 0)));
+
+	/* To a single chunk, and a size of 0 is refused. */
+	chunk_table_trim(&table, 0, chunk_table_size(&table));
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(resize_table(&table, SECTOR_SIZE))) && (table.nsegments == 1) && (table.nchunks == 1));
+	ok = (BOOLEAN) (ok && (resize_table(&table, 0) == STATUS_INVALID_PARAMETER) && (table.nchunks == 1));
+	ok = (BOOLEAN) (ok && (table.nallocated == 0));
+
+	chunk_table_free(&table);
+
+	return ok;
+}
+
+BOOLEAN check_abandon(void)
+{
+	CHUNK_TABLE_RESIZE resize;
+	CHUNK_TABLE table;
+	CHUNK **segments;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, GB / 2, CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	segments = table.segments;
+
+	ok = (BOOLEAN) (write_sector(&table, GB / 2 - SECTOR_SIZE, 1));
+
+	/* The driver gives up when it cannot allocate the new dirty chunks. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(chunk_table_prepare_resize(&table, 2 * GB, &resize))));
+
+	chunk_table_end_resize(&resize);
+
+	ok = (BOOLEAN) (ok && (table.segments == segments) && (table.nsegments == 1) && (table.nchunks == GB / 2 >> CHUNK_SHIFT));
+	ok = (BOOLEAN) (ok && (check_sector(&table, GB / 2 - SECTOR_SIZE, 1)) && (write_sector(&table, 0, 2)));
+
+	/* And the next one works. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(resize_table(&table, GB + SECTOR_SIZE))) && (check_sector(&table, GB / 2 - SECTOR_SIZE, 1)) && (check_sector(&table, GB, 0)));
+
+	chunk_table_free(&table);
+
+	return ok;
+}
+
+BOOLEAN stress(RESIZE_DISK *disk, ULONG nthreads, ULONG nresizes, RESIZE_STATS *stats, IO_THREAD *threads)
+{
+	ULONGLONG seed;
+	ULONGLONG size;
+	ULONG i;
+	ULONG t;
+	BOOLEAN ok;
+	NTSTATUS status;
+
+	memset(stats, 0, sizeof(RESIZE_STATS));
+
+	if (!NT_SUCCESS(chunk_table_init(&disk->table, sizes[0], CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	range_lock_init(&disk->range_lock);
+
+	disk->disk_size = sizes[0];
+	disk->limit = sizes[0];
+
+	init_slots(disk, sizes, sizeof(sizes) / sizeof(sizes[0]));
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].disk = disk;
+		threads[t].seed = RANDOM_SEED + t;
+		threads[t].nrequests = 0;
+		threads[t].max_latency = 0;
+
+		if (pthread_create(&threads[t].thread, NULL, do_io, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	seed = RANDOM_SEED;
+	ok = TRUE;
+
+	for (i = 0; (ok) && (i < nresizes); i++) {
+		do {
+			size = sizes[next_random(&seed) % (sizeof(sizes) / sizeof(sizes[0]))];
+		} while (size == disk->disk_size);
+
+		status = resize(disk, size, stats);
+
+		ok = (BOOLEAN) ((NT_SUCCESS(status)) || (status == STATUS_DEVICE_BUSY));
+
+		/* Let the threads run on the new size. */
+		sched_yield();
+	}
+
+	disk->stop = TRUE;
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	/* Everything in the disk, after the I/O. */
+	for (i = 0; (ok) && (i < disk->nslots) && (disk->slots[i] < disk->disk_size); i++) {
+		ok = (BOOLEAN) (NT_SUCCESS(execute(disk, REQUEST_READ, disk->slots[i], disk->slots[i] + SECTOR_SIZE, i)));
+	}
+
+	ok = (BOOLEAN) (ok && (disk->errors == 0) && (disk->range_lock.head == NULL));
+	ok = (BOOLEAN) (ok && (stats->grown > 0) && (stats->shrunk > 0));
+	ok = (BOOLEAN) (ok && (disk->table.nchunks == (disk->disk_size + CHUNK_SIZE - 1) >> CHUNK_SHIFT));
+
+	range_lock_destroy(&disk->range_lock);
+	chunk_table_free(&disk->table);
+
+	return ok;
+}
+
+/* As resize_disk() in the driver. */
+NTSTATUS resize(RESIZE_DISK *disk, ULONGLONG size, RESIZE_STATS *stats)
+{
+	CHUNK_TABLE_RESIZE resize;
+	RESIZE_REQUEST request;
+	RANGE_LOCK_ENTRY *granted;
+	RANGE_LOCK_ENTRY *next;
+	ULONGLONG old_size;
+	ULONGLONG start;
+	ULONGLONG end;
+	ULONGLONG elapsed;
+	ULONG i;
+	NTSTATUS status;
+
+	old_size = disk->disk_size;
+
+	/* A shrink: the file system has been shrunk first, and the tail trimmed. */
+	if (size < old_size) {
+		disk->limit = size;
+
+		execute(disk, REQUEST_TRIM, size, old_size, 0);
+	}
+
+	start = port_timestamp();
+
+	status = chunk_table_prepare_resize(&disk->table, size, &resize);
+	if (!NT_SUCCESS(status)) {
+		disk->limit = old_size;
+		return status;
+	}
+
+	elapsed = port_timestamp() - start;
+	if (elapsed > stats->max_prepare) {
+		stats->max_prepare = elapsed;
+	}
+
+	/* Stop the I/O; the requests validated with either size wait. */
+	end = chunk_table_size(&disk->table);
+	if (end < ((size + CHUNK_SIZE - 1) & ~((ULONGLONG) CHUNK_SIZE - 1))) {
+		end = (size + CHUNK_SIZE - 1) & ~((ULONGLONG) CHUNK_SIZE - 1);
+	}
+
+	request.granted = FALSE;
+
+	if (!range_lock_acquire(&disk->range_lock, &request.range, 0, end, TRUE)) {
+		while (!request.granted) {
+			sched_yield();
+		}
+	}
+
+	start = port_timestamp();
+
+	status = chunk_table_resize(&disk->table, &resize);
+	if (NT_SUCCESS(status)) {
+		disk->disk_size = size;
+
+		/* What was cut off reads as zeros if the disk grows again. */
+		for (i = 0; i < disk->nslots; i++) {
+			if (disk->slots[i] >= size) {
+				disk->versions[i] = 0;
+			}
+		}
+	}
+
+	elapsed = port_timestamp() - start;
+
+	for (granted = range_lock_release(&disk->range_lock, &request.range); granted; granted = next) {
+		next = granted->next_granted;
+		InterlockedIncrement(&((RESIZE_REQUEST *) granted)->granted);
+	}
+
+	chunk_table_end_resize(&resize);
+
+	stats->total_quiesce += elapsed;
+	if (elapsed > stats->max_quiesce) {
+		stats->max_quiesce = elapsed;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		/* Some requests validated before the limit wrote to the tail again. */
+		disk->limit = old_size;
+		stats->busy++;
+	} else if (size > old_size) {
+		disk->limit = size;
+		stats->grown++;
+	} else {
+		stats->shrunk++;
+	}
+
+	return status;
+}
+
+/* The three steps, without I/O. */
+NTSTATUS resize_table(CHUNK_TABLE *table, ULONGLONG size)
+{
+	CHUNK_TABLE_RESIZE resize;
+	NTSTATUS status;
+
+	status = chunk_table_prepare_resize(table, size, &resize);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = chunk_table_resize(table, &resize);
+
+	chunk_table_end_resize(&resize);
+
+	return status;
+}
+
+void *do_io(void *arg)
+{
+	IO_THREAD *thread;
+	RESIZE_DISK *disk;
+	ULONGLONG limit;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG r;
+	ULONG slot;
+	ULONG percent;
+	UCHAR operation;
+
+	thread = (IO_THREAD *) arg;
+	disk = thread->disk;
+
+	while (!disk->stop) {
+		r = next_random(&thread->seed);
+
+		slot = (ULONG) (r % disk->nslots);
+		percent = (ULONG) ((r >> 32) % 100);
+
+		if (percent < READ_PERCENT) {
+			operation = REQUEST_READ;
+		} else if (percent < READ_PERCENT + WRITE_PERCENT) {
+			operation = REQUEST_WRITE;
+		} else {
+			operation = REQUEST_TRIM;
+		}
+
+		if (!disk_io_check(disk->disk_size, SECTOR_SIZE, (LONGLONG) disk->slots[slot], SECTOR_SIZE)) {
+			continue;
+		}
+
+		/* Only the writes would keep a shrink from succeeding; the rest goes on up to the end. */
+		limit = disk->limit;
+
+		if ((operation == REQUEST_WRITE) && (disk->slots[slot] + SECTOR_SIZE > limit)) {
+			continue;
+		}
+
+		start = port_timestamp();
+
+		execute(disk, operation, disk->slots[slot], disk->slots[slot] + SECTOR_SIZE, slot);
+
+		elapsed = port_timestamp() - start;
+		if (elapsed > thread->max_latency) {
+			thread->max_latency = elapsed;
+		}
+
+		thread->nrequests++;
+	}
+
+	return NULL;
+}
+
+/* Like the driver: reads share the range, the other operations lock it exclusively. */
+NTSTATUS execute(RESIZE_DISK *disk, UCHAR operation, ULONGLONG start, ULONGLONG end, ULONG slot)
+{
+	RESIZE_REQUEST request;
+	RANGE_LOCK_ENTRY *granted;
+	RANGE_LOCK_ENTRY *next;
+	ULONGLONG chunk_mask;
+	ULONG i;
+	NTSTATUS status;
+
+	request.granted = FALSE;
+
+	/* Trimming might free whole chunks: lock the complete chunks. */
+	chunk_mask = (operation == REQUEST_TRIM) ? CHUNK_SIZE - 1 : 0;
+
+	if (!range_lock_acquire(&disk->range_lock, &request.range, start & ~chunk_mask, (end + chunk_mask) & ~chunk_mask, (BOOLEAN) (operation != REQUEST_READ))) {
+		while (!request.granted) {
+			sched_yield();
+		}
+	}
+
+	/* The disk might have shrunk while the request was waiting (trims cover whole chunks). */
+	if (request.range.end > ((operation == REQUEST_TRIM) ? chunk_table_size(&disk->table) : disk->disk_size)) {
+		InterlockedIncrement64(&disk->refused);
+		status = STATUS_INVALID_PARAMETER;
+	} else if (operation == REQUEST_TRIM) {
+		/* As trim() in the driver: up to the end of the last chunk, so that it can be freed. */
+		if (end == disk->disk_size) {
+			end = chunk_table_size(&disk->table);
+		}
+
+		chunk_table_trim(&disk->table, start, end - start);
+
+		for (i = 0; i < disk->nslots; i++) {
+			if ((disk->slots[i] >= start) && (disk->slots[i] < end)) {
+				disk->versions[i] = 0;
+			}
+		}
+
+		status = STATUS_SUCCESS;
+	} else if (operation == REQUEST_WRITE) {
+		status = (write_sector(&disk->table, start, disk->versions[slot] + 1)) ? STATUS_SUCCESS : STATUS_DATA_ERROR;
+
+		disk->versions[slot]++;
+	} else {
+		status = (check_sector(&disk->table, start, disk->versions[slot])) ? STATUS_SUCCESS : STATUS_DATA_ERROR;
+	}
+
+	if (status == STATUS_DATA_ERROR) {
+		InterlockedIncrement(&disk->errors);
+	}
+
+	for (granted = range_lock_release(&disk->range_lock, &request.range); granted; granted = next) {
+		/* The waiter might return (and reuse its entry) as soon as it sees the flag. */
+		next = granted->next_granted;
+		InterlockedIncrement(&((RESIZE_REQUEST *) granted)->granted);
+	}
+
+	return status;
+}
+
+/* Sectors all over the largest disk, and around each size; sorted and unique. */
+void init_slots(RESIZE_DISK *disk, const ULONGLONG *sizes, ULONG nsizes)
+{
+	ULONGLONG offset;
+	ULONG i;
+	ULONG j;
+	ULONG n;
+
+	n = 0;
+
+	for (i = 0; i < UNIFORM_SLOTS; i++) {
+		disk->slots[n++] = (MAX_SIZE / UNIFORM_SLOTS) * i + (i % (CHUNK_SIZE / SECTOR_SIZE)) * SECTOR_SIZE;
+	}
+
+	for (i = 0; i < nsizes; i++) {
+		disk->slots[n++] = sizes[i] - SECTOR_SIZE;
+		disk->slots[n++] = sizes[i] - CHUNK_SIZE;
+
+		if (sizes[i] < MAX_SIZE) {
+			disk->slots[n++] = sizes[i];
+		}
+	}
+
+	/* Insertion sort, dropping the duplicates. */
+	disk->nslots = 0;
+
+	for (i = 0; i < n; i++) {
+		offset = disk->slots[i];
+
+		for (j = disk->nslots; (j > 0) && (disk->slots[j - 1] > offset); j--) {
+			disk->slots[j] = disk->slots[j - 1];
+		}
+
+		if ((j > 0) && (disk->slots[j - 1] == offset)) {
+			memmove(&disk->slots[j], &disk->slots[j + 1], (disk->nslots - j) * sizeof(ULONGLONG));
+			continue;
+		}
+
+		disk->slots[j] = offset;
+		disk->versions[j] = 0;
+		disk->nslots++;
+	}
+}
+
+void fill_sector(UCHAR *buffer, ULONGLONG offset, ULONG version)
+{
+	ULONGLONG *words;
+	ULONG i;
+
+	words = (ULONGLONG *) buffer;
+
+	for (i = 0; i < SECTOR_SIZE / sizeof(ULONGLONG); i++) {
+		words[i] = (version) ? ((offset + i * sizeof(ULONGLONG)) * 0x9e3779b97f4a7c15ULL) ^ version : 0;
+	}
+}
+
+BOOLEAN write_sector(CHUNK_TABLE *table, ULONGLONG offset, ULONG version)
+{
+	ULONGLONG buffer[SECTOR_SIZE / sizeof(ULONGLONG)];
+
+	fill_sector((UCHAR *) buffer, offset, version);
+
+	return (BOOLEAN) (NT_SUCCESS(disk_io_transfer(table, REQUEST_WRITE, offset, (UCHAR *) buffer, SECTOR_SIZE)));
+}
+
+BOOLEAN check_sector(CHUNK_TABLE *table, ULONGLONG offset, ULONG version)
+{
+	ULONGLONG buffer[SECTOR_SIZE / sizeof(ULONGLONG)];
+	ULONGLONG expected[SECTOR_SIZE / sizeof(ULONGLONG)];
+
+	fill_sector((UCHAR *) expected, offset, version);
+
+	return (BOOLEAN) ((NT_SUCCESS(disk_io_transfer(table, REQUEST_READ, offset, (UCHAR *) buffer, SECTOR_SIZE))) && (memcmp(buffer, expected, SECTOR_SIZE) == 0));
+}
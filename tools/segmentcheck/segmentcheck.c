@@ -0,0 +1,249 @@
+/*
+ * Test of the segments of the chunk table and of the 64-bit offsets on
+ * Linux. For each chunk size it checks that:
+ *   - a disk gets one segment per SEGMENT_SHIFT bytes, the last one only as
+ *     long as needed, and every chunk index maps to its segment and to its
+ *     place in it (chunk_table_get_chunk());
+ *   - the transfers crossing a segment boundary are split: both sides are
+ *     written and read back, and nothing else is touched;
+ *   - the offsets beyond 4 GB don't alias those below (the low 32 bits);
+ *   - the requests are validated with 64-bit offsets and lengths
+ *     (disk_io_check()).
+ * The descriptors of the large disk are allocated, its chunks are not: a
+ * disk of hundreds of GB only needs tens of MB.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o segmentcheck segmentcheck.c ../common/tools.c \
+ *       ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c ../../bitmap.c \
+ *       ../../zero.c ../../copy.c ../../lz.c ../../numa_layout.c ../../port_numa.c \
+ *       ../../port_page.c
+ *
+ * Usage: segmentcheck [size]
+ *   size         Size of the large disk (K, M and G suffixes; default 64G).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "disk_io.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[size] (more than 4 GB)"
+#define SECTOR_SIZE                     512
+#define SEGMENT_SIZE                    (1ULL << SEGMENT_SHIFT)
+
+BOOLEAN check_layout(ULONGLONG size, ULONG chunk_shift);
+BOOLEAN check_crossing(ULONGLONG size, ULONG chunk_shift);
+BOOLEAN check_aliasing(ULONGLONG size);
+BOOLEAN check_validation(ULONGLONG size);
+BOOLEAN range_equals(CHUNK_TABLE *table, ULONGLONG offset, ULONG length, UCHAR value);
+
+int main(int argc, char **argv)
+{
+	ULONGLONG size;
+	ULONGLONG start;
+	ULONG chunk_shift;
+	ULONG i;
+	char name[64];
+	BOOLEAN ok;
+
+	static const ULONG chunk_shifts[] = {12, DEFAULT_CHUNK_SHIFT, 20};
+
+	size = 64ULL << 30;
+
+	if ((argc > 2) || ((argc == 2) && ((!parse_size(argv[1], &size)) || (size <= 4 * SEGMENT_SIZE) || (size % SECTOR_SIZE)))) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	for (i = 0; i < sizeof(chunk_shifts) / sizeof(chunk_shifts[0]); i++) {
+		chunk_shift = chunk_shifts[i];
+
+		/* Exactly a segment, a chunk more, and a sector short of three. */
+		snprintf(name, sizeof(name), "Segment layout, %u KB chunks", 1U << (chunk_shift - 10));
+		printf("%-52s %s\n", name, ((check_layout(SEGMENT_SIZE, chunk_shift)) &&
+									(check_layout(SEGMENT_SIZE + (1ULL << chunk_shift), chunk_shift)) &&
+									(check_layout(3 * SEGMENT_SIZE - SECTOR_SIZE, chunk_shift))) ? "ok" : (ok = FALSE, "FAILED"));
+
+		snprintf(name, sizeof(name), "Transfers across segments, %u KB chunks", 1U << (chunk_shift - 10));
+		printf("%-52s %s\n", name, (check_crossing(3 * SEGMENT_SIZE - SECTOR_SIZE, chunk_shift)) ? "ok" : (ok = FALSE, "FAILED"));
+	}
+
+	start = port_timestamp();
+
+	snprintf(name, sizeof(name), "Segment layout, %" PRIu64 " GB disk", size >> 30);
+	printf("%-52s %s\n", name, (check_layout(size, DEFAULT_CHUNK_SHIFT)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	printf("%-52s %s\n", "Offsets beyond 4 GB don't alias", (check_aliasing(size)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Requests are validated with 64-bit offsets", (check_validation(size)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	printf("(%.2f s for the large disk)\n", (double) (port_timestamp() - start) / 1e9);
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_layout(ULONGLONG size, ULONG chunk_shift)
+{
+	CHUNK_TABLE table;
+	CHUNK *chunk;
+	ULONGLONG nchunks;
+	ULONGLONG per_segment;
+	ULONGLONG index;
+	ULONG segment;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, size, chunk_shift))) {
+		return FALSE;
+	}
+
+	nchunks = (size + (1ULL << chunk_shift) - 1) >> chunk_shift;
+	per_segment = 1ULL << (SEGMENT_SHIFT - chunk_shift);
+
+	ok = (BOOLEAN) ((table.nchunks == nchunks) && (table.segment_shift == SEGMENT_SHIFT - chunk_shift));
+	ok = (BOOLEAN) (ok && (table.nsegments == (nchunks + per_segment - 1) / per_segment) && (chunk_table_size(&table) == nchunks << chunk_shift));
+
+	/* The first and the last chunk of each segment, and the ones around them. */
+	for (segment = 0; (ok) && (segment < table.nsegments); segment++) {
+		ok = (BOOLEAN) (table.segments[segment] != NULL);
+
+		for (index = segment * per_segment; (ok) && (index < nchunks) && (index < (segment + 1) * per_segment); index += ((index % per_segment == 1) ? per_segment - 3 : 1)) {
+			chunk = chunk_table_get_chunk(&table, index);
+
+			ok = (BOOLEAN) ((chunk == &table.segments[segment][index - segment * per_segment]) && (chunk->data == NULL) && (chunk->flags == 0));
+		}
+	}
+
+	chunk_table_free(&table);
+
+	return ok;
+}
+
+BOOLEAN check_crossing(ULONGLONG size, ULONG chunk_shift)
+{
+	CHUNK_TABLE table;
+	UCHAR *buffer;
+	ULONGLONG offset;
+	ULONGLONG boundary;
+	ULONG chunk_size;
+	ULONG length;
+	ULONG segment;
+	BOOLEAN ok;
+
+	chunk_size = 1UL << chunk_shift;
+
+	/* A chunk and a half on each side of the boundary. */
+	length = 3 * chunk_size;
+
+	if ((buffer = (UCHAR *) malloc(length)) == NULL) {
+		return FALSE;
+	}
+
+	if (!NT_SUCCESS(chunk_table_init(&table, size, chunk_shift))) {
+		free(buffer);
+		return FALSE;
+	}
+
+	ok = TRUE;
+
+	for (segment = 1; (ok) && (segment < table.nsegments); segment++) {
+		boundary = (ULONGLONG) segment * SEGMENT_SIZE;
+		offset = boundary - chunk_size - chunk_size / 2;
+
+		memset(buffer, (int) segment, length);
+
+		ok = (BOOLEAN) (NT_SUCCESS(disk_io_transfer(&table, REQUEST_WRITE, offset, buffer, length)));
+
+		/* Two chunks (one partly) on each side, in both segments. */
+		ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&table, (boundary >> chunk_shift) - 2)->data) && (chunk_table_get_chunk(&table, (boundary >> chunk_shift) + 1)->data));
+		ok = (BOOLEAN) (ok && (!chunk_table_get_chunk(&table, (boundary >> chunk_shift) - 3)->data) && (!chunk_table_get_chunk(&table, (boundary >> chunk_shift) + 2)->data));
+		ok = (BOOLEAN) (ok && (table.nallocated == (LONG) (4 * segment)));
+
+		/* Read back, and with the sector before and after: zeros. */
+		ok = (BOOLEAN) (ok && (range_equals(&table, offset, length, (UCHAR) segment)));
+		ok = (BOOLEAN) (ok && (range_equals(&table, offset - SECTOR_SIZE, SECTOR_SIZE, 0)) && (range_equals(&table, offset + length, SECTOR_SIZE, 0)));
+	}
+
+	/* The last sector of the disk, in the last chunk of the last segment. */
+	memset(buffer, 0x77, SECTOR_SIZE);
+
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(disk_io_transfer(&table, REQUEST_WRITE, size - SECTOR_SIZE, buffer, SECTOR_SIZE))));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&table, table.nchunks - 1)->data) && (range_equals(&table, size - SECTOR_SIZE, SECTOR_SIZE, 0x77)));
+
+	chunk_table_free(&table);
+	free(buffer);
+
+	return ok;
+}
+
+BOOLEAN check_aliasing(ULONGLONG size)
+{
+	CHUNK_TABLE table;
+	UCHAR buffer[SECTOR_SIZE];
+	ULONGLONG offset;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(chunk_table_init(&table, size, DEFAULT_CHUNK_SHIFT))) {
+		return FALSE;
+	}
+
+	/* 4 GB + 1 MB and the offsets which have the same low 32 bits. */
+	offset = (4ULL << 30) + (1ULL << 20);
+
+	memset(buffer, 0x42, sizeof(buffer));
+
+	ok = (BOOLEAN) (NT_SUCCESS(disk_io_transfer(&table, REQUEST_WRITE, offset, buffer, sizeof(buffer))));
+	ok = (BOOLEAN) (ok && (range_equals(&table, offset, sizeof(buffer), 0x42)) && (range_equals(&table, offset & 0xffffffff, sizeof(buffer), 0)));
+
+	if (offset + (4ULL << 30) + sizeof(buffer) <= size) {
+		ok = (BOOLEAN) (ok && (range_equals(&table, offset + (4ULL << 30), sizeof(buffer), 0)));
+	}
+
+	/* The last sector of the large disk. */
+	ok = (BOOLEAN) (ok && (NT_SUCCESS(disk_io_transfer(&table, REQUEST_WRITE, size - SECTOR_SIZE, buffer, sizeof(buffer)))));
+	ok = (BOOLEAN) (ok && (range_equals(&table, size - SECTOR_SIZE, sizeof(buffer), 0x42)) && (table.nallocated == 2));
+
+	chunk_table_free(&table);
+
+	return ok;
+}
+
+BOOLEAN check_validation(ULONGLONG size)
+{
+	return (BOOLEAN) ((disk_io_check(size, SECTOR_SIZE, (LONGLONG) (size - (1ULL << 20)), 1ULL << 20)) &&
+					  (disk_io_check(size, SECTOR_SIZE, 5LL << 30, 8ULL << 30)) &&
+					  (!disk_io_check(size, SECTOR_SIZE, (LONGLONG) (size - (1ULL << 20)), (1ULL << 20) + SECTOR_SIZE)) &&
+					  (!disk_io_check(size, SECTOR_SIZE, (LONGLONG) size, SECTOR_SIZE)) &&
+					  (!disk_io_check(size, SECTOR_SIZE, -SECTOR_SIZE, SECTOR_SIZE)) &&
+					  (!disk_io_check(size, SECTOR_SIZE, SECTOR_SIZE, (ULONGLONG) -SECTOR_SIZE)) &&
+					  (!disk_io_check(size, SECTOR_SIZE, (5LL << 30) + 1, SECTOR_SIZE)));
+}
+
+BOOLEAN range_equals(CHUNK_TABLE *table, ULONGLONG offset, ULONG length, UCHAR value)
+{
+	UCHAR *buffer;
+	ULONG i;
+	BOOLEAN ok;
+
+	if ((buffer = (UCHAR *) malloc(length)) == NULL) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) (NT_SUCCESS(disk_io_transfer(table, REQUEST_READ, offset, buffer, length)));
+
+	for (i = 0; (ok) && (i < length); i++) {
+		ok = (BOOLEAN) (buffer[i] == value);
+	}
+
+	free(buffer);
+
+	return ok;
+}
@@ -0,0 +1,648 @@
+/*
+ * End-to-end test of the spill of cold chunks (spill.c) on Linux, against a
+ * local file: worker threads read and write blocks of a disk while a
+ * spiller thread evaluates the policy every period and spills the coldest
+ * chunks, as the compression work item of the driver does. The memory
+ * pressure is synthetic: it comes and goes in cycles of -p/-q milliseconds.
+ * Every read is compared with a copy of the disk kept in memory, and the
+ * whole disk is read back and compared at the end.
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o spillbench spillbench.c ../common/tools.c \
+ *       ../../spill.c ../../disk_io.c ../../chunk_table.c ../../chunk_pool.c \
+ *       ../../range_lock.c ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c ../../port_file.c
+ *
+ * Usage: spillbench [options] file
+ *   -s size      Disk size (K, M and G suffixes; default 256M).
+ *   -m size      Memory never spilled (default 0).
+ *   -b size      Block size, 512 bytes to 1 MB (default 4K).
+ *   -t threads   Threads submitting requests (default 4).
+ *   -r percent   Reads, the rest are writes (default 70).
+ *   -h percent   Requests going to the first tenth of the disk (default 90).
+ *   -n count     Requests per thread (default 100000).
+ *   -i ms        Period of the policy (default 20).
+ *   -p ms        Duration of the pressure (default 200).
+ *   -q ms        Duration of the calm between pressures (default 300).
+ * The file is recreated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "spill.h"
+#include "disk_io.h"
+#include "range_lock.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-m size] [-b size] [-t threads] [-r percent] [-h percent] [-n count] [-i ms] [-p ms] [-q ms] file"
+#define MIN_BLOCK_SIZE                  512
+#define MAX_BLOCK_SIZE                  (1024 * 1024)
+#define SECTOR_SIZE                     512
+#define VERIFY_BLOCK_SIZE               (1024 * 1024)
+
+typedef struct {
+	RANGE_LOCK_ENTRY range;            /* First member: the granted entries are cast back. */
+	volatile LONG    granted;
+} SPILL_REQUEST;
+
+typedef struct {
+	CHUNK_POOL     pool;
+	CHUNK_QUOTA    quota;
+	CHUNK_TABLE    chunk_table;
+	RANGE_LOCK     range_lock;
+	SPILL          spill;
+	ULONGLONG      disk_size;
+	UCHAR          *reference;         /* What the disk must contain. */
+	pthread_mutex_t load_mutex;        /* The loads are sequential, as in the load queue of the driver. */
+
+	/* Spiller. */
+	pthread_t      spiller;
+	volatile LONG  stop;
+	ULONG          period;
+	ULONG          pressure_time;
+	ULONG          calm_time;
+	ULONGLONG      start;
+	ULONGLONG      pressure_periods;
+	ULONGLONG      min_used;           /* Lowest memory used under pressure. */
+	ULONGLONG      max_used;
+	SPILL_REQUEST  requests[SPILL_MAX_BATCH];
+	ULONGLONG      indexes[SPILL_MAX_BATCH];
+	UCHAR          *spill_buffer;
+} SPILL_DISK;
+
+typedef struct {
+	SPILL_DISK *disk;
+	pthread_t  thread;
+	ULONG      number;
+	ULONG      block_size;
+	ULONG      read_percent;
+	ULONG      hot_percent;
+	ULONGLONG  count;
+	UCHAR      *load_buffer;
+
+	ULONGLONG  *latencies;             /* Nanoseconds, one per request. */
+	ULONGLONG  nrequests;
+	ULONGLONG  faults;                 /* Requests which had to read chunks back. */
+	ULONGLONG  errors;
+	ULONGLONG  mismatches;
+} SPILL_THREAD;
+
+BOOLEAN open_disk(SPILL_DISK *disk, const char *path, ULONGLONG min_resident);
+void close_disk(SPILL_DISK *disk);
+BOOLEAN fill_disk(SPILL_DISK *disk);
+NTSTATUS execute(SPILL_THREAD *thread, UCHAR operation, ULONGLONG offset, UCHAR *buffer, ULONG length);
+BOOLEAN under_pressure(SPILL_DISK *disk);
+void *spiller(void *arg);
+void spill_cold_chunks(SPILL_DISK *disk);
+void release(SPILL_DISK *disk, SPILL_REQUEST *request);
+void *worker(void *arg);
+ULONGLONG verify(SPILL_DISK *disk);
+int compare(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+	SPILL_DISK disk;
+	SPILL_THREAD *threads;
+	ULONGLONG *latencies;
+	ULONGLONG min_resident;
+	ULONGLONG size;
+	ULONGLONG count;
+	ULONGLONG nrequests;
+	ULONGLONG faults;
+	ULONGLONG errors;
+	ULONGLONG mismatches;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG i;
+	ULONG nthreads;
+	ULONG block_size;
+	ULONG read_percent;
+	ULONG hot_percent;
+	ULONG t;
+	int opt;
+
+	memset(&disk, 0, sizeof(disk));
+
+	disk.disk_size = 256ULL << 20;
+	disk.period = 20;
+	disk.pressure_time = 200;
+	disk.calm_time = 300;
+	min_resident = 0;
+	block_size = 4096;
+	nthreads = 4;
+	read_percent = 70;
+	hot_percent = 90;
+	count = 100000;
+
+	while ((opt = getopt(argc, argv, "s:m:b:t:r:h:n:i:p:q:")) != -1) {
+		switch (opt) {
+			case 's':
+				if ((!parse_size(optarg, &disk.disk_size)) || (disk.disk_size == 0) || (disk.disk_size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'm':
+				if (!parse_size(optarg, &min_resident)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'b':
+				if ((!parse_size(optarg, &size)) || (size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE) || (size % SECTOR_SIZE)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				block_size = (ULONG) size;
+				break;
+			case 't':
+				if ((nthreads = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'r':
+				if ((read_percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'h':
+				if ((hot_percent = (ULONG) atoi(optarg)) > 100) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'i':
+				if ((disk.period = (ULONG) atoi(optarg)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'p':
+				disk.pressure_time = (ULONG) atoi(optarg);
+				break;
+			case 'q':
+				disk.calm_time = (ULONG) atoi(optarg);
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if ((optind != argc - 1) || (block_size * 10ULL > disk.disk_size) || (disk.pressure_time + disk.calm_time == 0)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	if ((disk.reference = (UCHAR *) malloc((size_t) disk.disk_size)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	if ((!open_disk(&disk, argv[optind], min_resident)) || (!fill_disk(&disk))) {
+		return 1;
+	}
+
+	if ((threads = (SPILL_THREAD *) calloc(nthreads, sizeof(SPILL_THREAD))) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].disk = &disk;
+		threads[t].number = t;
+		threads[t].block_size = block_size;
+		threads[t].read_percent = read_percent;
+		threads[t].hot_percent = hot_percent;
+		threads[t].count = count;
+
+		if (((threads[t].latencies = (ULONGLONG *) malloc(count * sizeof(ULONGLONG))) == NULL) ||
+			((threads[t].load_buffer = (UCHAR *) malloc(disk.spill.buffer_size)) == NULL)) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+	}
+
+	disk.max_used = chunk_table_memory_used(&disk.chunk_table);
+	disk.min_used = disk.max_used;
+
+	start = port_timestamp();
+	disk.start = start;
+
+	if (pthread_create(&disk.spiller, NULL, spiller, &disk) != 0) {
+		fprintf(stderr, "Cannot create the spiller.\n");
+		return 1;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t].thread, NULL, worker, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			return 1;
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	elapsed = port_timestamp() - start;
+
+	InterlockedIncrement(&disk.stop);
+	pthread_join(disk.spiller, NULL);
+
+	/* Merge the results of all the threads. */
+	for (t = 0, nrequests = 0, faults = 0, errors = 0, mismatches = 0; t < nthreads; t++) {
+		nrequests += threads[t].nrequests;
+		faults += threads[t].faults;
+		errors += threads[t].errors;
+		mismatches += threads[t].mismatches;
+	}
+
+	if ((latencies = (ULONGLONG *) malloc(nrequests * sizeof(ULONGLONG))) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (t = 0, i = 0; t < nthreads; t++) {
+		memcpy(latencies + i, threads[t].latencies, threads[t].nrequests * sizeof(ULONGLONG));
+		i += threads[t].nrequests;
+		free(threads[t].latencies);
+		free(threads[t].load_buffer);
+	}
+
+	qsort(latencies, nrequests, sizeof(ULONGLONG), compare);
+
+	printf("Requests: %" PRIu64 " (%" PRIu64 " errors) in %.3f s\n", nrequests, errors, (double) elapsed / 1e9);
+	printf("IOPS: %.0f\n", (double) nrequests * 1e9 / (double) elapsed);
+	printf("Faults: %.1f%% of the requests\n", (double) faults * 100.0 / (double) nrequests);
+	printf("Latency: p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+		   latencies[(nrequests - 1) * 50 / 100],
+		   latencies[(nrequests - 1) * 99 / 100],
+		   latencies[(nrequests - 1) * 999 / 1000],
+		   latencies[nrequests - 1]);
+	printf("Chunks: %" PRId64 " spilled in %" PRId64 " writes, %" PRId64 " faulted back, %" PRId64 " in the file\n",
+		   (int64_t) disk.spill.spilled, (int64_t) disk.spill.transfers, (int64_t) disk.spill.faulted, (int64_t) disk.spill.slots.count);
+	printf("Memory: %" PRIu64 " MB at the start, %" PRIu64 " MB at the lowest, %" PRIu64 " MB at the end (%" PRIu64 " periods under pressure)\n",
+		   disk.max_used >> 20, disk.min_used >> 20, chunk_table_memory_used(&disk.chunk_table) >> 20, disk.pressure_periods);
+
+	free(latencies);
+	free(threads);
+
+	mismatches += verify(&disk);
+
+	close_disk(&disk);
+
+	free(disk.reference);
+
+	if ((mismatches) || (errors)) {
+		printf("FAILED: %" PRIu64 " mismatches, %" PRIu64 " errors\n", mismatches, errors);
+		return 1;
+	}
+
+	printf("Verified\n");
+
+	return 0;
+}
+
+BOOLEAN open_disk(SPILL_DISK *disk, const char *path, ULONGLONG min_resident)
+{
+	NTSTATUS status;
+
+	if (!NT_SUCCESS(chunk_table_init(&disk->chunk_table, disk->disk_size, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Cannot create the disk.\n");
+		return FALSE;
+	}
+
+	/* The chunks come from a pool, as in the driver. */
+	chunk_pool_init(&disk->pool, DEFAULT_CHUNK_SHIFT, 0, CHUNK_POOL_CACHE);
+	chunk_quota_init(&disk->quota, &disk->pool, 0);
+
+	chunk_table_set_quota(&disk->chunk_table, &disk->quota);
+
+	range_lock_init(&disk->range_lock);
+
+	status = spill_open(&disk->spill, &disk->chunk_table, path, min_resident);
+	if (!NT_SUCCESS(status)) {
+		fprintf(stderr, "Cannot open %s (status 0x%08x).\n", path, (unsigned) status);
+		return FALSE;
+	}
+
+	if ((disk->spill_buffer = (UCHAR *) malloc(disk->spill.buffer_size)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return FALSE;
+	}
+
+	pthread_mutex_init(&disk->load_mutex, NULL);
+
+	return TRUE;
+}
+
+void close_disk(SPILL_DISK *disk)
+{
+	spill_close(&disk->spill);
+
+	pthread_mutex_destroy(&disk->load_mutex);
+	free(disk->spill_buffer);
+
+	range_lock_destroy(&disk->range_lock);
+	chunk_table_free(&disk->chunk_table);
+	chunk_pool_free(&disk->pool);
+}
+
+/* Every chunk has data, so that there is something to spill. */
+BOOLEAN fill_disk(SPILL_DISK *disk)
+{
+	ULONGLONG offset;
+	ULONGLONG random;
+	ULONG length;
+	ULONG i;
+
+	random = 0x2545f4914f6cdd1dULL;
+
+	for (offset = 0; offset < disk->disk_size; offset += length) {
+		length = ((disk->disk_size - offset) < VERIFY_BLOCK_SIZE) ? (ULONG) (disk->disk_size - offset) : VERIFY_BLOCK_SIZE;
+
+		for (i = 0; i + sizeof(random) <= length; i += sizeof(random)) {
+			next_random(&random);
+
+			memcpy(disk->reference + offset + i, &random, sizeof(random));
+		}
+
+		if (!NT_SUCCESS(disk_io_transfer(&disk->chunk_table, REQUEST_WRITE, offset, disk->reference + offset, length))) {
+			fprintf(stderr, "Cannot fill the disk.\n");
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* The order of execute_request() and EvtIoLoad in the driver. */
+NTSTATUS execute(SPILL_THREAD *thread, UCHAR operation, ULONGLONG offset, UCHAR *buffer, ULONG length)
+{
+	SPILL_DISK *disk;
+	SPILL_REQUEST request;
+	NTSTATUS status;
+
+	disk = thread->disk;
+
+	request.granted = FALSE;
+
+	/* The driver executes the waiters on behalf of the thread which releases the range; here they wait. */
+	if (!range_lock_acquire(&disk->range_lock, &request.range, offset, offset + length, (BOOLEAN) (operation != REQUEST_READ))) {
+		while (!request.granted) {
+			sched_yield();
+		}
+	}
+
+	if ((operation == REQUEST_WRITE) && (spill_pending(&disk->spill))) {
+		spill_claim(&disk->spill, &disk->chunk_table, offset, length);
+	}
+
+	status = STATUS_SUCCESS;
+
+	if ((spill_pending(&disk->spill)) && (!chunk_table_is_loaded(&disk->chunk_table, offset, length))) {
+		thread->faults++;
+
+		pthread_mutex_lock(&disk->load_mutex);
+		status = spill_load(&disk->spill, &disk->chunk_table, offset, length, thread->load_buffer);
+		pthread_mutex_unlock(&disk->load_mutex);
+	}
+
+	if (NT_SUCCESS(status)) {
+		status = disk_io_transfer(&disk->chunk_table, operation, offset, buffer, length);
+	}
+
+	/* The range is still held: the reference has the same contents as the disk. */
+	if (NT_SUCCESS(status)) {
+		if (operation == REQUEST_READ) {
+			if (memcmp(buffer, disk->reference + offset, length) != 0) {
+				thread->mismatches++;
+			}
+		} else {
+			memcpy(disk->reference + offset, buffer, length);
+		}
+	}
+
+	release(disk, &request);
+
+	return status;
+}
+
+/* Pressure during the first part of each cycle. */
+BOOLEAN under_pressure(SPILL_DISK *disk)
+{
+	ULONGLONG ms;
+
+	ms = (port_timestamp() - disk->start) / 1000000;
+
+	return (BOOLEAN) ((ms % (disk->pressure_time + disk->calm_time)) < disk->pressure_time);
+}
+
+void *spiller(void *arg)
+{
+	SPILL_DISK *disk;
+	ULONGLONG used;
+
+	disk = (SPILL_DISK *) arg;
+
+	while (!disk->stop) {
+		usleep(disk->period * 1000);
+
+		if (disk->stop) {
+			break;
+		}
+
+		spill_cold_chunks(disk);
+
+		used = chunk_table_memory_used(&disk->chunk_table);
+
+		if (disk->spill.active) {
+			disk->pressure_periods++;
+
+			if (used < disk->min_used) {
+				disk->min_used = used;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* As spill_cold_chunks() in the driver. */
+void spill_cold_chunks(SPILL_DISK *disk)
+{
+	CHUNK_TABLE *chunk_table;
+	ULONGLONG target;
+	ULONGLONG index;
+	ULONGLONG start;
+	ULONGLONG attempts;
+	ULONG count;
+	ULONG i;
+	NTSTATUS status;
+
+	chunk_table = &disk->chunk_table;
+
+	target = spill_target(&disk->spill, chunk_table_memory_used(chunk_table), under_pressure(disk));
+
+	for (attempts = 0; (attempts < chunk_table->nchunks) && (chunk_table_memory_used(chunk_table) > target); ) {
+		/* A batch of cold chunks without I/O, locked until they are in the file. */
+		for (count = 0;
+			 (count < SPILL_MAX_BATCH) && (attempts < chunk_table->nchunks) &&
+			 (chunk_table_memory_used(chunk_table) > target + ((ULONGLONG) count << chunk_table->chunk_shift));
+			 attempts++) {
+			if (!spill_next_victim(&disk->spill, chunk_table, &index)) {
+				attempts = chunk_table->nchunks;
+				break;
+			}
+
+			start = index << chunk_table->chunk_shift;
+			if (range_lock_try_acquire(&disk->range_lock, &disk->requests[count].range, start, start + ((ULONGLONG) 1 << chunk_table->chunk_shift), TRUE)) {
+				disk->indexes[count++] = index;
+			}
+		}
+
+		if (count == 0) {
+			break;
+		}
+
+		status = spill_chunks(&disk->spill, chunk_table, disk->indexes, count, disk->spill_buffer);
+
+		for (i = 0; i < count; i++) {
+			release(disk, &disk->requests[i]);
+		}
+
+		if (!NT_SUCCESS(status)) {
+			fprintf(stderr, "The chunks cannot be spilled (status 0x%08x).\n", (unsigned) status);
+			break;
+		}
+	}
+}
+
+void release(SPILL_DISK *disk, SPILL_REQUEST *request)
+{
+	RANGE_LOCK_ENTRY *granted;
+	RANGE_LOCK_ENTRY *next;
+
+	for (granted = range_lock_release(&disk->range_lock, &request->range); granted; granted = next) {
+		/* The waiter might return (and reuse its entry) as soon as it sees the flag. */
+		next = granted->next_granted;
+		InterlockedIncrement(&((SPILL_REQUEST *) granted)->granted);
+	}
+}
+
+void *worker(void *arg)
+{
+	SPILL_THREAD *thread;
+	ULONGLONG nblocks;
+	ULONGLONG nhot;
+	ULONGLONG block;
+	ULONGLONG random;
+	ULONGLONG start;
+	UCHAR operation;
+	UCHAR *buffer;
+	NTSTATUS status;
+
+	thread = (SPILL_THREAD *) arg;
+
+	if ((buffer = (UCHAR *) malloc(thread->block_size)) == NULL) {
+		return NULL;
+	}
+
+	nblocks = thread->disk->disk_size / thread->block_size;
+	nhot = nblocks / 10;
+
+	random = 0x9e3779b97f4a7c15ULL * (thread->number + 1);
+
+	for (thread->nrequests = 0; thread->nrequests < thread->count; thread->nrequests++) {
+		next_random(&random);
+
+		/* Most of the requests go to the hot part of the disk. */
+		if (((random >> 40) % 100) < thread->hot_percent) {
+			block = random % nhot;
+		} else {
+			block = nhot + (random % (nblocks - nhot));
+		}
+
+		operation = (((random >> 32) % 100) < thread->read_percent) ? REQUEST_READ : REQUEST_WRITE;
+
+		if (operation == REQUEST_WRITE) {
+			/* Something which tells the blocks and the writes apart. */
+			memset(buffer, (int) (random >> 56), thread->block_size);
+			memcpy(buffer, &random, sizeof(random));
+		}
+
+		start = port_timestamp();
+		status = execute(thread, operation, block * thread->block_size, buffer, thread->block_size);
+		thread->latencies[thread->nrequests] = port_timestamp() - start;
+
+		if (!NT_SUCCESS(status)) {
+			thread->errors++;
+		}
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+/* Returns the blocks of the disk which differ from the reference (the spilled chunks are read back). */
+ULONGLONG verify(SPILL_DISK *disk)
+{
+	ULONGLONG offset;
+	ULONGLONG mismatches;
+	ULONG length;
+	UCHAR *buffer;
+	UCHAR *load_buffer;
+
+	if (((buffer = (UCHAR *) malloc(VERIFY_BLOCK_SIZE)) == NULL) || ((load_buffer = (UCHAR *) malloc(disk->spill.buffer_size)) == NULL)) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (offset = 0, mismatches = 0; offset < disk->disk_size; offset += length) {
+		length = ((disk->disk_size - offset) < VERIFY_BLOCK_SIZE) ? (ULONG) (disk->disk_size - offset) : VERIFY_BLOCK_SIZE;
+
+		if ((!NT_SUCCESS(spill_load(&disk->spill, &disk->chunk_table, offset, length, load_buffer))) ||
+			(!NT_SUCCESS(disk_io_transfer(&disk->chunk_table, REQUEST_READ, offset, buffer, length))) ||
+			(memcmp(buffer, disk->reference + offset, length) != 0)) {
+			mismatches++;
+		}
+	}
+
+	if (disk->spill.slots.count != 0) {
+		fprintf(stderr, "%" PRId64 " slots still in use.\n", (int64_t) disk->spill.slots.count);
+		mismatches++;
+	}
+
+	free(load_buffer);
+	free(buffer);
+
+	return mismatches;
+}
+
+int compare(const void *a, const void *b)
+{
+	ULONGLONG x = *((const ULONGLONG *) a);
+	ULONGLONG y = *((const ULONGLONG *) b);
+
+	return (x > y) - (x < y);
+}
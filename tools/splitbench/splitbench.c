@@ -0,0 +1,175 @@
+/*
+ * Throughput of a single stream of large transfers on Linux, copied by one
+ * thread and then split across an increasing number of workers (split.c),
+ * with the speedup over the single thread. Without a transfer size it
+ * measures several of them: SplitThreshold is the smallest size which gets
+ * faster with the workers of the host (splitting is off by default).
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o splitbench splitbench.c ../common/tools.c \
+ *       ../../split.c ../../port_thread.c ../../disk_io.c ../../chunk_table.c \
+ *       ../../chunk_pool.c ../../bitmap.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ * Usage: splitbench [transfer_mb [max_workers]]   (transfer_mb 0: 1, 4, 16 and 64 MB)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "port.h"
+#include "split.h"
+#include "disk_io.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[transfer_mb [max_workers]]"
+#define DISK_SIZE                       (1024ULL * 1024 * 1024)
+#define BYTES_PER_RUN                   (4ULL * 1024 * 1024 * 1024) /* Copied for each number of workers. */
+#define MAX_TRANSFER_SIZE               64 /* MB. */
+
+typedef struct {
+	PORT_SEMAPHORE done;
+} STREAM;
+
+void completion(SPLIT_REQUEST *request);
+void measure_size(CHUNK_TABLE *table, ULONG max_workers, UCHAR *buffer, SIZE_T size);
+double measure(CHUNK_TABLE *table, ULONG nworkers, UCHAR *buffer, SIZE_T size, UCHAR operation);
+
+int main(int argc, char **argv)
+{
+	static const SIZE_T sizes[] = {1, 4, 16, 64};
+
+	CHUNK_TABLE table;
+	UCHAR *buffer;
+	SIZE_T size;
+	ULONG max_workers;
+	ULONG i;
+
+	size = (SIZE_T) ((argc > 1) ? atoi(argv[1]) : 0) * 1024 * 1024;
+	max_workers = (argc > 2) ? (ULONG) atoi(argv[2]) : port_cpu_count() - 1;
+
+	if ((argc > 3) || (size > DISK_SIZE)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	if (max_workers > SPLIT_MAX_PARTS - 1) {
+		max_workers = SPLIT_MAX_PARTS - 1;
+	}
+
+	if (!NT_SUCCESS(chunk_table_init(&table, DISK_SIZE, DEFAULT_CHUNK_SHIFT))) {
+		fprintf(stderr, "Cannot create the disk.\n");
+		return 1;
+	}
+
+	if ((buffer = (UCHAR *) malloc((size > 0) ? size : (SIZE_T) MAX_TRANSFER_SIZE << 20)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	memset(buffer, 0xa5, (size > 0) ? size : (SIZE_T) MAX_TRANSFER_SIZE << 20);
+
+	/* Allocate the chunks before measuring. */
+	measure(&table, 0, buffer, (size > 0) ? size : (SIZE_T) MAX_TRANSFER_SIZE << 20, REQUEST_WRITE);
+
+	printf("%lu processors\n", (unsigned long) port_cpu_count());
+
+	if (size > 0) {
+		measure_size(&table, max_workers, buffer, size);
+	} else {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			measure_size(&table, max_workers, buffer, sizes[i] << 20);
+		}
+	}
+
+	free(buffer);
+	chunk_table_free(&table);
+
+	return 0;
+}
+
+void completion(SPLIT_REQUEST *request)
+{
+	port_semaphore_release(&((STREAM *) request->context)->done, 1);
+}
+
+void measure_size(CHUNK_TABLE *table, ULONG max_workers, UCHAR *buffer, SIZE_T size)
+{
+	double read_single;
+	double write_single;
+	double read;
+	double write;
+	ULONG nworkers;
+
+	printf("\nTransfers of %lu MB\n", (unsigned long) (size >> 20));
+	printf("%8s %12s %12s %10s %10s\n", "workers", "read GB/s", "write GB/s", "read x", "write x");
+
+	read_single = 0;
+	write_single = 0;
+
+	for (nworkers = 0; nworkers <= max_workers; nworkers++) {
+		read = measure(table, nworkers, buffer, size, REQUEST_READ);
+		write = measure(table, nworkers, buffer, size, REQUEST_WRITE);
+
+		if (nworkers == 0) {
+			read_single = read;
+			write_single = write;
+		}
+
+		printf("%8lu %12.2f %12.2f %9.2fx %9.2fx\n", (unsigned long) nworkers, read, write, read / read_single, write / write_single);
+	}
+}
+
+/* Returns the GB/s of a stream of transfers of "size" bytes walking the disk. */
+double measure(CHUNK_TABLE *table, ULONG nworkers, UCHAR *buffer, SIZE_T size, UCHAR operation)
+{
+	SPLIT_POOL pool;
+	SPLIT_REQUEST request;
+	STREAM stream;
+	ULONGLONG offset;
+	ULONGLONG copied;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	NTSTATUS status;
+
+	/* Without workers everything is copied by this thread. */
+	if (!NT_SUCCESS(split_pool_init(&pool, nworkers, 1))) {
+		fprintf(stderr, "Cannot create the workers.\n");
+		exit(1);
+	}
+
+	port_semaphore_init(&stream.done);
+
+	request.completion = completion;
+	request.context = &stream;
+
+	start = port_timestamp();
+
+	for (offset = 0, copied = 0; copied < BYTES_PER_RUN; copied += size) {
+		if (offset + size > DISK_SIZE) {
+			offset = 0;
+		}
+
+		if (split_pool_should_split(&pool, size)) {
+			if (!split_execute(&pool, &request, table, operation, offset, buffer, size)) {
+				port_semaphore_wait(&stream.done);
+			}
+
+			status = request.status;
+		} else {
+			status = disk_io_transfer(table, operation, offset, buffer, size);
+		}
+
+		if (!NT_SUCCESS(status)) {
+			fprintf(stderr, "Transfer failed (status 0x%08x).\n", (unsigned) status);
+			exit(1);
+		}
+
+		offset += size;
+	}
+
+	elapsed = port_timestamp() - start;
+
+	port_semaphore_destroy(&stream.done);
+	split_pool_free(&pool);
+
+	return (double) BYTES_PER_RUN / (double) elapsed;
+}
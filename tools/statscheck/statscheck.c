@@ -0,0 +1,401 @@
+/*
+ * Test of the aggregation of the request counters (io_counters.c and
+ * cpu_queues_get_counters()) returned by IOCTL_RAMDISK_QUERY_STATISTICS,
+ * on Linux. It checks that:
+ *   - each latency falls in the bucket documented for RAMDISK_STATISTICS
+ *     ([2^(8 + i), 2^(9 + i)) ns, the first and the last buckets open), at
+ *     both ends of every bucket;
+ *   - the timestamps are converted to nanoseconds exactly, for the usual
+ *     frequencies and intervals of years, where ticks * 10^9 overflows;
+ *   - the counters of an operation add up over all the contexts, whatever
+ *     the sum held before, without touching the other operations;
+ *   - while threads count requests started and completed on different
+ *     contexts, the sums read meanwhile never go back, and once they are
+ *     done the sums, "in_flight" and the histogram are exact.
+ * Then it measures a query (the sums of all the operations, as
+ * query_statistics() does) for several numbers of contexts.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o statscheck statscheck.c ../common/tools.c \
+ *       ../../cpu_queue.c ../../io_counters.c ../../trace.c
+ *
+ * Usage: statscheck [options]
+ *   -t threads   Threads counting requests (default 4).
+ *   -n count     Requests per thread (default 1000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "cpu_queue.h"
+#include "ramdisk_ioctl.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-t threads] [-n count]"
+#define NCPUS                           16
+#define OPERATION                       5
+#define MAX_THREADS                     64
+#define ERROR_PERIOD                    7 /* Every 7th request of a thread fails. */
+#define QUERIES                         1000
+
+typedef struct {
+	CPU_QUEUES    *cpu_queues;
+	pthread_t     thread;
+	ULONG         id;
+	ULONGLONG     count;
+	volatile LONG *done;
+} COUNTER_THREAD;
+
+BOOLEAN check_buckets(void);
+BOOLEAN check_ticks(void);
+BOOLEAN check_sums(void);
+BOOLEAN check_concurrent(ULONG nthreads, ULONGLONG count);
+double measure_query(ULONG ncpus);
+void *count_requests(void *arg);
+ULONGLONG request_latency(ULONGLONG i);
+
+int main(int argc, char **argv)
+{
+	static const ULONG ncpus[] = { 1, 4, 16, 64, 256, 1024 };
+	ULONGLONG count;
+	ULONG nthreads;
+	ULONG i;
+	BOOLEAN ok;
+	int opt;
+
+	nthreads = 4;
+	count = 1000000;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+			case 't':
+				if (((nthreads = (ULONG) atoi(optarg)) == 0) || (nthreads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "The latencies fall in the documented buckets", (check_buckets()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "The timestamps convert to nanoseconds exactly", (check_ticks()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "The counters add up over the contexts", (check_sums()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "The sums read during the updates never go back", (check_concurrent(nthreads, count)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	if (ok) {
+		printf("\nQuery of the %u operations, microseconds:\n", CPU_QUEUE_COUNTERS);
+		printf("%10s %12s\n", "Contexts", "Query");
+
+		for (i = 0; i < sizeof(ncpus) / sizeof(ncpus[0]); i++) {
+			printf("%10u %12.2f\n", ncpus[i], measure_query(ncpus[i]));
+		}
+	}
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_buckets(void)
+{
+	ULONG i;
+	BOOLEAN ok;
+
+	/* The first bucket has everything below 512 ns, the last one everything from 2^31 ns. */
+	ok = (BOOLEAN) ((IO_LATENCY_BUCKETS == RAMDISK_LATENCY_BUCKETS) && (io_latency_bucket(0) == 0) && (io_latency_bucket(1) == 0) && (io_latency_bucket(511) == 0));
+	ok = (BOOLEAN) (ok && (io_latency_bucket((ULONGLONG) -1) == IO_LATENCY_BUCKETS - 1));
+	ok = (BOOLEAN) (ok && (io_latency_bucket((ULONGLONG) 1 << 40) == IO_LATENCY_BUCKETS - 1));
+
+	for (i = 1; (ok) && (i < IO_LATENCY_BUCKETS - 1); i++) {
+		ok = (BOOLEAN) ((io_latency_bucket((ULONGLONG) 1 << (8 + i)) == i) && (io_latency_bucket(((ULONGLONG) 1 << (9 + i)) - 1) == i));
+	}
+
+	ok = (BOOLEAN) (ok && (io_latency_bucket((ULONGLONG) 1 << (8 + IO_LATENCY_BUCKETS - 1)) == IO_LATENCY_BUCKETS - 1));
+
+	return ok;
+}
+
+BOOLEAN check_ticks(void)
+{
+	/* The performance counter (10 MHz), the HPET, a TSC and an odd one. */
+	static const ULONGLONG frequencies[] = { 10000000, 14318180, 1000000000, 2994374000ULL, 3579545 };
+	static const ULONGLONG seconds[] = { 0, 1, 59, 3600, 86400 * 365 * 10ULL };
+	unsigned __int128 expected;
+	ULONGLONG ticks;
+	ULONGLONG seed;
+	ULONG i;
+	ULONG j;
+	ULONG k;
+	BOOLEAN ok;
+
+	ok = TRUE;
+	seed = RANDOM_SEED;
+
+	for (i = 0; (ok) && (i < sizeof(frequencies) / sizeof(frequencies[0])); i++) {
+		ok = (BOOLEAN) ((io_ticks_to_ns(0, frequencies[i]) == 0) && (io_ticks_to_ns(frequencies[i], frequencies[i]) == 1000000000ULL));
+
+		for (j = 0; (ok) && (j < sizeof(seconds) / sizeof(seconds[0])); j++) {
+			for (k = 0; (ok) && (k < 1000); k++) {
+				/* A few seconds and a fraction, or any number of ticks below a second. */
+				ticks = seconds[j] * frequencies[i] + ((k == 0) ? frequencies[i] - 1 : next_random(&seed) % frequencies[i]);
+
+				expected = (unsigned __int128) ticks * 1000000000ULL / frequencies[i];
+
+				ok = (BOOLEAN) (io_ticks_to_ns(ticks, frequencies[i]) == (ULONGLONG) expected);
+			}
+		}
+	}
+
+	return ok;
+}
+
+BOOLEAN check_sums(void)
+{
+	CPU_QUEUES cpu_queues;
+	IO_COUNTERS expected;
+	IO_COUNTERS counters;
+	IO_COUNTERS *queue;
+	ULONGLONG seed;
+	ULONGLONG latency;
+	ULONGLONG bytes;
+	ULONG cpu;
+	ULONG i;
+	BOOLEAN error;
+	BOOLEAN ok;
+
+	/* 16 processors in groups of 3: the last context has a single processor. */
+	if (!NT_SUCCESS(cpu_queues_init(&cpu_queues, NCPUS, 3, 0))) {
+		return FALSE;
+	}
+
+	RtlZeroMemory(&expected, sizeof(expected));
+
+	seed = RANDOM_SEED;
+
+	for (i = 0; i < 10000; i++) {
+		cpu = (ULONG) (next_random(&seed) % NCPUS);
+		latency = next_random(&seed) >> (next_random(&seed) % 64);
+		bytes = (next_random(&seed) % 256) * 512;
+		error = (BOOLEAN) ((next_random(&seed) % 10) == 0);
+
+		queue = &cpu_queues_select(&cpu_queues, cpu)->counters[OPERATION];
+
+		io_counters_start(queue);
+		io_counters_complete(queue, bytes, error, latency);
+
+		expected.requests++;
+		expected.bytes += (error) ? 0 : (LONGLONG) bytes;
+		expected.errors += (error) ? 1 : 0;
+		expected.latency[io_latency_bucket(latency)]++;
+	}
+
+	/* Still in flight: started on every processor. */
+	for (cpu = 0; cpu < NCPUS; cpu++) {
+		io_counters_start(&cpu_queues_select(&cpu_queues, cpu)->counters[OPERATION]);
+	}
+
+	expected.in_flight = NCPUS;
+
+	/* Whatever was in the sum is overwritten. */
+	memset(&counters, 0xcc, sizeof(counters));
+
+	cpu_queues_get_counters(&cpu_queues, OPERATION, &counters);
+
+	ok = (BOOLEAN) ((cpu_queues.nqueues == (NCPUS + 2) / 3) && (cpu_queues.queues[cpu_queues.nqueues - 1].data.counters[OPERATION].in_flight == 1));
+	ok = (BOOLEAN) (ok && (memcmp(&counters, &expected, sizeof(IO_COUNTERS)) == 0));
+
+	/* The other operations have nothing. */
+	RtlZeroMemory(&expected, sizeof(expected));
+
+	for (i = 0; (ok) && (i < CPU_QUEUE_COUNTERS); i++) {
+		if (i != OPERATION) {
+			memset(&counters, 0xcc, sizeof(counters));
+
+			cpu_queues_get_counters(&cpu_queues, i, &counters);
+
+			ok = (BOOLEAN) (memcmp(&counters, &expected, sizeof(IO_COUNTERS)) == 0);
+		}
+	}
+
+	/* io_counters_add() accumulates. */
+	cpu_queues_get_counters(&cpu_queues, OPERATION, &counters);
+	cpu_queues_get_counters(&cpu_queues, OPERATION, &expected);
+
+	io_counters_add(&counters, &expected);
+
+	ok = (BOOLEAN) (ok && (counters.requests == 2 * expected.requests) && (counters.bytes == 2 * expected.bytes));
+	ok = (BOOLEAN) (ok && (counters.errors == 2 * expected.errors) && (counters.in_flight == 2 * NCPUS));
+
+	for (i = 0; (ok) && (i < IO_LATENCY_BUCKETS); i++) {
+		ok = (BOOLEAN) (counters.latency[i] == 2 * expected.latency[i]);
+	}
+
+	cpu_queues_free(&cpu_queues);
+
+	return ok;
+}
+
+BOOLEAN check_concurrent(ULONG nthreads, ULONGLONG count)
+{
+	COUNTER_THREAD threads[MAX_THREADS];
+	CPU_QUEUES cpu_queues;
+	IO_COUNTERS previous;
+	IO_COUNTERS counters;
+	IO_COUNTERS expected;
+	volatile LONG done;
+	ULONGLONG nreads;
+	ULONGLONG i;
+	ULONG t;
+	ULONG j;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(cpu_queues_init(&cpu_queues, NCPUS, 1, 0))) {
+		return FALSE;
+	}
+
+	done = 0;
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].cpu_queues = &cpu_queues;
+		threads[t].id = t;
+		threads[t].count = count;
+		threads[t].done = &done;
+
+		if (pthread_create(&threads[t].thread, NULL, count_requests, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	/* Read as the queries do, until all the threads are done. */
+	RtlZeroMemory(&previous, sizeof(previous));
+
+	ok = TRUE;
+	nreads = 0;
+
+	while (done < (LONG) nthreads) {
+		cpu_queues_get_counters(&cpu_queues, OPERATION, &counters);
+
+		ok = (BOOLEAN) (ok && (counters.requests >= previous.requests) && (counters.bytes >= previous.bytes) && (counters.errors >= previous.errors));
+
+		for (j = 0; j < IO_LATENCY_BUCKETS; j++) {
+			ok = (BOOLEAN) (ok && (counters.latency[j] >= previous.latency[j]));
+		}
+
+		previous = counters;
+		nreads++;
+
+		sched_yield();
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	/* Once done: exact. */
+	RtlZeroMemory(&expected, sizeof(expected));
+
+	for (i = 0; i < count; i++) {
+		expected.requests += nthreads;
+
+		if ((i % ERROR_PERIOD) == ERROR_PERIOD - 1) {
+			expected.errors += nthreads;
+		} else {
+			expected.bytes += (LONGLONG) (nthreads * 4096);
+		}
+
+		expected.latency[io_latency_bucket(request_latency(i))] += nthreads;
+	}
+
+	cpu_queues_get_counters(&cpu_queues, OPERATION, &counters);
+
+	ok = (BOOLEAN) (ok && (nreads > 0) && (memcmp(&counters, &expected, sizeof(IO_COUNTERS)) == 0));
+
+	cpu_queues_free(&cpu_queues);
+
+	return ok;
+}
+
+double measure_query(ULONG ncpus)
+{
+	CPU_QUEUES cpu_queues;
+	IO_COUNTERS counters;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONG i;
+	ULONG j;
+
+	if (!NT_SUCCESS(cpu_queues_init(&cpu_queues, ncpus, 1, 0))) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	start = port_timestamp();
+
+	for (i = 0; i < QUERIES; i++) {
+		for (j = 0; j < CPU_QUEUE_COUNTERS; j++) {
+			cpu_queues_get_counters(&cpu_queues, j, &counters);
+		}
+	}
+
+	elapsed = port_timestamp() - start;
+
+	cpu_queues_free(&cpu_queues);
+
+	return (double) elapsed / QUERIES / 1e3;
+}
+
+/* Each request is started on a processor and completed on the next one. */
+void *count_requests(void *arg)
+{
+	COUNTER_THREAD *thread;
+	ULONGLONG i;
+	ULONG cpu;
+
+	thread = (COUNTER_THREAD *) arg;
+
+	for (i = 0; i < thread->count; i++) {
+		cpu = (ULONG) (thread->id + i) % NCPUS;
+
+		io_counters_start(&cpu_queues_select(thread->cpu_queues, cpu)->counters[OPERATION]);
+
+		if ((i % ERROR_PERIOD) == ERROR_PERIOD - 1) {
+			io_counters_complete(&cpu_queues_select(thread->cpu_queues, cpu + 1)->counters[OPERATION], 4096, TRUE, request_latency(i));
+		} else {
+			io_counters_complete(&cpu_queues_select(thread->cpu_queues, cpu + 1)->counters[OPERATION], 4096, FALSE, request_latency(i));
+		}
+	}
+
+	InterlockedIncrement(thread->done);
+
+	return NULL;
+}
+
+/* Every bucket in turn. */
+ULONGLONG request_latency(ULONGLONG i)
+{
+	return ((ULONGLONG) 1 << (8 + i % (IO_LATENCY_BUCKETS + 1))) + i % 256;
+}
@@ -0,0 +1,758 @@
+/*
+ * Test of the request trace rings (trace.c, cpu_queues_read_trace()) and of
+ * the decoding of the traces by tools/tracedump, on Linux.
+ * It checks that:
+ *   - the rings have a power of two records, and none when disabled;
+ *   - the records are read oldest first, in batches of any size, with their
+ *     sequence numbers, and once only;
+ *   - when the reader falls behind, the newest records are kept and the
+ *     others are counted as lost;
+ *   - the records of all the contexts are read, starting with a different
+ *     context every time;
+ *   - while threads write records, to a ring large enough and to a ring of
+ *     a few records, the reader never returns a record mixing two writes,
+ *     the records of each thread come in order and every record is either
+ *     read or counted as lost;
+ *   - tracedump decodes a trace file as the driver and "ramstat -t" write
+ *     it (the records, their times and the summary per operation), and
+ *     rejects truncated files and unknown versions.
+ * Then it measures the time to write a record from 1 to "max_threads"
+ * threads, each with its own ring (as each processor in the driver) and
+ * with a single ring, and the cost of a disabled trace.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o tracecheck tracecheck.c ../common/tools.c \
+ *       ../../cpu_queue.c ../../io_counters.c ../../trace.c
+ * (and tools/tracedump).
+ *
+ * Usage: tracecheck [options]
+ *   -d program   tracedump to check (default: tracedump in the directory of
+ *                tracecheck, or else in ../tracedump from there).
+ *   -f file      Trace file written for tracedump (default tracecheck.trc;
+ *                its output goes to file.out, both deleted at the end).
+ *   -t threads   Maximum number of threads (default: processors, at least 4).
+ *   -n count     Records written per thread (default 1000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "port.h"
+#include "cpu_queue.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-d program] [-f file] [-t threads] [-n count]"
+#define MAX_THREADS                     64
+#define RING_RECORDS                    4096
+#define SMALL_RING_RECORDS              4
+#define READ_BATCH                      100
+#define DUMP_RECORDS                    1000
+#define FREQUENCY                       10000000 /* 100 ns ticks, as the performance counter. */
+#define DUMP_ERROR                      0xC0000185 /* STATUS_IO_DEVICE_ERROR */
+
+typedef struct {
+	TRACE_RING    *ring;
+	pthread_t     thread;
+	ULONG         id;
+	ULONGLONG     count;
+	volatile LONG *done;
+} TRACE_THREAD;
+
+BOOLEAN check_sizes(void);
+BOOLEAN check_order(void);
+BOOLEAN check_overwrite(void);
+BOOLEAN check_queues(void);
+BOOLEAN check_concurrent(ULONG nthreads, ULONGLONG count, ULONG nrecords);
+BOOLEAN check_dump(const char *program, const char *filename, const char *output);
+BOOLEAN check_dump_errors(const char *program, const char *filename, const char *output);
+double measure(ULONG nthreads, ULONGLONG count, BOOLEAN shared, BOOLEAN enabled);
+void *write_records(void *arg);
+void make_record(RAMDISK_TRACE_RECORD *record, ULONG id, ULONGLONG n);
+BOOLEAN check_record(const RAMDISK_TRACE_RECORD *record);
+void make_dump_record(RAMDISK_TRACE_RECORD *record, ULONG i);
+BOOLEAN write_trace(FILE *file, ULONG nrecords, ULONGLONG lost, const RAMDISK_TRACE_RECORD *records);
+int run_dump(const char *program, const char *options, const char *filename, const char *output);
+void find_dump(const char *self, char *program, size_t size);
+
+int main(int argc, char **argv)
+{
+	char program[1024];
+	const char *filename;
+	char output[1024];
+	ULONGLONG count;
+	ULONG max_threads;
+	ULONG nthreads;
+	BOOLEAN ok;
+	int opt;
+
+	max_threads = port_cpu_count();
+	if (max_threads < 4) {
+		max_threads = 4;
+	} else if (max_threads > MAX_THREADS) {
+		max_threads = MAX_THREADS;
+	}
+
+	find_dump(argv[0], program, sizeof(program));
+	filename = "tracecheck.trc";
+	count = 1000000;
+
+	while ((opt = getopt(argc, argv, "d:f:t:n:")) != -1) {
+		switch (opt) {
+			case 'd':
+				snprintf(program, sizeof(program), "%s", optarg);
+				break;
+			case 'f':
+				filename = optarg;
+				break;
+			case 't':
+				if (((max_threads = (ULONG) atoi(optarg)) == 0) || (max_threads > MAX_THREADS)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	snprintf(output, sizeof(output), "%s.out", filename);
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "The rings have a power of two records", (check_sizes()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "The records are read in order, once", (check_order()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "A full ring keeps the newest records", (check_overwrite()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "The rings of all the contexts are read in turn", (check_queues()) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Concurrent writers: every record read or lost", (check_concurrent(max_threads, count / 10, RING_RECORDS)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Concurrent writers, small ring: no torn records", (check_concurrent(max_threads, count / 10, SMALL_RING_RECORDS)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "tracedump decodes the records and the summary", (check_dump(program, filename, output)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "tracedump rejects truncated and unknown traces", (check_dump_errors(program, filename, output)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	remove(filename);
+	remove(output);
+
+	if (ok) {
+		printf("\nTime to write a record (ns), %u processors:\n", port_cpu_count());
+		printf("%8s %12s %12s %12s\n", "Threads", "Own rings", "One ring", "Disabled");
+
+		for (nthreads = 1; nthreads <= max_threads; nthreads = (nthreads < 4) ? nthreads + 1 : nthreads * 2) {
+			printf("%8u %12.2f %12.2f %12.2f\n",
+				nthreads,
+				measure(nthreads, count, FALSE, TRUE),
+				measure(nthreads, count, TRUE, TRUE),
+				measure(nthreads, count, FALSE, FALSE));
+		}
+	}
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_sizes(void)
+{
+	static const ULONG sizes[][2] = { { 1, 1 }, { 2, 2 }, { 3, 4 }, { 5, 8 }, { 4096, 4096 }, { 4097, 8192 } };
+	RAMDISK_TRACE_RECORD record;
+	TRACE_RING ring;
+	ULONGLONG lost;
+	ULONG i;
+	BOOLEAN ok;
+
+	/* Disabled: nothing to write to, nothing to read. */
+	ok = (BOOLEAN) ((NT_SUCCESS(trace_ring_init(&ring, 0))) && (!trace_ring_enabled(&ring)));
+
+	lost = 0;
+
+	ok = (BOOLEAN) (ok && (trace_ring_read(&ring, &record, 1, &lost) == 0) && (lost == 0));
+
+	trace_ring_free(&ring);
+
+	for (i = 0; (ok) && (i < sizeof(sizes) / sizeof(sizes[0])); i++) {
+		ok = (BOOLEAN) ((NT_SUCCESS(trace_ring_init(&ring, sizes[i][0]))) && (trace_ring_enabled(&ring)) && (ring.mask + 1 == sizes[i][1]));
+		ok = (BOOLEAN) (ok && (ring.head == 0) && (ring.tail == 0) && (ring.records[ring.mask].sequence == 0));
+
+		trace_ring_free(&ring);
+	}
+
+	return ok;
+}
+
+BOOLEAN check_order(void)
+{
+	RAMDISK_TRACE_RECORD records[RING_RECORDS];
+	RAMDISK_TRACE_RECORD record;
+	TRACE_RING ring;
+	ULONGLONG lost;
+	ULONG batch;
+	ULONG n;
+	ULONG read;
+	ULONG i;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(trace_ring_init(&ring, RING_RECORDS))) {
+		return FALSE;
+	}
+
+	/* Written in two parts, read in batches of 1, 2, 3... records. */
+	ok = TRUE;
+	lost = 0;
+	read = 0;
+	batch = 1;
+
+	for (i = 0; i < RING_RECORDS / 2; i++) {
+		make_record(&record, 0, i);
+
+		/* The ring assigns the sequence number. */
+		record.sequence = 12345;
+
+		trace_ring_write(&ring, &record);
+	}
+
+	while ((ok) && ((n = trace_ring_read(&ring, records + read, batch, &lost)) > 0)) {
+		ok = (BOOLEAN) (n <= batch);
+
+		read += n;
+		batch++;
+
+		if (read == RING_RECORDS / 2) {
+			for (i = RING_RECORDS / 2; i < RING_RECORDS - 1; i++) {
+				make_record(&record, 0, i);
+				trace_ring_write(&ring, &record);
+			}
+		}
+	}
+
+	ok = (BOOLEAN) (ok && (read == RING_RECORDS - 1) && (lost == 0));
+
+	for (i = 0; (ok) && (i < read); i++) {
+		make_record(&record, 0, i);
+
+		record.sequence = i + 1;
+
+		ok = (BOOLEAN) (memcmp(&records[i], &record, sizeof(record)) == 0);
+	}
+
+	/* Nothing left. */
+	ok = (BOOLEAN) (ok && (trace_ring_read(&ring, records, RING_RECORDS, &lost) == 0) && (ring.tail == ring.head));
+
+	trace_ring_free(&ring);
+
+	return ok;
+}
+
+BOOLEAN check_overwrite(void)
+{
+	RAMDISK_TRACE_RECORD records[RING_RECORDS];
+	RAMDISK_TRACE_RECORD record;
+	TRACE_RING ring;
+	ULONGLONG written;
+	ULONGLONG lost;
+	ULONG n;
+	ULONG i;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(trace_ring_init(&ring, RING_RECORDS))) {
+		return FALSE;
+	}
+
+	/* Three times around and a bit, then read. */
+	written = 3 * RING_RECORDS + 5;
+
+	for (i = 0; i < written; i++) {
+		make_record(&record, 0, i);
+		trace_ring_write(&ring, &record);
+	}
+
+	lost = 7;
+
+	n = trace_ring_read(&ring, records, RING_RECORDS, &lost);
+
+	ok = (BOOLEAN) ((n == RING_RECORDS) && (lost == 7 + written - RING_RECORDS));
+
+	for (i = 0; (ok) && (i < n); i++) {
+		ok = (BOOLEAN) ((check_record(&records[i])) && (records[i].sequence == written - RING_RECORDS + i + 1) && (records[i].offset == written - RING_RECORDS + i));
+	}
+
+	/* Falling behind again, while reading in small batches. */
+	for (i = 0; i < RING_RECORDS + 1; i++) {
+		make_record(&record, 0, written + i);
+		trace_ring_write(&ring, &record);
+	}
+
+	lost = 0;
+
+	ok = (BOOLEAN) (ok && (trace_ring_read(&ring, records, 10, &lost) == 10) && (lost == 1) && (records[0].sequence == written + 2));
+	ok = (BOOLEAN) (ok && (trace_ring_read(&ring, records, RING_RECORDS, &lost) == RING_RECORDS - 10) && (lost == 1));
+
+	trace_ring_free(&ring);
+
+	return ok;
+}
+
+BOOLEAN check_queues(void)
+{
+	RAMDISK_TRACE_RECORD records[64];
+	RAMDISK_TRACE_RECORD record;
+	CPU_QUEUES cpu_queues;
+	ULONGLONG lost;
+	ULONG counts[4];
+	ULONG firsts[4];
+	ULONG total;
+	ULONG n;
+	ULONG i;
+	ULONG j;
+	BOOLEAN ok;
+
+	/* 4 contexts of 2 processors, 16 records each (12 on the last one, which loses 4). */
+	if (!NT_SUCCESS(cpu_queues_init(&cpu_queues, 8, 2, 16))) {
+		return FALSE;
+	}
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < ((i == 3) ? 20 : 12); j++) {
+			make_record(&record, i, j);
+			trace_ring_write(&cpu_queues_select(&cpu_queues, 2 * i + (j & 1))->trace, &record);
+		}
+	}
+
+	/* Reads of 5 records: each one starts with the next context. */
+	memset(counts, 0, sizeof(counts));
+
+	lost = 0;
+	total = 0;
+	ok = TRUE;
+
+	for (i = 0; (ok) && ((n = cpu_queues_read_trace(&cpu_queues, records, 5, &lost)) > 0); i++) {
+		if (i < 4) {
+			firsts[i] = records[0].cpu;
+		}
+
+		for (j = 0; (ok) && (j < n); j++) {
+			ok = (BOOLEAN) ((check_record(&records[j])) && (records[j].cpu < 4));
+
+			counts[records[j].cpu]++;
+		}
+
+		total += n;
+	}
+
+	ok = (BOOLEAN) (ok && (i >= 4) && (total == 3 * 12 + 16) && (lost == 4));
+	ok = (BOOLEAN) (ok && (counts[0] == 12) && (counts[1] == 12) && (counts[2] == 12) && (counts[3] == 16));
+	ok = (BOOLEAN) (ok && (firsts[0] == 0) && (firsts[1] == 1) && (firsts[2] == 2) && (firsts[3] == 3));
+
+	cpu_queues_free(&cpu_queues);
+
+	return ok;
+}
+
+BOOLEAN check_concurrent(ULONG nthreads, ULONGLONG count, ULONG nrecords)
+{
+	TRACE_THREAD threads[MAX_THREADS];
+	RAMDISK_TRACE_RECORD records[READ_BATCH];
+	ULONGLONG next[MAX_THREADS];
+	TRACE_RING ring;
+	ULONGLONG sequence;
+	ULONGLONG read;
+	ULONGLONG lost;
+	volatile LONG done;
+	ULONG n;
+	ULONG t;
+	ULONG i;
+	BOOLEAN ok;
+
+	if (!NT_SUCCESS(trace_ring_init(&ring, nrecords))) {
+		return FALSE;
+	}
+
+	done = 0;
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].ring = &ring;
+		threads[t].id = t;
+		threads[t].count = count;
+		threads[t].done = &done;
+
+		next[t] = 0;
+
+		if (pthread_create(&threads[t].thread, NULL, write_records, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	ok = TRUE;
+	read = 0;
+	lost = 0;
+	sequence = 0;
+
+	/* Read while they write, and what is left once they are done. */
+	do {
+		t = (ULONG) done;
+
+		while ((n = trace_ring_read(&ring, records, READ_BATCH, &lost)) > 0) {
+			for (i = 0; i < n; i++) {
+				ok = (BOOLEAN) (ok && (check_record(&records[i])) && (records[i].sequence > sequence));
+				ok = (BOOLEAN) (ok && (records[i].cpu < nthreads) && (records[i].offset >= next[records[i].cpu]));
+
+				if (ok) {
+					sequence = records[i].sequence;
+					next[records[i].cpu] = records[i].offset + 1;
+				}
+			}
+
+			read += n;
+		}
+
+		sched_yield();
+	} while (t < nthreads);
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	ok = (BOOLEAN) (ok && (ring.tail == ring.head) && (read + lost == nthreads * count) && (read > 0));
+
+	trace_ring_free(&ring);
+
+	return ok;
+}
+
+BOOLEAN check_dump(const char *program, const char *filename, const char *output)
+{
+	RAMDISK_TRACE_RECORD records[DUMP_RECORDS];
+	RAMDISK_TRACE_RECORD expected;
+	ULONGLONG requests[3];
+	ULONGLONG errors[3];
+	ULONGLONG bytes[3];
+	ULONGLONG values[3];
+	ULONGLONG sequence;
+	ULONGLONG offset;
+	ULONGLONG length;
+	ULONGLONG wait;
+	ULONGLONG service;
+	LONGLONG arrival;
+	ULONG status;
+	ULONG nrecords;
+	ULONG cpu;
+	ULONG i;
+	char operation[16];
+	char line[256];
+	char name[16];
+	FILE *file;
+	BOOLEAN ok;
+
+	memset(requests, 0, sizeof(requests));
+	memset(errors, 0, sizeof(errors));
+	memset(bytes, 0, sizeof(bytes));
+
+	nrecords = 0;
+
+	for (i = 0; i < DUMP_RECORDS; i++) {
+		make_dump_record(&records[i], i);
+
+		/* Unknown operations are skipped. */
+		if (records[i].operation < 3) {
+			requests[records[i].operation]++;
+
+			if (records[i].status == DUMP_ERROR) {
+				errors[records[i].operation]++;
+			} else {
+				bytes[records[i].operation] += records[i].length;
+			}
+
+			nrecords++;
+		}
+	}
+
+	/* As "ramstat -t" saves them: a trace per read, one with only lost records. */
+	if ((file = fopen(filename, "wb")) == NULL) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) ((write_trace(file, 300, 0, records)) && (write_trace(file, 0, 17, NULL)) && (write_trace(file, DUMP_RECORDS - 300, 3, records + 300)));
+
+	fclose(file);
+
+	/* The records. */
+	ok = (BOOLEAN) (ok && (run_dump(program, "", filename, output) == 0) && ((file = fopen(output, "r")) != NULL));
+
+	if (ok) {
+		ok = (BOOLEAN) ((fgets(line, sizeof(line), file) != NULL) && (strncmp(line, "sequence cpu operation", 22) == 0));
+
+		for (i = 0; (ok) && (i < DUMP_RECORDS); i++) {
+			make_dump_record(&expected, i);
+
+			if (expected.operation >= 3) {
+				continue;
+			}
+
+			ok = (BOOLEAN) ((fgets(line, sizeof(line), file) != NULL) &&
+				(sscanf(line, "%" SCNu64 " %u %15s %" SCNu64 " %" SCNu64 " %x %" SCNd64 " %" SCNu64 " %" SCNu64,
+					&sequence, &cpu, operation, &offset, &length, &status, &arrival, &wait, &service) == 9));
+
+			/* Times in ns from the first arrival. */
+			ok = (BOOLEAN) (ok && (sequence == expected.sequence) && (cpu == expected.cpu) && (offset == expected.offset) && (length == expected.length));
+			ok = (BOOLEAN) (ok && (strcmp(operation, (expected.operation == 0) ? "read" : (expected.operation == 1) ? "write" : "trim") == 0) && (status == expected.status));
+			ok = (BOOLEAN) (ok && (arrival == (LONGLONG) (expected.arrival - records[0].arrival) * (1000000000 / FREQUENCY)));
+			ok = (BOOLEAN) (ok && (wait == (expected.dispatch - expected.arrival) * (1000000000 / FREQUENCY)));
+			ok = (BOOLEAN) (ok && (service == (expected.completion - expected.dispatch) * (1000000000 / FREQUENCY)));
+		}
+
+		ok = (BOOLEAN) (ok && (fgets(line, sizeof(line), file) == NULL));
+
+		fclose(file);
+	}
+
+	/* The summary. */
+	ok = (BOOLEAN) (ok && (run_dump(program, "-s ", filename, output) == 0) && ((file = fopen(output, "r")) != NULL));
+
+	if (ok) {
+		ok = (BOOLEAN) ((fgets(line, sizeof(line), file) != NULL) &&
+			(sscanf(line, "%" SCNu64 " requests, %" SCNu64 " lost.", &values[0], &values[1]) == 2) &&
+			(values[0] == nrecords) && (values[1] == 20));
+
+		for (i = 0; (ok) && (i < 3); i++) {
+			/* Skip the histograms. */
+			do {
+				ok = (BOOLEAN) (fgets(line, sizeof(line), file) != NULL);
+			} while ((ok) && (line[0] == ' ' || line[0] == '\n'));
+
+			ok = (BOOLEAN) (ok && (sscanf(line, "%15[a-z]: %" SCNu64 " requests, %" SCNu64 " errors, %" SCNu64 " bytes.", name, &values[0], &values[1], &values[2]) == 4));
+			ok = (BOOLEAN) (ok && (strcmp(name, (i == 0) ? "read" : (i == 1) ? "write" : "trim") == 0));
+			ok = (BOOLEAN) (ok && (values[0] == requests[i]) && (values[1] == errors[i]) && (values[2] == bytes[i]));
+		}
+
+		fclose(file);
+	}
+
+	return ok;
+}
+
+BOOLEAN check_dump_errors(const char *program, const char *filename, const char *output)
+{
+	RAMDISK_TRACE_RECORD records[4];
+	RAMDISK_TRACE trace;
+	FILE *file;
+	ULONG i;
+	BOOLEAN ok;
+
+	for (i = 0; i < 4; i++) {
+		make_dump_record(&records[i], i);
+	}
+
+	/* The last record is cut. */
+	if ((file = fopen(filename, "wb")) == NULL) {
+		return FALSE;
+	}
+
+	ok = (BOOLEAN) (write_trace(file, 4, 0, records));
+
+	fclose(file);
+
+	ok = (BOOLEAN) (ok && (truncate(filename, sizeof(RAMDISK_TRACE) + 4 * sizeof(RAMDISK_TRACE_RECORD) - 8) == 0));
+	ok = (BOOLEAN) (ok && (run_dump(program, "-s ", filename, output) == 1));
+
+	/* A newer version. */
+	memset(&trace, 0, sizeof(trace));
+
+	trace.version = RAMDISK_TRACE_VERSION + 1;
+	trace.frequency = FREQUENCY;
+
+	ok = (BOOLEAN) (ok && ((file = fopen(filename, "wb")) != NULL));
+
+	if (ok) {
+		ok = (BOOLEAN) (fwrite(&trace, sizeof(trace), 1, file) == 1);
+		fclose(file);
+	}
+
+	ok = (BOOLEAN) (ok && (run_dump(program, "-s ", filename, output) == 1));
+
+	/* An empty file is an empty trace. */
+	ok = (BOOLEAN) (ok && ((file = fopen(filename, "wb")) != NULL));
+
+	if (ok) {
+		fclose(file);
+	}
+
+	ok = (BOOLEAN) (ok && (run_dump(program, "-s ", filename, output) == 0));
+
+	return ok;
+}
+
+double measure(ULONG nthreads, ULONGLONG count, BOOLEAN shared, BOOLEAN enabled)
+{
+	TRACE_THREAD threads[MAX_THREADS];
+	TRACE_RING rings[MAX_THREADS];
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	volatile LONG done;
+	ULONG t;
+
+	for (t = 0; t < nthreads; t++) {
+		if (!NT_SUCCESS(trace_ring_init(&rings[t], (enabled) ? RING_RECORDS : 0))) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	done = 0;
+
+	start = port_timestamp();
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].ring = &rings[(shared) ? 0 : t];
+		threads[t].id = t;
+		threads[t].count = count;
+		threads[t].done = &done;
+
+		if (pthread_create(&threads[t].thread, NULL, write_records, &threads[t]) != 0) {
+			fprintf(stderr, "Cannot create the threads.\n");
+			exit(1);
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	elapsed = port_timestamp() - start;
+
+	for (t = 0; t < nthreads; t++) {
+		trace_ring_free(&rings[t]);
+	}
+
+	/* Per record and thread: the threads share the processors. */
+	return (double) elapsed * ((nthreads < port_cpu_count()) ? nthreads : port_cpu_count()) / ((double) nthreads * count);
+}
+
+/* As complete_request(): nothing but the check when the trace is disabled. */
+void *write_records(void *arg)
+{
+	RAMDISK_TRACE_RECORD record;
+	TRACE_THREAD *thread;
+	ULONGLONG i;
+
+	thread = (TRACE_THREAD *) arg;
+
+	for (i = 0; i < thread->count; i++) {
+		if (trace_ring_enabled(thread->ring)) {
+			make_record(&record, thread->id, i);
+			trace_ring_write(thread->ring, &record);
+		}
+	}
+
+	InterlockedIncrement(thread->done);
+
+	return NULL;
+}
+
+/* Every field depends on the thread ("cpu") and its record number ("offset"), so that a mix of two records shows. */
+void make_record(RAMDISK_TRACE_RECORD *record, ULONG id, ULONGLONG n)
+{
+	ULONGLONG hash;
+
+	hash = (n + ((ULONGLONG) id << 40)) * 0x9e3779b97f4a7c15ULL;
+
+	record->sequence = 0;
+	record->offset = n;
+	record->length = hash >> 32;
+	record->arrival = hash;
+	record->dispatch = hash ^ 0x5555555555555555ULL;
+	record->completion = hash + n;
+	record->status = (ULONG) hash;
+	record->cpu = (USHORT) id;
+	record->operation = (UCHAR) (hash >> 61);
+	record->reserved = 0;
+}
+
+BOOLEAN check_record(const RAMDISK_TRACE_RECORD *record)
+{
+	RAMDISK_TRACE_RECORD expected;
+
+	make_record(&expected, record->cpu, record->offset);
+
+	expected.sequence = record->sequence;
+
+	return (BOOLEAN) ((record->sequence > 0) && (memcmp(record, &expected, sizeof(expected)) == 0));
+}
+
+/* Requests of every operation (and some unknown ones), of 512 bytes to 64 KB, a few failed. */
+void make_dump_record(RAMDISK_TRACE_RECORD *record, ULONG i)
+{
+	record->sequence = i + 1;
+	record->offset = (ULONGLONG) i * 4096;
+	record->length = 512ULL << (i % 8);
+	record->arrival = 1000000 + (ULONGLONG) i * 7 - ((i % 10 == 3) ? 500 : 0);
+	record->dispatch = record->arrival + (i % 13);
+	record->completion = record->dispatch + 10 * (i % 101);
+	record->status = ((i % 5) == 4) ? DUMP_ERROR : 0;
+	record->cpu = (USHORT) (i % 6);
+	record->operation = (UCHAR) (((i % 17) == 16) ? 7 : i % 3);
+	record->reserved = 0;
+}
+
+BOOLEAN write_trace(FILE *file, ULONG nrecords, ULONGLONG lost, const RAMDISK_TRACE_RECORD *records)
+{
+	RAMDISK_TRACE trace;
+
+	trace.version = RAMDISK_TRACE_VERSION;
+	trace.nrecords = nrecords;
+	trace.frequency = FREQUENCY;
+	trace.lost = lost;
+
+	return (BOOLEAN) ((fwrite(&trace, sizeof(trace), 1, file) == 1) && ((nrecords == 0) || (fwrite(records, sizeof(RAMDISK_TRACE_RECORD), nrecords, file) == nrecords)));
+}
+
+/* Runs tracedump on the file, its output in "output"; returns its exit status. */
+int run_dump(const char *program, const char *options, const char *filename, const char *output)
+{
+	char command[1024];
+	int status;
+
+	snprintf(command, sizeof(command), "'%s' %s'%s' > '%s' 2> /dev/null", program, options, filename, output);
+
+	status = system(command);
+
+	return (WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+}
+
+/* tracedump next to tracecheck (both built in one directory), or else where it is in the tree. */
+void find_dump(const char *self, char *program, size_t size)
+{
+	const char *slash;
+	int length;
+
+	/* Run from the PATH: so is tracedump. */
+	if ((slash = strrchr(self, '/')) == NULL) {
+		snprintf(program, size, "tracedump");
+		return;
+	}
+
+	length = (int) (slash - self + 1);
+
+	snprintf(program, size, "%.*stracedump", length, self);
+
+	if (access(program, X_OK) != 0) {
+		snprintf(program, size, "%.*s../tracedump/tracedump", length, self);
+	}
+}
@@ -0,0 +1,190 @@
+/*
+ * Decodes the request traces saved by "ramstat -t" (see trace_format.h).
+ * Runs on Linux, built with the portable modules of the driver:
+ *   gcc -O2 -DRAMDISK_USER_MODE -I../.. -o tracedump tracedump.c ../common/tools.c ../../io_counters.c
+ * Usage: tracedump [-s] file
+ * Prints one line per request (times in ns from the arrival of the first
+ * record), or with -s a summary per operation: request sizes and the
+ * histograms of the time waiting for the range and of the execution time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "trace_format.h"
+#include "io_counters.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s] file"
+#define NOPERATIONS                     3
+#define SIZE_BUCKETS                    24 /* Powers of two from 512 bytes. */
+
+/* The layout written by the driver. */
+typedef char check_record_size[(sizeof(RAMDISK_TRACE_RECORD) == 56) ? 1 : -1];
+typedef char check_header_size[(sizeof(RAMDISK_TRACE) == 24) ? 1 : -1];
+
+typedef struct {
+	ULONGLONG requests;
+	ULONGLONG errors;
+	ULONGLONG bytes;
+	ULONGLONG sizes[SIZE_BUCKETS];
+	ULONGLONG wait[IO_LATENCY_BUCKETS];       /* Arrival to dispatch. */
+	ULONGLONG service[IO_LATENCY_BUCKETS];    /* Dispatch to completion. */
+} SUMMARY;
+
+const char *operation_names[NOPERATIONS] = {"read", "write", "trim"};
+
+void print_record(const RAMDISK_TRACE_RECORD *record, ULONGLONG frequency, ULONGLONG origin);
+void add_record(SUMMARY *summary, const RAMDISK_TRACE_RECORD *record, ULONGLONG frequency);
+void print_histogram(const char *title, const ULONGLONG *buckets, ULONG nbuckets, const char *unit);
+
+int main(int argc, char **argv)
+{
+	static SUMMARY summaries[NOPERATIONS];
+	RAMDISK_TRACE_RECORD record;
+	RAMDISK_TRACE trace;
+	const char *filename;
+	ULONGLONG origin;
+	ULONGLONG records;
+	ULONGLONG lost;
+	BOOLEAN summary;
+	FILE *file;
+	ULONG i;
+
+	if ((argc == 3) && (strcmp(argv[1], "-s") == 0)) {
+		summary = TRUE;
+		filename = argv[2];
+	} else if ((argc == 2) && (argv[1][0] != '-')) {
+		summary = FALSE;
+		filename = argv[1];
+	} else {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	if ((file = fopen(filename, "rb")) == NULL) {
+		fprintf(stderr, "Cannot open %s.\n", filename);
+		return 1;
+	}
+
+	origin = 0;
+	records = 0;
+	lost = 0;
+
+	if (!summary) {
+		printf("sequence cpu operation offset length status arrival wait service\n");
+	}
+
+	while (fread(&trace, sizeof(trace), 1, file) == 1) {
+		if ((trace.version != RAMDISK_TRACE_VERSION) || (trace.frequency == 0)) {
+			fprintf(stderr, "%s: unknown trace format (version %" PRIu32 ").\n", filename, trace.version);
+			fclose(file);
+			return 1;
+		}
+
+		lost += trace.lost;
+
+		for (i = 0; i < trace.nrecords; i++) {
+			if (fread(&record, sizeof(record), 1, file) != 1) {
+				fprintf(stderr, "%s: truncated trace.\n", filename);
+				fclose(file);
+				return 1;
+			}
+
+			if (record.operation >= NOPERATIONS) {
+				continue;
+			}
+
+			/* The records of the different processors are not sorted, the times might be negative. */
+			if (records == 0) {
+				origin = record.arrival;
+			}
+
+			if (summary) {
+				add_record(&summaries[record.operation], &record, trace.frequency);
+			} else {
+				print_record(&record, trace.frequency, origin);
+			}
+
+			records++;
+		}
+	}
+
+	fclose(file);
+
+	if (summary) {
+		printf("%" PRIu64 " requests, %" PRIu64 " lost.\n", records, lost);
+
+		for (i = 0; i < NOPERATIONS; i++) {
+			if (summaries[i].requests == 0) {
+				continue;
+			}
+
+			printf("\n%s: %" PRIu64 " requests, %" PRIu64 " errors, %" PRIu64 " bytes.\n",
+				   operation_names[i],
+				   summaries[i].requests,
+				   summaries[i].errors,
+				   summaries[i].bytes);
+
+			print_histogram("Size", summaries[i].sizes, SIZE_BUCKETS, "bytes");
+			print_histogram("Wait", summaries[i].wait, IO_LATENCY_BUCKETS, "ns");
+			print_histogram("Service", summaries[i].service, IO_LATENCY_BUCKETS, "ns");
+		}
+	} else if (lost > 0) {
+		fprintf(stderr, "%" PRIu64 " records lost.\n", lost);
+	}
+
+	return 0;
+}
+
+void print_record(const RAMDISK_TRACE_RECORD *record, ULONGLONG frequency, ULONGLONG origin)
+{
+	printf("%" PRIu64 " %u %s %" PRIu64 " %" PRIu64 " 0x%08" PRIx32 " %" PRId64 " %" PRIu64 " %" PRIu64 "\n",
+		   record->sequence,
+		   (unsigned) record->cpu,
+		   operation_names[record->operation],
+		   record->offset,
+		   record->length,
+		   record->status,
+		   (record->arrival >= origin) ? (LONGLONG) io_ticks_to_ns(record->arrival - origin, frequency) : -(LONGLONG) io_ticks_to_ns(origin - record->arrival, frequency),
+		   io_ticks_to_ns(record->dispatch - record->arrival, frequency),
+		   io_ticks_to_ns(record->completion - record->dispatch, frequency));
+}
+
+void add_record(SUMMARY *summary, const RAMDISK_TRACE_RECORD *record, ULONGLONG frequency)
+{
+	summary->requests++;
+
+	if ((NTSTATUS) record->status < 0) {
+		summary->errors++;
+	} else {
+		summary->bytes += record->length;
+	}
+
+	/* The sizes use the buckets of the latencies too. */
+	summary->sizes[io_latency_bucket(record->length)]++;
+	summary->wait[io_latency_bucket(io_ticks_to_ns(record->dispatch - record->arrival, frequency))]++;
+	summary->service[io_latency_bucket(io_ticks_to_ns(record->completion - record->dispatch, frequency))]++;
+}
+
+void print_histogram(const char *title, const ULONGLONG *buckets, ULONG nbuckets, const char *unit)
+{
+	ULONG i;
+
+	printf("  %s:\n", title);
+
+	/* Same buckets as the latencies: bucket i is below 512 << i. */
+	for (i = 0; i < nbuckets; i++) {
+		if (buckets[i] == 0) {
+			continue;
+		}
+
+		if (i == nbuckets - 1) {
+			printf("    >= %12" PRIu64 " %s: %" PRIu64 "\n", (ULONGLONG) 256 << i, unit, buckets[i]);
+		} else {
+			printf("    <  %12" PRIu64 " %s: %" PRIu64 "\n", (ULONGLONG) 512 << i, unit, buckets[i]);
+		}
+	}
+}
@@ -0,0 +1,396 @@
+/*
+ * Test of the trims (chunk_table_trim(), what IOCTL_STORAGE_MANAGE_DATA_SET_
+ * ATTRIBUTES does for each range) on Linux. It checks that:
+ *   - a trim of whole chunks frees them, a trim of a part zeroes it;
+ *   - the granules of a chunk are only marked when they are completely
+ *     trimmed, a write unmarks them, and the chunk is freed when the trims
+ *     of its parts have covered it;
+ *   - the trims of chunks never written allocate nothing.
+ * Then it replays random interleavings of writes (some of zeros) and trims,
+ * sector aligned and from a sector to a few chunks long, against a copy of
+ * the disk in memory: every read is compared with the copy and, after each
+ * operation, no chunk with all its granules marked still has data and no
+ * chunk holding data has lost it. It reports the memory used next to that
+ * of the chunks holding data; nothing is left once the whole disk is
+ * trimmed.
+ * Built on Linux:
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o trimcheck trimcheck.c ../common/tools.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ *
+ * Usage: trimcheck [options]
+ *   -s size      Disk size (K, M and G suffixes; default 16M).
+ *   -n count     Operations of the replay (default 200000).
+ *   -r seed      Seed of the replay (default 1).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "zero.h"
+#include "tools/common/tools.h"
+
+#define USAGE                           "[-s size] [-n count] [-r seed]"
+#define SECTOR_SIZE                     512
+#define MAX_CHUNKS_PER_OPERATION        4
+
+typedef struct {
+	CHUNK_TABLE table;
+	UCHAR       *copy;           /* What the disk should hold. */
+	UCHAR       *buffer;
+	ULONGLONG   size;
+	ULONG       chunk_size;
+	ULONGLONG   seed;
+} TRIM_DISK;
+
+BOOLEAN check_whole_chunks(TRIM_DISK *disk);
+BOOLEAN check_granules(TRIM_DISK *disk);
+BOOLEAN check_unwritten(TRIM_DISK *disk);
+BOOLEAN replay(TRIM_DISK *disk, ULONGLONG count);
+BOOLEAN check_chunks(TRIM_DISK *disk, ULONGLONG first, ULONGLONG last);
+BOOLEAN range_equals(TRIM_DISK *disk, ULONGLONG offset, ULONG length);
+ULONGLONG live_chunks(TRIM_DISK *disk);
+void write_range(TRIM_DISK *disk, ULONGLONG offset, ULONG length, int value);
+void trim_range(TRIM_DISK *disk, ULONGLONG offset, ULONG length);
+
+int main(int argc, char **argv)
+{
+	TRIM_DISK disk;
+	ULONGLONG count;
+	BOOLEAN ok;
+	int opt;
+
+	memset(&disk, 0, sizeof(disk));
+
+	disk.size = 16ULL << 20;
+	disk.seed = 1;
+	count = 200000;
+
+	while ((opt = getopt(argc, argv, "s:n:r:")) != -1) {
+		switch (opt) {
+			case 's':
+				if (!parse_size(optarg, &disk.size)) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'n':
+				if ((count = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			case 'r':
+				if ((disk.seed = strtoull(optarg, NULL, 10)) == 0) {
+					usage(argv[0], USAGE);
+					return 1;
+				}
+
+				break;
+			default:
+				usage(argv[0], USAGE);
+				return 1;
+		}
+	}
+
+	disk.chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+
+	/* Whole chunks, at least those of the checks. */
+	if ((optind != argc) || (disk.size < 8ULL * disk.chunk_size) || (disk.size % disk.chunk_size)) {
+		usage(argv[0], USAGE);
+		return 1;
+	}
+
+	if (((disk.copy = (UCHAR *) calloc(1, disk.size)) == NULL) ||
+		((disk.buffer = (UCHAR *) malloc(MAX_CHUNKS_PER_OPERATION * disk.chunk_size)) == NULL) ||
+		(!NT_SUCCESS(chunk_table_init(&disk.table, disk.size, DEFAULT_CHUNK_SHIFT)))) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	ok = TRUE;
+
+	printf("%-52s %s\n", "Whole chunks are freed, parts zeroed", (check_whole_chunks(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Chunks trimmed in parts are freed", (check_granules(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Trims of chunks never written allocate nothing", (check_unwritten(&disk)) ? "ok" : (ok = FALSE, "FAILED"));
+	printf("%-52s %s\n", "Replay of writes and trims", (replay(&disk, count)) ? "ok" : (ok = FALSE, "FAILED"));
+
+	chunk_table_free(&disk.table);
+	free(disk.buffer);
+	free(disk.copy);
+
+	if (!ok) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+BOOLEAN check_whole_chunks(TRIM_DISK *disk)
+{
+	BOOLEAN ok;
+
+	/* Four chunks written, then trimmed from the middle of the first one to the middle of the last one. */
+	write_range(disk, 0, 4 * disk->chunk_size, 0x11);
+
+	ok = (BOOLEAN) (chunk_table_memory_used(&disk->table) == 4ULL * disk->chunk_size);
+
+	trim_range(disk, disk->chunk_size / 2, 3 * disk->chunk_size);
+
+	ok = (BOOLEAN) (ok && (chunk_table_memory_used(&disk->table) == 2ULL * disk->chunk_size));
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->table, 0)->data) && (!chunk_table_get_chunk(&disk->table, 1)->data));
+	ok = (BOOLEAN) (ok && (!chunk_table_get_chunk(&disk->table, 2)->data) && (chunk_table_get_chunk(&disk->table, 3)->data));
+	ok = (BOOLEAN) (ok && (range_equals(disk, 0, 4 * disk->chunk_size)));
+
+	trim_range(disk, 0, 4 * disk->chunk_size);
+
+	return (BOOLEAN) (ok && (chunk_table_memory_used(&disk->table) == 0));
+}
+
+BOOLEAN check_granules(TRIM_DISK *disk)
+{
+	ULONG granule_size;
+	ULONG i;
+	BOOLEAN ok;
+
+	granule_size = disk->chunk_size >> TRIM_GRANULES_SHIFT;
+
+	write_range(disk, 0, disk->chunk_size, 0x22);
+
+	/* A granule trimmed in two parts is not marked; trimmed at once, it is. */
+	trim_range(disk, 0, granule_size - SECTOR_SIZE);
+	ok = (BOOLEAN) (chunk_table_get_chunk(&disk->table, 0)->trimmed == 0);
+
+	trim_range(disk, granule_size - SECTOR_SIZE, SECTOR_SIZE);
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->table, 0)->trimmed == 0));
+
+	trim_range(disk, 0, granule_size);
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->table, 0)->trimmed == 1));
+
+	/* A range across two granules marks neither. */
+	trim_range(disk, granule_size + SECTOR_SIZE, granule_size);
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->table, 0)->trimmed == 1));
+
+	/* All the granules but the last one, in pieces: still there. */
+	for (i = 1; i < (1UL << TRIM_GRANULES_SHIFT) - 1; i++) {
+		trim_range(disk, (ULONGLONG) i * granule_size, granule_size);
+	}
+
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->table, 0)->data) && (chunk_table_get_chunk(&disk->table, 0)->trimmed == (LONGLONG) (~0ULL >> 1)));
+
+	/* A write of the first granule unmarks it: trimming the last one doesn't free the chunk. */
+	write_range(disk, SECTOR_SIZE, SECTOR_SIZE, 0x33);
+	trim_range(disk, disk->chunk_size - granule_size, granule_size);
+
+	ok = (BOOLEAN) (ok && (chunk_table_get_chunk(&disk->table, 0)->data) && (range_equals(disk, 0, disk->chunk_size)));
+
+	/* Trimming the first one again does. */
+	trim_range(disk, 0, granule_size);
+
+	ok = (BOOLEAN) (ok && (!chunk_table_get_chunk(&disk->table, 0)->data) && (chunk_table_memory_used(&disk->table) == 0));
+
+	return (BOOLEAN) (ok && (range_equals(disk, 0, disk->chunk_size)));
+}
+
+BOOLEAN check_unwritten(TRIM_DISK *disk)
+{
+	ULONGLONG i;
+	BOOLEAN ok;
+
+	trim_range(disk, SECTOR_SIZE, 2 * disk->chunk_size);
+
+	/* A write of zeros doesn't allocate either. */
+	write_range(disk, 2ULL * disk->chunk_size, disk->chunk_size, 0);
+
+	ok = (BOOLEAN) (chunk_table_memory_used(&disk->table) == 0);
+
+	for (i = 0; i < 4; i++) {
+		ok = (BOOLEAN) (ok && (!chunk_table_get_chunk(&disk->table, i)->data) && (chunk_table_get_chunk(&disk->table, i)->trimmed == 0));
+	}
+
+	return (BOOLEAN) (ok && (range_equals(disk, 0, 4 * disk->chunk_size)));
+}
+
+BOOLEAN replay(TRIM_DISK *disk, ULONGLONG count)
+{
+	ULONGLONG nsectors;
+	ULONGLONG offset;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG peak;
+	ULONGLONG r;
+	ULONGLONG i;
+	ULONGLONG counts[3];
+	ULONG length;
+	ULONG kind;
+	BOOLEAN ok;
+
+	nsectors = disk->size / SECTOR_SIZE;
+	peak = 0;
+	ok = TRUE;
+
+	memset(counts, 0, sizeof(counts));
+
+	start = port_timestamp();
+
+	for (i = 0; (ok) && (i < count); i++) {
+		r = next_random(&disk->seed);
+
+		/* Mostly short requests, some of whole chunks: sector aligned either way. */
+		if (r & 1) {
+			length = (ULONG) (((r >> 8) % (disk->chunk_size / SECTOR_SIZE)) + 1) * SECTOR_SIZE;
+		} else {
+			length = (ULONG) (((r >> 8) % MAX_CHUNKS_PER_OPERATION) + 1) * disk->chunk_size;
+		}
+
+		offset = ((r >> 32) % nsectors) * SECTOR_SIZE;
+
+		if (offset + length > disk->size) {
+			length = (ULONG) (disk->size - offset);
+		}
+
+		/* 45% writes, 10% writes of zeros, 45% trims. */
+		kind = (ULONG) ((r >> 1) % 20);
+
+		if (kind < 9) {
+			write_range(disk, offset, length, (int) (r >> 16) | 1);
+			counts[0]++;
+		} else if (kind < 11) {
+			write_range(disk, offset, length, 0);
+			counts[1]++;
+		} else {
+			trim_range(disk, offset, length);
+			counts[2]++;
+		}
+
+		ok = (BOOLEAN) ((check_chunks(disk, offset >> DEFAULT_CHUNK_SHIFT, (offset + length - 1) >> DEFAULT_CHUNK_SHIFT)) && (range_equals(disk, offset, length)));
+
+		/* And somewhere else. */
+		r = next_random(&disk->seed);
+		offset = ((r >> 32) % nsectors) * SECTOR_SIZE;
+		length = (ULONG) ((r % (disk->chunk_size / SECTOR_SIZE)) + 1) * SECTOR_SIZE;
+
+		if (offset + length > disk->size) {
+			length = (ULONG) (disk->size - offset);
+		}
+
+		ok = (BOOLEAN) (ok && (range_equals(disk, offset, length)));
+
+		if (chunk_table_memory_used(&disk->table) > peak) {
+			peak = chunk_table_memory_used(&disk->table);
+		}
+	}
+
+	elapsed = port_timestamp() - start;
+
+	ok = (BOOLEAN) (ok && (check_chunks(disk, 0, disk->table.nchunks - 1)) && (range_equals(disk, 0, (ULONG) disk->size)));
+
+	printf("  %" PRIu64 " writes, %" PRIu64 " writes of zeros, %" PRIu64 " trims in %.2f s\n",
+		   counts[0],
+		   counts[1],
+		   counts[2],
+		   (double) elapsed / 1e9);
+
+	printf("  Memory used: %" PRIu64 " KB (peak %" PRIu64 " KB), chunks with data %" PRIu64 " KB, disk %" PRIu64 " KB\n",
+		   chunk_table_memory_used(&disk->table) >> 10,
+		   peak >> 10,
+		   (live_chunks(disk) * disk->chunk_size) >> 10,
+		   disk->size >> 10);
+
+	/*
+	 * The trims only free the chunks which they cover, so some chunks hold
+	 * nothing but zeros; the chunks holding data must all be there.
+	 */
+	ok = (BOOLEAN) (ok && (chunk_table_memory_used(&disk->table) >= live_chunks(disk) * disk->chunk_size));
+
+	trim_range(disk, 0, (ULONG) disk->size);
+
+	return (BOOLEAN) (ok && (chunk_table_memory_used(&disk->table) == 0) && (disk->table.nallocated == 0));
+}
+
+BOOLEAN check_chunks(TRIM_DISK *disk, ULONGLONG first, ULONGLONG last)
+{
+	CHUNK *chunk;
+	ULONGLONG index;
+	ULONGLONG nallocated;
+
+	for (index = first; index <= last; index++) {
+		chunk = chunk_table_get_chunk(&disk->table, index);
+
+		/* A chunk completely trimmed has no data; one with data in the copy has it. */
+		if (((chunk->data) && (chunk->trimmed == ALL_GRANULES_TRIMMED)) ||
+			((!chunk->data) && (!is_zero_block(disk->copy + (index << DEFAULT_CHUNK_SHIFT), disk->chunk_size)))) {
+			return FALSE;
+		}
+	}
+
+	nallocated = 0;
+
+	for (index = 0; index < disk->table.nchunks; index++) {
+		if (chunk_table_get_chunk(&disk->table, index)->data) {
+			nallocated++;
+		}
+	}
+
+	return (BOOLEAN) (nallocated == (ULONGLONG) disk->table.nallocated);
+}
+
+BOOLEAN range_equals(TRIM_DISK *disk, ULONGLONG offset, ULONG length)
+{
+	ULONG count;
+
+	while (length > 0) {
+		count = MAX_CHUNKS_PER_OPERATION * disk->chunk_size;
+		if (count > length) {
+			count = length;
+		}
+
+		if ((!NT_SUCCESS(chunk_table_read(&disk->table, offset, disk->buffer, count))) || (memcmp(disk->buffer, disk->copy + offset, count) != 0)) {
+			return FALSE;
+		}
+
+		offset += count;
+		length -= count;
+	}
+
+	return TRUE;
+}
+
+ULONGLONG live_chunks(TRIM_DISK *disk)
+{
+	ULONGLONG index;
+	ULONGLONG count;
+
+	count = 0;
+
+	for (index = 0; index < disk->table.nchunks; index++) {
+		if (!is_zero_block(disk->copy + (index << DEFAULT_CHUNK_SHIFT), disk->chunk_size)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+void write_range(TRIM_DISK *disk, ULONGLONG offset, ULONG length, int value)
+{
+	memset(disk->buffer, value, length);
+	memset(disk->copy + offset, value, length);
+
+	chunk_table_write(&disk->table, offset, disk->buffer, length);
+}
+
+void trim_range(TRIM_DISK *disk, ULONGLONG offset, ULONG length)
+{
+	/* The trimmed data reads as zeros. */
+	memset(disk->copy + offset, 0, length);
+
+	chunk_table_trim(&disk->table, offset, length);
+}
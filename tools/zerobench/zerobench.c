@@ -0,0 +1,185 @@
+/*
+ * Compares the all-zero scans on Linux: the scalar loop (a word at a time,
+ * the fallback of zero.c) against is_zero_block(), SSE2 by default or AVX2
+ * if built with -mavx2, for several block sizes. The blocks are all zeros,
+ * so that the whole block is scanned, and small enough to stay in the
+ * caches: it is the cost of the scan, not of the memory.
+ * Then what the scan adds to the writes which overwrite a whole chunk with
+ * data (chunk_table_write()): data starting with a non-zero byte (the scan
+ * stops at once), data which is zero but for its last bytes (the scan goes
+ * through the whole chunk) and, for reference, the copy alone.
+ *   gcc -O2 -pthread -DRAMDISK_USER_MODE -I../.. -o zerobench zerobench.c \
+ *       ../../chunk_table.c ../../chunk_pool.c ../../zero.c ../../copy.c ../../lz.c \
+ *       ../../numa_layout.c ../../port_numa.c ../../port_page.c
+ * (add -mavx2 for the AVX2 scan).
+ * Usage: zerobench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "port.h"
+#include "chunk_table.h"
+#include "zero.h"
+
+#define MIN_SIZE                        512
+#define MAX_SIZE                        (1024 * 1024)
+#define BYTES_PER_SIZE                  (4ULL * 1024 * 1024 * 1024) /* Scanned for each size. */
+#define WRITE_CHUNKS                    64 /* Chunks of the disk of the writes. */
+#define WRITES                          100000
+
+BOOLEAN is_zero_scalar(const UCHAR *buffer, SIZE_T length);
+double measure_scan(const UCHAR *buffer, SIZE_T size, BOOLEAN simd);
+double measure_writes(CHUNK_TABLE *table, const UCHAR *data, BOOLEAN copy_only);
+
+int main(void)
+{
+	CHUNK_TABLE table;
+	UCHAR *buffer;
+	UCHAR *data;
+	SIZE_T size;
+	ULONG chunk_size;
+	double scalar;
+	double simd;
+
+	if ((buffer = (UCHAR *) calloc(1, MAX_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+#if defined(__AVX2__)
+	printf("Scan of zeros (AVX2), in cache:\n");
+#else
+	printf("Scan of zeros (SSE2), in cache:\n");
+#endif
+
+	printf("%10s %12s %12s %10s\n", "Block", "Scalar GB/s", "SIMD GB/s", "Speedup");
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size <<= 1) {
+		scalar = measure_scan(buffer, size, FALSE);
+		simd = measure_scan(buffer, size, TRUE);
+
+		printf("%10lu %12.2f %12.2f %9.2fx\n", (unsigned long) size, scalar, simd, simd / scalar);
+	}
+
+	chunk_size = 1UL << DEFAULT_CHUNK_SHIFT;
+
+	if (((data = (UCHAR *) malloc(chunk_size)) == NULL) || (!NT_SUCCESS(chunk_table_init(&table, (ULONGLONG) WRITE_CHUNKS * chunk_size, DEFAULT_CHUNK_SHIFT)))) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	printf("\nWrites of whole %u KB chunks with data:\n", chunk_size >> 10);
+	printf("%-30s %12s\n", "", "ns/write");
+
+	memset(data, 0x5a, chunk_size);
+	printf("%-30s %12.0f\n", "non-zero from the start", measure_writes(&table, data, FALSE));
+
+	memset(data, 0, chunk_size - 64);
+	printf("%-30s %12.0f\n", "zero but the last 64 bytes", measure_writes(&table, data, FALSE));
+
+	printf("%-30s %12.0f\n", "copy alone", measure_writes(&table, data, TRUE));
+
+	chunk_table_free(&table);
+	free(data);
+	free(buffer);
+
+	return 0;
+}
+
+/* The scalar loop of zero.c, which is static there. */
+BOOLEAN is_zero_scalar(const UCHAR *buffer, SIZE_T length)
+{
+	ULONG_PTR word;
+
+	while ((length > 0) && ((ULONG_PTR) buffer & (sizeof(ULONG_PTR) - 1))) {
+		if (*buffer) {
+			return FALSE;
+		}
+
+		buffer++;
+		length--;
+	}
+
+	while (length >= sizeof(ULONG_PTR)) {
+		word = *((const ULONG_PTR *) buffer);
+		if (word) {
+			return FALSE;
+		}
+
+		buffer += sizeof(ULONG_PTR);
+		length -= sizeof(ULONG_PTR);
+	}
+
+	while (length > 0) {
+		if (*buffer) {
+			return FALSE;
+		}
+
+		buffer++;
+		length--;
+	}
+
+	return TRUE;
+}
+
+double measure_scan(const UCHAR *buffer, SIZE_T size, BOOLEAN simd)
+{
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	ULONGLONG passes;
+	ULONGLONG zeros;
+	ULONGLONG i;
+
+	passes = BYTES_PER_SIZE / size;
+	zeros = 0;
+
+	start = port_timestamp();
+
+	for (i = 0; i < passes; i++) {
+		zeros += (simd) ? is_zero_block(buffer, size) : is_zero_scalar(buffer, size);
+
+		/* Keeps the compiler from hoisting the scan out of the loop. */
+		__asm__ __volatile__("" ::: "memory");
+	}
+
+	elapsed = port_timestamp() - start;
+
+	if (zeros != passes) {
+		printf("(scan failed)\n");
+	}
+
+	return (double) passes * size / (double) elapsed;
+}
+
+double measure_writes(CHUNK_TABLE *table, const UCHAR *data, BOOLEAN copy_only)
+{
+	UCHAR *chunks[WRITE_CHUNKS];
+	ULONGLONG start;
+	ULONGLONG i;
+	ULONG chunk_size;
+	ULONG index;
+
+	chunk_size = 1UL << table->chunk_shift;
+
+	/* Every chunk allocated first: the writes overwrite them. */
+	for (index = 0; index < WRITE_CHUNKS; index++) {
+		chunk_table_write(table, (ULONGLONG) index * chunk_size, data, chunk_size);
+		chunks[index] = chunk_table_get_chunk(table, index)->data;
+	}
+
+	start = port_timestamp();
+
+	for (i = 0; i < WRITES; i++) {
+		index = (ULONG) (i % WRITE_CHUNKS);
+
+		if (copy_only) {
+			memcpy(chunks[index], data, chunk_size);
+		} else {
+			chunk_table_write(table, (ULONGLONG) index * chunk_size, data, chunk_size);
+		}
+	}
+
+	return (double) (port_timestamp() - start) / WRITES;
+}
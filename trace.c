@@ -0,0 +1,113 @@
+#include "trace.h"
+
+#define MAX_TRACE_RECORDS               (1UL << 24)
+
+NTSTATUS trace_ring_init(__out TRACE_RING *ring, __in ULONG nrecords)
+{
+	ULONG size;
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->records = NULL;
+	ring->mask = 0;
+
+	if (nrecords == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	if (nrecords > MAX_TRACE_RECORDS) {
+		nrecords = MAX_TRACE_RECORDS;
+	}
+
+	for (size = 1; size < nrecords; size <<= 1);
+
+	if ((ring->records = (RAMDISK_TRACE_RECORD *) port_alloc(size * sizeof(RAMDISK_TRACE_RECORD))) == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	/* Sequence 0: never written. */
+	RtlZeroMemory(ring->records, size * sizeof(RAMDISK_TRACE_RECORD));
+
+	ring->mask = size - 1;
+
+	return STATUS_SUCCESS;
+}
+
+void trace_ring_free(__in TRACE_RING *ring)
+{
+	if (ring->records) {
+		port_free(ring->records);
+		ring->records = NULL;
+	}
+}
+
+void trace_ring_write(__in TRACE_RING *ring, __in RAMDISK_TRACE_RECORD *record)
+{
+	RAMDISK_TRACE_RECORD *slot;
+	ULONGLONG sequence;
+
+	sequence = (ULONGLONG) InterlockedIncrement64(&ring->head);
+	slot = &ring->records[(sequence - 1) & ring->mask];
+
+	/* Invalidate the slot while it is written (the reader has the full barriers). */
+	*((volatile ULONGLONG *) &slot->sequence) = 0;
+	port_store_barrier();
+
+	slot->offset = record->offset;
+	slot->length = record->length;
+	slot->arrival = record->arrival;
+	slot->dispatch = record->dispatch;
+	slot->completion = record->completion;
+	slot->status = record->status;
+	slot->cpu = record->cpu;
+	slot->operation = record->operation;
+	slot->reserved = 0;
+
+	port_store_barrier();
+	*((volatile ULONGLONG *) &slot->sequence) = sequence;
+}
+
+ULONG trace_ring_read(__in TRACE_RING *ring, __out RAMDISK_TRACE_RECORD *records, __in ULONG count, __inout ULONGLONG *lost)
+{
+	RAMDISK_TRACE_RECORD *slot;
+	ULONGLONG sequence;
+	LONGLONG head;
+	ULONG n;
+
+	if (!ring->records) {
+		return 0;
+	}
+
+	head = ring->head;
+
+	/* The oldest records have been overwritten. */
+	if (head - ring->tail > (LONGLONG) ring->mask + 1) {
+		*lost += (ULONGLONG) (head - ring->tail - ring->mask - 1);
+		ring->tail = head - ring->mask - 1;
+	}
+
+	for (n = 0; (n < count) && (ring->tail < head); ring->tail++) {
+		slot = &ring->records[ring->tail & ring->mask];
+
+		sequence = *((volatile ULONGLONG *) &slot->sequence);
+		if (sequence <= (ULONGLONG) ring->tail) {
+			/* Still being written: read it next time. */
+			break;
+		}
+
+		port_memory_barrier();
+		records[n] = *slot;
+		port_memory_barrier();
+
+		/* Overwritten by a newer record (before or while it was copied). */
+		if ((sequence != (ULONGLONG) ring->tail + 1) || (*((volatile ULONGLONG *) &slot->sequence) != sequence)) {
+			(*lost)++;
+			continue;
+		}
+
+		records[n].sequence = sequence;
+		n++;
+	}
+
+	return n;
+}
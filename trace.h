@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "port.h"
+#include "trace_format.h"
+
+/*
+ * Ring of request trace records.
+ * The writers reserve a slot by incrementing "head" and never wait: when the
+ * ring is full the oldest records are overwritten. The sequence number of a
+ * record is written last, so that the reader can tell a complete record from
+ * one being written or overwritten meanwhile. There must be a single reader.
+ */
+
+typedef struct {
+	volatile LONGLONG    head;           /* Records reserved by the writers. */
+	LONGLONG             tail;           /* Next record to be read. */
+	RAMDISK_TRACE_RECORD *records;       /* NULL: tracing disabled. */
+	ULONG                mask;           /* Number of records - 1. */
+} TRACE_RING;
+
+/* The number of records is rounded up to a power of two (0: tracing disabled). */
+NTSTATUS trace_ring_init(__out TRACE_RING *ring, __in ULONG nrecords);
+void trace_ring_free(__in TRACE_RING *ring);
+
+#define trace_ring_enabled(ring)        ((ring)->records != NULL)
+
+/* The sequence number of "record" is assigned by the ring. */
+void trace_ring_write(__in TRACE_RING *ring, __in RAMDISK_TRACE_RECORD *record);
+
+/*
+ * Copies up to "count" records (oldest first) and returns how many; "lost"
+ * is incremented with the records overwritten before they could be read.
+ */
+ULONG trace_ring_read(__in TRACE_RING *ring, __out RAMDISK_TRACE_RECORD *records, __in ULONG count, __inout ULONGLONG *lost);
+
+#endif /* TRACE_H */
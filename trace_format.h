@@ -0,0 +1,37 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+/*
+ * Format of the request traces returned by IOCTL_RAMDISK_READ_TRACE.
+ * It only uses the basic Windows types, so that it can be included by the
+ * driver, by Windows programs and, through port.h, by Linux programs.
+ * A trace is a RAMDISK_TRACE header followed by "nrecords" records; the
+ * files written by the tools are sequences of such traces.
+ */
+#define RAMDISK_TRACE_VERSION           1
+
+#define RAMDISK_TRACE_READ              0
+#define RAMDISK_TRACE_WRITE             1
+#define RAMDISK_TRACE_TRIM              2
+
+typedef struct {
+	ULONGLONG sequence;                  /* Position in the ring of its processor, from 1. */
+	ULONGLONG offset;
+	ULONGLONG length;                    /* Trims: the range of whole chunks locked. */
+	ULONGLONG arrival;                   /* Timestamps, in ticks of RAMDISK_TRACE.frequency. */
+	ULONGLONG dispatch;                  /* The range was granted. */
+	ULONGLONG completion;
+	ULONG     status;
+	USHORT    cpu;                       /* Processor which completed the request. */
+	UCHAR     operation;
+	UCHAR     reserved;
+} RAMDISK_TRACE_RECORD;
+
+typedef struct {
+	ULONG     version;
+	ULONG     nrecords;
+	ULONGLONG frequency;                 /* Of the timestamps. */
+	ULONGLONG lost;                      /* Records overwritten before they could be read. */
+} RAMDISK_TRACE;
+
+#endif /* TRACE_FORMAT_H */
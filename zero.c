@@ -0,0 +1,95 @@
+#include "zero.h"
+
+/*
+ * SSE2 is always available on x64 and can be used in kernel mode without
+ * saving the extended processor state. x86 kernel code would have to save
+ * it (KeSaveFloatingPointState) and AVX2 would require it everywhere, so
+ * the x86 driver scans with the scalar loop and AVX2 is only used in user
+ * mode, when the compiler targets it.
+ */
+#if defined(RAMDISK_USER_MODE) && defined(__AVX2__)
+	#define ZERO_AVX2
+	#include <immintrin.h>
+#elif defined(_M_X64) || (defined(RAMDISK_USER_MODE) && defined(__SSE2__))
+	#define ZERO_SSE2
+	#include <emmintrin.h>
+#endif
+
+static BOOLEAN is_zero_scalar(__in const UCHAR *buffer, __in SIZE_T length);
+
+BOOLEAN is_zero_block(__in const UCHAR *buffer, __in SIZE_T length)
+{
+#if defined(ZERO_AVX2)
+	__m256i v;
+
+	/* 128 bytes per iteration, stop at the first non-zero block. */
+	while (length >= 128) {
+		v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i *) buffer),
+		                                    _mm256_loadu_si256((const __m256i *) (buffer + 32))),
+		                    _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (buffer + 64)),
+		                                    _mm256_loadu_si256((const __m256i *) (buffer + 96))));
+
+		if (!_mm256_testz_si256(v, v)) {
+			return FALSE;
+		}
+
+		buffer += 128;
+		length -= 128;
+	}
+#elif defined(ZERO_SSE2)
+	__m128i v;
+
+	/* 64 bytes per iteration, stop at the first non-zero block. */
+	while (length >= 64) {
+		v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *) buffer),
+		                              _mm_loadu_si128((const __m128i *) (buffer + 16))),
+		                 _mm_or_si128(_mm_loadu_si128((const __m128i *) (buffer + 32)),
+		                              _mm_loadu_si128((const __m128i *) (buffer + 48))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+			return FALSE;
+		}
+
+		buffer += 64;
+		length -= 64;
+	}
+#endif
+
+	return is_zero_scalar(buffer, length);
+}
+
+BOOLEAN is_zero_scalar(__in const UCHAR *buffer, __in SIZE_T length)
+{
+	ULONG_PTR word;
+
+	/* Bytes up to the first aligned word. */
+	while ((length > 0) && ((ULONG_PTR) buffer & (sizeof(ULONG_PTR) - 1))) {
+		if (*buffer) {
+			return FALSE;
+		}
+
+		buffer++;
+		length--;
+	}
+
+	while (length >= sizeof(ULONG_PTR)) {
+		word = *((const ULONG_PTR *) buffer);
+		if (word) {
+			return FALSE;
+		}
+
+		buffer += sizeof(ULONG_PTR);
+		length -= sizeof(ULONG_PTR);
+	}
+
+	while (length > 0) {
+		if (*buffer) {
+			return FALSE;
+		}
+
+		buffer++;
+		length--;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,9 @@
+#ifndef ZERO_H
+#define ZERO_H
+
+#include "port.h"
+
+/* Returns TRUE if all the bytes of the buffer are zero. */
+BOOLEAN is_zero_block(__in const UCHAR *buffer, __in SIZE_T length);
+
+#endif /* ZERO_H */